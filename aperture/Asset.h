@@ -1,7 +1,6 @@
 #pragma once
 
 #include <boost/shared_ptr.hpp>
-#include <boost/tuple/tuple.hpp>
 
 #include "byte.h"
 #include "IAsset.h"
@@ -9,54 +8,56 @@
 namespace whip
 {
 /**
- * Represents a single asset with data and metadata both in
- * storage and on the wire
+ * An asset received from a WHIP server. Only the binary data is kept, in a
+ * pooled block, the name, description and the rest of the packet header are
+ * dropped once read
  */
 class Asset : public aperture::IAsset
 {
-private:
-	static const unsigned int NAME_FIELD_SZ_LOC = 39;
-
-	aperture::byte_array_ptr _data;
-
 public:
 	typedef boost::shared_ptr<Asset> ptr;
 
-public:
 	/**
-		Constructs an asset with a data array pre allocated to the given size
+		The packet header before the variable length fields
 	*/
-	explicit Asset(unsigned int sizeHint);
+	static const unsigned int NAME_FIELD_SZ_LOC = 39;
+	static const unsigned int TYPE_LOC = 32;
+	static const unsigned int LOCAL_LOC = 33;
 
 	/**
-		Constructs an asset from the given byte array	
+		The longest the packet header can be: two length prefixed fields of up
+		to 255 bytes and the data size
 	*/
-	Asset(aperture::byte_array_ptr data);
-	
-	virtual ~Asset();
+	static const unsigned int MAX_HEADER_SIZE = NAME_FIELD_SZ_LOC + 1 + 255 + 1 + 255 + sizeof(unsigned int);
+
+private:
+	aperture::UUID _uuid;
+	aperture::byte _type;
+	bool _local;
 
+	boost::shared_ptr<aperture::byte> _data;
+	size_t _size;
+
+public:
 	/**
-		Returns the UUID of this asset from the first 32 bytes 
-		of packet data
+		Constructs an asset from its binary data, held in the first size bytes
+		of data
 	*/
-	std::string getUUID() const override;
+	Asset(const aperture::UUID& uuid, aperture::byte type, bool local, boost::shared_ptr<aperture::byte> data,
+		size_t size);
+	
+	virtual ~Asset();
 
 	/**
-		Returns the size of the data array holding the asset
-		data and metadata
+		Returns the UUID of this asset
 	*/
-	unsigned int getSize() const;
+	aperture::UUID getUUID() const override;
 
 	/**
 		Returns the size of the binary asset data
 	*/
 	size_t getBinaryDataSize() const override;
 
-	/**
-		Returns the internal data for this asset
-	*/
-	aperture::byte_array_ptr getData() const;
-
 	/**
 		Returns whether or not this is a local asset
 	*/
@@ -68,18 +69,16 @@ public:
 	aperture::byte getType() const override;
 
 	/**
-	 * Copies the asset data only to the given storage area
-	 */
-	size_t copyAssetData(std::string& storage) const override;
-
-	/**
-	 * Copies the asset data only to the given storage area (rngStart + rngEnd are INCLUSIVE)
+	 * Returns a view of the asset data
 	 */
-	size_t copyAssetData(std::string& storage, size_t rngStart, size_t rngEnd) const override;
+	boost::asio::const_buffer getAssetData() const override;
 
 	/**
 	 * Finds the location and size of the actual internal asset binary data
+	 * in a packet given at least its header. Returns false if the header is
+	 * cut short in the given length
 	 */
-	boost::tuple<unsigned int, unsigned int> findDataLocationAndSize() const;
+	static bool findDataLocationAndSize(const aperture::byte* packet, size_t length,
+		unsigned int& location, unsigned int& size);
 };
-}
\ No newline at end of file
+}
@@ -2,6 +2,13 @@
 
 #include "AssetServer.h"
 #include "AppLog.h"
+#include "BufferPool.h"
+#include "Settings.h"
+#include "StreamRegistry.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 using namespace boost::posix_time;
 using boost::asio::ip::tcp;
@@ -10,18 +17,56 @@ using namespace aperture;
 
 namespace whip
 {
+	const unsigned int AssetServer::MIN_RECONNECT_DELAY_MS;
+	const unsigned int AssetServer::MAX_RECONNECT_DELAY_MS;
+	const unsigned int AssetServer::STABLE_CONNECTION_SECS;
+
+	namespace
+	{
+		/// Milliseconds on a clock that is never set back, for the breaker
+		long long steadyMs()
+		{
+			return std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+	}
+
 	AssetServer::AssetServer(const WhipURI& uri, boost::asio::io_service& ioService)
 	:	_serverURI(uri),
 		_ioService(ioService),
+		_strand(_ioService),
 		_serviceSocket(_ioService),
 		_connectionState(CSTATE_DISCONNECTED),
-		_reconnectTimer(_ioService)
+		_reconnectTimer(_ioService),
+		_consecutiveFailures(0),
+		_reconnectDelayMs(MIN_RECONNECT_DELAY_MS),
+		_jitter(std::random_device()()),
+		_breakerOpenUntilMs(0),
+		_probeTimer(_ioService),
+		_probeInFlight(false),
+		_probeVerified(false),
+		_probeLatencyUs(0),
+		_transfersInFlight(0),
+		_bytesInTransfer(0),
+		_averageAssetSize(INITIAL_ASSET_SIZE_GUESS),
+		_receiveSize(0),
+		_receivedBytes(0),
+		_resolver(_ioService),
+		_writeInProgress(false),
+		_lingerTimer(_ioService),
+		_lingerArmed(false)
 	{
-		tcp::resolver resolver(_ioService);
-		tcp::resolver::query query(tcp::v4(), uri.getHostName(), boost::lexical_cast<std::string>(uri.getPort()));
-		tcp::resolver::iterator addr = resolver.resolve(query);
+		auto config = Settings::instance().config();
 
-		_assetServiceEndpoint = *addr;
+		_maxBatchRequests = std::max(config["whip_batch_requests"].as<unsigned int>(), 1u);
+		_sendLinger = boost::posix_time::microseconds(config["whip_batch_linger_us"].as<unsigned int>());
+
+		_breakerFailures = config["whip_breaker_failures"].as<unsigned int>();
+		_breakerCooldown = boost::posix_time::seconds(config["whip_breaker_cooldown"].as<unsigned int>());
+		_probeInterval = boost::posix_time::milliseconds(std::max(config["whip_probe_interval"].as<unsigned int>(), 1u));
+		_probeTimeout = boost::posix_time::milliseconds(config["whip_probe_timeout"].as<unsigned int>());
+
+		_streamMinSize = config["whip_stream_min_size"].as<unsigned int>();
 	}
 
 	AssetServer::~AssetServer()
@@ -35,6 +80,8 @@ namespace whip
 	void AssetServer::close(bool doShutdown)
 	{
 		if (_connectionState != CSTATE_DISCONNECTED && _connectionState != CSTATE_SHUTDOWN) {
+			ConnectionState previousState = _connectionState;
+
 			_serviceSocket.close();
 
 			if (doShutdown) _connectionState = CSTATE_SHUTDOWN;
@@ -52,29 +99,76 @@ namespace whip
 				Asset::ptr nullAsset;
 				for (boost::function<void (Asset::ptr)> callback : callbacks)
 				{
-					callback(nullAsset);
+					_ioService.post(boost::bind(callback, nullAsset));
 				}
 			}
 
 			_pendingTransfers.clear();
+			_transfersInFlight = 0;
+
+			//replies already sending a streamed asset are cut off
+			if (_receiveStream) {
+				_receiveStream->fail();
+				StreamRegistry::instance().retire(_receiveStream);
+				_receiveStream.reset();
+			}
+			_bytesInTransfer = 0;
 			
-			PendingSendQueue empty;
-			std::swap(_pendingSends, empty);
+			//a write still in progress is aborted by the close and clears its own batch
+			_sendQueue.clear();
+			if (_lingerArmed) _lingerTimer.cancel();
+
+			_probeTimer.cancel();
+			_probeInFlight = false;
+			_probeVerified = false;
 
 			if (_connectionState == CSTATE_DISCONNECTED) {
+				if (previousState == CSTATE_CONNECTING || previousState == CSTATE_CONNECTED) {
+					this->recordFailure(previousState == CSTATE_CONNECTED);
+				}
+
 				//begin the reconnect process
 				this->tryReconnect();
 			}
 		}
 	}
 
+	void AssetServer::recordFailure(bool wasConnected)
+	{
+		if (wasConnected && microsec_clock::universal_time() - _connectedAt >= seconds(STABLE_CONNECTION_SECS)) {
+			//the link was fine for a while, this is a new problem
+			_consecutiveFailures = 0;
+			_reconnectDelayMs = MIN_RECONNECT_DELAY_MS;
+		}
+
+		if (++_consecutiveFailures > 1) {
+			_reconnectDelayMs = std::min(_reconnectDelayMs * 2, MAX_RECONNECT_DELAY_MS);
+		}
+
+		if (_breakerFailures != 0 && _consecutiveFailures >= _breakerFailures) {
+			if (! this->isBreakerOpen()) {
+				AppLog::instance().out() 
+					<< "[WHIP] " << _consecutiveFailures << " failures in a row on intramesh server "
+					<< _serverURI.getHostName() << ":" << _serverURI.getPort()
+					<< ", keeping traffic off it for " << _breakerCooldown.total_seconds() << " seconds"
+					<< std::endl;
+			}
+
+			_breakerOpenUntilMs = steadyMs() + _breakerCooldown.total_milliseconds();
+		}
+	}
+
 	void AssetServer::tryReconnect()
 	{
 		_connectionState = CSTATE_RECONNECT_WAIT;
 
-		_reconnectTimer.expires_from_now(boost::posix_time::seconds(RECONNECT_DELAY));
-		_reconnectTimer.async_wait(boost::bind(&AssetServer::onReconnect, this,
-            boost::asio::placeholders::error));
+		//anywhere between half and all of the delay, so a pool that lost its
+		//connections together does not hammer the server together
+		unsigned int delayMs = _reconnectDelayMs / 2 + _jitter() % (_reconnectDelayMs / 2 + 1);
+
+		_reconnectTimer.expires_from_now(boost::posix_time::milliseconds(delayMs));
+		_reconnectTimer.async_wait(_strand.wrap(boost::bind(&AssetServer::onReconnect, this,
+            boost::asio::placeholders::error)));
 	}
 
 	void AssetServer::onReconnect(const boost::system::error_code& error)
@@ -89,18 +183,52 @@ namespace whip
 		if (_connectionState != CSTATE_SHUTDOWN) {
 			_connectionState = CSTATE_CONNECTING;
 
+			//resolved again on every reconnect, the server may have moved
+			tcp::resolver::query query(tcp::v4(), _serverURI.getHostName(),
+				boost::lexical_cast<std::string>(_serverURI.getPort()));
+
+			_resolver.async_resolve(query,
+				_strand.wrap(boost::bind(&AssetServer::onResolve, this,
+				  boost::asio::placeholders::error, boost::asio::placeholders::iterator)));
+		}
+	}
+
+	void AssetServer::onResolve(const boost::system::error_code& error, tcp::resolver::iterator endpoints)
+	{
+		if (_connectionState == CSTATE_SHUTDOWN) {
+			return;
+		}
+
+		if (! error && endpoints != tcp::resolver::iterator()) {
+			_assetServiceEndpoint = *endpoints;
+
 			_serviceSocket.async_connect(_assetServiceEndpoint,
-				boost::bind(&AssetServer::onConnect, this,
-				  boost::asio::placeholders::error));
+				_strand.wrap(boost::bind(&AssetServer::onConnect, this,
+				  boost::asio::placeholders::error)));
+
+		} else {
+			AppLog::instance().out() 
+				<< "[WHIP] Unable to resolve intramesh server "
+				<< _serverURI.getHostName() << ":" << _serverURI.getPort()
+				<< std::endl;
+
+			this->close();
 		}
 	}
 
 	void AssetServer::shutdown()
+	{
+		_strand.dispatch(boost::bind(&AssetServer::doShutdown, shared_from_this()));
+	}
+
+	void AssetServer::doShutdown()
 	{
 		if (_connectionState == CSTATE_RECONNECT_WAIT) {
 			_reconnectTimer.cancel();
 		}
 
+		_resolver.cancel();
+
 		this->close(true);
 	}
 
@@ -112,11 +240,11 @@ namespace whip
 
 			boost::asio::async_read(_serviceSocket,
 				boost::asio::buffer(authChallenge->getDataStorage(), AuthChallengeMsg::MESSAGE_SIZE),
-				boost::bind(
+				_strand.wrap(boost::bind(
 				  &AssetServer::onRecvChallenge, this,
 					boost::asio::placeholders::error,
 					boost::asio::placeholders::bytes_transferred,
-					authChallenge));
+					authChallenge)));
 
 		} else {
 			AppLog::instance().out() 
@@ -152,9 +280,9 @@ namespace whip
 
 		boost::asio::async_write(_serviceSocket,
 			boost::asio::buffer(respMessage->getDataStorage(), AuthResponseMsg::MESSAGE_SIZE),
-			boost::bind(&AssetServer::onChallengeResponseWrite, this,
+			_strand.wrap(boost::bind(&AssetServer::onChallengeResponseWrite, this,
 				boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred,
-				respMessage));
+				respMessage)));
 	}
 
 	void AssetServer::onAuthenticationStatus(const boost::system::error_code& error, size_t bytesRcvd,
@@ -189,6 +317,14 @@ namespace whip
 				<< std::endl;
 
 			_connectionState = CSTATE_CONNECTED;
+			_connectedAt = microsec_clock::universal_time();
+
+			//no traffic until the server answered a probe
+			this->sendProbe();
+
+			_probeTimer.expires_from_now(_probeInterval);
+			_probeTimer.async_wait(_strand.wrap(boost::bind(&AssetServer::onProbeTimer, shared_from_this(),
+				boost::asio::placeholders::error)));
 
 		} else {
 			AppLog::instance().out() 
@@ -211,9 +347,9 @@ namespace whip
 			//read the response back from the server
 			boost::asio::async_read(_serviceSocket,
 			boost::asio::buffer(authStatus->getDataStorage(), AuthStatusMsg::MESSAGE_SIZE),
-				boost::bind(&AssetServer::onAuthenticationStatus, this,
+				_strand.wrap(boost::bind(&AssetServer::onAuthenticationStatus, this,
 					boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred,
-					authStatus));
+					authStatus)));
 
 		} else {
 			AppLog::instance().out() 
@@ -227,6 +363,11 @@ namespace whip
 		}
 	}
 
+	const WhipURI& AssetServer::getURI() const
+	{
+		return _serverURI;
+	}
+
 	AssetServer::ConnectionState AssetServer::getServiceConnectionState() const
 	{
 		return _connectionState;
@@ -234,79 +375,205 @@ namespace whip
 
 	bool AssetServer::isConnected() const
 	{
-		return _connectionState == CSTATE_CONNECTED;
+		return _connectionState == CSTATE_CONNECTED && _probeVerified && ! this->isBreakerOpen();
+	}
+
+	bool AssetServer::isBreakerOpen() const
+	{
+		return steadyMs() < _breakerOpenUntilMs;
+	}
+
+	unsigned long long AssetServer::probeLatencyUs() const
+	{
+		return _probeLatencyUs;
+	}
+
+	void AssetServer::sendProbe()
+	{
+		if (_pendingTransfers.find(aperture::UUID()) != _pendingTransfers.end()) {
+			//someone asked for the nil asset, the probe would be mistaken for it
+			return;
+		}
+
+		_probeInFlight = true;
+		_probeSentAt = microsec_clock::universal_time();
+
+		this->queueRequest(ClientRequestMsg::RT_TEST, aperture::UUID(), boost::function<void (aperture::IAsset::ptr)>());
+	}
+
+	void AssetServer::onProbeTimer(const boost::system::error_code& error)
+	{
+		if (error || _connectionState != CSTATE_CONNECTED) {
+			return;
+		}
+
+		if (_probeInFlight) {
+			if (_probeTimeout.total_milliseconds() != 0 &&
+				microsec_clock::universal_time() - _probeSentAt >= _probeTimeout) {
+
+				AppLog::instance().out() 
+					<< "[WHIP] Intramesh server " << _assetServiceEndpoint
+					<< " did not answer a probe within " << _probeTimeout.total_milliseconds()
+					<< "ms, reconnecting"
+					<< std::endl;
+
+				this->close();
+				return;
+			}
+
+		} else {
+			this->sendProbe();
+		}
+
+		_probeTimer.expires_from_now(_probeInterval);
+		_probeTimer.async_wait(_strand.wrap(boost::bind(&AssetServer::onProbeTimer, shared_from_this(),
+			boost::asio::placeholders::error)));
+	}
+
+	void AssetServer::onProbeAnswered()
+	{
+		if (! _probeInFlight) {
+			return;
+		}
+
+		_probeInFlight = false;
+
+		unsigned long long latency = (microsec_clock::universal_time() - _probeSentAt).total_microseconds();
+		unsigned long long average = _probeLatencyUs;
+		_probeLatencyUs = average == 0 ? latency : average - average / 4 + latency / 4;
+
+		_probeVerified = true;
 	}
 
-	void AssetServer::getAsset(const std::string& uuid, boost::function<void (aperture::IAsset::ptr)> callBack)
+	unsigned long long AssetServer::outstandingBytes() const
 	{
-		if (_pendingTransfers.find(uuid) != _pendingTransfers.end()) {
+		unsigned int transfers = _transfersInFlight;
+		unsigned long long receiving = _bytesInTransfer;
+
+		unsigned int waiting = (receiving != 0 && transfers != 0) ? transfers - 1 : transfers;
+		return receiving + waiting * _averageAssetSize;
+	}
+
+	void AssetServer::getAsset(const aperture::UUID& uuid, boost::function<void (aperture::IAsset::ptr)> callBack)
+	{
+		_strand.dispatch(boost::bind(&AssetServer::doGetAsset, shared_from_this(), uuid, callBack));
+	}
+
+	void AssetServer::doGetAsset(const aperture::UUID& uuid, boost::function<void (aperture::IAsset::ptr)> callBack)
+	{
+		PendingTransferMap::iterator i = _pendingTransfers.find(uuid);
+		if (i != _pendingTransfers.end()) {
 			//we have a transfer in progess for this specific UUID, so the only step taken
 			//is to add another tracker for when this asset is available
 			//we dont have to send out another request
-			_pendingTransfers[uuid].emplace_back(callBack);
+			i->second.emplace_back(callBack);
 
 		} else {
 			//transfer(s) in progress but nothing for the asset we're looking for
 			//send out the request and queue up this asset
+			this->queueRequest(ClientRequestMsg::RT_GET, uuid, callBack);
+		}
+	
+	}
 
-			//queue the asset request
-			_pendingSends.push(uuid);
+	void AssetServer::queueRequest(ClientRequestMsg::RequestType type, const aperture::UUID& uuid,
+		boost::function<void (aperture::IAsset::ptr)> callBack)
+	{
+		//queue the request, it goes out with the next batch
+		size_t offset = _sendQueue.size();
+		_sendQueue.resize(offset + ClientRequestMsg::HEADER_SIZE);
+		ClientRequestMsg::encodeHeader(type, uuid, &_sendQueue[offset]);
 
-			if (_pendingSends.size() == 1) {
-				//im the only one in the queue. That means we need to fire this off live
-				this->processNextSendItem();
-			}
+		bool receiving = ! _pendingTransfers.empty();
 
-			if (_pendingTransfers.size() == 0) {
-				//queue the callback for when this asset comes in
-				AssetCallbackList callBacks;
-				callBacks.emplace_back(callBack);
-				_pendingTransfers[uuid] = callBacks;
+		//queue the callback for when the answer comes in
+		AssetCallbackList& callBacks = _pendingTransfers[uuid];
+		if (callBack) {
+			callBacks.emplace_back(callBack);
+		}
 
-				//just me in here, fire off the recv process
-				this->beginResponseHeaderRead();
+		if (! receiving) {
+			//just me in here, fire off the recv process. otherwise someone
+			//else is already receiving and will call me in time
+			this->beginResponseHeaderRead();
+		}
 
-			} else {
-				//queue the callback for when this asset comes in,
-				//someone else is already recv and will call me in time
-				AssetCallbackList callBacks;
-				callBacks.emplace_back(callBack);
-				_pendingTransfers[uuid] = callBacks;
+		_transfersInFlight = static_cast<unsigned int>(_pendingTransfers.size());
 
-			}
+		this->scheduleSend();
+	}
 
+	void AssetServer::scheduleSend()
+	{
+		if (_writeInProgress || _sendQueue.empty()) {
+			//whatever is queued goes out when the current write completes
+			return;
+		}
+
+		size_t queued = _sendQueue.size() / ClientRequestMsg::HEADER_SIZE;
+
+		//every pending transfer still in the queue means the server has nothing
+		//of ours to work on, waiting for more requests would leave it idle
+		bool serverIdle = _pendingTransfers.size() <= queued;
+
+		if (queued >= _maxBatchRequests || serverIdle || _sendLinger.total_microseconds() == 0) {
+			this->sendQueuedRequests();
+
+		} else if (! _lingerArmed) {
+			_lingerArmed = true;
+			_lingerTimer.expires_from_now(_sendLinger);
+			_lingerTimer.async_wait(_strand.wrap(boost::bind(&AssetServer::onSendLinger, shared_from_this(),
+				boost::asio::placeholders::error)));
 		}
-	
 	}
 
-	void AssetServer::processNextSendItem()
+	void AssetServer::onSendLinger(const boost::system::error_code& error)
 	{
-		ClientRequestMsg::ptr request(new ClientRequestMsg(ClientRequestMsg::RT_GET, _pendingSends.front()));
-		boost::asio::async_write(_serviceSocket,
-			boost::asio::buffer(request->getHeaderData(), request->getHeaderData().size()),
-			boost::bind(&AssetServer::onWriteAssetRequest, this,
-				  boost::asio::placeholders::error,
-				  boost::asio::placeholders::bytes_transferred,
-				  request));
+		_lingerArmed = false;
+
+		if (! error) {
+			this->sendQueuedRequests();
+		}
 	}
 
-	void AssetServer::tryProcessNextSendItem()
+	void AssetServer::sendQueuedRequests()
 	{
-		if (!_pendingSends.empty()) {
-			this->processNextSendItem();
+		if (_writeInProgress || _sendQueue.empty()) {
+			return;
 		}
+
+		if (_lingerArmed) {
+			_lingerTimer.cancel();
+		}
+
+		size_t batchBytes = std::min(_sendQueue.size(), size_t(_maxBatchRequests) * ClientRequestMsg::HEADER_SIZE);
+		if (batchBytes == _sendQueue.size()) {
+			_sendBuffer.swap(_sendQueue);
+		} else {
+			_sendBuffer.assign(_sendQueue.begin(), _sendQueue.begin() + batchBytes);
+			_sendQueue.erase(_sendQueue.begin(), _sendQueue.begin() + batchBytes);
+		}
+
+		_writeInProgress = true;
+		boost::asio::async_write(_serviceSocket,
+			boost::asio::buffer(_sendBuffer),
+			_strand.wrap(boost::bind(&AssetServer::onWriteAssetRequests, shared_from_this(),
+				  boost::asio::placeholders::error,
+				  boost::asio::placeholders::bytes_transferred)));
 	}
 
-	void AssetServer::onWriteAssetRequest(const boost::system::error_code& error, size_t bytesSent,
-		ClientRequestMsg::ptr request)
+	void AssetServer::onWriteAssetRequests(const boost::system::error_code& error, size_t bytesSent)
 	{
+		_writeInProgress = false;
+		_sendBuffer.clear();
+
 		if (! error && bytesSent > 0) {
-			_pendingSends.pop();
-			this->tryProcessNextSendItem();
+			//the requests queued meanwhile are sent right away to keep the server busy
+			this->sendQueuedRequests();
 
-		} else {
+		} else if (error != boost::asio::error::operation_aborted) {
 			AppLog::instance().out() 
-				<< "[WHIP] Error while reading asset header from mesh server "
+				<< "[WHIP] Error while sending asset requests to mesh server "
 				<< _assetServiceEndpoint
 				<< ": "
 				<< error.message()
@@ -323,10 +590,10 @@ namespace whip
 		ServerResponseMsg::ptr response(new ServerResponseMsg());
 		boost::asio::async_read(_serviceSocket, 
 			boost::asio::buffer(response->getHeader(), response->getHeader().size()),
-			boost::bind(&AssetServer::onReadResponseHeader, this,
+			_strand.wrap(boost::bind(&AssetServer::onReadResponseHeader, this,
 			  boost::asio::placeholders::error,
 			  boost::asio::placeholders::bytes_transferred,
-			  response));
+			  response)));
 	}
 
 	void AssetServer::onReadResponseHeader(const boost::system::error_code& error, size_t bytesSent,
@@ -337,17 +604,19 @@ namespace whip
 			if (response->validateHeader() && 
 				response->getResponseCode() == ServerResponseMsg::RC_FOUND) {
 				
-				//adjust data size
-				response->initializeDataStorage();
+				_bytesInTransfer = response->getDataSize();
+
+				//read as much of the packet as can hold its header, the data is
+				//then read straight into a pooled block
+				size_t headerBytes = std::min<size_t>(response->getDataSize(), Asset::MAX_HEADER_SIZE);
 
-				//read the data
 #pragma warning (disable: 4503) //decorated name length exceeded
 				boost::asio::async_read(_serviceSocket, 
-					boost::asio::buffer(*(response->getData()), response->getData()->size()),
-					boost::bind(&AssetServer::onReadResponseData, this,
+					boost::asio::buffer(_packetHeader, headerBytes),
+					_strand.wrap(boost::bind(&AssetServer::onReadAssetHeader, this,
 					  boost::asio::placeholders::error,
 					  boost::asio::placeholders::bytes_transferred,
-					  response));
+					  response)));
 
 			} else {
 				//error, not found, or other condition
@@ -371,12 +640,17 @@ namespace whip
 						//read the data and discard
 						boost::asio::async_read(_serviceSocket, 
 							boost::asio::buffer(*(response->getData()), response->getData()->size()),
-							boost::bind(&AssetServer::onHandleRequestErrorData, this,
+							_strand.wrap(boost::bind(&AssetServer::onHandleRequestErrorData, this,
 							  boost::asio::placeholders::error,
 							  boost::asio::placeholders::bytes_transferred,
-							  response));
+							  response)));
 
 					} else {
+						if (response->getResponseCode() == ServerResponseMsg::RC_OK &&
+							response->getAssetUUID() == aperture::UUID()) {
+							this->onProbeAnswered();
+						}
+
 						this->fireAssetRcvdCallbacks(response->getAssetUUID(), Asset::ptr());
 						this->testContinueRecv();
 					}
@@ -398,18 +672,23 @@ namespace whip
 		}
 	}
 
-	void AssetServer::fireAssetRcvdCallbacks(const std::string& assetUUID, Asset::ptr asset)
+	void AssetServer::fireAssetRcvdCallbacks(const aperture::UUID& assetUUID, Asset::ptr asset)
 	{
 		PendingTransferMap::iterator i = _pendingTransfers.find(assetUUID);
 		if (i != _pendingTransfers.end()) {
+			//hand the callbacks to the io_service so the responses are built in
+			//parallel instead of on this connection's strand
 			AssetCallbackList& callbacks = i->second;
 			for (const boost::function<void (Asset::ptr)> &callback : callbacks)
 			{
-				callback(asset);
+				_ioService.post(boost::bind(callback, asset));
 			}
 			
 			_pendingTransfers.erase(i);
 		}
+
+		_transfersInFlight = static_cast<unsigned int>(_pendingTransfers.size());
+		_bytesInTransfer = 0;
 		
 	}
 	
@@ -442,12 +721,87 @@ namespace whip
 		}
 	}
 
+	void AssetServer::onReadAssetHeader(const boost::system::error_code& error, size_t bytesSent,
+		ServerResponseMsg::ptr response)
+	{
+		if (error || bytesSent == 0) {
+			AppLog::instance().out() 
+				<< "[WHIP] Error while reading asset data from mesh server "
+				<< _assetServiceEndpoint
+				<< ": "
+				<< error.message()
+				<< std::endl;
+
+			//close the connection something is broken
+			this->close();
+			return;
+		}
+
+		unsigned int dataLoc, dataSz;
+		if (! Asset::findDataLocationAndSize(_packetHeader, bytesSent, dataLoc, dataSz) ||
+			dataLoc + (unsigned long long) dataSz != response->getDataSize()) {
+
+			AppLog::instance().out() 
+				<< "[WHIP] Invalid asset packet sent from server. Terminating connection "
+				<< "asset svc ep: " << _assetServiceEndpoint
+				<< std::endl;
+
+			this->close();
+			return;
+		}
+
+		_receiveBlock = BufferPool::instance().acquire(std::max(dataSz, 1u));
+		_receiveSize = dataSz;
+
+		//the start of the data may already be in with the header
+		size_t alreadyRead = bytesSent - dataLoc;
+		if (alreadyRead > 0) {
+			std::memcpy(_receiveBlock.get(), _packetHeader + dataLoc, alreadyRead);
+		}
+
+		if (alreadyRead == dataSz) {
+			this->onReadResponseData(boost::system::error_code(), 0, response);
+			return;
+		}
+
+		if (_streamMinSize != 0 && dataSz >= _streamMinSize) {
+			//large enough to have the waiting replies start before it is all in
+			_receiveStream.reset(new StreamingAsset(response->getAssetUUID(), _packetHeader[Asset::TYPE_LOC],
+				_receiveBlock, dataSz));
+			_receivedBytes = static_cast<unsigned int>(alreadyRead);
+			_receiveStream->advance(_receivedBytes);
+
+			StreamRegistry::instance().publish(_receiveStream);
+
+			this->readStreamData(response);
+			return;
+		}
+
+		boost::asio::async_read(_serviceSocket, 
+			boost::asio::buffer(_receiveBlock.get() + alreadyRead, dataSz - alreadyRead),
+			_strand.wrap(boost::bind(&AssetServer::onReadResponseData, this,
+			  boost::asio::placeholders::error,
+			  boost::asio::placeholders::bytes_transferred,
+			  response)));
+	}
+
 	void AssetServer::onReadResponseData(const boost::system::error_code& error, size_t bytesSent,
 		ServerResponseMsg::ptr response)
 	{
-		if (!error && bytesSent > 0) {
+		if (! error) {
 			//new asset is available
-			Asset::ptr meshAsset(new Asset(response->getData()));
+			unsigned long long average = _averageAssetSize;
+			_averageAssetSize = average - average / 8 + _receiveSize / 8;
+
+			Asset::ptr meshAsset(new Asset(response->getAssetUUID(), _packetHeader[Asset::TYPE_LOC],
+				_packetHeader[Asset::LOCAL_LOC] == 1, std::move(_receiveBlock), _receiveSize));
+			_receiveBlock.reset();
+
+			if (_receiveStream) {
+				StreamRegistry::instance().retire(_receiveStream);
+				_receiveStream.reset();
+			}
+
 			this->fireAssetRcvdCallbacks(response->getAssetUUID(), meshAsset);
 			this->testContinueRecv();
 
@@ -464,5 +818,32 @@ namespace whip
 			this->close();
 		}
 	}
-}
 
+	void AssetServer::readStreamData(ServerResponseMsg::ptr response)
+	{
+		_serviceSocket.async_read_some(
+			boost::asio::buffer(_receiveBlock.get() + _receivedBytes, _receiveSize - _receivedBytes),
+			_strand.wrap(boost::bind(&AssetServer::onReadStreamData, this,
+			  boost::asio::placeholders::error,
+			  boost::asio::placeholders::bytes_transferred,
+			  response)));
+	}
+
+	void AssetServer::onReadStreamData(const boost::system::error_code& error, size_t bytesSent,
+		ServerResponseMsg::ptr response)
+	{
+		if (error) {
+			this->onReadResponseData(error, bytesSent, response);
+			return;
+		}
+
+		_receivedBytes += static_cast<unsigned int>(bytesSent);
+		_receiveStream->advance(_receivedBytes);
+
+		if (_receivedBytes < _receiveSize) {
+			this->readStreamData(response);
+		} else {
+			this->onReadResponseData(error, _receiveSize, response);
+		}
+	}
+}
@@ -9,14 +9,16 @@
 #include "WhipURI.h"
 #include "IAsset.h"
 #include "IAssetServer.h"
+#include "StreamingAsset.h"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/asio.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/function.hpp>
 
-#include <queue>
-#include <map>
+#include <atomic>
+#include <random>
+#include <unordered_map>
 #include <vector>
 
 namespace whip
@@ -48,7 +50,15 @@ namespace whip
 		};
 
 	private:
-		static const int RECONNECT_DELAY = 5;
+		/// The reconnect delay doubles from the first to the last after every failure
+		static const unsigned int MIN_RECONNECT_DELAY_MS = 500;
+		static const unsigned int MAX_RECONNECT_DELAY_MS = 60000;
+
+		/// A connection lasting this long ends a run of failures
+		static const unsigned int STABLE_CONNECTION_SECS = 30;
+
+		/// What a request is assumed to cost before any asset was received
+		static const unsigned int INITIAL_ASSET_SIZE_GUESS = 32 * 1024;
 
 		/**
 		 * The URI that identifies this server
@@ -65,6 +75,12 @@ namespace whip
 		 */
 		boost::asio::io_service& _ioService;
 
+		/**
+		 * Strand that serializes all work on the service socket. getAsset() and
+		 * shutdown() may be called from any of the HTTP threads
+		 */
+		boost::asio::io_service::strand _strand;
+
 		/**
 		 * Tcp/Ip socket for accessing asset services on the remote
 		 */
@@ -73,7 +89,7 @@ namespace whip
 		/**
 		 * Whether or not a successful connection was made to the asset service port
 		 */
-		ConnectionState _connectionState;
+		std::atomic<ConnectionState> _connectionState;
 
 		/**
 		 * Callback to make when all searches are completed
@@ -81,21 +97,101 @@ namespace whip
 		SafeKillCallback _safeKillCallback;
 
 		/**
-		 * Stores all pending transfer send requests
+		 * Request headers waiting to be written, packed back to back so a whole
+		 * batch goes out in one write
 		 */
-		typedef std::queue<std::string> PendingSendQueue;
-		PendingSendQueue _pendingSends;
+		aperture::byte_array _sendQueue;
+
+		/**
+		 * The batch of request headers currently being written
+		 */
+		aperture::byte_array _sendBuffer;
+		bool _writeInProgress;
+
+		/**
+		 * The most requests written at once, and how long requests may wait for
+		 * others to join their batch while the server still has work
+		 */
+		unsigned int _maxBatchRequests;
+		boost::posix_time::time_duration _sendLinger;
+
+		boost::asio::deadline_timer _lingerTimer;
+		bool _lingerArmed;
 
 		/**
 		 * Stores all pending transfer receives
 		 */
 		typedef std::vector<boost::function<void (Asset::ptr)> > AssetCallbackList;
-		typedef std::map<std::string, AssetCallbackList> PendingTransferMap;
+		typedef std::unordered_map<aperture::UUID, AssetCallbackList> PendingTransferMap;
 		PendingTransferMap _pendingTransfers;
 
 		boost::asio::deadline_timer _reconnectTimer;
 
+		/**
+		 * Connection failures in a row, the next reconnect delay, and the
+		 * generator jittering it so a pool does not reconnect all at once
+		 */
+		unsigned int _consecutiveFailures;
+		unsigned int _reconnectDelayMs;
+		std::minstd_rand _jitter;
+		boost::posix_time::ptime _connectedAt;
+
+		/**
+		 * The circuit breaker. After enough failures in a row the server is
+		 * reported as disconnected until the cooldown ends, whether or not a
+		 * reconnect succeeded, so the traffic goes elsewhere instead of
+		 * following every flap of the link
+		 */
+		unsigned int _breakerFailures;
+		boost::posix_time::time_duration _breakerCooldown;
+		std::atomic<long long> _breakerOpenUntilMs;
+
+		/**
+		 * RT_TEST probes, sent down the request stream to see the server
+		 * answering and time it. A new connection takes no traffic until it
+		 * answered its first probe, and one not answered within the timeout
+		 * counts as a failed connection
+		 */
+		boost::posix_time::time_duration _probeInterval;
+		boost::posix_time::time_duration _probeTimeout;
+		boost::asio::deadline_timer _probeTimer;
+		boost::posix_time::ptime _probeSentAt;
+		bool _probeInFlight;
+		std::atomic<bool> _probeVerified;
+		std::atomic<unsigned long long> _probeLatencyUs;
 
+		/**
+		 * What is known about the transfers in progress, kept for pools choosing
+		 * the least loaded connection from other threads
+		 */
+		std::atomic<unsigned int> _transfersInFlight;
+		std::atomic<unsigned long long> _bytesInTransfer;
+		std::atomic<unsigned long long> _averageAssetSize;
+
+		/**
+		 * The asset being received: its packet header, and the pooled block its
+		 * data is read into
+		 */
+		aperture::byte _packetHeader[Asset::MAX_HEADER_SIZE];
+		boost::shared_ptr<aperture::byte> _receiveBlock;
+		unsigned int _receiveSize;
+
+		/**
+		 * Assets of at least this size are read in pieces and published as a
+		 * stream while they come in, 0 for never. The stream and how much of it
+		 * is in, for the asset being received
+		 */
+		unsigned int _streamMinSize;
+		aperture::StreamingAsset::ptr _receiveStream;
+		unsigned int _receivedBytes;
+
+		/**
+		 * Looks the server up on every connect without blocking the io_service
+		 */
+		boost::asio::ip::tcp::resolver _resolver;
+
+
+		void onResolve(const boost::system::error_code& error, boost::asio::ip::tcp::resolver::iterator endpoints);
 
 		void onConnect(const boost::system::error_code& error);
 		
@@ -113,32 +209,75 @@ namespace whip
 		/**
 		 * Asset request process methods
 		 */
-		void processNextSendItem();
+		/**
+		 * Writes the queued requests now if a batch is full or the server has
+		 * nothing left to answer, otherwise waits up to the linger time for more
+		 */
+		void scheduleSend();
 
-		void tryProcessNextSendItem();
+		void onSendLinger(const boost::system::error_code& error);
 
-		void onWriteAssetRequest(const boost::system::error_code& error, size_t bytesSent,
-			ClientRequestMsg::ptr request);
+		/**
+		 * Writes up to a batch of the queued requests unless a write is already
+		 * in progress
+		 */
+		void sendQueuedRequests();
+
+		void onWriteAssetRequests(const boost::system::error_code& error, size_t bytesSent);
 
 		void beginResponseHeaderRead();
 
 		void onReadResponseHeader(const boost::system::error_code& error, size_t bytesSent,
 			ServerResponseMsg::ptr response);
 
-		void fireAssetRcvdCallbacks(const std::string& assetUUID, Asset::ptr asset);
+		void fireAssetRcvdCallbacks(const aperture::UUID& assetUUID, Asset::ptr asset);
 
 		void testContinueRecv();
 
 		void onHandleRequestErrorData(const boost::system::error_code& error, size_t bytesSent,
 			ServerResponseMsg::ptr response);
 
+		void onReadAssetHeader(const boost::system::error_code& error, size_t bytesSent,
+			ServerResponseMsg::ptr response);
+
 		void onReadResponseData(const boost::system::error_code& error, size_t bytesSent,
 			ServerResponseMsg::ptr response);
 
+		/**
+		 * Reads the next piece of a streamed asset
+		 */
+		void readStreamData(ServerResponseMsg::ptr response);
+
+		void onReadStreamData(const boost::system::error_code& error, size_t bytesSent,
+			ServerResponseMsg::ptr response);
+
 		void tryReconnect();
 
+		/**
+		 * Counts a failed connection and opens the circuit breaker if there
+		 * were too many in a row
+		 */
+		void recordFailure(bool wasConnected);
+
+		void sendProbe();
+
+		void onProbeTimer(const boost::system::error_code& error);
+
+		void onProbeAnswered();
+
+		/**
+		 * Queues a request for the given asset, and starts reading responses if
+		 * none was expected
+		 */
+		void queueRequest(ClientRequestMsg::RequestType type, const aperture::UUID& uuid,
+			boost::function<void (aperture::IAsset::ptr)> callBack);
+
 		void onReconnect(const boost::system::error_code& error);
 
+		void doGetAsset(const aperture::UUID& uuid, boost::function<void (aperture::IAsset::ptr)> callBack);
+
+		void doShutdown();
+
 
 	public:
 		AssetServer(const WhipURI& serverURI, boost::asio::io_service& ioService);
@@ -154,24 +293,48 @@ namespace whip
 		 */
 		void connect();
 
+		/**
+		 * Returns the URI this server was created with
+		 */
+		const WhipURI& getURI() const;
+
 		/**
 		 * Returns the status of the connection to this server
 		 */
 		ConnectionState getServiceConnectionState() const;
 
 		/**
-		 * Returns a simple true or false for whether the server is ready for requests
+		 * Returns a simple true or false for whether the server is ready for
+		 * requests: connected, answering probes and with its breaker closed
 		 */
 		virtual bool isConnected() const;
 
+		/**
+		 * Returns whether the circuit breaker is keeping traffic off this server
+		 */
+		bool isBreakerOpen() const;
+
+		/**
+		 * Returns the recent round trip time of probes in microseconds, 0 until
+		 * one was answered
+		 */
+		unsigned long long probeLatencyUs() const;
+
 		/**
 		 * Retrieves the given asset from this server
 		 */
-		virtual void getAsset(const std::string& uuid, boost::function<void (aperture::IAsset::ptr)> callBack);
+		virtual void getAsset(const aperture::UUID& uuid, boost::function<void (aperture::IAsset::ptr)> callBack);
 
 		/**
 		 * Shuts down the connections and marks this server as shut down
 		 */
 		virtual void shutdown();
+
+		/**
+		 * Returns an estimate of the bytes still to be received for the requests
+		 * made on this connection: the size of the asset being received plus the
+		 * average asset size for every request waiting behind it
+		 */
+		unsigned long long outstandingBytes() const;
 	};
 }
@@ -0,0 +1,154 @@
+#include "stdafx.h"
+
+#include "AssetServerPool.h"
+#include "AppLog.h"
+
+#include <limits>
+
+using namespace aperture;
+
+namespace whip
+{
+	AssetServerPool::AssetServerPool(const WhipURI& serverURI, boost::asio::io_service& ioService, unsigned int size)
+	:	_ioService(ioService)
+	{
+		if (size == 0) size = 1;
+
+		for (unsigned int i = 0; i < size; ++i) {
+			_members.push_back(AssetServer::ptr(new AssetServer(serverURI, ioService)));
+		}
+	}
+
+	AssetServerPool::~AssetServerPool()
+	{
+	}
+
+	void AssetServerPool::connect()
+	{
+		for (AssetServer::ptr member : _members) {
+			member->connect();
+		}
+	}
+
+	bool AssetServerPool::isConnected() const
+	{
+		for (const AssetServer::ptr& member : _members) {
+			if (member->isConnected()) return true;
+		}
+
+		return false;
+	}
+
+	AssetServer::ptr AssetServerPool::leastLoaded() const
+	{
+		AssetServer::ptr best;
+		unsigned long long bestBytes = std::numeric_limits<unsigned long long>::max();
+
+		for (const AssetServer::ptr& member : _members) {
+			if (! member->isConnected()) continue;
+
+			unsigned long long bytes = member->outstandingBytes();
+			if (bytes < bestBytes) {
+				best = member;
+				bestBytes = bytes;
+			}
+		}
+
+		return best;
+	}
+
+	void AssetServerPool::getAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack)
+	{
+		AssetServer::ptr member;
+
+		{
+			boost::mutex::scoped_lock lock(_mutex);
+
+			PendingTransferMap::iterator i = _pendingTransfers.find(uuid);
+			if (i != _pendingTransfers.end()) {
+				//already requested on one of the members, just wait for it
+				i->second.push_back(callBack);
+				return;
+			}
+
+			member = this->leastLoaded();
+			if (member) {
+				_pendingTransfers[uuid].push_back(callBack);
+			}
+		}
+
+		if (! member) {
+			_ioService.post(boost::bind(callBack, IAsset::ptr()));
+			return;
+		}
+
+		member->getAsset(uuid, boost::bind(&AssetServerPool::onAssetReceived, shared_from_this(), uuid, member, _1));
+	}
+
+	void AssetServerPool::onAssetReceived(const UUID& uuid, AssetServer::ptr member, IAsset::ptr asset)
+	{
+		if (! asset && ! member->isConnected()) {
+			//the connection failed before answering, another one may still be up
+			AssetServer::ptr next;
+			{
+				boost::mutex::scoped_lock lock(_mutex);
+				next = this->leastLoaded();
+			}
+
+			if (next) {
+				next->getAsset(uuid, boost::bind(&AssetServerPool::onAssetReceived, shared_from_this(), uuid, next, _1));
+				return;
+			}
+		}
+
+		AssetCallbackList callbacks;
+
+		{
+			boost::mutex::scoped_lock lock(_mutex);
+
+			PendingTransferMap::iterator i = _pendingTransfers.find(uuid);
+			if (i == _pendingTransfers.end()) {
+				return;
+			}
+
+			callbacks.swap(i->second);
+			_pendingTransfers.erase(i);
+		}
+
+		//the members already run this on the io_service, hand any further
+		//waiters to it so their responses are built in parallel
+		for (size_t i = 1; i < callbacks.size(); ++i) {
+			_ioService.post(boost::bind(callbacks[i], asset));
+		}
+
+		callbacks.front()(asset);
+	}
+
+	void AssetServerPool::shutdown()
+	{
+		for (AssetServer::ptr member : _members) {
+			member->shutdown();
+		}
+	}
+
+	unsigned long long AssetServerPool::probeLatencyUs() const
+	{
+		unsigned long long total = 0;
+		unsigned int timed = 0;
+
+		for (const AssetServer::ptr& member : _members) {
+			unsigned long long latency = member->probeLatencyUs();
+			if (member->isConnected() && latency != 0) {
+				total += latency;
+				++timed;
+			}
+		}
+
+		return timed == 0 ? 0 : total / timed;
+	}
+
+	const std::vector<AssetServer::ptr>& AssetServerPool::getMembers() const
+	{
+		return _members;
+	}
+}
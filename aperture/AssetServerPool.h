@@ -0,0 +1,96 @@
+#pragma once
+
+#include "AssetServer.h"
+#include "IAsset.h"
+#include "IAssetServer.h"
+#include "UUID.h"
+#include "WhipURI.h"
+
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <unordered_map>
+#include <vector>
+
+namespace whip
+{
+	/**
+	 * Several authenticated connections to the same WHIP server. A connection
+	 * receives its responses one after another, so a large asset holds up every
+	 * request queued behind it; spreading requests over a pool keeps the small
+	 * ones flowing. Each request goes to the connected member with the fewest
+	 * bytes outstanding, and concurrent requests for the same asset are sent only
+	 * once across the whole pool
+	 */
+	class AssetServerPool : public boost::enable_shared_from_this<AssetServerPool>, public aperture::IAssetServer
+	{
+	public:
+		typedef boost::shared_ptr<AssetServerPool> ptr;
+
+	private:
+		boost::asio::io_service& _ioService;
+
+		std::vector<AssetServer::ptr> _members;
+
+		/**
+		 * Callbacks waiting on each asset requested from a member
+		 */
+		typedef std::vector<boost::function<void (aperture::IAsset::ptr)> > AssetCallbackList;
+		typedef std::unordered_map<aperture::UUID, AssetCallbackList> PendingTransferMap;
+		PendingTransferMap _pendingTransfers;
+
+		/**
+		 * Protects _pendingTransfers, getAsset() is called from any thread
+		 */
+		boost::mutex _mutex;
+
+		/**
+		 * Returns the connected member with the fewest bytes outstanding, or an
+		 * empty pointer if none is connected
+		 */
+		AssetServer::ptr leastLoaded() const;
+
+		/**
+		 * Hands the asset to everyone waiting for it, or sends the request to
+		 * another member if the one asked disconnected without an answer
+		 */
+		void onAssetReceived(const aperture::UUID& uuid, AssetServer::ptr member, aperture::IAsset::ptr asset);
+
+	public:
+		/**
+		 * Creates a pool of the given number of connections to the server
+		 */
+		AssetServerPool(const WhipURI& serverURI, boost::asio::io_service& ioService, unsigned int size);
+		virtual ~AssetServerPool();
+
+		/**
+		 * Connects every member of the pool
+		 */
+		void connect();
+
+		/**
+		 * Returns whether any member of the pool is ready for requests
+		 */
+		virtual bool isConnected() const;
+
+		virtual void getAsset(const aperture::UUID& uuid, boost::function<void (aperture::IAsset::ptr)> callBack);
+
+		/**
+		 * Shuts down every member of the pool
+		 */
+		virtual void shutdown();
+
+		/**
+		 * Returns the mean probe round trip of the connected members in
+		 * microseconds, 0 if none was timed yet
+		 */
+		unsigned long long probeLatencyUs() const;
+
+		/**
+		 * Returns the members of the pool
+		 */
+		const std::vector<AssetServer::ptr>& getMembers() const;
+	};
+}
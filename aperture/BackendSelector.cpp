@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include "BackendSelector.h"
+
+#include <algorithm>
+
+namespace aperture {
+
+const unsigned int BackendSelector::MIN_SAMPLES;
+const unsigned int BackendSelector::EXPLORE_INTERVAL;
+const unsigned int BackendSelector::SWITCH_MARGIN_PERCENT;
+
+namespace {
+	/// Weight of a new answer in the moving averages
+	const double EWMA_WEIGHT = 1.0 / 16;
+}
+
+BackendSelector::BackendSelector(const std::string& primaryName, const std::string& secondaryName,
+	unsigned int numBuckets)
+	: _buckets(std::min(std::max(numBuckets, 1u), 256u))
+{
+	_names[PRIMARY] = primaryName;
+	_names[SECONDARY] = secondaryName;
+}
+
+BackendSelector::Bucket& BackendSelector::bucketFor(const UUID& uuid)
+{
+	return _buckets[uuid.data()[0] % _buckets.size()];
+}
+
+bool BackendSelector::secondaryFirst(const UUID& uuid)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	Bucket& bucket = this->bucketFor(uuid);
+	bool explore = ++bucket.requests % EXPLORE_INTERVAL == 0;
+
+	return bucket.secondaryFirst != explore;
+}
+
+void BackendSelector::record(Backend backend, const UUID& uuid, const boost::posix_time::time_duration& elapsed,
+	bool found)
+{
+	double elapsedUs = (double) std::max<long long>(elapsed.total_microseconds(), 0);
+
+	boost::mutex::scoped_lock lock(_mutex);
+
+	Bucket& bucket = this->bucketFor(uuid);
+	if (bucket.samples[backend]++ == 0) {
+		bucket.latencyUs[backend] = elapsedUs;
+		bucket.missRate[backend] = found ? 0 : 1;
+	} else {
+		bucket.latencyUs[backend] += (elapsedUs - bucket.latencyUs[backend]) * EWMA_WEIGHT;
+		bucket.missRate[backend] += ((found ? 0 : 1) - bucket.missRate[backend]) * EWMA_WEIGHT;
+	}
+
+	this->decide(bucket);
+}
+
+void BackendSelector::decide(Bucket& bucket)
+{
+	if (bucket.samples[PRIMARY] < MIN_SAMPLES || bucket.samples[SECONDARY] < MIN_SAMPLES) {
+		return;
+	}
+
+	//the expected wait for the asset is the first answer plus, on a miss, the second
+	double primaryFirst = bucket.latencyUs[PRIMARY] + bucket.missRate[PRIMARY] * bucket.latencyUs[SECONDARY];
+	double secondaryFirst = bucket.latencyUs[SECONDARY] + bucket.missRate[SECONDARY] * bucket.latencyUs[PRIMARY];
+
+	double margin = (100 - SWITCH_MARGIN_PERCENT) / 100.0;
+	if (bucket.secondaryFirst) {
+		if (primaryFirst < secondaryFirst * margin) bucket.secondaryFirst = false;
+	} else {
+		if (secondaryFirst < primaryFirst * margin) bucket.secondaryFirst = true;
+	}
+}
+
+void BackendSelector::writeStats(std::ostream& out) const
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	for (int backend = PRIMARY; backend <= SECONDARY; ++backend) {
+		double latency = 0, missRate = 0;
+		unsigned long long samples = 0;
+
+		for (const Bucket& bucket : _buckets) {
+			latency += bucket.latencyUs[backend] * bucket.samples[backend];
+			missRate += bucket.missRate[backend] * bucket.samples[backend];
+			samples += bucket.samples[backend];
+		}
+
+		out << "backend_" << _names[backend] << "_latency_us=" << (unsigned long long) (samples ? latency / samples : 0) << "\n"
+			<< "backend_" << _names[backend] << "_miss_rate=" << (samples ? missRate / samples : 0) << "\n"
+			<< "backend_" << _names[backend] << "_answers=" << samples << "\n";
+	}
+
+	size_t secondaryFirst = std::count_if(_buckets.begin(), _buckets.end(),
+		[](const Bucket& bucket) { return bucket.secondaryFirst; });
+
+	out << "backend_" << _names[SECONDARY] << "_first_buckets=" << secondaryFirst << "\n"
+		<< "backend_buckets=" << _buckets.size() << "\n";
+}
+
+}
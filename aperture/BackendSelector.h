@@ -0,0 +1,92 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Decides which of two backends to ask for an asset first. Keeps a moving
+ * average of the answer time and the miss rate of each backend, per bucket of
+ * asset ids, and puts the secondary first wherever that gives the asset
+ * sooner on average: a primary that mostly misses costs its answer time on
+ * top of the secondary's for nearly every request.
+ *
+ * Every EXPLORE_INTERVAL-th request of a bucket is sent in the other order so
+ * the statistics of the backend asked second stay current. Safe to use from
+ * any thread
+ */
+class BackendSelector
+{
+public:
+	enum Backend { PRIMARY = 0, SECONDARY = 1 };
+
+	/// Answers from each backend in a bucket before its order may change
+	static const unsigned int MIN_SAMPLES = 32;
+
+	/// One request in this many tries the other order
+	static const unsigned int EXPLORE_INTERVAL = 32;
+
+	/// The other order has to be this much faster, in percent, to be taken
+	static const unsigned int SWITCH_MARGIN_PERCENT = 20;
+
+private:
+	struct Bucket
+	{
+		Bucket() : secondaryFirst(false), requests(0)
+		{
+			for (int i = 0; i < 2; ++i) {
+				latencyUs[i] = 0;
+				missRate[i] = 0;
+				samples[i] = 0;
+			}
+		}
+
+		double latencyUs[2];
+		double missRate[2];
+		unsigned long long samples[2];
+
+		bool secondaryFirst;
+		unsigned long long requests;
+	};
+
+	std::string _names[2];
+	std::vector<Bucket> _buckets;
+	mutable boost::mutex _mutex;
+
+	Bucket& bucketFor(const UUID& uuid);
+
+	/// Works the order of the bucket out again from its statistics
+	void decide(Bucket& bucket);
+
+public:
+	/**
+	 * Creates a selector keeping separate statistics for the given number of
+	 * buckets, picked by the first byte of the asset id
+	 */
+	BackendSelector(const std::string& primaryName, const std::string& secondaryName, unsigned int numBuckets);
+
+	/**
+	 * Returns whether to ask the secondary first for the given asset
+	 */
+	bool secondaryFirst(const UUID& uuid);
+
+	/**
+	 * Records an answer from one of the backends
+	 */
+	void record(Backend backend, const UUID& uuid, const boost::posix_time::time_duration& elapsed, bool found);
+
+	/**
+	 * Writes the average answer time and miss rate of each backend over all
+	 * buckets, and how many buckets ask the secondary first
+	 */
+	void writeStats(std::ostream& out) const;
+};
+
+}
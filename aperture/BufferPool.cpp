@@ -0,0 +1,113 @@
+#include "stdafx.h"
+#include "BufferPool.h"
+
+#include <algorithm>
+
+namespace aperture {
+
+const size_t BufferPool::MIN_BLOCK_SIZE;
+const size_t BufferPool::MAX_POOLED_SIZE;
+const size_t BufferPool::MAX_IDLE_BYTES_PER_CLASS;
+
+BufferPool& BufferPool::instance()
+{
+	static BufferPool* pool = new BufferPool();
+	return *pool;
+}
+
+BufferPool::BufferPool()
+	: _reused(0), _allocated(0), _idleBytes(0)
+{
+	for (size_t base = MIN_BLOCK_SIZE; base <= MAX_POOLED_SIZE; base *= 2) {
+		for (size_t quarters = 4; quarters < 8; ++quarters) {
+			size_t blockSize = base / 4 * quarters;
+			if (blockSize > MAX_POOLED_SIZE) break;
+
+			SizeClass* sizeClass = new SizeClass();
+			sizeClass->blockSize = blockSize;
+			_classes.push_back(sizeClass);
+		}
+	}
+}
+
+BufferPool::~BufferPool()
+{
+	for (SizeClass* sizeClass : _classes) {
+		for (byte* block : sizeClass->idle) {
+			delete [] block;
+		}
+
+		delete sizeClass;
+	}
+}
+
+size_t BufferPool::classFor(size_t size) const
+{
+	std::vector<SizeClass*>::const_iterator i = std::lower_bound(_classes.begin(), _classes.end(), size,
+		[](const SizeClass* sizeClass, size_t size) { return sizeClass->blockSize < size; });
+
+	return i - _classes.begin();
+}
+
+boost::shared_ptr<byte> BufferPool::acquire(size_t size)
+{
+	if (size > MAX_POOLED_SIZE) {
+		_allocated.fetch_add(1, std::memory_order_relaxed);
+		return boost::shared_ptr<byte>(new byte[size], [](byte* block) { delete [] block; });
+	}
+
+	size_t classIndex = this->classFor(size);
+	SizeClass& sizeClass = *_classes[classIndex];
+
+	byte* block = 0;
+	{
+		boost::mutex::scoped_lock lock(sizeClass.mutex);
+		if (! sizeClass.idle.empty()) {
+			block = sizeClass.idle.back();
+			sizeClass.idle.pop_back();
+		}
+	}
+
+	if (block) {
+		_reused.fetch_add(1, std::memory_order_relaxed);
+		_idleBytes.fetch_sub(sizeClass.blockSize, std::memory_order_relaxed);
+	} else {
+		_allocated.fetch_add(1, std::memory_order_relaxed);
+		block = new byte[sizeClass.blockSize];
+	}
+
+	return boost::shared_ptr<byte>(block, [this, classIndex](byte* block) { this->release(classIndex, block); });
+}
+
+void BufferPool::release(size_t classIndex, byte* block)
+{
+	SizeClass& sizeClass = *_classes[classIndex];
+
+	{
+		boost::mutex::scoped_lock lock(sizeClass.mutex);
+		if ((sizeClass.idle.size() + 1) * sizeClass.blockSize <= std::max(MAX_IDLE_BYTES_PER_CLASS, sizeClass.blockSize)) {
+			sizeClass.idle.push_back(block);
+			_idleBytes.fetch_add(sizeClass.blockSize, std::memory_order_relaxed);
+			return;
+		}
+	}
+
+	delete [] block;
+}
+
+unsigned long long BufferPool::reused() const
+{
+	return _reused.load(std::memory_order_relaxed);
+}
+
+unsigned long long BufferPool::allocated() const
+{
+	return _allocated.load(std::memory_order_relaxed);
+}
+
+unsigned long long BufferPool::idleBytes() const
+{
+	return _idleBytes.load(std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "byte.h"
+
+namespace aperture {
+
+/**
+ * Recycles the blocks asset data is received into. Blocks come in size classes
+ * four to each power of two, so at most a fifth of a block is wasted, and are
+ * never zero filled. A block goes back to its class when the last reference
+ * to it is dropped, typically when its asset leaves the cache, and a class
+ * keeps only a bounded amount of idle memory. Safe to use from any thread
+ */
+class BufferPool
+{
+public:
+	/// The smallest block handed out
+	static const size_t MIN_BLOCK_SIZE = 512;
+
+	/// Requests above this are allocated to size and never pooled
+	static const size_t MAX_POOLED_SIZE = 16 * 1024 * 1024;
+
+	/// Idle memory kept for each size class
+	static const size_t MAX_IDLE_BYTES_PER_CLASS = 8 * 1024 * 1024;
+
+private:
+	struct SizeClass
+	{
+		size_t blockSize;
+		boost::mutex mutex;
+		std::vector<byte*> idle;
+	};
+
+	std::vector<SizeClass*> _classes;
+
+	std::atomic<unsigned long long> _reused;
+	std::atomic<unsigned long long> _allocated;
+	std::atomic<unsigned long long> _idleBytes;
+
+	BufferPool();
+
+	/**
+	 * Returns the index of the smallest class holding size bytes
+	 */
+	size_t classFor(size_t size) const;
+
+	void release(size_t classIndex, byte* block);
+
+public:
+	/**
+	 * Returns the singleton instance, which lives as long as the process so
+	 * blocks can be released during exit
+	 */
+	static BufferPool& instance();
+
+	~BufferPool();
+
+	/**
+	 * Returns a block of at least size bytes with unspecified contents
+	 */
+	boost::shared_ptr<byte> acquire(size_t size);
+
+	/**
+	 * Returns how many blocks were taken from a class rather than allocated
+	 */
+	unsigned long long reused() const;
+
+	/**
+	 * Returns how many blocks had to be allocated
+	 */
+	unsigned long long allocated() const;
+
+	/**
+	 * Returns the memory held by idle blocks
+	 */
+	unsigned long long idleBytes() const;
+};
+
+}
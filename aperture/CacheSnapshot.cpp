@@ -0,0 +1,422 @@
+#include "stdafx.h"
+#include "CacheSnapshot.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/make_shared.hpp>
+
+#include "AppLog.h"
+
+namespace aperture {
+
+const unsigned int CacheSnapshot::BACKEND_RETRY_MS;
+
+namespace {
+	const unsigned int SNAPSHOT_MAGIC = 0x4E535041; //"APSN"
+	const unsigned int SNAPSHOT_VERSION = 1;
+
+	/// Set in SnapshotHeader::flags when every entry is followed by its data
+	const unsigned int SNAPSHOT_HAS_DATA = 1;
+
+	/// Starts the file, followed by count entries and then the data, in host byte order
+	struct SnapshotHeader
+	{
+		unsigned int magic;
+		unsigned int version;
+		unsigned int count;
+		unsigned int flags;
+	};
+
+	/// One asset of the snapshot, hottest first
+	struct SnapshotEntry
+	{
+		unsigned char uuid[UUID::BYTE_LEN];
+		unsigned long long offset;
+		unsigned int size;
+		unsigned char type;
+		unsigned char reserved[3];
+	};
+
+#ifndef _WIN32
+	/// A snapshot file mapped into memory, unmapped when the last asset pointing
+	/// into it goes away
+	class SnapshotMapping
+	{
+	public:
+		typedef boost::shared_ptr<SnapshotMapping> ptr;
+
+		SnapshotMapping(void* data, size_t size) : _data(data), _size(size) {}
+		~SnapshotMapping() { ::munmap(_data, _size); }
+
+		const char* data() const { return static_cast<const char*>(_data); }
+		size_t size() const { return _size; }
+
+	private:
+		void* _data;
+		size_t _size;
+	};
+
+	/// An asset whose data is in a mapped snapshot
+	class SnapshotAsset : public IAsset
+	{
+	public:
+		SnapshotAsset(const UUID& uuid, aperture::byte type, SnapshotMapping::ptr mapping,
+			const char* data, size_t size)
+			: _uuid(uuid), _type(type), _mapping(mapping), _data(data), _size(size)
+		{
+		}
+
+		virtual UUID getUUID() const { return _uuid; }
+		virtual size_t getBinaryDataSize() const { return _size; }
+		virtual aperture::byte getType() const { return _type; }
+		virtual boost::asio::const_buffer getAssetData() const { return boost::asio::const_buffer(_data, _size); }
+
+	private:
+		UUID _uuid;
+		aperture::byte _type;
+		SnapshotMapping::ptr _mapping;
+		const char* _data;
+		size_t _size;
+	};
+
+	bool write_all(int fd, const char* data, size_t size)
+	{
+		while (size > 0) {
+			ssize_t written = ::write(fd, data, size);
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+
+			data += written;
+			size -= written;
+		}
+
+		return true;
+	}
+#endif
+}
+
+CacheSnapshot::CacheSnapshot(const std::string& path, size_t maxAssets, bool saveData,
+	unsigned int interval, unsigned int restoreConcurrency)
+	: _path(path), _maxAssets(maxAssets), _saveData(saveData), _interval(interval),
+	_restoreConcurrency(std::max(1u, restoreConcurrency)), _inFlight(0), _stop(false), _restored(false)
+{
+}
+
+CacheSnapshot::~CacheSnapshot()
+{
+	this->stop();
+}
+
+void CacheSnapshot::start(collect_function collect, warm_function warm, insert_function insert, bool restore)
+{
+	_collect = collect;
+	_warm = warm;
+	_insert = insert;
+
+	_worker = boost::thread(&CacheSnapshot::run, this, restore);
+}
+
+void CacheSnapshot::shutdown()
+{
+	if (! _worker.joinable()) {
+		return;
+	}
+
+	this->stop();
+
+	if (_restored) {
+		this->save();
+	} else {
+		AppLog::instance().out()
+			<< "[SNAPSHOT] Not saving, the previous snapshot was not restored completely"
+			<< std::endl;
+	}
+}
+
+void CacheSnapshot::stop()
+{
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+		_stop = true;
+	}
+
+	_signal.notify_all();
+
+	if (_worker.joinable()) {
+		_worker.join();
+	}
+}
+
+bool CacheSnapshot::save()
+{
+	std::vector<IAsset::ptr> assets(_collect(_maxAssets));
+
+	if (! write(_path, assets, _saveData)) {
+		return false;
+	}
+
+	AppLog::instance().out()
+		<< "[SNAPSHOT] Saved " << assets.size() << " assets to " << _path
+		<< std::endl;
+
+	return true;
+}
+
+void CacheSnapshot::run(bool restore)
+{
+	bool restored = restore ? this->restore() : true;
+
+	boost::mutex::scoped_lock lock(_mutex);
+	_restored = restored;
+
+	while (! _stop) {
+		if (_interval == 0) {
+			_signal.wait(lock);
+			continue;
+		}
+
+		if (_signal.wait_for(lock, boost::chrono::seconds(_interval), [this] { return _stop; })) {
+			break;
+		}
+
+		lock.unlock();
+		this->save();
+		lock.lock();
+	}
+}
+
+bool CacheSnapshot::restore()
+{
+	std::vector<Entry> entries;
+	if (! read(_path, entries)) {
+		return true;
+	}
+
+	AppLog::instance().out()
+		<< "[SNAPSHOT] Restoring " << entries.size() << " assets from " << _path
+		<< std::endl;
+
+	boost::chrono::steady_clock::time_point started = boost::chrono::steady_clock::now();
+	size_t fetched = 0;
+
+	for (const Entry& entry : entries) {
+		if (entry.asset) {
+			_insert(entry.asset);
+			continue;
+		}
+
+		boost::mutex::scoped_lock lock(_mutex);
+		while (_inFlight >= _restoreConcurrency && ! _stop) {
+			_signal.wait(lock);
+		}
+
+		//the backends may still be connecting
+		while (! _stop && ! _warm(entry.uuid, boost::bind(&CacheSnapshot::warmed, shared_from_this()))) {
+			_signal.wait_for(lock, boost::chrono::milliseconds(BACKEND_RETRY_MS));
+		}
+
+		if (_stop) {
+			return false;
+		}
+
+		++_inFlight;
+		++fetched;
+	}
+
+	boost::mutex::scoped_lock lock(_mutex);
+	while (_inFlight > 0 && ! _stop) {
+		_signal.wait(lock);
+	}
+
+	AppLog::instance().out()
+		<< "[SNAPSHOT] Restored " << entries.size() << " assets, " << fetched << " from the backends, in "
+		<< boost::chrono::duration_cast<boost::chrono::seconds>(boost::chrono::steady_clock::now() - started).count() << "s"
+		<< std::endl;
+
+	return ! _stop;
+}
+
+void CacheSnapshot::warmed()
+{
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+		--_inFlight;
+	}
+
+	_signal.notify_all();
+}
+
+#ifndef _WIN32
+
+bool CacheSnapshot::write(const std::string& path, const std::vector<IAsset::ptr>& assets, bool withData)
+{
+	std::vector<SnapshotEntry> table;
+	std::vector<boost::asio::const_buffer> data;
+	table.reserve(assets.size());
+
+	for (const IAsset::ptr& asset : assets) {
+		SnapshotEntry entry;
+		std::memset(&entry, 0, sizeof(entry));
+		std::memcpy(entry.uuid, asset->getUUID().data(), UUID::BYTE_LEN);
+		entry.type = asset->getType();
+
+		if (withData) {
+			try {
+				data.push_back(asset->getAssetData());
+			} catch (const std::exception& e) {
+				AppLog::instance().out()
+					<< "[SNAPSHOT] Leaving out " << asset->getUUID().toString() << ": " << e.what()
+					<< std::endl;
+				continue;
+			}
+
+			entry.size = static_cast<unsigned int>(boost::asio::buffer_size(data.back()));
+		}
+
+		table.push_back(entry);
+	}
+
+	//the data follows the table in the same order
+	if (withData) {
+		unsigned long long offset = sizeof(SnapshotHeader) + table.size() * sizeof(SnapshotEntry);
+		for (SnapshotEntry& entry : table) {
+			entry.offset = offset;
+			offset += entry.size;
+		}
+	}
+
+	SnapshotHeader header;
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.count = static_cast<unsigned int>(table.size());
+	header.flags = withData ? SNAPSHOT_HAS_DATA : 0;
+
+	std::string tempPath = path + ".tmp";
+	int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		AppLog::instance().out()
+			<< "[SNAPSHOT] Unable to create " << tempPath << ": " << std::strerror(errno)
+			<< std::endl;
+		return false;
+	}
+
+	bool written = write_all(fd, reinterpret_cast<const char*>(&header), sizeof(header))
+		&& (table.empty() || write_all(fd, reinterpret_cast<const char*>(&table[0]), table.size() * sizeof(SnapshotEntry)));
+
+	for (size_t i = 0; written && i < data.size(); ++i) {
+		written = write_all(fd, boost::asio::buffer_cast<const char*>(data[i]), boost::asio::buffer_size(data[i]));
+	}
+
+	written = written && ::fsync(fd) == 0;
+	::close(fd);
+
+	if (! written || ::rename(tempPath.c_str(), path.c_str()) != 0) {
+		AppLog::instance().out()
+			<< "[SNAPSHOT] Unable to write " << path << ": " << std::strerror(errno)
+			<< std::endl;
+		::unlink(tempPath.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool CacheSnapshot::read(const std::string& path, std::vector<Entry>& entries)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			AppLog::instance().out()
+				<< "[SNAPSHOT] Unable to open " << path << ": " << std::strerror(errno)
+				<< std::endl;
+		}
+		return false;
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+		AppLog::instance().out() << "[SNAPSHOT] Ignoring truncated snapshot " << path << std::endl;
+		::close(fd);
+		return false;
+	}
+
+	size_t fileSize = static_cast<size_t>(st.st_size);
+	void* mapped = ::mmap(0, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (mapped == MAP_FAILED) {
+		AppLog::instance().out()
+			<< "[SNAPSHOT] Unable to map " << path << ": " << std::strerror(errno)
+			<< std::endl;
+		return false;
+	}
+
+	SnapshotMapping::ptr mapping(boost::make_shared<SnapshotMapping>(mapped, fileSize));
+
+	SnapshotHeader header;
+	std::memcpy(&header, mapping->data(), sizeof(header));
+
+	if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION
+		|| (fileSize - sizeof(header)) / sizeof(SnapshotEntry) < header.count) {
+		AppLog::instance().out() << "[SNAPSHOT] Ignoring invalid snapshot " << path << std::endl;
+		return false;
+	}
+
+	bool withData = (header.flags & SNAPSHOT_HAS_DATA) != 0;
+	const char* table = mapping->data() + sizeof(header);
+
+	entries.reserve(header.count);
+	for (unsigned int i = 0; i < header.count; ++i) {
+		SnapshotEntry stored;
+		std::memcpy(&stored, table + i * sizeof(SnapshotEntry), sizeof(stored));
+
+		Entry entry;
+		entry.uuid = UUID(stored.uuid);
+
+		if (withData) {
+			if (stored.offset > fileSize || fileSize - stored.offset < stored.size) {
+				AppLog::instance().out() << "[SNAPSHOT] Snapshot " << path << " ends early" << std::endl;
+				break;
+			}
+
+			entry.asset = boost::make_shared<SnapshotAsset>(entry.uuid, stored.type, mapping,
+				mapping->data() + stored.offset, stored.size);
+		}
+
+		entries.push_back(entry);
+	}
+
+	return true;
+}
+
+#else
+
+bool CacheSnapshot::write(const std::string& path, const std::vector<IAsset::ptr>& assets, bool withData)
+{
+	AppLog::instance().out() << "[SNAPSHOT] Cache snapshots are not supported on this platform" << std::endl;
+	return false;
+}
+
+bool CacheSnapshot::read(const std::string& path, std::vector<Entry>& entries)
+{
+	return false;
+}
+
+#endif
+
+}
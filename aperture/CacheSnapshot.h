@@ -0,0 +1,131 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "IAsset.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Keeps the asset cache warm across restarts. The ids of the hottest cached
+ * assets, and optionally their data, are written to a snapshot file periodically
+ * and on shutdown. On start a background thread reads the snapshot back: assets
+ * stored with their data go straight into the cache, the others are fetched from
+ * the backends in the order they were saved with a bounded number in flight.
+ *
+ * The data of a snapshot is mapped in one piece and cached assets point into the
+ * mapping, so restoring them copies nothing. Only supported on POSIX systems
+ */
+class CacheSnapshot : public boost::enable_shared_from_this<CacheSnapshot>
+{
+public:
+	typedef boost::shared_ptr<CacheSnapshot> ptr;
+
+	/// Returns up to the given number of cached assets, hottest first
+	typedef boost::function<std::vector<IAsset::ptr> (size_t)> collect_function;
+
+	/// Starts loading an asset into the cache and calls the given function once
+	/// it is done. Returns false if no backend can take the request right now
+	typedef boost::function<bool (const UUID&, boost::function<void()>)> warm_function;
+
+	/// Puts an asset read from the snapshot into the cache
+	typedef boost::function<void (IAsset::ptr)> insert_function;
+
+	/// An asset read from a snapshot. The asset is empty unless the data was saved
+	struct Entry
+	{
+		UUID uuid;
+		IAsset::ptr asset;
+	};
+
+	/// How long to wait for a backend to come up before warming more assets
+	static const unsigned int BACKEND_RETRY_MS = 1000;
+
+private:
+	std::string _path;
+	size_t _maxAssets;
+	bool _saveData;
+	unsigned int _interval;
+	unsigned int _restoreConcurrency;
+
+	collect_function _collect;
+	warm_function _warm;
+	insert_function _insert;
+
+	boost::mutex _mutex;
+	boost::condition_variable _signal;
+	unsigned int _inFlight;
+	bool _stop;
+
+	/// Set once the old snapshot is restored. A cache that is still warming up
+	/// would replace it with a worse one, so it isn't saved before then
+	bool _restored;
+
+	boost::thread _worker;
+
+public:
+	/**
+	 * Creates a snapshot of up to maxAssets assets at path, saved every interval
+	 * seconds (0 only saves on shutdown), restored with up to restoreConcurrency
+	 * backend requests at once
+	 */
+	CacheSnapshot(const std::string& path, size_t maxAssets, bool saveData,
+		unsigned int interval, unsigned int restoreConcurrency);
+	virtual ~CacheSnapshot();
+
+	/**
+	 * Starts saving snapshots in the background, after restoring the last one
+	 * if restore is set
+	 */
+	void start(collect_function collect, warm_function warm, insert_function insert, bool restore);
+
+	/**
+	 * Stops the background thread and saves a final snapshot unless the old one
+	 * was not restored completely
+	 */
+	void shutdown();
+
+	/**
+	 * Stops the background thread without saving, for when another process
+	 * takes over the snapshot
+	 */
+	void stop();
+
+	/**
+	 * Writes the hottest cached assets to the snapshot file
+	 */
+	bool save();
+
+	/**
+	 * Writes a snapshot of the given assets, with or without their data. The
+	 * file is replaced atomically
+	 */
+	static bool write(const std::string& path, const std::vector<IAsset::ptr>& assets, bool withData);
+
+	/**
+	 * Reads a snapshot written by write(). Returns false if there is no usable
+	 * snapshot at path
+	 */
+	static bool read(const std::string& path, std::vector<Entry>& entries);
+
+private:
+	void run(bool restore);
+
+	/// Loads the entries of the snapshot into the cache. Returns false if it
+	/// was stopped before it was done
+	bool restore();
+
+	/// Called when a warm request completes
+	void warmed();
+};
+
+}
@@ -2,17 +2,17 @@
 
 #include "ClientRequestMsg.h"
 
+#include <cstring>
+
 ClientRequestMsg::ClientRequestMsg()
 : _header(HEADER_SIZE)
 {
 	
 }
-ClientRequestMsg::ClientRequestMsg(RequestType type, const std::string& uuid)
+ClientRequestMsg::ClientRequestMsg(RequestType type, const aperture::UUID& uuid)
+: _header(HEADER_SIZE)
 {
-	_header.push_back((aperture::byte) type);
-	std::copy(uuid.begin(), uuid.end(), std::back_inserter(_header));
-	//four zero bytes for the size
-	_header.insert(_header.end(), 4, 0);
+	encodeHeader(type, uuid, &_header[0]);
 }
 
 
@@ -20,6 +20,15 @@ ClientRequestMsg::~ClientRequestMsg()
 {
 }
 
+void ClientRequestMsg::encodeHeader(RequestType type, const aperture::UUID& uuid, aperture::byte* dest)
+{
+	dest[0] = (aperture::byte) type;
+	uuid.toHex((char*) &dest[1]);
+
+	//the last four bytes are the zero size
+	std::memset(&dest[DATA_SIZE_MARKER_LOC], 0, HEADER_SIZE - DATA_SIZE_MARKER_LOC);
+}
+
 void ClientRequestMsg::initDataStorageFromHeader()
 {
 	//read the size from the header
@@ -42,9 +51,12 @@ ClientRequestMsg::RequestType ClientRequestMsg::getType() const
 	return static_cast<ClientRequestMsg::RequestType>(_header[0]);
 }
 
-std::string ClientRequestMsg::getUUID() const
+aperture::UUID ClientRequestMsg::getUUID() const
 {
-	return std::string((char*) &_header[1], 32);
+	aperture::UUID uuid;
+	aperture::UUID::parse(boost::string_view((const char*) &_header[1], aperture::UUID::HEX_LEN), uuid);
+
+	return uuid;
 }
 
 aperture::byte_array_ptr ClientRequestMsg::getData()
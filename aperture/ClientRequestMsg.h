@@ -3,6 +3,7 @@
 #include <boost/shared_ptr.hpp>
 
 #include "byte.h"
+#include "UUID.h"
 
 /**
 Request from a client for an action on an asset
@@ -33,8 +34,13 @@ public:
 	/**
 	 * CTOR for a get request
 	 */
-	ClientRequestMsg(RequestType type, const std::string& uuid);
+	ClientRequestMsg(RequestType type, const aperture::UUID& uuid);
 	virtual ~ClientRequestMsg();
+
+	/**
+	Writes the HEADER_SIZE bytes of a request without a body to dest
+	*/
+	static void encodeHeader(RequestType type, const aperture::UUID& uuid, aperture::byte* dest);
 	
 	/**
 	Returns the raw storage for the header
@@ -49,7 +55,7 @@ public:
 	/**
 	Returns the UUID this message applies to
 	*/
-	std::string getUUID() const;
+	aperture::UUID getUUID() const;
 
 	/**
 	Returns the data from this request
@@ -2,31 +2,41 @@
 
 #include <boost/shared_ptr.hpp>
 
+#include "byte.h"
 #include "IAsset.h"
-#include "StratusAsset.pb.h"
 
 namespace aperture {
 namespace cloudfiles {
 
+/**
+ * An asset fetched from cloud files. The asset data is served from the
+ * response body it was received in
+ */
 class CloudFilesAsset : public IAsset
 {
 public:
 	typedef boost::shared_ptr<CloudFilesAsset> ptr;
 
 private:
-	std::string _assetId;
-	boost::shared_ptr<Halcyon::Data::Assets::Stratus::StratusAsset> _assetBase;
+	UUID _assetId;
+	int _type;
+
+	aperture::byte_array_ptr _buffer;
+	size_t _dataOffset;
+	size_t _dataSize;
 
 public:
-	CloudFilesAsset(const std::string& assetId, boost::shared_ptr<Halcyon::Data::Assets::Stratus::StratusAsset> assetBase);
+	/**
+	 * Constructs an asset whose data is the dataSize bytes at dataOffset in buffer
+	 */
+	CloudFilesAsset(const UUID& assetId, int type, aperture::byte_array_ptr buffer, size_t dataOffset, size_t dataSize);
 	virtual ~CloudFilesAsset();
 
-	virtual std::string getUUID() const;
+	virtual UUID getUUID() const;
 	virtual size_t getBinaryDataSize() const;
 	virtual aperture::byte getType() const;
     virtual int getFullType() const; //for debugging
-	virtual size_t copyAssetData(std::string& storage) const;
-	virtual size_t copyAssetData(std::string& storage, size_t rngStart, size_t rngEnd) const;
+	virtual boost::asio::const_buffer getAssetData() const;
 };
 
 }}
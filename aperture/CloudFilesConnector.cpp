@@ -1,23 +1,44 @@
 #include "stdafx.h"
 #include "CloudFilesConnector.h"
 
-#include "curl/curl.h"
+#include <sstream>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/bind.hpp>
+#include <boost/format.hpp>
+
 #include "RackspaceAuthorizer.h"
 #include "Settings.h"
 #include "AppLog.h"
+#include "CloudFilesAsset.h"
+#include "StratusAssetDecoder.h"
+
+using boost::asio::ip::tcp;
 
-namespace aperture { 
+namespace aperture {
 namespace cloudfiles {
 
+const int CloudFilesConnector::CONTAINER_UUID_PREFIX_LEN;
+const size_t CloudFilesConnector::MAX_BODY_RESERVE;
+
 CloudFilesConnector::CloudFilesConnector(boost::asio::io_service& ioService)
-	: _ioService(ioService)
+	: _ioService(ioService),
+	_strand(ioService),
+	_multi(0),
+	_share(0),
+	_timer(ioService),
+	_stopped(false),
+	_requests(0),
+	_failures(0),
+	_inFlight(0)
 {
-	_stop = false;
-
 	curl_global_init(CURL_GLOBAL_ALL);
 
 	auto config = Settings::instance().config();
 
+	_containerPrefix = config["cf_container_prefix"].as<std::string>();
+	_debug = config["debug"].as<bool>();
+
 	_rsAuth.reset(
 		new RackspaceAuthorizer(
 			config["cf_username"].as<std::string>(),
@@ -31,23 +52,60 @@ CloudFilesConnector::CloudFilesConnector(boost::asio::io_service& ioService)
 	_rsAuth->requestNewAuthToken();
 
 	AppLog::instance().out() << "[CLOUDFILES] Auth successful, using " << _rsAuth->getCloudFilesUrl() << std::endl;
-	//fire up our workers
-	unsigned int numWorkers = config["cf_worker_threads"].as<unsigned int>();
-	for (unsigned int i = 0; i < numWorkers; i++) {
-		CloudFilesGetWorker::ptr worker(new CloudFilesGetWorker(*this, _ioService));
-		worker->start();
-		_workers.push_back(worker);
-	}
+
+	//the handles are only ever used from the strand, so the share needs no locks
+	_share = curl_share_init();
+	if (! _share) throw std::runtime_error(__FILE__ " curl_share_init() failed");
+
+	curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	_multi = curl_multi_init();
+	if (! _multi) throw std::runtime_error(__FILE__ " curl_multi_init() failed");
+
+	long maxConnections = std::max(config["cf_max_connections"].as<unsigned int>(), 1u);
+
+	curl_multi_setopt(_multi, CURLMOPT_SOCKETFUNCTION, &CloudFilesConnector::onCurlSocket);
+	curl_multi_setopt(_multi, CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(_multi, CURLMOPT_TIMERFUNCTION, &CloudFilesConnector::onCurlTimer);
+	curl_multi_setopt(_multi, CURLMOPT_TIMERDATA, this);
+	curl_multi_setopt(_multi, CURLMOPT_MAX_HOST_CONNECTIONS, maxConnections);
+	curl_multi_setopt(_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, maxConnections);
+	curl_multi_setopt(_multi, CURLMOPT_MAXCONNECTS, maxConnections);
+#ifdef CURLPIPE_MULTIPLEX
+	curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+
+	_authWork.reset(new boost::asio::io_service::work(_authService));
+	_authThread = boost::thread(boost::bind(&boost::asio::io_service::run, &_authService));
 }
 
 
 CloudFilesConnector::~CloudFilesConnector()
 {
-	for (CloudFilesGetWorker::ptr worker : _workers)
-	{
-		worker->waitForStop();
+	_stopped = true;
+
+	for (auto& transfer : _transfers) {
+		curl_multi_remove_handle(_multi, transfer.first);
+		curl_slist_free_all(transfer.second->headers);
+		_idleHandles.push_back(transfer.first);
+	}
+
+	_transfers.clear();
+
+	//closes the connections kept alive through onCloseSocket()
+	curl_multi_cleanup(_multi);
+
+	for (CURL* easy : _idleHandles) {
+		curl_easy_cleanup(easy);
 	}
 
+	curl_share_cleanup(_share);
+
+	_authWork.reset();
+	_authService.stop();
+	_authThread.join();
+
 	curl_global_cleanup();
 }
 
@@ -56,35 +114,423 @@ bool CloudFilesConnector::isConnected() const
 	return true;
 }
 
-void CloudFilesConnector::getAsset(const std::string& uuid, boost::function<void (IAsset::ptr)> callBack)
+void CloudFilesConnector::getAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack)
+{
+	_requests.fetch_add(1, std::memory_order_relaxed);
+	_inFlight.fetch_add(1, std::memory_order_relaxed);
+
+	Transfer::ptr transfer(new Transfer(uuid, callBack));
+	_strand.post(boost::bind(&CloudFilesConnector::doGetAsset, shared_from_this(), transfer));
+}
+
+void CloudFilesConnector::doGetAsset(Transfer::ptr transfer)
+{
+	if (_stopped) {
+		this->fail(transfer);
+		return;
+	}
+
+	this->startTransfer(transfer);
+}
+
+std::string CloudFilesConnector::getContainerName(const std::string& assetHex) const
+{
+	return _containerPrefix + boost::to_upper_copy(assetHex.substr(0, CONTAINER_UUID_PREFIX_LEN));
+}
+
+std::string CloudFilesConnector::buildContainerUrl(const UUID& assetId) const
+{
+	std::string assetHex(assetId.toString());
+
+	std::stringstream builder;
+	builder << _rsAuth->getCloudFilesUrl() << "/" << this->getContainerName(assetHex) << "/"
+		<< assetHex << ".asset";
+
+	return builder.str();
+}
+
+void CloudFilesConnector::startTransfer(Transfer::ptr transfer)
+{
+	CURL* easy;
+	if (_idleHandles.empty()) {
+		easy = curl_easy_init();
+		if (! easy) {
+			AppLog::instance().out() << "[CLOUDFILES] curl_easy_init() failed" << std::endl;
+			this->fail(transfer);
+			return;
+		}
+
+	} else {
+		easy = _idleHandles.back();
+		_idleHandles.pop_back();
+	}
+
+	std::string authHeader((boost::format("X-Auth-Token: %1%") % _rsAuth->getAuthToken()).str());
+
+	transfer->easy = easy;
+	transfer->headers = curl_slist_append(0, authHeader.c_str());
+	transfer->url = this->buildContainerUrl(transfer->uuid);
+	transfer->response.reset();
+	transfer->body.reset(new aperture::byte_array());
+
+	curl_easy_setopt(easy, CURLOPT_URL, transfer->url.c_str());
+	curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
+	curl_easy_setopt(easy, CURLOPT_USERAGENT, "Mozilla/4.0 (compatible; MSIE 6.0; Windows NT 5.1; SV1; .NET CLR 1.1.4322; .NET CLR 2.0.5");
+	curl_easy_setopt(easy, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(easy, CURLOPT_TIMEOUT, 30L);
+	curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, &HttpRequestHandler::onHeaderLine);
+	curl_easy_setopt(easy, CURLOPT_WRITEHEADER, &transfer->response);
+	curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, &CloudFilesConnector::onBodyData);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, transfer.get());
+	curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer.get());
+	curl_easy_setopt(easy, CURLOPT_SHARE, _share);
+	curl_easy_setopt(easy, CURLOPT_OPENSOCKETFUNCTION, &CloudFilesConnector::onOpenSocket);
+	curl_easy_setopt(easy, CURLOPT_OPENSOCKETDATA, this);
+	curl_easy_setopt(easy, CURLOPT_CLOSESOCKETFUNCTION, &CloudFilesConnector::onCloseSocket);
+	curl_easy_setopt(easy, CURLOPT_CLOSESOCKETDATA, this);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	//HTTP/2 over TLS where the server offers it, waiting for a connection to
+	//multiplex on rather than opening another one
+	curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+#endif
+
+	if (_debug) {
+		AppLog::instance().out() << "[CLOUDFILES] Getting " << transfer->url << std::endl;
+	}
+
+	_transfers[easy] = transfer;
+
+	CURLMcode res = curl_multi_add_handle(_multi, easy);
+	if (res != CURLM_OK) {
+		AppLog::instance().out() << "[CLOUDFILES] curl_multi_add_handle() failed: " << curl_multi_strerror(res) << std::endl;
+
+		_transfers.erase(easy);
+		curl_slist_free_all(transfer->headers);
+		transfer->headers = 0;
+		_idleHandles.push_back(easy);
+
+		this->fail(transfer);
+	}
+}
+
+void CloudFilesConnector::checkFinished()
+{
+	int pending;
+	while (CURLMsg* msg = curl_multi_info_read(_multi, &pending)) {
+		if (msg->msg != CURLMSG_DONE) continue;
+
+		CURL* easy = msg->easy_handle;
+		CURLcode result = msg->data.result;
+
+		curl_multi_remove_handle(_multi, easy);
+
+		auto i = _transfers.find(easy);
+		if (i == _transfers.end()) continue;
+
+		Transfer::ptr transfer = i->second;
+		_transfers.erase(i);
+
+		curl_slist_free_all(transfer->headers);
+		transfer->headers = 0;
+		transfer->easy = 0;
+		_idleHandles.push_back(easy);
+
+		this->finishTransfer(transfer, result);
+	}
+}
+
+void CloudFilesConnector::finishTransfer(Transfer::ptr transfer, int result)
+{
+	if (result != CURLE_OK) {
+		AppLog::instance().out() << "[CLOUDFILES] Caught exception while trying to get asset: curl transfer failed: "
+			<< curl_easy_strerror(static_cast<CURLcode>(result)) << std::endl;
+
+		this->fail(transfer);
+		return;
+	}
+
+	int httpCode = transfer->response.getLastHttpCode();
+
+	if (httpCode == 401 && ! transfer->isRetry) {
+		//we need to re-auth and get a new token, then try again. one renewal
+		//serves every transfer turned away meanwhile
+		transfer->isRetry = true;
+		_waitingForAuth.push_back(transfer);
+
+		if (_waitingForAuth.size() == 1) {
+			_authService.post(boost::bind(&CloudFilesConnector::renewAuthToken, shared_from_this()));
+		}
+
+		return;
+	}
+
+	if (httpCode != 200) {
+		if (httpCode != 404) {
+			AppLog::instance().out() << "[CLOUDFILES] Caught exception while trying to get asset: "
+				<< (boost::format("CF HTTP request returned HTTP/%1%") % httpCode).str() << std::endl;
+		}
+
+		this->fail(transfer);
+		return;
+	}
+
+	this->decodeAsset(transfer);
+}
+
+void CloudFilesConnector::decodeAsset(Transfer::ptr transfer)
+{
+	const aperture::byte_array& body = *transfer->body;
+
+	StratusAssetDecoder decoder;
+	if (! decoder.decode(body.data(), body.size())) {
+		AppLog::instance().out() << "[CLOUDFILES] Caught exception while trying to get asset: Unable to deserialize asset "
+			<< transfer->uuid.toString() << std::endl;
+
+		this->fail(transfer);
+		return;
+	}
+
+	_inFlight.fetch_sub(1, std::memory_order_relaxed);
+
+	//the asset data stays where it was received
+	CloudFilesAsset::ptr cfAsset(new CloudFilesAsset(transfer->uuid, decoder.getType(), transfer->body,
+		decoder.getDataOffset(), decoder.getDataSize()));
+
+	_ioService.post(boost::bind(transfer->callBack, cfAsset));
+}
+
+void CloudFilesConnector::fail(Transfer::ptr transfer)
+{
+	_failures.fetch_add(1, std::memory_order_relaxed);
+	_inFlight.fetch_sub(1, std::memory_order_relaxed);
+
+	_ioService.post(boost::bind(transfer->callBack, IAsset::ptr()));
+}
+
+void CloudFilesConnector::renewAuthToken()
+{
+	bool renewed = false;
+
+	try {
+		_rsAuth->requestNewAuthToken();
+		renewed = true;
+
+	} catch (const std::exception& e) {
+		_ioService.post([=]{ AppLog::instance().out() << "[CLOUDFILES] Unable to renew auth token: " << e.what() << std::endl; });
+	}
+
+	_strand.post(boost::bind(&CloudFilesConnector::onAuthTokenRenewed, shared_from_this(), renewed));
+}
+
+void CloudFilesConnector::onAuthTokenRenewed(bool renewed)
+{
+	std::vector<Transfer::ptr> waiting;
+	waiting.swap(_waitingForAuth);
+
+	for (Transfer::ptr transfer : waiting) {
+		if (renewed && ! _stopped) {
+			this->startTransfer(transfer);
+		} else {
+			this->fail(transfer);
+		}
+	}
+}
+
+void CloudFilesConnector::watchSocket(Socket::ptr sock)
+{
+	if (_stopped) return;
+
+	if ((sock->wanted & CURL_POLL_IN) && ! sock->readPending) {
+		sock->readPending = true;
+		sock->socket.async_read_some(boost::asio::null_buffers(),
+			_strand.wrap(boost::bind(&CloudFilesConnector::onSocketReady, shared_from_this(), sock, CURL_POLL_IN,
+				boost::asio::placeholders::error)));
+	}
+
+	if ((sock->wanted & CURL_POLL_OUT) && ! sock->writePending) {
+		sock->writePending = true;
+		sock->socket.async_write_some(boost::asio::null_buffers(),
+			_strand.wrap(boost::bind(&CloudFilesConnector::onSocketReady, shared_from_this(), sock, CURL_POLL_OUT,
+				boost::asio::placeholders::error)));
+	}
+}
+
+void CloudFilesConnector::onSocketReady(Socket::ptr sock, int direction, const boost::system::error_code& error)
+{
+	if (direction == CURL_POLL_IN) {
+		sock->readPending = false;
+	} else {
+		sock->writePending = false;
+	}
+
+	if (error == boost::asio::error::operation_aborted || ! sock->socket.is_open()) {
+		return;
+	}
+
+	if (sock->wanted & direction) {
+		int action = error ? CURL_CSELECT_ERR : (direction == CURL_POLL_IN ? CURL_CSELECT_IN : CURL_CSELECT_OUT);
+		int running;
+		curl_multi_socket_action(_multi, sock->socket.native_handle(), action, &running);
+
+		this->checkFinished();
+	}
+
+	//curl may still want the socket, closed ones were taken out of the map
+	if (sock->socket.is_open()) {
+		this->watchSocket(sock);
+	}
+}
+
+void CloudFilesConnector::onTimer(const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
+	int running;
+	curl_multi_socket_action(_multi, CURL_SOCKET_TIMEOUT, 0, &running);
+
+	this->checkFinished();
+}
+
+int CloudFilesConnector::onCurlSocket(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp)
 {
-	boost::mutex::scoped_lock lock(_queueMutex);
-	_workQueue.emplace(std::tie(uuid, callBack));
-	_signal.notify_one();
+	CloudFilesConnector* self = static_cast<CloudFilesConnector*>(userp);
+
+	auto i = self->_sockets.find(s);
+	if (i == self->_sockets.end()) {
+		//not a socket curl opened through us
+		return 0;
+	}
+
+	Socket::ptr sock = i->second;
+	sock->wanted = what == CURL_POLL_REMOVE ? 0 : what;
+
+	self->watchSocket(sock);
+
+	return 0;
+}
+
+int CloudFilesConnector::onCurlTimer(CURLM* multi, long timeoutMs, void* userp)
+{
+	CloudFilesConnector* self = static_cast<CloudFilesConnector*>(userp);
+
+	boost::system::error_code ignored;
+	self->_timer.cancel(ignored);
+
+	if (timeoutMs >= 0 && ! self->_stopped) {
+		//curl may not be called back into from here, so even a timeout of 0 waits for the timer
+		self->_timer.expires_from_now(boost::posix_time::milliseconds(timeoutMs));
+		self->_timer.async_wait(self->_strand.wrap(boost::bind(&CloudFilesConnector::onTimer, self->shared_from_this(),
+			boost::asio::placeholders::error)));
+	}
+
+	return 0;
+}
+
+curl_socket_t CloudFilesConnector::onOpenSocket(void* clientp, curlsocktype purpose, struct curl_sockaddr* address)
+{
+	CloudFilesConnector* self = static_cast<CloudFilesConnector*>(clientp);
+
+	if (purpose != CURLSOCKTYPE_IPCXN || address->socktype != SOCK_STREAM
+		|| (address->family != AF_INET && address->family != AF_INET6)) {
+		return CURL_SOCKET_BAD;
+	}
+
+	//the socket is opened on the io_service so its readiness can be waited for there
+	Socket::ptr sock(new Socket(self->_ioService));
+
+	boost::system::error_code error;
+	sock->socket.open(address->family == AF_INET ? tcp::v4() : tcp::v6(), error);
+	if (error) {
+		AppLog::instance().out() << "[CLOUDFILES] Unable to open socket: " << error.message() << std::endl;
+		return CURL_SOCKET_BAD;
+	}
+
+	curl_socket_t s = sock->socket.native_handle();
+	self->_sockets[s] = sock;
+
+	return s;
+}
+
+int CloudFilesConnector::onCloseSocket(void* clientp, curl_socket_t s)
+{
+	CloudFilesConnector* self = static_cast<CloudFilesConnector*>(clientp);
+
+	auto i = self->_sockets.find(s);
+	if (i != self->_sockets.end()) {
+		boost::system::error_code ignored;
+		i->second->socket.close(ignored);
+		self->_sockets.erase(i);
+	}
+
+	return 0;
+}
+
+size_t CloudFilesConnector::onBodyData(void* ptr, size_t size, size_t nmemb, void* userdata)
+{
+	Transfer* transfer = static_cast<Transfer*>(userdata);
+	aperture::byte_array& body = *transfer->body;
+
+#if LIBCURL_VERSION_NUM >= 0x073700
+	if (body.empty()) {
+		//size the buffer once instead of copying it as it grows
+		curl_off_t contentLength;
+		if (curl_easy_getinfo(transfer->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength) == CURLE_OK
+			&& contentLength > 0 && (unsigned long long)contentLength <= MAX_BODY_RESERVE) {
+			body.reserve((size_t)contentLength);
+		}
+	}
+#endif
+
+	const aperture::byte* data = static_cast<const aperture::byte*>(ptr);
+	body.insert(body.end(), data, data + size * nmemb);
+
+	return size * nmemb;
 }
 
 void CloudFilesConnector::shutdown()
 {
+	_strand.post(boost::bind(&CloudFilesConnector::doShutdown, shared_from_this()));
 }
 
-std::tuple<std::string, boost::function<void (IAsset::ptr)>> CloudFilesConnector::waitForWork()
+void CloudFilesConnector::doShutdown()
 {
-	boost::mutex::scoped_lock lock(_queueMutex);
-	while (_workQueue.empty() && !_stop) {
-		_signal.wait(lock);
+	_stopped = true;
+
+	for (auto& i : _transfers) {
+		curl_multi_remove_handle(_multi, i.first);
+		curl_slist_free_all(i.second->headers);
+		i.second->headers = 0;
+		_idleHandles.push_back(i.first);
+
+		this->fail(i.second);
 	}
 
-	if (_stop) return std::tuple<std::string, boost::function<void (IAsset::ptr)>>();
+	_transfers.clear();
 
-	auto work = _workQueue.front();
-	_workQueue.pop();
+	//the connections stay open until the multi handle is cleaned up, but
+	//nothing waits on them any more
+	boost::system::error_code ignored;
+	_timer.cancel(ignored);
+
+	for (auto& i : _sockets) {
+		i.second->socket.cancel(ignored);
+	}
 
-	return work;
+	_authWork.reset();
 }
 
-bool CloudFilesConnector::isStopping() const
+void CloudFilesConnector::writeStats(std::ostream& out) const
 {
-	return _stop;
+	out << "cf_requests=" << _requests.load(std::memory_order_relaxed) << "\n"
+		<< "cf_failures=" << _failures.load(std::memory_order_relaxed) << "\n"
+		<< "cf_in_flight=" << _inFlight.load(std::memory_order_relaxed) << "\n";
 }
 
 boost::shared_ptr<RackspaceAuthorizer> CloudFilesConnector::getAuthorizer()
@@ -92,4 +538,4 @@ boost::shared_ptr<RackspaceAuthorizer> CloudFilesConnector::getAuthorizer()
 	return _rsAuth;
 }
 
-}}
\ No newline at end of file
+}}
@@ -1,43 +1,157 @@
 #pragma once
 
-#include <queue>
-#include <tuple>
+#include <atomic>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
-#include <boost/thread.hpp>
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <boost/function.hpp>
-#include <boost/thread/mutex.hpp>
-#include <boost/thread/condition_variable.hpp>
-#include <boost/asio/io_service.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "curl/curl.h"
 
+#include "byte.h"
+#include "HttpRequestHandler.h"
 #include "IAsset.h"
 #include "IAssetServer.h"
-#include "CloudFilesGetWorker.h"
 
-namespace aperture { 
+namespace aperture {
 namespace cloudfiles {
 
 class RackspaceAuthorizer;
 
 /**
- * Connector that provides access to assets stored on rackspace cloud files
+ * Connector that provides access to assets stored on rackspace cloud files.
+ *
+ * All transfers run on one curl multi handle driven from the io_service
+ * through curl_multi_socket_action, so any number of fetches are in flight
+ * without a thread each. Connections are kept alive between requests and
+ * multiplexed over HTTP/2 where the server speaks it, and the transfers share
+ * their DNS and TLS session caches
  */
-class CloudFilesConnector : public IAssetServer
+class CloudFilesConnector : public boost::enable_shared_from_this<CloudFilesConnector>, public IAssetServer
 {
 public:
 	typedef boost::shared_ptr<CloudFilesConnector> ptr;
 
 private:
+	static const int CONTAINER_UUID_PREFIX_LEN = 4;
+
+	/// Largest Content-Length the body buffer is sized for up front
+	static const size_t MAX_BODY_RESERVE = 64 * 1024 * 1024;
+
+	/// One asset fetch and the easy handle carrying it
+	struct Transfer
+	{
+		typedef boost::shared_ptr<Transfer> ptr;
+
+		Transfer(const UUID& id, boost::function<void (IAsset::ptr)> cb)
+			: uuid(id), callBack(cb), easy(0), headers(0), isRetry(false)
+		{
+		}
+
+		UUID uuid;
+		boost::function<void (IAsset::ptr)> callBack;
+
+		CURL* easy;
+		struct curl_slist* headers;
+		std::string url;
+		HttpRequestHandler response;
+
+		/// The response body, kept whole as the asset is served from it
+		aperture::byte_array_ptr body;
+
+		/// Whether this is the second try, after the auth token was renewed
+		bool isRetry;
+	};
+
+	/// A socket curl opened through us and what curl waits for on it
+	struct Socket
+	{
+		typedef boost::shared_ptr<Socket> ptr;
+
+		explicit Socket(boost::asio::io_service& ioService)
+			: socket(ioService), wanted(0), readPending(false), writePending(false)
+		{
+		}
+
+		boost::asio::ip::tcp::socket socket;
+		int wanted;
+		bool readPending;
+		bool writePending;
+	};
+
 	boost::asio::io_service& _ioService;
 
+	/// Serializes all work on the multi handle, getAsset() may be called from any thread
+	boost::asio::io_service::strand _strand;
+
 	boost::shared_ptr<RackspaceAuthorizer> _rsAuth;
-	std::vector<CloudFilesGetWorker::ptr> _workers;
-	std::queue<std::tuple<std::string, boost::function<void (IAsset::ptr)>>> _workQueue;
+	std::string _containerPrefix;
+	bool _debug;
+
+	CURLM* _multi;
+	CURLSH* _share;
+
+	/// Easy handles of finished transfers, reused for the next ones
+	std::vector<CURL*> _idleHandles;
 
-	boost::mutex _queueMutex;
-	boost::condition_variable _signal;
+	std::unordered_map<CURL*, Transfer::ptr> _transfers;
+	std::unordered_map<curl_socket_t, Socket::ptr> _sockets;
+	boost::asio::deadline_timer _timer;
 
-	bool _stop;
+	/// Renewing the auth token blocks, so it is done on a thread of its own.
+	/// Transfers turned away meanwhile wait for the new token
+	boost::asio::io_service _authService;
+	boost::scoped_ptr<boost::asio::io_service::work> _authWork;
+	boost::thread _authThread;
+	std::vector<Transfer::ptr> _waitingForAuth;
+
+	bool _stopped;
+
+	std::atomic<unsigned long long> _requests;
+	std::atomic<unsigned long long> _failures;
+	std::atomic<unsigned int> _inFlight;
+
+	std::string buildContainerUrl(const UUID& assetId) const;
+	std::string getContainerName(const std::string& assetHex) const;
+
+	/// Sets the transfer up on an easy handle and adds it to the multi handle
+	void startTransfer(Transfer::ptr transfer);
+
+	void doGetAsset(Transfer::ptr transfer);
+
+	/// Hands the finished transfers over to finishTransfer()
+	void checkFinished();
+
+	void finishTransfer(Transfer::ptr transfer, int result);
+
+	/// Decodes a fetched asset in place and answers the request with it
+	void decodeAsset(Transfer::ptr transfer);
+
+	void fail(Transfer::ptr transfer);
+
+	void renewAuthToken();
+	void onAuthTokenRenewed(bool renewed);
+
+	/// Waits for the socket to become readable or writable as curl wants it
+	void watchSocket(Socket::ptr sock);
+
+	void onSocketReady(Socket::ptr sock, int direction, const boost::system::error_code& error);
+
+	void onTimer(const boost::system::error_code& error);
+
+	void doShutdown();
+
+	/// curl callbacks
+	static int onCurlSocket(CURL* easy, curl_socket_t s, int what, void* userp, void* socketp);
+	static int onCurlTimer(CURLM* multi, long timeoutMs, void* userp);
+	static curl_socket_t onOpenSocket(void* clientp, curlsocktype purpose, struct curl_sockaddr* address);
+	static int onCloseSocket(void* clientp, curl_socket_t s);
+	static size_t onBodyData(void* ptr, size_t size, size_t nmemb, void* userdata);
 
 public:
 	CloudFilesConnector(boost::asio::io_service& ioService);
@@ -45,15 +159,19 @@ public:
 
 	virtual bool isConnected() const;
 
-	virtual void getAsset(const std::string& uuid, boost::function<void (IAsset::ptr)> callBack);
+	virtual void getAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack);
 
+	/**
+	 * Fails the transfers in progress and stops taking new ones
+	 */
 	virtual void shutdown();
 
-	std::tuple<std::string, boost::function<void (IAsset::ptr)>> waitForWork();
-
-	bool isStopping() const;
+	/**
+	 * Writes the number of requests, failures and transfers in flight
+	 */
+	virtual void writeStats(std::ostream& out) const;
 
 	boost::shared_ptr<RackspaceAuthorizer> getAuthorizer();
 };
 
-}}
\ No newline at end of file
+}}
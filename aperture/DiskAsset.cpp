@@ -0,0 +1,108 @@
+#include "stdafx.h"
+#include "DiskAsset.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "AppLog.h"
+
+namespace aperture {
+
+DiskSegment::DiskSegment(unsigned int id, int fd, const std::string& path)
+	: _id(id), _fd(fd), _path(path)
+{
+}
+
+DiskSegment::~DiskSegment()
+{
+#ifndef _WIN32
+	::close(_fd);
+#endif
+}
+
+DiskAsset::DiskAsset(const UUID& uuid, aperture::byte type, DiskSegment::ptr segment,
+	unsigned long long offset, size_t size)
+	: _uuid(uuid), _type(type), _segment(segment), _offset(offset), _size(size),
+	_mapping(0), _mappingSize(0), _data(0)
+{
+}
+
+DiskAsset::~DiskAsset()
+{
+#ifndef _WIN32
+	if (_mapping) {
+		::munmap(_mapping, _mappingSize);
+	}
+#endif
+}
+
+UUID DiskAsset::getUUID() const
+{
+	return _uuid;
+}
+
+size_t DiskAsset::getBinaryDataSize() const
+{
+	return _size;
+}
+
+aperture::byte DiskAsset::getType() const
+{
+	return _type;
+}
+
+boost::asio::const_buffer DiskAsset::getAssetData() const
+{
+	std::call_once(_mapped, &DiskAsset::map, this);
+
+	if (! _data) {
+		throw std::runtime_error("Unable to map asset " + _uuid.toString() + " from the disk cache");
+	}
+
+	return boost::asio::const_buffer(_data, _size);
+}
+
+int DiskAsset::getFile() const
+{
+	return _segment->getFile();
+}
+
+unsigned long long DiskAsset::getFileOffset() const
+{
+	return _offset;
+}
+
+void DiskAsset::map() const
+{
+#ifndef _WIN32
+	if (_size == 0) {
+		static const char EMPTY = 0;
+		_data = &EMPTY;
+		return;
+	}
+
+	//mappings have to start on a page boundary
+	unsigned long long pageSize = static_cast<unsigned long long>(::sysconf(_SC_PAGESIZE));
+	unsigned long long mapStart = _offset & ~(pageSize - 1);
+	_mappingSize = static_cast<size_t>(_offset - mapStart) + _size;
+
+	void* mapping = ::mmap(0, _mappingSize, PROT_READ, MAP_SHARED, _segment->getFile(), static_cast<off_t>(mapStart));
+	if (mapping == MAP_FAILED) {
+		AppLog::instance().out()
+			<< "[DISKCACHE] Unable to map " << _segment->getPath() << ": " << std::strerror(errno)
+			<< std::endl;
+		return;
+	}
+
+	_mapping = mapping;
+	_data = static_cast<const char*>(mapping) + (_offset - mapStart);
+#endif
+}
+
+}
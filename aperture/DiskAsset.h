@@ -0,0 +1,89 @@
+#pragma once
+
+#include <mutex>
+
+#include <boost/shared_ptr.hpp>
+
+#include "IAsset.h"
+
+#if defined(__linux__)
+/// Replies can be sent straight from a file descriptor
+#define AP_HAVE_SENDFILE
+#endif
+
+namespace aperture {
+
+/**
+ * An open segment file of the disk cache. The file is closed when the last
+ * reference goes away, so assets being sent from a segment keep it readable
+ * even after the cache has collected and unlinked it
+ */
+class DiskSegment
+{
+public:
+	typedef boost::shared_ptr<DiskSegment> ptr;
+
+private:
+	unsigned int _id;
+	int _fd;
+	std::string _path;
+
+public:
+	DiskSegment(unsigned int id, int fd, const std::string& path);
+	virtual ~DiskSegment();
+
+	unsigned int getId() const { return _id; }
+
+	int getFile() const { return _fd; }
+
+	const std::string& getPath() const { return _path; }
+};
+
+/**
+ * An asset stored in a disk cache segment. The data is not read into memory
+ * unless getAssetData() is called, replies send it straight from the file
+ * with sendfile where that is supported
+ */
+class DiskAsset : public IAsset
+{
+public:
+	typedef boost::shared_ptr<DiskAsset> ptr;
+
+private:
+	UUID _uuid;
+	aperture::byte _type;
+	DiskSegment::ptr _segment;
+	unsigned long long _offset;
+	size_t _size;
+
+	/// The pages holding the data, mapped on the first call to getAssetData()
+	mutable std::once_flag _mapped;
+	mutable void* _mapping;
+	mutable size_t _mappingSize;
+	mutable const char* _data;
+
+public:
+	DiskAsset(const UUID& uuid, aperture::byte type, DiskSegment::ptr segment,
+		unsigned long long offset, size_t size);
+	virtual ~DiskAsset();
+
+	virtual UUID getUUID() const;
+	virtual size_t getBinaryDataSize() const;
+	virtual aperture::byte getType() const;
+	virtual boost::asio::const_buffer getAssetData() const;
+
+	/**
+	 * Returns the file descriptor of the segment holding the data
+	 */
+	int getFile() const;
+
+	/**
+	 * Returns the offset of the data in the segment file
+	 */
+	unsigned long long getFileOffset() const;
+
+private:
+	void map() const;
+};
+
+}
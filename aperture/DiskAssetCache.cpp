@@ -0,0 +1,471 @@
+#include "stdafx.h"
+#include "DiskAssetCache.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#include <boost/make_shared.hpp>
+
+#include "AppLog.h"
+
+namespace aperture {
+
+const unsigned int DiskAssetCache::MAX_QUEUED_BYTES;
+
+namespace {
+	const unsigned int RECORD_MAGIC = 0x43445041; //"APDC"
+
+	/// Precedes the data of every asset in a segment, in host byte order
+	struct RecordHeader
+	{
+		unsigned int magic;
+		unsigned int size;
+		unsigned char uuid[UUID::BYTE_LEN];
+		unsigned char type;
+		unsigned char reserved[3];
+		unsigned int check;
+	};
+
+	/// FNV-1a of every header field before check, catches torn and stale headers
+	unsigned int header_check(const RecordHeader& header)
+	{
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&header);
+		unsigned int hash = 2166136261u;
+		for (size_t i = 0; i < offsetof(RecordHeader, check); ++i) {
+			hash = (hash ^ bytes[i]) * 16777619u;
+		}
+
+		return hash;
+	}
+}
+
+DiskAssetCache::DiskAssetCache(const std::string& path, unsigned long long maxSize, unsigned long long segmentSize)
+	: _path(path), _maxSize(maxSize), _segmentSize(segmentSize), _nextSegmentId(0),
+	_diskBytes(0), _queuedBytes(0), _stop(false), _hits(0), _misses(0)
+{
+}
+
+DiskAssetCache::~DiskAssetCache()
+{
+	this->shutdown();
+}
+
+size_t DiskAssetCache::size() const
+{
+	boost::mutex::scoped_lock lock(_indexMutex);
+	return _index.size();
+}
+
+unsigned long long DiskAssetCache::byteSize() const
+{
+	return _diskBytes;
+}
+
+void DiskAssetCache::shutdown()
+{
+	{
+		boost::mutex::scoped_lock lock(_queueMutex);
+		_stop = true;
+	}
+
+	_queueSignal.notify_all();
+
+	if (_writer.joinable()) {
+		_writer.join();
+	}
+}
+
+std::string DiskAssetCache::segmentPath(unsigned int id) const
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "segment-%08u.dat", id);
+
+	return _path + "/" + name;
+}
+
+#ifndef _WIN32
+
+namespace {
+	bool write_fully(int fd, const char* data, size_t size, unsigned long long offset)
+	{
+		while (size > 0) {
+			ssize_t written = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+			if (written < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+
+			data += written;
+			size -= written;
+			offset += written;
+		}
+
+		return true;
+	}
+
+	bool read_fully(int fd, char* data, size_t size, unsigned long long offset)
+	{
+		while (size > 0) {
+			ssize_t got = ::pread(fd, data, size, static_cast<off_t>(offset));
+			if (got < 0) {
+				if (errno == EINTR) continue;
+				return false;
+			}
+
+			if (got == 0) return false;
+
+			data += got;
+			size -= got;
+			offset += got;
+		}
+
+		return true;
+	}
+}
+
+bool DiskAssetCache::open()
+{
+	if (::mkdir(_path.c_str(), 0755) != 0 && errno != EEXIST) {
+		AppLog::instance().out()
+			<< "[DISKCACHE] Unable to create " << _path << ": " << std::strerror(errno)
+			<< std::endl;
+		return false;
+	}
+
+	this->loadSegments();
+
+	AppLog::instance().out()
+		<< "[DISKCACHE] Indexed " << this->size() << " assets in " << _segments.size() << " segments, "
+		<< _diskBytes / 1024 / 1024 << " of " << _maxSize / 1024 / 1024 << " MB used"
+		<< std::endl;
+
+	_writer = boost::thread(&DiskAssetCache::writerLoop, this);
+	return true;
+}
+
+void DiskAssetCache::loadSegments()
+{
+	DIR* dir = ::opendir(_path.c_str());
+	if (! dir) {
+		return;
+	}
+
+	std::map<unsigned int, std::string> found;
+	while (struct dirent* entry = ::readdir(dir)) {
+		unsigned int id;
+		char trailing;
+		if (std::sscanf(entry->d_name, "segment-%u.da%c", &id, &trailing) == 2 && trailing == 't'
+			&& this->segmentPath(id) == _path + "/" + entry->d_name) {
+			found[id] = _path + "/" + entry->d_name;
+		}
+	}
+	::closedir(dir);
+
+	for (auto& file : found) {
+		int fd = ::open(file.second.c_str(), O_RDWR);
+		struct stat st;
+		if (fd < 0 || ::fstat(fd, &st) != 0) {
+			AppLog::instance().out()
+				<< "[DISKCACHE] Unable to open " << file.second << ": " << std::strerror(errno)
+				<< std::endl;
+			if (fd >= 0) ::close(fd);
+			continue;
+		}
+
+		DiskSegment::ptr segment(new DiskSegment(file.first, fd, file.second));
+		unsigned long long fileSize = static_cast<unsigned long long>(st.st_size);
+		unsigned long long validSize = this->indexSegment(segment, fileSize);
+
+		if (validSize != fileSize) {
+			AppLog::instance().out()
+				<< "[DISKCACHE] Dropping " << fileSize - validSize << " torn bytes at the end of " << file.second
+				<< std::endl;
+
+			if (::ftruncate(fd, static_cast<off_t>(validSize)) != 0) {
+				AppLog::instance().out()
+					<< "[DISKCACHE] Unable to truncate " << file.second << ": " << std::strerror(errno)
+					<< std::endl;
+			}
+		}
+
+		SegmentInfo info = { segment, validSize };
+		_segments[file.first] = info;
+		_diskBytes += validSize;
+		_nextSegmentId = file.first + 1;
+	}
+}
+
+unsigned long long DiskAssetCache::indexSegment(const DiskSegment::ptr& segment, unsigned long long fileSize)
+{
+	unsigned long long offset = 0;
+
+	while (offset + sizeof(RecordHeader) <= fileSize) {
+		RecordHeader header;
+		if (! read_fully(segment->getFile(), reinterpret_cast<char*>(&header), sizeof(header), offset)
+			|| header.magic != RECORD_MAGIC || header.check != header_check(header)
+			|| offset + sizeof(header) + header.size > fileSize) {
+			break;
+		}
+
+		UUID uuid(header.uuid);
+
+		//later records of the same asset replace earlier ones
+		Location location = { segment, offset + sizeof(header), header.size, header.type, false };
+		_index[uuid] = location;
+
+		offset += sizeof(header) + header.size;
+	}
+
+	return offset;
+}
+
+IAsset::ptr DiskAssetCache::fetch(const UUID& uuid)
+{
+	boost::mutex::scoped_lock lock(_indexMutex);
+
+	auto found = _index.find(uuid);
+	if (found == _index.end()) {
+		++_misses;
+		return IAsset::ptr();
+	}
+
+	++_hits;
+
+	Location& location = found->second;
+	location.referenced = true;
+
+	return boost::make_shared<DiskAsset>(uuid, location.type, location.segment, location.offset, location.size);
+}
+
+void DiskAssetCache::insert(const IAsset::ptr& asset)
+{
+	{
+		boost::mutex::scoped_lock lock(_indexMutex);
+		if (_index.find(asset->getUUID()) != _index.end()) {
+			return;
+		}
+	}
+
+	{
+		boost::mutex::scoped_lock lock(_queueMutex);
+
+		//the disk can't keep up, the asset will be written when it is requested again
+		if (_stop || _queuedBytes + asset->getBinaryDataSize() > MAX_QUEUED_BYTES) {
+			return;
+		}
+
+		_writeQueue.push(asset);
+		_queuedBytes += asset->getBinaryDataSize();
+	}
+
+	_queueSignal.notify_one();
+}
+
+void DiskAssetCache::writerLoop()
+{
+	//the configured size may have shrunk since the segments were written
+	while (_diskBytes > _maxSize && _segments.size() > 1) {
+		this->collectOldest();
+	}
+
+	for (;;) {
+		IAsset::ptr asset;
+
+		{
+			boost::mutex::scoped_lock lock(_queueMutex);
+			while (_writeQueue.empty() && ! _stop) {
+				_queueSignal.wait(lock);
+			}
+
+			if (_stop) {
+				return;
+			}
+
+			asset = _writeQueue.front();
+			_writeQueue.pop();
+			_queuedBytes -= asset->getBinaryDataSize();
+		}
+
+		UUID uuid = asset->getUUID();
+
+		{
+			boost::mutex::scoped_lock lock(_indexMutex);
+			if (_index.find(uuid) != _index.end()) {
+				continue;
+			}
+		}
+
+		boost::asio::const_buffer data = asset->getAssetData();
+		this->appendRecord(uuid, asset->getType(), boost::asio::buffer_cast<const char*>(data),
+			static_cast<unsigned int>(boost::asio::buffer_size(data)), false);
+
+		while (_diskBytes > _maxSize && _segments.size() > 1) {
+			this->collectOldest();
+		}
+	}
+}
+
+DiskSegment::ptr DiskAssetCache::createSegment()
+{
+	unsigned int id = _nextSegmentId++;
+	std::string path = this->segmentPath(id);
+
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		AppLog::instance().out()
+			<< "[DISKCACHE] Unable to create " << path << ": " << std::strerror(errno)
+			<< std::endl;
+		return DiskSegment::ptr();
+	}
+
+	DiskSegment::ptr segment(new DiskSegment(id, fd, path));
+	SegmentInfo info = { segment, 0 };
+	_segments[id] = info;
+
+	return segment;
+}
+
+bool DiskAssetCache::appendRecord(const UUID& uuid, aperture::byte type, const char* data, unsigned int size, bool referenced)
+{
+	unsigned long long recordSize = sizeof(RecordHeader) + size;
+
+	if (_segments.empty() || (_segments.rbegin()->second.size != 0
+		&& _segments.rbegin()->second.size + recordSize > _segmentSize)) {
+		if (! this->createSegment()) {
+			return false;
+		}
+	}
+
+	SegmentInfo& active = _segments.rbegin()->second;
+
+	RecordHeader header;
+	std::memset(&header, 0, sizeof(header));
+	header.magic = RECORD_MAGIC;
+	header.size = size;
+	std::memcpy(header.uuid, uuid.data(), UUID::BYTE_LEN);
+	header.type = type;
+	header.check = header_check(header);
+
+	int fd = active.segment->getFile();
+	if (! write_fully(fd, reinterpret_cast<const char*>(&header), sizeof(header), active.size)
+		|| ! write_fully(fd, data, size, active.size + sizeof(header))) {
+		//the next record overwrites whatever made it out
+		AppLog::instance().out()
+			<< "[DISKCACHE] Unable to write to " << active.segment->getPath() << ": " << std::strerror(errno)
+			<< std::endl;
+		return false;
+	}
+
+	Location location = { active.segment, active.size + sizeof(header), size, type, referenced };
+
+	active.size += recordSize;
+	_diskBytes += recordSize;
+
+	boost::mutex::scoped_lock lock(_indexMutex);
+	_index[uuid] = location;
+
+	return true;
+}
+
+void DiskAssetCache::collectOldest()
+{
+	auto oldest = _segments.begin();
+	DiskSegment::ptr segment = oldest->second.segment;
+	unsigned long long segmentSize = oldest->second.size;
+
+	size_t kept = 0, dropped = 0;
+	std::vector<char> data;
+
+	unsigned long long offset = 0;
+	while (offset + sizeof(RecordHeader) <= segmentSize) {
+		RecordHeader header;
+		if (! read_fully(segment->getFile(), reinterpret_cast<char*>(&header), sizeof(header), offset)) {
+			break;
+		}
+
+		UUID uuid(header.uuid);
+		unsigned long long dataOffset = offset + sizeof(header);
+		offset = dataOffset + header.size;
+
+		bool referenced;
+		{
+			boost::mutex::scoped_lock lock(_indexMutex);
+
+			auto found = _index.find(uuid);
+			if (found == _index.end() || found->second.segment != segment || found->second.offset != dataOffset) {
+				//replaced by a later record
+				continue;
+			}
+
+			referenced = found->second.referenced;
+			if (! referenced) {
+				_index.erase(found);
+			}
+		}
+
+		if (! referenced) {
+			++dropped;
+			continue;
+		}
+
+		//read since it was written, give it another lap
+		data.resize(header.size);
+		if (read_fully(segment->getFile(), data.data(), header.size, dataOffset)
+			&& this->appendRecord(uuid, header.type, data.data(), header.size, false)) {
+			++kept;
+		} else {
+			boost::mutex::scoped_lock lock(_indexMutex);
+			_index.erase(uuid);
+			++dropped;
+		}
+	}
+
+	_segments.erase(segment->getId());
+	_diskBytes -= segmentSize;
+
+	//assets being sent from the segment keep the file open until they are done
+	if (::unlink(segment->getPath().c_str()) != 0) {
+		AppLog::instance().out()
+			<< "[DISKCACHE] Unable to delete " << segment->getPath() << ": " << std::strerror(errno)
+			<< std::endl;
+	}
+
+	AppLog::instance().out()
+		<< "[DISKCACHE] Collected segment " << segment->getId() << ", kept " << kept
+		<< " assets and dropped " << dropped
+		<< std::endl;
+}
+
+#else
+
+bool DiskAssetCache::open()
+{
+	AppLog::instance().out()
+		<< "[DISKCACHE] The disk cache is not supported on this platform"
+		<< std::endl;
+	return false;
+}
+
+IAsset::ptr DiskAssetCache::fetch(const UUID& uuid)
+{
+	return IAsset::ptr();
+}
+
+void DiskAssetCache::insert(const IAsset::ptr& asset)
+{
+}
+
+#endif
+
+}
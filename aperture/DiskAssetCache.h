@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <queue>
+#include <string>
+#include <unordered_map>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "DiskAsset.h"
+#include "IAsset.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Persistent second tier below the in memory asset cache. Assets are appended
+ * by a background thread to large segment files, and an in memory index maps
+ * each id to its record. The index is rebuilt from the segment files on start.
+ *
+ * When the segments use more than the configured size the oldest one is
+ * collected: records that were read since they were written are copied to the
+ * newest segment, the rest are dropped, and the file is deleted.
+ *
+ * Only supported on POSIX systems
+ */
+class DiskAssetCache
+{
+public:
+	typedef boost::shared_ptr<DiskAssetCache> ptr;
+
+	/// Writes are dropped while more than this many bytes are waiting to be written
+	static const unsigned int MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+private:
+	/// Where a record's data is and whether it was read since it was written
+	struct Location
+	{
+		DiskSegment::ptr segment;
+		unsigned long long offset;
+		unsigned int size;
+		aperture::byte type;
+		bool referenced;
+	};
+
+	/// A segment file and the bytes in it
+	struct SegmentInfo
+	{
+		DiskSegment::ptr segment;
+		unsigned long long size;
+	};
+
+	std::string _path;
+	unsigned long long _maxSize;
+	unsigned long long _segmentSize;
+
+	/// Guards _index
+	mutable boost::mutex _indexMutex;
+	std::unordered_map<UUID, Location> _index;
+
+	/// Segments by id, oldest first. Only touched by the writer thread once open
+	std::map<unsigned int, SegmentInfo> _segments;
+	unsigned int _nextSegmentId;
+
+	/// Total size of all segment files
+	std::atomic<unsigned long long> _diskBytes;
+
+	boost::mutex _queueMutex;
+	boost::condition_variable _queueSignal;
+	std::queue<IAsset::ptr> _writeQueue;
+	size_t _queuedBytes;
+	bool _stop;
+
+	boost::thread _writer;
+
+	std::atomic<unsigned long long> _hits;
+	std::atomic<unsigned long long> _misses;
+
+public:
+	/**
+	 * Creates a cache storing up to maxSize bytes of segments of segmentSize
+	 * bytes each in the given directory
+	 */
+	DiskAssetCache(const std::string& path, unsigned long long maxSize, unsigned long long segmentSize);
+	virtual ~DiskAssetCache();
+
+	/**
+	 * Creates the directory if needed, indexes the segments already in it and
+	 * starts the writer thread. Returns false if the cache can't be used
+	 */
+	bool open();
+
+	/**
+	 * Stops the writer thread. Assets still waiting to be written are dropped
+	 */
+	void shutdown();
+
+	/**
+	 * Returns the asset if it is on disk or an empty pointer. Safe to call from
+	 * any thread
+	 */
+	IAsset::ptr fetch(const UUID& uuid);
+
+	/**
+	 * Queues the asset to be written if it isn't on disk yet. Safe to call from
+	 * any thread
+	 */
+	void insert(const IAsset::ptr& asset);
+
+	size_t size() const;
+	unsigned long long byteSize() const;
+	unsigned long long maxSize() const { return _maxSize; }
+	unsigned long long hits() const { return _hits; }
+	unsigned long long misses() const { return _misses; }
+
+private:
+	void loadSegments();
+
+	/// Reads the records of a segment into the index. A torn record at the end
+	/// is cut off. Returns the size of the valid part of the file
+	unsigned long long indexSegment(const DiskSegment::ptr& segment, unsigned long long fileSize);
+
+	void writerLoop();
+
+	/// Appends a record to the newest segment, starting a new one if it is full,
+	/// and indexes it
+	bool appendRecord(const UUID& uuid, aperture::byte type, const char* data, unsigned int size, bool referenced);
+
+	DiskSegment::ptr createSegment();
+
+	/// Collects the oldest segment
+	void collectOldest();
+
+	std::string segmentPath(unsigned int id) const;
+};
+
+}
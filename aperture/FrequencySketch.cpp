@@ -0,0 +1,89 @@
+#include "stdafx.h"
+#include "FrequencySketch.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace aperture {
+
+const int FrequencySketch::DEPTH;
+const unsigned char FrequencySketch::MAX_COUNT;
+
+FrequencySketch::FrequencySketch(size_t expectedEntries)
+	: _width(64), _additions(0)
+{
+	while (_width < expectedEntries) {
+		_width <<= 1;
+	}
+
+	_counters.assign(_width * DEPTH, 0);
+	_sampleSize = _width * 10;
+}
+
+void FrequencySketch::increment(const UUID& key)
+{
+	size_t indexes[DEPTH];
+	this->indexesOf(key, indexes);
+
+	unsigned char minCount = MAX_COUNT;
+	for (int i = 0; i < DEPTH; ++i) {
+		minCount = std::min(minCount, _counters[indexes[i]]);
+	}
+
+	if (minCount == MAX_COUNT) {
+		return;
+	}
+
+	//conservative update, only the counters holding the estimate grow
+	for (int i = 0; i < DEPTH; ++i) {
+		if (_counters[indexes[i]] == minCount) {
+			++_counters[indexes[i]];
+		}
+	}
+
+	if (++_additions >= _sampleSize) {
+		this->halve();
+	}
+}
+
+unsigned int FrequencySketch::estimate(const UUID& key) const
+{
+	size_t indexes[DEPTH];
+	this->indexesOf(key, indexes);
+
+	unsigned char minCount = MAX_COUNT;
+	for (int i = 0; i < DEPTH; ++i) {
+		minCount = std::min(minCount, _counters[indexes[i]]);
+	}
+
+	return minCount;
+}
+
+void FrequencySketch::indexesOf(const UUID& key, size_t* indexes) const
+{
+	unsigned long long high, low;
+	std::memcpy(&high, key.data(), sizeof(high));
+	std::memcpy(&low, key.data() + sizeof(high), sizeof(low));
+
+	//double hashing, one independent index per row
+	unsigned long long h1 = (high ^ (low >> 29)) * 0x9E3779B97F4A7C15ULL;
+	unsigned long long h2 = (low ^ (high >> 31)) * 0xC2B2AE3D27D4EB4FULL;
+	h1 ^= h1 >> 32;
+	h2 ^= h2 >> 29;
+	h2 |= 1;
+
+	for (int i = 0; i < DEPTH; ++i) {
+		indexes[i] = i * _width + static_cast<size_t>((h1 + i * h2) & (_width - 1));
+	}
+}
+
+void FrequencySketch::halve()
+{
+	for (unsigned char& counter : _counters) {
+		counter >>= 1;
+	}
+
+	_additions /= 2;
+}
+
+}
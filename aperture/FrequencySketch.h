@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * A count-min sketch of how often asset ids were requested recently. Counters
+ * saturate at 15 and are all halved once enough requests were counted, so old
+ * popularity fades. Not thread safe
+ */
+class FrequencySketch
+{
+private:
+	static const int DEPTH = 4;
+	static const unsigned char MAX_COUNT = 15;
+
+	/// The counters, DEPTH rows of _width each
+	std::vector<unsigned char> _counters;
+	size_t _width;
+
+	/// Requests counted since the last halving, and the number that triggers one
+	size_t _additions;
+	size_t _sampleSize;
+
+public:
+	/**
+	 * Creates a sketch sized to track about expectedEntries ids
+	 */
+	explicit FrequencySketch(size_t expectedEntries);
+
+	/**
+	 * Counts a request for the given id
+	 */
+	void increment(const UUID& key);
+
+	/**
+	 * Returns the estimated number of recent requests for the given id
+	 */
+	unsigned int estimate(const UUID& key) const;
+
+private:
+	void indexesOf(const UUID& key, size_t* indexes) const;
+
+	void halve();
+};
+
+}
@@ -0,0 +1,84 @@
+#include "stdafx.h"
+#include "HashRing.h"
+
+#include <algorithm>
+
+namespace aperture {
+
+const unsigned int HashRing::DEFAULT_VNODES;
+
+namespace {
+	/// FNV-1a with a final mix, stable across platforms and builds unlike std::hash
+	unsigned long long point_hash(const std::string& name, unsigned int replica)
+	{
+		unsigned long long h = 0xCBF29CE484222325ULL;
+		for (char c : name) {
+			h = (h ^ static_cast<unsigned char>(c)) * 0x100000001B3ULL;
+		}
+
+		for (int i = 0; i < 4; ++i) {
+			h = (h ^ ((replica >> (i * 8)) & 0xFF)) * 0x100000001B3ULL;
+		}
+
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+
+		return h;
+	}
+}
+
+HashRing::HashRing(const std::vector<std::string>& nodes, unsigned int vnodes)
+	: _numNodes(nodes.size())
+{
+	_points.reserve(nodes.size() * vnodes);
+	for (unsigned int node = 0; node < nodes.size(); ++node) {
+		for (unsigned int replica = 0; replica < vnodes; ++replica) {
+			_points.push_back(std::make_pair(point_hash(nodes[node], replica), node));
+		}
+	}
+
+	std::sort(_points.begin(), _points.end());
+}
+
+std::vector<std::pair<unsigned long long, unsigned int> >::const_iterator HashRing::find(const UUID& key) const
+{
+	std::vector<std::pair<unsigned long long, unsigned int> >::const_iterator it =
+		std::lower_bound(_points.begin(), _points.end(),
+			std::make_pair(static_cast<unsigned long long>(key.hash()), 0u));
+
+	return it == _points.end() ? _points.begin() : it;
+}
+
+unsigned int HashRing::owner(const UUID& key) const
+{
+	return _points.empty() ? 0 : this->find(key)->second;
+}
+
+std::vector<unsigned int> HashRing::owners(const UUID& key, size_t count) const
+{
+	std::vector<unsigned int> result;
+	if (_points.empty()) {
+		return result;
+	}
+
+	count = std::min(count, _numNodes);
+
+	std::vector<std::pair<unsigned long long, unsigned int> >::const_iterator it = this->find(key);
+	for (size_t i = 0; i < _points.size() && result.size() < count; ++i) {
+		if (std::find(result.begin(), result.end(), it->second) == result.end()) {
+			result.push_back(it->second);
+		}
+
+		if (++it == _points.end()) it = _points.begin();
+	}
+
+	return result;
+}
+
+size_t HashRing::size() const
+{
+	return _numNodes;
+}
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * A consistent hash ring mapping asset ids to one of a list of nodes. Each node
+ * is placed on the ring at several points derived from its name only, so every
+ * process given the same names agrees on the owners, and adding or removing a
+ * node only moves the assets it owns. Immutable once built, so safe to share
+ * between threads
+ */
+class HashRing
+{
+public:
+	/// Points placed on the ring for each node
+	static const unsigned int DEFAULT_VNODES = 160;
+
+private:
+	/// Ring positions and the node at each, sorted by position
+	std::vector<std::pair<unsigned long long, unsigned int> > _points;
+	size_t _numNodes;
+
+public:
+	/**
+	 * Builds a ring of the given nodes, which are identified by their index in
+	 * the list from then on
+	 */
+	explicit HashRing(const std::vector<std::string>& nodes, unsigned int vnodes = DEFAULT_VNODES);
+
+	/**
+	 * Returns the node owning the given asset
+	 */
+	unsigned int owner(const UUID& key) const;
+
+	/**
+	 * Returns up to count distinct nodes for the given asset, the owner first
+	 * and then the ones that take over if it fails
+	 */
+	std::vector<unsigned int> owners(const UUID& key, size_t count) const;
+
+	size_t size() const;
+
+private:
+	std::vector<std::pair<unsigned long long, unsigned int> >::const_iterator find(const UUID& key) const;
+};
+
+}
@@ -0,0 +1,286 @@
+#include "stdafx.h"
+#include "HedgedAssetServer.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/bind.hpp>
+
+namespace aperture {
+
+const unsigned int HedgedAssetServer::INITIAL_HEDGE_DELAY_MS;
+const unsigned int HedgedAssetServer::MIN_SAMPLES;
+const unsigned int HedgedAssetServer::RECOMPUTE_INTERVAL;
+const unsigned int HedgedAssetServer::DECAY_INTERVAL;
+
+namespace {
+	/// The answer time buckets start at 250us and end after about 65 seconds
+	const unsigned long long FIRST_BUCKET_BOUND_US = 250;
+	const unsigned int NUM_BUCKETS = 72;
+}
+
+HedgedAssetServer::HedgedAssetServer(IAssetServer::ptr primary, IAssetServer::ptr secondary,
+	boost::asio::io_service& ioService, unsigned int deadlineMs, unsigned int hedgePercentile,
+	unsigned int minHedgeDelayMs, unsigned int selectorBuckets)
+	: _primary(primary),
+	_secondary(secondary),
+	_ioService(ioService),
+	_deadlineMs(deadlineMs),
+	_hedgePercentile(std::min(hedgePercentile, 99u)),
+	_minHedgeDelayMs(minHedgeDelayMs),
+	_buckets(NUM_BUCKETS),
+	_samples(0),
+	_hedgeDelayUs(INITIAL_HEDGE_DELAY_MS * 1000ULL),
+	_requests(0),
+	_fallbacks(0),
+	_hedges(0),
+	_hedgeWins(0),
+	_deadlinesExpired(0)
+{
+	for (unsigned int i = 0; i < NUM_BUCKETS; ++i) {
+		_bucketBoundsUs.push_back((unsigned long long) (FIRST_BUCKET_BOUND_US * std::pow(2.0, i / 4.0)));
+	}
+
+	if (_secondary && selectorBuckets != 0) {
+		_selector.reset(new BackendSelector("whip", "cf", selectorBuckets));
+	}
+}
+
+HedgedAssetServer::~HedgedAssetServer()
+{
+}
+
+bool HedgedAssetServer::isConnected() const
+{
+	return _primary->isConnected();
+}
+
+IAssetServer::ptr HedgedAssetServer::first(const Fetch& fetch) const
+{
+	return fetch.secondaryFirst ? _secondary : _primary;
+}
+
+IAssetServer::ptr HedgedAssetServer::second(const Fetch& fetch) const
+{
+	return fetch.secondaryFirst ? _primary : _secondary;
+}
+
+void HedgedAssetServer::getAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack)
+{
+	_requests.fetch_add(1, std::memory_order_relaxed);
+
+	FetchPtr fetch(new Fetch(uuid, callBack, _ioService));
+
+	{
+		//the first backend may answer on another thread before the timers are set up
+		boost::mutex::scoped_lock lock(fetch->mutex);
+
+		fetch->secondaryFirst = _selector && _selector->secondaryFirst(uuid);
+
+		//only a primary asked first is hedged, its answer times set the delay
+		if (_secondary && _hedgePercentile != 0 && ! fetch->secondaryFirst) {
+			unsigned long long delayUs = std::max<unsigned long long>(_hedgeDelayUs.load(std::memory_order_relaxed),
+				_minHedgeDelayMs * 1000ULL);
+
+			fetch->hedgeTimer.expires_from_now(boost::posix_time::microseconds(delayUs));
+			fetch->hedgeTimer.async_wait(boost::bind(&HedgedAssetServer::onHedgeTimer, shared_from_this(), fetch,
+				boost::asio::placeholders::error));
+		}
+
+		if (_deadlineMs != 0) {
+			fetch->deadlineTimer.expires_from_now(boost::posix_time::milliseconds(_deadlineMs));
+			fetch->deadlineTimer.async_wait(boost::bind(&HedgedAssetServer::onDeadline, shared_from_this(), fetch,
+				boost::asio::placeholders::error));
+		}
+	}
+
+	this->first(*fetch)->getAsset(uuid, boost::bind(&HedgedAssetServer::onFirstAnswer, shared_from_this(), fetch, _1));
+}
+
+void HedgedAssetServer::askSecond(FetchPtr fetch)
+{
+	this->second(*fetch)->getAsset(fetch->uuid, boost::bind(&HedgedAssetServer::onSecondAnswer, shared_from_this(), fetch, _1));
+}
+
+void HedgedAssetServer::onFirstAnswer(FetchPtr fetch, IAsset::ptr asset)
+{
+	bool askSecond = false;
+
+	{
+		boost::mutex::scoped_lock lock(fetch->mutex);
+
+		fetch->firstAnswered = true;
+
+		boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - fetch->started;
+		if (asset && ! fetch->secondaryFirst) {
+			this->recordAnswerTime(elapsed);
+		}
+
+		if (_selector) {
+			_selector->record(fetch->secondaryFirst ? BackendSelector::SECONDARY : BackendSelector::PRIMARY,
+				fetch->uuid, elapsed, asset ? true : false);
+		}
+
+		if (fetch->done) {
+			return;
+		}
+
+		if (asset) {
+			this->finish(*fetch, asset);
+
+		} else if (! _secondary || fetch->secondAnswered) {
+			//nowhere left to look
+			this->finish(*fetch, asset);
+
+		} else if (! fetch->secondAsked) {
+			fetch->secondAsked = true;
+			fetch->secondStarted = boost::posix_time::microsec_clock::universal_time();
+			askSecond = true;
+		}
+
+		//otherwise the hedged request is still on its way
+	}
+
+	if (askSecond) {
+		_fallbacks.fetch_add(1, std::memory_order_relaxed);
+		this->askSecond(fetch);
+	}
+}
+
+void HedgedAssetServer::onSecondAnswer(FetchPtr fetch, IAsset::ptr asset)
+{
+	boost::mutex::scoped_lock lock(fetch->mutex);
+
+	fetch->secondAnswered = true;
+
+	if (_selector) {
+		_selector->record(fetch->secondaryFirst ? BackendSelector::PRIMARY : BackendSelector::SECONDARY,
+			fetch->uuid, boost::posix_time::microsec_clock::universal_time() - fetch->secondStarted, asset ? true : false);
+	}
+
+	if (fetch->done) {
+		return;
+	}
+
+	if (asset) {
+		if (fetch->hedged && ! fetch->firstAnswered) {
+			_hedgeWins.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		this->finish(*fetch, asset);
+
+	} else if (fetch->firstAnswered) {
+		this->finish(*fetch, asset);
+	}
+
+	//otherwise the first backend may still have it
+}
+
+void HedgedAssetServer::onHedgeTimer(FetchPtr fetch, const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
+	{
+		boost::mutex::scoped_lock lock(fetch->mutex);
+
+		if (fetch->done || fetch->secondAsked) {
+			return;
+		}
+
+		fetch->secondAsked = true;
+		fetch->secondStarted = boost::posix_time::microsec_clock::universal_time();
+		fetch->hedged = true;
+	}
+
+	_hedges.fetch_add(1, std::memory_order_relaxed);
+	this->askSecond(fetch);
+}
+
+void HedgedAssetServer::onDeadline(FetchPtr fetch, const boost::system::error_code& error)
+{
+	if (error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
+	boost::mutex::scoped_lock lock(fetch->mutex);
+
+	if (! fetch->done) {
+		_deadlinesExpired.fetch_add(1, std::memory_order_relaxed);
+		this->finish(*fetch, IAsset::ptr());
+	}
+}
+
+void HedgedAssetServer::finish(Fetch& fetch, IAsset::ptr asset)
+{
+	fetch.done = true;
+
+	boost::system::error_code ignored;
+	fetch.hedgeTimer.cancel(ignored);
+	fetch.deadlineTimer.cancel(ignored);
+
+	_ioService.post(boost::bind(fetch.callBack, asset));
+	fetch.callBack.clear();
+}
+
+void HedgedAssetServer::recordAnswerTime(const boost::posix_time::time_duration& elapsed)
+{
+	unsigned long long elapsedUs = std::max<long long>(elapsed.total_microseconds(), 0);
+
+	size_t bucket = std::lower_bound(_bucketBoundsUs.begin(), _bucketBoundsUs.end(), elapsedUs) - _bucketBoundsUs.begin();
+	_buckets[std::min<size_t>(bucket, NUM_BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+
+	unsigned long long samples = _samples.fetch_add(1, std::memory_order_relaxed) + 1;
+
+	if (samples % DECAY_INTERVAL == 0) {
+		//halve the old answers so the delay follows the primary as it speeds up or slows down
+		for (std::atomic<unsigned long long>& count : _buckets) {
+			count.store(count.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+		}
+	}
+
+	if (samples < MIN_SAMPLES || samples % RECOMPUTE_INTERVAL != 0 || _hedgePercentile == 0) {
+		return;
+	}
+
+	unsigned long long total = 0;
+	for (const std::atomic<unsigned long long>& count : _buckets) {
+		total += count.load(std::memory_order_relaxed);
+	}
+
+	unsigned long long wanted = total * _hedgePercentile / 100;
+	unsigned long long seen = 0;
+	for (unsigned int i = 0; i < NUM_BUCKETS; ++i) {
+		seen += _buckets[i].load(std::memory_order_relaxed);
+		if (seen > wanted) {
+			_hedgeDelayUs.store(_bucketBoundsUs[i], std::memory_order_relaxed);
+			break;
+		}
+	}
+}
+
+void HedgedAssetServer::shutdown()
+{
+	_primary->shutdown();
+}
+
+void HedgedAssetServer::writeStats(std::ostream& out) const
+{
+	out << "backend_requests=" << _requests.load(std::memory_order_relaxed) << "\n"
+		<< "backend_fallbacks=" << _fallbacks.load(std::memory_order_relaxed) << "\n"
+		<< "backend_hedges=" << _hedges.load(std::memory_order_relaxed) << "\n"
+		<< "backend_hedge_wins=" << _hedgeWins.load(std::memory_order_relaxed) << "\n"
+		<< "backend_deadlines_expired=" << _deadlinesExpired.load(std::memory_order_relaxed) << "\n"
+		<< "backend_hedge_delay_us="
+		<< std::max<unsigned long long>(_hedgeDelayUs.load(std::memory_order_relaxed), _minHedgeDelayMs * 1000ULL)
+		<< "\n";
+
+	if (_selector) {
+		_selector->writeStats(out);
+	}
+
+	_primary->writeStats(out);
+}
+
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "BackendSelector.h"
+#include "IAsset.h"
+#include "IAssetServer.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Puts a deadline on fetches from a primary asset server and falls back to a
+ * secondary one. The secondary is asked when the primary has no answer, and,
+ * when hedging, also when the primary is slower than it usually is for that
+ * fraction of requests: whichever answers first with the asset wins and the
+ * other answer is ignored, neither backend can take a request back.
+ *
+ * The hedge delay follows the given percentile of the primary's recent
+ * answer times, so only about the slowest (100 - percentile)% of requests are
+ * sent twice.
+ *
+ * With adaptive ordering a BackendSelector may have the secondary asked first
+ * for assets the primary mostly misses, the primary is then only asked when
+ * the secondary has no answer
+ */
+class HedgedAssetServer : public boost::enable_shared_from_this<HedgedAssetServer>, public IAssetServer
+{
+public:
+	typedef boost::shared_ptr<HedgedAssetServer> ptr;
+
+	/// Used as the hedge delay until enough answers were timed
+	static const unsigned int INITIAL_HEDGE_DELAY_MS = 100;
+
+	/// Answers timed before their percentile is trusted
+	static const unsigned int MIN_SAMPLES = 64;
+
+	/// The hedge delay is worked out again after this many answers
+	static const unsigned int RECOMPUTE_INTERVAL = 64;
+
+	/// Answer times older than about this many answers fade out
+	static const unsigned int DECAY_INTERVAL = 4096;
+
+private:
+	/// One backend fetch, answered once by whichever of its steps finishes it
+	struct Fetch
+	{
+		Fetch(const UUID& id, boost::function<void (IAsset::ptr)> cb, boost::asio::io_service& ioService)
+			: uuid(id), callBack(cb), started(boost::posix_time::microsec_clock::universal_time()),
+			secondaryFirst(false), done(false), firstAnswered(false), secondAsked(false), secondAnswered(false),
+			hedged(false), hedgeTimer(ioService), deadlineTimer(ioService)
+		{
+		}
+
+		UUID uuid;
+		boost::function<void (IAsset::ptr)> callBack;
+		boost::posix_time::ptime started;
+		boost::posix_time::ptime secondStarted;
+
+		/// Whether the backends are asked the other way round
+		bool secondaryFirst;
+
+		boost::mutex mutex;
+		bool done;
+		bool firstAnswered;
+		bool secondAsked;
+		bool secondAnswered;
+		bool hedged;
+
+		boost::asio::deadline_timer hedgeTimer;
+		boost::asio::deadline_timer deadlineTimer;
+	};
+
+	typedef boost::shared_ptr<Fetch> FetchPtr;
+
+	IAssetServer::ptr _primary;
+	IAssetServer::ptr _secondary;
+	boost::asio::io_service& _ioService;
+
+	unsigned int _deadlineMs;
+	unsigned int _hedgePercentile;
+	unsigned int _minHedgeDelayMs;
+
+	/// Picks the order of the backends, empty for always the primary first
+	boost::scoped_ptr<BackendSelector> _selector;
+
+	/// Recent primary answer times in buckets four to each doubling
+	std::vector<unsigned long long> _bucketBoundsUs;
+	std::vector<std::atomic<unsigned long long> > _buckets;
+	std::atomic<unsigned long long> _samples;
+	std::atomic<unsigned long long> _hedgeDelayUs;
+
+	std::atomic<unsigned long long> _requests;
+	std::atomic<unsigned long long> _fallbacks;
+	std::atomic<unsigned long long> _hedges;
+	std::atomic<unsigned long long> _hedgeWins;
+	std::atomic<unsigned long long> _deadlinesExpired;
+
+	/// Returns the backend asked first or second for the fetch
+	IAssetServer::ptr first(const Fetch& fetch) const;
+	IAssetServer::ptr second(const Fetch& fetch) const;
+
+	void askSecond(FetchPtr fetch);
+
+	void onFirstAnswer(FetchPtr fetch, IAsset::ptr asset);
+	void onSecondAnswer(FetchPtr fetch, IAsset::ptr asset);
+	void onHedgeTimer(FetchPtr fetch, const boost::system::error_code& error);
+	void onDeadline(FetchPtr fetch, const boost::system::error_code& error);
+
+	/// Answers the fetch and stops its timers. Called with the fetch locked,
+	/// the callback is run from the io_service
+	void finish(Fetch& fetch, IAsset::ptr asset);
+
+	void recordAnswerTime(const boost::posix_time::time_duration& elapsed);
+
+public:
+	/**
+	 * Creates the server. secondary may be empty for a deadline only, a
+	 * deadline or percentile of 0 turns the deadline or the hedging off, and
+	 * 0 selector buckets keep the primary first
+	 */
+	HedgedAssetServer(IAssetServer::ptr primary, IAssetServer::ptr secondary, boost::asio::io_service& ioService,
+		unsigned int deadlineMs, unsigned int hedgePercentile, unsigned int minHedgeDelayMs,
+		unsigned int selectorBuckets);
+	virtual ~HedgedAssetServer();
+
+	/**
+	 * Returns whether the primary server is connected
+	 */
+	virtual bool isConnected() const;
+
+	virtual void getAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack);
+
+	/**
+	 * Shuts the primary server down, the secondary is left to its owner
+	 */
+	virtual void shutdown();
+
+	/**
+	 * Writes the request, fallback, hedge and deadline counters, the current
+	 * hedge delay and the selector's statistics, followed by the primary's own
+	 * stats
+	 */
+	virtual void writeStats(std::ostream& out) const;
+};
+
+}
@@ -0,0 +1,284 @@
+#include "stdafx.h"
+#include "HotRestart.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <boost/bind.hpp>
+
+#include "AppLog.h"
+
+namespace aperture {
+
+const unsigned int HotRestart::MAX_SOCKETS;
+
+namespace {
+	const unsigned int HANDOFF_MAGIC = 0x52485041; //"APHR"
+
+	/// Sent by the new process to ask for the sockets
+	struct HandoffRequest
+	{
+		unsigned int magic;
+	};
+
+	/// Sent back with the sockets attached, followed by pathLength bytes of the
+	/// cache file path and stateLength bytes of state
+	struct HandoffReply
+	{
+		unsigned int magic;
+		unsigned int socketCount;
+		unsigned int pathLength;
+		unsigned int stateLength;
+	};
+
+#ifndef _WIN32
+	bool read_string(int fd, size_t length, std::string& out)
+	{
+		std::vector<char> buffer(length);
+		size_t got = 0;
+		while (got < length) {
+			ssize_t n = ::read(fd, &buffer[got], length - got);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			got += n;
+		}
+
+		out.assign(buffer.begin(), buffer.end());
+		return true;
+	}
+#endif
+}
+
+#ifndef _WIN32
+
+HotRestart::HotRestart(boost::asio::io_service& ioService, const std::string& path)
+	: _ioService(ioService), _path(path), _acceptor(ioService), _peer(ioService)
+{
+}
+
+HotRestart::~HotRestart()
+{
+}
+
+bool HotRestart::takeOver(std::vector<int>& listenFds, std::string& cachePath, std::string& state)
+{
+	sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (_path.size() >= sizeof(addr.sun_path)) {
+		AppLog::instance().out() << "[HOTRESTART] Socket path " << _path << " is too long" << std::endl;
+		return false;
+	}
+	std::memcpy(addr.sun_path, _path.c_str(), _path.size());
+
+	int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return false;
+	}
+
+	if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		//nothing running, a normal start
+		::close(fd);
+		return false;
+	}
+
+	AppLog::instance().out() << "[HOTRESTART] Taking over from the process at " << _path << std::endl;
+
+	HandoffRequest request = { HANDOFF_MAGIC };
+	HandoffReply reply;
+	char control[CMSG_SPACE(MAX_SOCKETS * sizeof(int))];
+
+	iovec iov = { &reply, sizeof(reply) };
+	msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t got;
+	if (::write(fd, &request, sizeof(request)) != sizeof(request)
+		|| (got = ::recvmsg(fd, &msg, MSG_WAITALL)) != sizeof(reply)
+		|| reply.magic != HANDOFF_MAGIC) {
+		AppLog::instance().out() << "[HOTRESTART] The running process did not hand over" << std::endl;
+		::close(fd);
+		return false;
+	}
+
+	for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const unsigned char* fds = CMSG_DATA(cmsg);
+			for (size_t i = 0; i < count; ++i) {
+				int received;
+				std::memcpy(&received, fds + i * sizeof(int), sizeof(int));
+				listenFds.push_back(received);
+			}
+		}
+	}
+
+	if (! read_string(fd, reply.pathLength, cachePath) || ! read_string(fd, reply.stateLength, state)) {
+		AppLog::instance().out() << "[HOTRESTART] The handoff was cut short" << std::endl;
+		cachePath.clear();
+		state.clear();
+	}
+
+	::close(fd);
+
+	AppLog::instance().out()
+		<< "[HOTRESTART] Took over " << listenFds.size() << " listening socket(s)"
+		<< (cachePath.empty() ? "" : " and the cache") << std::endl;
+
+	return true;
+}
+
+bool HotRestart::listen(handoff_function handoff, handed_off_function handedOff)
+{
+	_handoff = handoff;
+	_handedOff = handedOff;
+
+	//the process this one took over from is no longer listening, and a file left
+	//by a crashed one is of no use either
+	::unlink(_path.c_str());
+
+	boost::system::error_code ec;
+	_acceptor.open(boost::asio::local::stream_protocol(), ec);
+	if (! ec) _acceptor.bind(boost::asio::local::stream_protocol::endpoint(_path), ec);
+	if (! ec) _acceptor.listen(boost::asio::socket_base::max_connections, ec);
+
+	if (ec) {
+		AppLog::instance().out()
+			<< "[HOTRESTART] Unable to listen on " << _path << ": " << ec.message()
+			<< std::endl;
+		_acceptor.close(ec);
+		return false;
+	}
+
+	this->acceptNext();
+	return true;
+}
+
+void HotRestart::close()
+{
+	boost::system::error_code ignored;
+	_acceptor.close(ignored);
+}
+
+void HotRestart::acceptNext()
+{
+	_acceptor.async_accept(_peer, boost::bind(&HotRestart::onAccept, this, boost::asio::placeholders::error));
+}
+
+void HotRestart::onAccept(const boost::system::error_code& error)
+{
+	if (error) {
+		return;
+	}
+
+	//the new process asks right after connecting, so reading blocks very briefly
+	HandoffRequest request;
+	boost::system::error_code ec;
+	boost::asio::read(_peer, boost::asio::buffer(&request, sizeof(request)), ec);
+
+	if (ec || request.magic != HANDOFF_MAGIC) {
+		AppLog::instance().out() << "[HOTRESTART] Ignoring a bad handoff request" << std::endl;
+		_peer.close(ec);
+		this->acceptNext();
+		return;
+	}
+
+	AppLog::instance().out() << "[HOTRESTART] A new process is taking over" << std::endl;
+
+	std::string cachePath, state;
+	std::vector<int> fds = _handoff(cachePath, state);
+	if (fds.size() > MAX_SOCKETS) {
+		fds.resize(MAX_SOCKETS);
+	}
+
+	HandoffReply reply = { HANDOFF_MAGIC, static_cast<unsigned int>(fds.size()),
+		static_cast<unsigned int>(cachePath.size()), static_cast<unsigned int>(state.size()) };
+	char control[CMSG_SPACE(MAX_SOCKETS * sizeof(int))];
+	std::memset(control, 0, sizeof(control));
+
+	iovec iov = { &reply, sizeof(reply) };
+	msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (! fds.empty()) {
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(fds.size() * sizeof(int));
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+		std::memcpy(CMSG_DATA(cmsg), &fds[0], fds.size() * sizeof(int));
+	}
+
+	_peer.native_non_blocking(false, ec);
+
+	if (::sendmsg(_peer.native_handle(), &msg, MSG_NOSIGNAL) != sizeof(reply)) {
+		AppLog::instance().out()
+			<< "[HOTRESTART] Unable to hand over: " << std::strerror(errno)
+			<< std::endl;
+		if (! cachePath.empty()) ::unlink(cachePath.c_str());
+		_peer.close(ec);
+		this->acceptNext();
+		return;
+	}
+
+	boost::asio::write(_peer, boost::asio::buffer(cachePath + state), ec);
+	_peer.close(ec);
+
+	//the new process listens at the path from now on
+	_acceptor.close(ec);
+
+	_handedOff();
+}
+
+#else
+
+HotRestart::HotRestart(boost::asio::io_service& ioService, const std::string& path)
+	: _ioService(ioService), _path(path)
+{
+}
+
+HotRestart::~HotRestart()
+{
+}
+
+bool HotRestart::takeOver(std::vector<int>& listenFds, std::string& cachePath, std::string& state)
+{
+	return false;
+}
+
+bool HotRestart::listen(handoff_function handoff, handed_off_function handedOff)
+{
+	AppLog::instance().out() << "[HOTRESTART] Hot restarts are not supported on this platform" << std::endl;
+	return false;
+}
+
+void HotRestart::close()
+{
+}
+
+void HotRestart::acceptNext()
+{
+}
+
+void HotRestart::onAccept(const boost::system::error_code& error)
+{
+}
+
+#endif
+
+}
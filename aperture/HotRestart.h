@@ -0,0 +1,76 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace aperture {
+
+/**
+ * Lets a newly started process take over from a running one without closing
+ * the listening sockets. The running process listens on a Unix socket; the new
+ * one connects to it at startup and receives the listening sockets, the path
+ * of a file in shared memory holding the cached assets and the caps. The old
+ * process then stops accepting and exits once its connections are done.
+ *
+ * Only supported on POSIX systems
+ */
+class HotRestart
+{
+public:
+	typedef boost::shared_ptr<HotRestart> ptr;
+
+	/// Called when a newer process asks to take over. Returns the listening
+	/// sockets to hand over and sets the path of the file holding the cache,
+	/// which stays empty if there is none, and any other state to pass on
+	typedef boost::function<std::vector<int> (std::string&, std::string&)> handoff_function;
+
+	/// Called once the sockets have been handed over
+	typedef boost::function<void ()> handed_off_function;
+
+	/// The most listening sockets that can be handed over
+	static const unsigned int MAX_SOCKETS = 64;
+
+private:
+	boost::asio::io_service& _ioService;
+	std::string _path;
+
+#ifndef _WIN32
+	boost::asio::local::stream_protocol::acceptor _acceptor;
+	boost::asio::local::stream_protocol::socket _peer;
+#endif
+
+	handoff_function _handoff;
+	handed_off_function _handedOff;
+
+public:
+	HotRestart(boost::asio::io_service& ioService, const std::string& path);
+	virtual ~HotRestart();
+
+	/**
+	 * Asks the process listening at the socket path to hand over. Returns false
+	 * if there is no such process
+	 */
+	bool takeOver(std::vector<int>& listenFds, std::string& cachePath, std::string& state);
+
+	/**
+	 * Listens at the socket path for the next process to take over from this
+	 * one. Returns false if the socket can't be created
+	 */
+	bool listen(handoff_function handoff, handed_off_function handedOff);
+
+	/**
+	 * Stops listening
+	 */
+	void close();
+
+private:
+	void acceptNext();
+
+	void onAccept(const boost::system::error_code& error);
+};
+
+}
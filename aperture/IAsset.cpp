@@ -7,4 +7,25 @@ IAsset::~IAsset()
 {
 }
 
+void IAsset::clampRange(size_t dataSz, size_t& rngStart, size_t& rngEnd)
+{
+	if (rngEnd > (dataSz - 1)) {
+		//http spec says clamp it
+		rngEnd = dataSz - 1;
+	}
+
+	if (rngStart > (dataSz - 1)) {
+		//entirely reset the range and just return the whole object
+		rngStart = 0;
+		rngEnd = dataSz - 1;
+	}
+
+	if (rngEnd < rngStart) {
+		//entirely reset the range. this seems to be a bug in the viewer,
+		//but for flipped ranges apache just returns the entire object
+		rngStart = 0;
+		rngEnd = dataSz - 1;
+	}
+}
+
 }
\ No newline at end of file
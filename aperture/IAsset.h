@@ -1,6 +1,10 @@
 #pragma once
 
+#include <boost/asio/buffer.hpp>
+#include <boost/shared_ptr.hpp>
+
 #include "byte.h"
+#include "UUID.h"
 
 namespace aperture {
 
@@ -18,7 +22,7 @@ public:
 	/**
 	 * Returns the asset UUID
 	 */
-	virtual std::string getUUID() const = 0;
+	virtual UUID getUUID() const = 0;
 
 	/**
 	 * Returns the size of the binary asset data
@@ -31,14 +35,15 @@ public:
 	virtual aperture::byte getType() const = 0;
 
 	/**
-	 * Copies the asset data only to the given storage area
+	 * Returns a read-only view of the binary asset data. The view is valid for as
+	 * long as a reference to this asset is held
 	 */
-	virtual size_t copyAssetData(std::string& storage) const = 0;
+	virtual boost::asio::const_buffer getAssetData() const = 0;
 
 	/**
-	 * Copies the asset data only to the given storage area (rngStart + rngEnd are INCLUSIVE)
+	 * Clamps an INCLUSIVE byte range to data of the given size. dataSz must not be 0
 	 */
-	virtual size_t copyAssetData(std::string& storage, size_t rngStart, size_t rngEnd) const = 0;
+	static void clampRange(size_t dataSz, size_t& rngStart, size_t& rngEnd);
 };
 
 }
\ No newline at end of file
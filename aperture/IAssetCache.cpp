@@ -0,0 +1,29 @@
+#include "stdafx.h"
+#include "IAssetCache.h"
+
+namespace aperture {
+
+IAssetCache::~IAssetCache()
+{
+}
+
+std::vector<IAsset::ptr> IAssetCache::interleave(const std::vector<std::vector<IAsset::ptr> >& lists, size_t maxAssets)
+{
+	std::vector<IAsset::ptr> merged;
+
+	for (size_t rank = 0; merged.size() < maxAssets; ++rank) {
+		bool found = false;
+		for (const std::vector<IAsset::ptr>& list : lists) {
+			if (rank < list.size() && merged.size() < maxAssets) {
+				merged.push_back(list[rank]);
+				found = true;
+			}
+		}
+
+		if (! found) break;
+	}
+
+	return merged;
+}
+
+}
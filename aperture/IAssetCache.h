@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include "IAsset.h"
+
+namespace aperture {
+
+/**
+ * An in memory asset cache bounded by the bytes counted by AssetSizeCalculator.
+ * Implementations are safe to use from any thread
+ */
+class IAssetCache
+{
+public:
+	typedef boost::shared_ptr<IAssetCache> ptr;
+
+public:
+	virtual ~IAssetCache();
+
+	/**
+	 * Returns the cached asset or an empty pointer, counting a hit or a miss
+	 */
+	virtual IAsset::ptr fetch(const UUID& key) = 0;
+
+	/**
+	 * Inserts or replaces an asset. The cache decides what to evict, and may
+	 * decide not to keep the new asset at all
+	 */
+	virtual void insert(const UUID& key, const IAsset::ptr& asset) = 0;
+
+	/**
+	 * Removes an asset if it is cached
+	 */
+	virtual void remove(const UUID& key) = 0;
+
+	/**
+	 * Removes all assets
+	 */
+	virtual void clear() = 0;
+
+	/**
+	 * Returns the number of cached assets
+	 */
+	virtual size_t size() const = 0;
+
+	/**
+	 * Returns the number of bytes used as counted by AssetSizeCalculator
+	 */
+	virtual unsigned long long byteSize() const = 0;
+
+	/**
+	 * Returns the configured maximum number of bytes
+	 */
+	virtual unsigned long long maxSize() const = 0;
+
+	/**
+	 * Returns the number of fetches that found an asset
+	 */
+	virtual unsigned long long hits() const = 0;
+
+	/**
+	 * Returns the number of fetches that found nothing
+	 */
+	virtual unsigned long long misses() const = 0;
+
+	/**
+	 * Returns the name of the eviction policy, as used in the cache_policy setting
+	 */
+	virtual const char* policyName() const = 0;
+
+	/**
+	 * Returns up to maxAssets cached assets, the ones the policy would keep
+	 * longest first
+	 */
+	virtual std::vector<IAsset::ptr> hottest(size_t maxAssets) const = 0;
+
+	/**
+	 * Merges lists that are each ordered hottest first by taking one asset from
+	 * every list in turn, stopping at maxAssets
+	 */
+	static std::vector<IAsset::ptr> interleave(const std::vector<std::vector<IAsset::ptr> >& lists, size_t maxAssets);
+};
+
+}
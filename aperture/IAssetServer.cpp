@@ -7,5 +7,9 @@ IAssetServer::~IAssetServer(void)
 {
 }
 
+void IAssetServer::writeStats(std::ostream& out) const
+{
+}
+
 
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <ostream>
+
 #include <boost/shared_ptr.hpp>
 #include "IAsset.h"
 
@@ -25,12 +27,18 @@ public:
 	 * Retrieves the requested asset by ID and calls back the given function with the asset or a null
 	 * pointer in the case where the asset could not be found or there was another error
 	 */
-	virtual void getAsset(const std::string& uuid, boost::function<void (aperture::IAsset::ptr)> callBack) = 0;
+	virtual void getAsset(const UUID& uuid, boost::function<void (aperture::IAsset::ptr)> callBack) = 0;
 
 	/**
 	 * Stops the asset server
 	 */
 	virtual void shutdown() = 0;
+
+	/**
+	 * Writes the health of the server as name=value lines for the stats
+	 * request. Writes nothing by default
+	 */
+	virtual void writeStats(std::ostream& out) const;
 };
 
 }
\ No newline at end of file
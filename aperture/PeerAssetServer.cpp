@@ -0,0 +1,370 @@
+#include "stdafx.h"
+#include "PeerAssetServer.h"
+
+#include <cstring>
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#include "AppLog.h"
+
+using boost::asio::ip::tcp;
+
+namespace aperture {
+
+const unsigned int PeerAssetServer::PROTOCOL_MAGIC;
+const unsigned int PeerAssetServer::MAX_ASSET_SIZE;
+const unsigned int PeerAssetServer::MIN_RECONNECT_DELAY_MS;
+const unsigned int PeerAssetServer::MAX_RECONNECT_DELAY_MS;
+
+namespace {
+	/// An asset received from a peer
+	class PeerAsset : public IAsset
+	{
+	public:
+		PeerAsset(const UUID& uuid, aperture::byte type, std::vector<char>&& data)
+			: _uuid(uuid), _type(type), _data(std::move(data))
+		{
+		}
+
+		virtual UUID getUUID() const { return _uuid; }
+		virtual size_t getBinaryDataSize() const { return _data.size(); }
+		virtual aperture::byte getType() const { return _type; }
+		virtual boost::asio::const_buffer getAssetData() const
+		{
+			return boost::asio::const_buffer(_data.empty() ? 0 : &_data[0], _data.size());
+		}
+
+	private:
+		UUID _uuid;
+		aperture::byte _type;
+		std::vector<char> _data;
+	};
+}
+
+PeerAssetServer::PeerAssetServer(const std::string& hostPort, unsigned int timeoutMs, boost::asio::io_service& ioService)
+	: _name(hostPort),
+	_ioService(ioService),
+	_strand(ioService),
+	_socket(ioService),
+	_connectionState(CSTATE_DISCONNECTED),
+	_timeoutMs(timeoutMs),
+	_timeoutTimer(ioService),
+	_reconnectTimer(ioService),
+	_reconnectDelayMs(MIN_RECONNECT_DELAY_MS),
+	_generation(0),
+	_hits(0),
+	_misses(0),
+	_failures(0)
+{
+	std::string::size_type colon = hostPort.rfind(':');
+	if (colon == std::string::npos) {
+		throw std::runtime_error("Peer address " + hostPort + " has no port");
+	}
+
+	_host = hostPort.substr(0, colon);
+	_port = hostPort.substr(colon + 1);
+}
+
+PeerAssetServer::~PeerAssetServer()
+{
+}
+
+void PeerAssetServer::connect()
+{
+	_strand.dispatch(boost::bind(&PeerAssetServer::doConnect, shared_from_this()));
+}
+
+void PeerAssetServer::doConnect()
+{
+	if (_connectionState == CSTATE_SHUTDOWN) {
+		return;
+	}
+
+	_connectionState = CSTATE_CONNECTING;
+
+	boost::shared_ptr<tcp::resolver> resolver(boost::make_shared<tcp::resolver>(_ioService));
+	resolver->async_resolve(tcp::resolver::query(_host, _port),
+		_strand.wrap(boost::bind(&PeerAssetServer::onResolve, shared_from_this(),
+			boost::asio::placeholders::error, boost::asio::placeholders::iterator, resolver)));
+}
+
+void PeerAssetServer::onResolve(const boost::system::error_code& error, tcp::resolver::iterator endpoints,
+	boost::shared_ptr<tcp::resolver> resolver)
+{
+	if (_connectionState == CSTATE_SHUTDOWN) {
+		return;
+	}
+
+	if (error || endpoints == tcp::resolver::iterator()) {
+		this->fail("unable to resolve the address");
+		return;
+	}
+
+	_endpoint = *endpoints;
+	_socket.async_connect(_endpoint, _strand.wrap(boost::bind(&PeerAssetServer::onConnect, shared_from_this(),
+		boost::asio::placeholders::error)));
+}
+
+void PeerAssetServer::onConnect(const boost::system::error_code& error)
+{
+	if (_connectionState == CSTATE_SHUTDOWN) {
+		return;
+	}
+
+	if (error) {
+		this->fail("unable to connect: " + error.message());
+		return;
+	}
+
+	boost::system::error_code ignored;
+	_socket.set_option(tcp::no_delay(true), ignored);
+
+	AppLog::instance().out() << "[PEER] Connected to peer " << _name << std::endl;
+
+	_connectionState = CSTATE_CONNECTED;
+	_reconnectDelayMs = MIN_RECONNECT_DELAY_MS;
+
+	this->readResponse();
+}
+
+bool PeerAssetServer::isConnected() const
+{
+	return _connectionState == CSTATE_CONNECTED;
+}
+
+void PeerAssetServer::getAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack)
+{
+	if (_connectionState != CSTATE_CONNECTED) {
+		_ioService.post(boost::bind(callBack, IAsset::ptr()));
+		return;
+	}
+
+	_strand.post(boost::bind(&PeerAssetServer::doGetAsset, shared_from_this(), uuid, callBack));
+}
+
+void PeerAssetServer::doGetAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack)
+{
+	if (_connectionState != CSTATE_CONNECTED) {
+		_ioService.post(boost::bind(callBack, IAsset::ptr()));
+		return;
+	}
+
+	PendingRequest pending = { uuid, callBack,
+		boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(_timeoutMs) };
+	_pending.push_back(pending);
+
+	Request request;
+	request.magic = htonl(PROTOCOL_MAGIC);
+	std::memcpy(request.uuid, uuid.data(), UUID::BYTE_LEN);
+	_sendQueue.push_back(request);
+
+	if (_sending.empty()) {
+		this->sendNext();
+	}
+
+	if (_pending.size() == 1) {
+		this->armTimeout();
+	}
+}
+
+void PeerAssetServer::sendNext()
+{
+	_sending.swap(_sendQueue);
+
+	boost::asio::async_write(_socket, boost::asio::buffer(&_sending[0], _sending.size() * sizeof(Request)),
+		_strand.wrap(boost::bind(&PeerAssetServer::onWrite, shared_from_this(),
+			boost::asio::placeholders::error, _generation)));
+}
+
+void PeerAssetServer::onWrite(const boost::system::error_code& error, unsigned int generation)
+{
+	_sending.clear();
+
+	if (generation != _generation) {
+		//written on a connection that failed since, a new one may be waiting
+		if (_connectionState == CSTATE_CONNECTED && ! _sendQueue.empty()) this->sendNext();
+		return;
+	}
+
+	if (error) {
+		this->fail("unable to send: " + error.message());
+		return;
+	}
+
+	if (! _sendQueue.empty()) {
+		this->sendNext();
+	}
+}
+
+void PeerAssetServer::readResponse()
+{
+	boost::asio::async_read(_socket, boost::asio::buffer(&_response, sizeof(_response)),
+		_strand.wrap(boost::bind(&PeerAssetServer::onReadResponse, shared_from_this(),
+			boost::asio::placeholders::error, _generation)));
+}
+
+void PeerAssetServer::onReadResponse(const boost::system::error_code& error, unsigned int generation)
+{
+	if (generation != _generation) {
+		return;
+	}
+
+	if (error) {
+		this->fail("connection lost: " + error.message());
+		return;
+	}
+
+	if (ntohl(_response.magic) != PROTOCOL_MAGIC || _pending.empty()) {
+		this->fail("unexpected response");
+		return;
+	}
+
+	if (_response.status != Response::FOUND) {
+		this->completeFront(IAsset::ptr());
+		this->readResponse();
+		return;
+	}
+
+	unsigned int size = ntohl(_response.size);
+	if (size > MAX_ASSET_SIZE) {
+		this->fail("asset too large");
+		return;
+	}
+
+	_responseData.resize(size);
+	boost::asio::async_read(_socket, boost::asio::buffer(_responseData),
+		_strand.wrap(boost::bind(&PeerAssetServer::onReadData, shared_from_this(),
+			boost::asio::placeholders::error, _generation)));
+}
+
+void PeerAssetServer::onReadData(const boost::system::error_code& error, unsigned int generation)
+{
+	if (generation != _generation) {
+		return;
+	}
+
+	if (error) {
+		this->fail("connection lost: " + error.message());
+		return;
+	}
+
+	IAsset::ptr asset(boost::make_shared<PeerAsset>(_pending.front().uuid, _response.type, std::move(_responseData)));
+	_responseData.clear();
+
+	this->completeFront(asset);
+	this->readResponse();
+}
+
+void PeerAssetServer::completeFront(IAsset::ptr asset)
+{
+	(asset ? _hits : _misses).fetch_add(1, std::memory_order_relaxed);
+
+	_ioService.post(boost::bind(_pending.front().callBack, asset));
+	_pending.pop_front();
+
+	this->armTimeout();
+}
+
+void PeerAssetServer::armTimeout()
+{
+	if (_pending.empty()) {
+		_timeoutTimer.cancel();
+		return;
+	}
+
+	//requests are answered in order, so only the oldest can time out first
+	_timeoutTimer.expires_at(_pending.front().deadline);
+	_timeoutTimer.async_wait(_strand.wrap(boost::bind(&PeerAssetServer::onTimeout, shared_from_this(),
+		boost::asio::placeholders::error, _generation)));
+}
+
+void PeerAssetServer::onTimeout(const boost::system::error_code& error, unsigned int generation)
+{
+	if (error == boost::asio::error::operation_aborted || generation != _generation || _pending.empty()) {
+		return;
+	}
+
+	if (_pending.front().deadline <= boost::posix_time::microsec_clock::universal_time()) {
+		this->fail("request timed out");
+	} else {
+		this->armTimeout();
+	}
+}
+
+void PeerAssetServer::fail(const std::string& reason)
+{
+	bool wasConnected = _connectionState == CSTATE_CONNECTED;
+
+	++_generation;
+
+	boost::system::error_code ignored;
+	_socket.close(ignored);
+	_timeoutTimer.cancel();
+
+	_failures.fetch_add(_pending.size(), std::memory_order_relaxed);
+	for (const PendingRequest& pending : _pending) {
+		_ioService.post(boost::bind(pending.callBack, IAsset::ptr()));
+	}
+
+	_pending.clear();
+	_sendQueue.clear();
+
+	if (_connectionState == CSTATE_SHUTDOWN) {
+		return;
+	}
+
+	if (wasConnected || _reconnectDelayMs == MIN_RECONNECT_DELAY_MS) {
+		AppLog::instance().out() << "[PEER] Peer " << _name << " is down, " << reason << std::endl;
+	}
+
+	_connectionState = CSTATE_DISCONNECTED;
+
+	_reconnectTimer.expires_from_now(boost::posix_time::milliseconds(_reconnectDelayMs));
+	_reconnectTimer.async_wait(_strand.wrap(boost::bind(&PeerAssetServer::onReconnect, shared_from_this(),
+		boost::asio::placeholders::error)));
+
+	_reconnectDelayMs = std::min(_reconnectDelayMs * 2, MAX_RECONNECT_DELAY_MS);
+}
+
+void PeerAssetServer::onReconnect(const boost::system::error_code& error)
+{
+	if (! error) {
+		this->doConnect();
+	}
+}
+
+void PeerAssetServer::shutdown()
+{
+	_strand.dispatch(boost::bind(&PeerAssetServer::doShutdown, shared_from_this()));
+}
+
+void PeerAssetServer::doShutdown()
+{
+	_connectionState = CSTATE_SHUTDOWN;
+	_reconnectTimer.cancel();
+
+	this->fail("shutting down");
+}
+
+const std::string& PeerAssetServer::name() const
+{
+	return _name;
+}
+
+unsigned long long PeerAssetServer::hits() const
+{
+	return _hits.load(std::memory_order_relaxed);
+}
+
+unsigned long long PeerAssetServer::misses() const
+{
+	return _misses.load(std::memory_order_relaxed);
+}
+
+unsigned long long PeerAssetServer::failures() const
+{
+	return _failures.load(std::memory_order_relaxed);
+}
+
+}
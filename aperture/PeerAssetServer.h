@@ -0,0 +1,174 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+
+#include "IAsset.h"
+#include "IAssetServer.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Fetches assets from the cache of another aperture node over the peer protocol.
+ * Requests are pipelined over one connection and answered in order, a peer only
+ * answers from its caches and never goes to the backends for us.
+ *
+ * A request not answered within the timeout closes the connection, failing every
+ * request on it so the callers fall back to the backends. The peer counts as down
+ * until a reconnect succeeds, which is retried with a growing delay
+ */
+class PeerAssetServer : public boost::enable_shared_from_this<PeerAssetServer>, public IAssetServer
+{
+public:
+	typedef boost::shared_ptr<PeerAssetServer> ptr;
+
+	static const unsigned int PROTOCOL_MAGIC = 0x52455041; //"APER"
+
+	/// Sent for every asset wanted, all fields in network byte order
+	struct Request
+	{
+		unsigned int magic;
+		unsigned char uuid[UUID::BYTE_LEN];
+	};
+
+	/// Answers each request in order, followed by size bytes of asset data
+	struct Response
+	{
+		enum Status { FOUND = 0, NOT_FOUND = 1 };
+
+		unsigned int magic;
+		unsigned char status;
+		unsigned char type;
+		unsigned short reserved;
+		unsigned int size;
+	};
+
+	/// The largest asset a peer may send
+	static const unsigned int MAX_ASSET_SIZE = 64 * 1024 * 1024;
+
+	static const unsigned int MIN_RECONNECT_DELAY_MS = 500;
+	static const unsigned int MAX_RECONNECT_DELAY_MS = 30000;
+
+private:
+	enum ConnectionState
+	{
+		CSTATE_DISCONNECTED,
+		CSTATE_CONNECTING,
+		CSTATE_CONNECTED,
+		CSTATE_SHUTDOWN
+	};
+
+	struct PendingRequest
+	{
+		UUID uuid;
+		boost::function<void (IAsset::ptr)> callBack;
+		boost::posix_time::ptime deadline;
+	};
+
+	std::string _name;
+	std::string _host;
+	std::string _port;
+	boost::asio::ip::tcp::endpoint _endpoint;
+
+	boost::asio::io_service& _ioService;
+
+	/// Serializes all work on the socket, getAsset() may be called from any thread
+	boost::asio::io_service::strand _strand;
+
+	boost::asio::ip::tcp::socket _socket;
+	std::atomic<ConnectionState> _connectionState;
+
+	unsigned int _timeoutMs;
+
+	/// Requests sent or waiting to be sent, in the order they'll be answered
+	std::deque<PendingRequest> _pending;
+
+	/// Requests not written yet, and the ones being written
+	std::vector<Request> _sendQueue;
+	std::vector<Request> _sending;
+
+	Response _response;
+	std::vector<char> _responseData;
+
+	boost::asio::deadline_timer _timeoutTimer;
+	boost::asio::deadline_timer _reconnectTimer;
+	unsigned int _reconnectDelayMs;
+
+	/// Bumped whenever the connection fails, so handlers of the old one are ignored
+	unsigned int _generation;
+
+	std::atomic<unsigned long long> _hits;
+	std::atomic<unsigned long long> _misses;
+	std::atomic<unsigned long long> _failures;
+
+public:
+	/**
+	 * Creates a connection to the peer at host:port, failing requests that take
+	 * longer than timeoutMs
+	 */
+	PeerAssetServer(const std::string& hostPort, unsigned int timeoutMs, boost::asio::io_service& ioService);
+	virtual ~PeerAssetServer();
+
+	/**
+	 * Connects to the peer
+	 */
+	void connect();
+
+	virtual bool isConnected() const;
+
+	virtual void getAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack);
+
+	virtual void shutdown();
+
+	/// The host:port this peer was created with
+	const std::string& name() const;
+
+	/// Requests the peer answered with an asset and without one
+	unsigned long long hits() const;
+	unsigned long long misses() const;
+
+	/// Requests failed by timeouts and connection errors
+	unsigned long long failures() const;
+
+private:
+	void doConnect();
+
+	void onResolve(const boost::system::error_code& error, boost::asio::ip::tcp::resolver::iterator endpoints,
+		boost::shared_ptr<boost::asio::ip::tcp::resolver> resolver);
+
+	void onConnect(const boost::system::error_code& error);
+
+	void doGetAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack);
+
+	void sendNext();
+
+	void onWrite(const boost::system::error_code& error, unsigned int generation);
+
+	void readResponse();
+
+	void onReadResponse(const boost::system::error_code& error, unsigned int generation);
+
+	void onReadData(const boost::system::error_code& error, unsigned int generation);
+
+	void completeFront(IAsset::ptr asset);
+
+	void armTimeout();
+
+	void onTimeout(const boost::system::error_code& error, unsigned int generation);
+
+	/// Closes the connection, fails everything pending and schedules a reconnect
+	void fail(const std::string& reason);
+
+	void onReconnect(const boost::system::error_code& error);
+
+	void doShutdown();
+};
+
+}
@@ -0,0 +1,99 @@
+#include "stdafx.h"
+#include "PeerCluster.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/make_shared.hpp>
+
+#include "AppLog.h"
+
+namespace aperture {
+
+PeerCluster::PeerCluster(boost::asio::io_service& ioService, const std::vector<std::string>& nodes,
+	const std::string& self, unsigned int timeoutMs)
+	: _ioService(ioService), _ring(nodes), _self(0), _selfPort(0)
+{
+	std::vector<std::string>::const_iterator selfIt = std::find(nodes.begin(), nodes.end(), self);
+	std::string::size_type colon = self.rfind(':');
+	if (selfIt == nodes.end() || colon == std::string::npos) {
+		throw std::runtime_error("peer_self " + self + " is not one of the peers");
+	}
+
+	_self = static_cast<unsigned int>(selfIt - nodes.begin());
+	_selfPort = boost::lexical_cast<unsigned short>(self.substr(colon + 1));
+
+	for (unsigned int i = 0; i < nodes.size(); ++i) {
+		if (i == _self) {
+			_peers.push_back(PeerAssetServer::ptr());
+		} else {
+			_peers.push_back(boost::make_shared<PeerAssetServer>(nodes[i], timeoutMs, boost::ref(ioService)));
+		}
+	}
+}
+
+PeerCluster::~PeerCluster()
+{
+}
+
+void PeerCluster::start(PeerListener::lookup_function lookup)
+{
+	AppLog::instance().out()
+		<< "[PEER] Sharing the cache with " << _peers.size() - 1 << " other node(s)"
+		<< std::endl;
+
+	_listener = boost::make_shared<PeerListener>(boost::ref(_ioService), lookup);
+	_listener->listen(_selfPort);
+
+	for (PeerAssetServer::ptr peer : _peers) {
+		if (peer) peer->connect();
+	}
+}
+
+void PeerCluster::closeListener()
+{
+	if (_listener) _listener->close();
+}
+
+void PeerCluster::shutdown()
+{
+	this->closeListener();
+
+	for (PeerAssetServer::ptr peer : _peers) {
+		if (peer) peer->shutdown();
+	}
+}
+
+IAssetServer::ptr PeerCluster::ownerOf(const UUID& assetId) const
+{
+	const PeerAssetServer::ptr& owner = _peers[_ring.owner(assetId)];
+
+	if (owner && owner->isConnected()) {
+		return owner;
+	}
+
+	return IAssetServer::ptr();
+}
+
+std::vector<PeerAssetServer::ptr> PeerCluster::peers() const
+{
+	std::vector<PeerAssetServer::ptr> others;
+	for (PeerAssetServer::ptr peer : _peers) {
+		if (peer) others.push_back(peer);
+	}
+
+	return others;
+}
+
+std::vector<std::string> PeerCluster::parseNodes(const std::string& list)
+{
+	std::vector<std::string> nodes;
+	boost::split(nodes, list, boost::is_any_of(", "), boost::token_compress_on);
+
+	nodes.erase(std::remove(nodes.begin(), nodes.end(), std::string()), nodes.end());
+	return nodes;
+}
+
+}
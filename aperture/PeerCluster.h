@@ -0,0 +1,82 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "HashRing.h"
+#include "IAssetServer.h"
+#include "PeerAssetServer.h"
+#include "PeerListener.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * The aperture nodes sharing their caches. Every node is given the same list
+ * of peer protocol addresses, itself included, and assets are spread over them
+ * by consistent hashing so each one is cached by its owner only. A node asks
+ * the owner before going to the backends and answers the others from its own
+ * caches
+ */
+class PeerCluster
+{
+public:
+	typedef boost::shared_ptr<PeerCluster> ptr;
+
+private:
+	boost::asio::io_service& _ioService;
+
+	HashRing _ring;
+	unsigned int _self;
+	unsigned short _selfPort;
+
+	/// The connection to every node, empty for this one
+	std::vector<PeerAssetServer::ptr> _peers;
+
+	PeerListener::ptr _listener;
+
+public:
+	/**
+	 * Creates the cluster of the given nodes, self being the address of this
+	 * node in the list. Throws if self isn't in it
+	 */
+	PeerCluster(boost::asio::io_service& ioService, const std::vector<std::string>& nodes,
+		const std::string& self, unsigned int timeoutMs);
+	virtual ~PeerCluster();
+
+	/**
+	 * Answers the other nodes with the given lookup and connects to them
+	 */
+	void start(PeerListener::lookup_function lookup);
+
+	/**
+	 * Stops answering the other nodes, leaving the connections to them open
+	 */
+	void closeListener();
+
+	/**
+	 * Stops answering and disconnects from the other nodes
+	 */
+	void shutdown();
+
+	/**
+	 * Returns the node to ask for the given asset, or an empty pointer if this
+	 * node owns it or the owner is down
+	 */
+	IAssetServer::ptr ownerOf(const UUID& assetId) const;
+
+	/**
+	 * Returns the connections to the other nodes
+	 */
+	std::vector<PeerAssetServer::ptr> peers() const;
+
+	/**
+	 * Splits a comma separated list of addresses
+	 */
+	static std::vector<std::string> parseNodes(const std::string& list);
+};
+
+}
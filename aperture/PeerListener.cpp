@@ -0,0 +1,227 @@
+#include "stdafx.h"
+#include "PeerListener.h"
+
+#include <boost/bind.hpp>
+#include <boost/make_shared.hpp>
+
+#include "AppLog.h"
+
+using boost::asio::ip::tcp;
+
+namespace aperture {
+
+const unsigned int PeerListener::MAX_PIPELINE;
+
+/// One connection from a peer
+class PeerListener::Session : public boost::enable_shared_from_this<PeerListener::Session>
+{
+private:
+	struct Answer
+	{
+		bool ready;
+		IAsset::ptr asset;
+		PeerAssetServer::Response header;
+	};
+
+	tcp::socket _socket;
+	boost::asio::io_service::strand _strand;
+	lookup_function _lookup;
+
+	PeerAssetServer::Request _request;
+
+	/// Answers in request order, the first one has sequence number _firstSequence
+	std::deque<Answer> _answers;
+	size_t _firstSequence;
+
+	bool _reading;
+	bool _writing;
+	bool _closed;
+
+public:
+	Session(boost::asio::io_service& ioService, lookup_function lookup)
+		: _socket(ioService), _strand(ioService), _lookup(lookup), _firstSequence(0),
+		_reading(false), _writing(false), _closed(false)
+	{
+	}
+
+	tcp::socket& socket()
+	{
+		return _socket;
+	}
+
+	void start()
+	{
+		boost::system::error_code ignored;
+		_socket.set_option(tcp::no_delay(true), ignored);
+
+		_strand.dispatch(boost::bind(&Session::readRequest, shared_from_this()));
+	}
+
+private:
+	void readRequest()
+	{
+		_reading = true;
+		boost::asio::async_read(_socket, boost::asio::buffer(&_request, sizeof(_request)),
+			_strand.wrap(boost::bind(&Session::onRequest, shared_from_this(), boost::asio::placeholders::error)));
+	}
+
+	void onRequest(const boost::system::error_code& error)
+	{
+		_reading = false;
+
+		if (error || ntohl(_request.magic) != PeerAssetServer::PROTOCOL_MAGIC) {
+			this->close();
+			return;
+		}
+
+		Answer answer = { false, IAsset::ptr(), PeerAssetServer::Response() };
+		_answers.push_back(answer);
+
+		_lookup(UUID(_request.uuid), _strand.wrap(boost::bind(&Session::onLookup, shared_from_this(),
+			_firstSequence + _answers.size() - 1, _1)));
+
+		//a peer that doesn't read its answers stops being read from
+		if (_answers.size() < MAX_PIPELINE) {
+			this->readRequest();
+		}
+	}
+
+	void onLookup(size_t sequence, IAsset::ptr asset)
+	{
+		if (_closed) {
+			return;
+		}
+
+		Answer& answer = _answers[sequence - _firstSequence];
+		answer.ready = true;
+		answer.asset = asset;
+
+		this->writeNext();
+	}
+
+	void writeNext()
+	{
+		if (_writing || _closed || _answers.empty() || ! _answers.front().ready) {
+			return;
+		}
+
+		Answer& answer = _answers.front();
+		answer.header.magic = htonl(PeerAssetServer::PROTOCOL_MAGIC);
+		answer.header.reserved = 0;
+
+		std::vector<boost::asio::const_buffer> buffers;
+		buffers.push_back(boost::asio::buffer(&answer.header, sizeof(answer.header)));
+
+		boost::asio::const_buffer data;
+		if (answer.asset) {
+			try {
+				data = answer.asset->getAssetData();
+			} catch (const std::exception&) {
+				answer.asset.reset();
+			}
+		}
+
+		if (answer.asset && boost::asio::buffer_size(data) <= PeerAssetServer::MAX_ASSET_SIZE) {
+			answer.header.status = PeerAssetServer::Response::FOUND;
+			answer.header.type = answer.asset->getType();
+			answer.header.size = htonl(static_cast<unsigned int>(boost::asio::buffer_size(data)));
+			buffers.push_back(data);
+		} else {
+			answer.header.status = PeerAssetServer::Response::NOT_FOUND;
+			answer.header.type = 0;
+			answer.header.size = 0;
+		}
+
+		_writing = true;
+		boost::asio::async_write(_socket, buffers,
+			_strand.wrap(boost::bind(&Session::onWrite, shared_from_this(), boost::asio::placeholders::error)));
+	}
+
+	void onWrite(const boost::system::error_code& error)
+	{
+		_writing = false;
+
+		if (error) {
+			this->close();
+			return;
+		}
+
+		_answers.pop_front();
+		++_firstSequence;
+
+		if (! _reading && ! _closed && _answers.size() < MAX_PIPELINE) {
+			this->readRequest();
+		}
+
+		this->writeNext();
+	}
+
+	void close()
+	{
+		_closed = true;
+
+		boost::system::error_code ignored;
+		_socket.close(ignored);
+	}
+};
+
+PeerListener::PeerListener(boost::asio::io_service& ioService, lookup_function lookup)
+	: _ioService(ioService), _acceptor(ioService), _lookup(lookup)
+{
+}
+
+PeerListener::~PeerListener()
+{
+}
+
+bool PeerListener::listen(unsigned short port)
+{
+	boost::system::error_code ec;
+	tcp::endpoint endpoint(tcp::v4(), port);
+
+	_acceptor.open(endpoint.protocol(), ec);
+	if (! ec) _acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+	if (! ec) _acceptor.bind(endpoint, ec);
+	if (! ec) _acceptor.listen(boost::asio::socket_base::max_connections, ec);
+
+	if (ec) {
+		AppLog::instance().out()
+			<< "[PEER] Unable to listen for peers on TCP/" << port << ": " << ec.message()
+			<< std::endl;
+		_acceptor.close(ec);
+		return false;
+	}
+
+	AppLog::instance().out() << "[PEER] Listening for peers on TCP/" << port << std::endl;
+
+	this->acceptNext();
+	return true;
+}
+
+void PeerListener::close()
+{
+	boost::system::error_code ignored;
+	_acceptor.close(ignored);
+}
+
+void PeerListener::acceptNext()
+{
+	boost::shared_ptr<Session> session(boost::make_shared<Session>(boost::ref(_ioService), _lookup));
+	_acceptor.async_accept(session->socket(), boost::bind(&PeerListener::onAccept, shared_from_this(),
+		boost::asio::placeholders::error, session));
+}
+
+void PeerListener::onAccept(const boost::system::error_code& error, boost::shared_ptr<Session> session)
+{
+	if (error == boost::asio::error::operation_aborted) {
+		return;
+	}
+
+	if (! error) {
+		session->start();
+	}
+
+	this->acceptNext();
+}
+
+}
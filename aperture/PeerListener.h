@@ -0,0 +1,60 @@
+#pragma once
+
+#include <deque>
+
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+
+#include "IAsset.h"
+#include "PeerAssetServer.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Answers PeerAssetServer requests from other aperture nodes out of this node's
+ * caches. Lookups may complete out of order, each connection holds the answers
+ * back until the ones before them are written
+ */
+class PeerListener : public boost::enable_shared_from_this<PeerListener>
+{
+public:
+	typedef boost::shared_ptr<PeerListener> ptr;
+
+	/// Looks an asset up in the local caches only and calls back with it, or
+	/// with an empty pointer. The callback may be called from any thread
+	typedef boost::function<void (const UUID&, boost::function<void (IAsset::ptr)>)> lookup_function;
+
+	/// Requests read ahead on a connection before its answers are written
+	static const unsigned int MAX_PIPELINE = 64;
+
+private:
+	class Session;
+
+	boost::asio::io_service& _ioService;
+	boost::asio::ip::tcp::acceptor _acceptor;
+	lookup_function _lookup;
+
+public:
+	PeerListener(boost::asio::io_service& ioService, lookup_function lookup);
+	virtual ~PeerListener();
+
+	/**
+	 * Starts accepting peers on the given port. Returns false if the port can't
+	 * be bound
+	 */
+	bool listen(unsigned short port);
+
+	/**
+	 * Stops accepting peers. Open connections end when their peers close them
+	 */
+	void close();
+
+private:
+	void acceptNext();
+
+	void onAccept(const boost::system::error_code& error, boost::shared_ptr<Session> session);
+};
+
+}
@@ -0,0 +1,47 @@
+#include "stdafx.h"
+#include "RenderedAsset.h"
+
+namespace aperture {
+
+RenderedAsset::RenderedAsset(IAsset::ptr asset, const std::string& fullResponseHeader,
+	const std::string& partialResponsePrefix)
+	: _asset(asset), _fullResponseHeader(fullResponseHeader), _partialResponsePrefix(partialResponsePrefix)
+{
+
+}
+
+RenderedAsset::~RenderedAsset()
+{
+}
+
+UUID RenderedAsset::getUUID() const
+{
+	return _asset->getUUID();
+}
+
+size_t RenderedAsset::getBinaryDataSize() const
+{
+	return _asset->getBinaryDataSize();
+}
+
+aperture::byte RenderedAsset::getType() const
+{
+	return _asset->getType();
+}
+
+boost::asio::const_buffer RenderedAsset::getAssetData() const
+{
+	return _asset->getAssetData();
+}
+
+const std::string& RenderedAsset::getFullResponseHeader() const
+{
+	return _fullResponseHeader;
+}
+
+const std::string& RenderedAsset::getPartialResponsePrefix() const
+{
+	return _partialResponsePrefix;
+}
+
+}
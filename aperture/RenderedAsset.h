@@ -0,0 +1,52 @@
+#pragma once
+
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+#include "IAsset.h"
+
+namespace aperture {
+
+/**
+ * A cached asset along with the serialized response headers used to send it.
+ * Cache hits for the whole asset can be written out with no per request formatting
+ */
+class RenderedAsset : public IAsset
+{
+public:
+	typedef boost::shared_ptr<RenderedAsset> ptr;
+
+private:
+	IAsset::ptr _asset;
+	std::string _fullResponseHeader;
+	std::string _partialResponsePrefix;
+
+public:
+	/**
+	 * Wraps the asset. fullResponseHeader is the status line and headers of a 200
+	 * response for the whole asset, partialResponsePrefix is the status line and the
+	 * headers a 206 response has in common for any range. Neither includes the
+	 * blank line that ends the headers
+	 */
+	RenderedAsset(IAsset::ptr asset, const std::string& fullResponseHeader,
+		const std::string& partialResponsePrefix);
+	virtual ~RenderedAsset();
+
+	virtual UUID getUUID() const;
+	virtual size_t getBinaryDataSize() const;
+	virtual aperture::byte getType() const;
+	virtual boost::asio::const_buffer getAssetData() const;
+
+	/**
+	 * Returns the status line and headers of a 200 response for this asset
+	 */
+	const std::string& getFullResponseHeader() const;
+
+	/**
+	 * Returns the status line and the fixed headers of a 206 response for this asset
+	 */
+	const std::string& getPartialResponsePrefix() const;
+};
+
+}
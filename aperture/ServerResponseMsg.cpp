@@ -81,9 +81,12 @@ unsigned int ServerResponseMsg::getDataSize() const
 	return dataLen;
 }
 
-std::string ServerResponseMsg::getAssetUUID() const
+aperture::UUID ServerResponseMsg::getAssetUUID() const
 {
-	return std::string((const char*)&_header[UUID_LOC], 32);
+	aperture::UUID uuid;
+	aperture::UUID::parse(boost::string_view((const char*)&_header[UUID_LOC], aperture::UUID::HEX_LEN), uuid);
+
+	return uuid;
 }
 
 }
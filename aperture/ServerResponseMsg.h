@@ -1,6 +1,7 @@
 #pragma once
 
 #include "byte.h"
+#include "UUID.h"
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
 
@@ -95,7 +96,7 @@ public:
 	/**
 	 * Returns the asset UUID that this response is for
 	 */
-	std::string getAssetUUID() const;
+	aperture::UUID getAssetUUID() const;
 };
 
 class ServerResponseMsgCreator
@@ -32,18 +32,52 @@ namespace aperture
 		po::options_description desc("Allowed options");
 		desc.add_options()
 			("http_listen_port", po::value<unsigned short>()->default_value(Settings::DEFAULT_HTTP_PORT), "TCP port to listen for HTTP client connections")
+			("http_threads", po::value<unsigned int>()->default_value(1), "Number of I/O threads servicing HTTP connections")
+			("http_shards", po::value<unsigned int>()->default_value(0), "Number of independent SO_REUSEPORT listeners, each with its own thread and slice of the cache. 0 disables sharding")
+			("http_pipeline_depth", po::value<unsigned int>()->default_value(8), "Maximum number of pipelined requests on a connection that are processed at the same time")
 			("enable_whip", po::value<bool>()->default_value(true), "Whether to enable WHIP server connections")
-			("whip_url", po::value<std::string>(), "Whip host URL to connect to")
+			("whip_url", po::value<std::string>(), "Whip host URL to connect to. A comma separated list spreads the assets over several WHIP servers by consistent hashing")
+			("whip_connections", po::value<unsigned int>()->default_value(4), "Number of connections to the WHIP server. Each receives its assets one after another, so more connections keep small assets from waiting behind large ones")
+			("whip_batch_requests", po::value<unsigned int>()->default_value(256), "Most asset requests written to a WHIP connection at once")
+			("whip_batch_linger_us", po::value<unsigned int>()->default_value(250), "Microseconds a request may wait for others to share its write while the WHIP server is still busy with earlier ones. 0 sends every request right away")
+			("whip_stream_min_size", po::value<unsigned int>()->default_value(262144), "Assets of at least this many bytes are sent on to the waiting clients while they are still coming in from WHIP. 0 waits for every asset to arrive in full")
+			("whip_probe_interval", po::value<unsigned int>()->default_value(5000), "Milliseconds between the test requests timing each WHIP connection")
+			("whip_probe_timeout", po::value<unsigned int>()->default_value(10000), "Milliseconds a WHIP connection may take to answer a test request before it is reconnected. 0 waits forever")
+			("whip_breaker_failures", po::value<unsigned int>()->default_value(3), "Connection failures in a row after which no requests are sent to a WHIP server for whip_breaker_cooldown. 0 disables the breaker")
+			("whip_breaker_cooldown", po::value<unsigned int>()->default_value(30), "Seconds requests stay off a WHIP server after repeated failures")
 			("debug", po::value<bool>()->default_value(false), "Is debugging enabled")
 			("caps_token", po::value<std::string>(), "Token to allow caps addition")
-			("cache_size", po::value<unsigned int>()->default_value(0), "Maximum size of the asset cache in bytes")
+			("cache_size", po::value<unsigned long long>()->default_value(0), "Maximum size of the asset cache in bytes")
+			("cache_policy", po::value<std::string>()->default_value("clock"), "Asset cache eviction policy. clock approximates LRU with lock free hits, tinylfu only admits assets more popular than the ones they would evict, shared keeps the cache in shared memory used by every aperture process on the host")
+			("cache_shm_name", po::value<std::string>()->default_value("/aperture-cache"), "Name of the shared memory region used by the shared cache policy. Processes using the same name share their cache")
+			("cache_shards", po::value<unsigned int>()->default_value(16), "Number of independently locked parts of the asset cache, rounded up to a power of two. Ignored when http_shards is used")
+			("cache_prerender_responses", po::value<bool>()->default_value(true), "Whether cached assets keep their rendered response headers for the cache hit fast path")
+			("cache_snapshot_path", po::value<std::string>()->default_value(""), "File holding the ids of the hottest cached assets, used to warm the asset cache on start. Empty disables snapshots")
+			("cache_snapshot_interval", po::value<unsigned int>()->default_value(600), "Seconds between cache snapshots. 0 only saves a snapshot on shutdown")
+			("cache_snapshot_max_assets", po::value<unsigned int>()->default_value(100000), "Maximum number of assets in a cache snapshot")
+			("cache_snapshot_data", po::value<bool>()->default_value(false), "Whether cache snapshots also hold the asset data, so they can be restored without the backends")
+			("cache_snapshot_restore_concurrency", po::value<unsigned int>()->default_value(16), "Maximum number of backend requests in flight while restoring a cache snapshot")
+			("peers", po::value<std::string>()->default_value(""), "Comma separated host:port peer protocol addresses of every aperture node sharing its cache, this one included. Every node must be given the same list. Empty disables the peer cache")
+			("peer_self", po::value<std::string>()->default_value(""), "The entry in peers that is this node. Its port is where other nodes connect")
+			("peer_timeout", po::value<unsigned int>()->default_value(250), "Milliseconds to wait for a peer to answer before falling back to the backends")
+			("hot_restart_socket", po::value<std::string>()->default_value(""), "Unix socket a newly started process uses to take over the listening sockets and the asset cache of the running one. http_shards has to stay the same. Empty disables hot restarts")
+			("hot_restart_shm_dir", po::value<std::string>()->default_value("/dev/shm"), "Shared memory directory the asset cache is passed through on a hot restart")
+			("hot_restart_drain_timeout", po::value<unsigned int>()->default_value(300), "Seconds a process that handed over waits for its connections to finish before closing them")
+			("disk_cache_path", po::value<std::string>()->default_value(""), "Directory of the disk cache below the asset cache. Empty disables the disk cache")
+			("disk_cache_size", po::value<unsigned long long>()->default_value(0), "Maximum size of the disk cache in bytes")
+			("disk_cache_segment_size", po::value<unsigned long long>()->default_value(256 * 1024 * 1024), "Size of each disk cache segment file in bytes. The oldest segment is collected when the disk cache is full")
 			("enable_cloudfiles", po::value<bool>()->default_value(false), "Whether to enable cloud files connections")
 			("cf_username", po::value<std::string>(), "CloudFiles user name")
 			("cf_api_key", po::value<std::string>(), "CloudFiles API key")
 			("cf_container_prefix", po::value<std::string>(), "The prefix of the containers we would like to read from CF")
 			("cf_region_name", po::value<std::string>(), "The cloudfiles datacenter/region to use")
 			("cf_use_internal_url", po::value<bool>()->default_value(false), "Whether or not to use the servicenet URL for CF")
-			("cf_worker_threads", po::value<unsigned int>()->default_value(16), "Default number of worker threads to make requests on CF")
+			("cf_worker_threads", po::value<unsigned int>()->default_value(16), "No longer used, CF requests all run on the I/O threads. Kept so older configuration files still load")
+			("cf_max_connections", po::value<unsigned int>()->default_value(32), "Most connections kept open to CF. Transfers beyond that wait for a connection, or share one when CF speaks HTTP/2")
+			("backend_deadline", po::value<unsigned int>()->default_value(30000), "Milliseconds a request may wait on WHIP and CF together before it fails. 0 waits forever")
+			("backend_hedge_percentile", po::value<unsigned int>()->default_value(95), "Also ask CF for an asset once WHIP takes longer than this percentile of its recent answers, serving whichever answers first. 0 only asks CF after WHIP failed")
+			("backend_hedge_min_delay", po::value<unsigned int>()->default_value(20), "The shortest wait in milliseconds before asking CF as well")
+			("backend_selector_buckets", po::value<unsigned int>()->default_value(1), "Groups of asset ids, by their first byte, for which WHIP or CF is asked first depending on which gives the asset sooner on average. Up to 256, 0 always asks WHIP first")
 		;
 
 		
@@ -98,9 +132,20 @@ namespace aperture
 		return *_vm;
 	}
 
-	whip::WhipURI Settings::getWhipURL() const
+	std::vector<whip::WhipURI> Settings::getWhipURLs() const
 	{
-		whip::WhipURI uri((*_vm)["whip_url"].as<std::string>());
-		return uri;
+		std::vector<std::string> urls;
+		boost::split(urls, (*_vm)["whip_url"].as<std::string>(), boost::is_any_of(", "), boost::token_compress_on);
+
+		std::vector<whip::WhipURI> uris;
+		for (const std::string& url : urls) {
+			if (! url.empty()) uris.push_back(whip::WhipURI(url));
+		}
+
+		if (uris.empty()) {
+			throw std::runtime_error("whip_url does not hold any WHIP server");
+		}
+
+		return uris;
 	}
 }
@@ -3,6 +3,7 @@
 #include <boost/program_options.hpp>
 #include <boost/shared_ptr.hpp>
 #include <string>
+#include <vector>
 
 #include "WhipURI.h"
 
@@ -51,9 +52,9 @@ namespace aperture
 		void reload();
 
 		/**
-		 * Returns the parsed whip url stored in the whip_url setting
+		 * Returns the parsed whip urls stored in the whip_url setting
 		 */
-		whip::WhipURI getWhipURL() const;
+		std::vector<whip::WhipURI> getWhipURLs() const;
 	};
 
 }
\ No newline at end of file
@@ -0,0 +1,312 @@
+#include "stdafx.h"
+#include "ShardedAssetCache.h"
+
+#include <algorithm>
+#include <mutex>
+
+namespace aperture {
+
+const unsigned int ShardedAssetCache::EMPTY_SLOT;
+const unsigned int ShardedAssetCache::MIN_INDEX_SIZE;
+
+ShardedAssetCache::Entry::Entry(const UUID& key, const IAsset::ptr& asset)
+	: key(key), asset(asset), referenced(true)
+{
+}
+
+ShardedAssetCache::Entry::Entry(Entry&& other) noexcept
+	: key(other.key), asset(std::move(other.asset)), referenced(other.referenced.load(std::memory_order_relaxed))
+{
+}
+
+ShardedAssetCache::Entry& ShardedAssetCache::Entry::operator=(Entry&& other) noexcept
+{
+	key = other.key;
+	asset = std::move(other.asset);
+	referenced.store(other.referenced.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+	return *this;
+}
+
+ShardedAssetCache::ShardedAssetCache(unsigned long long maxSize, unsigned int numShards)
+	: _numShards(1), _maxSize(maxSize)
+{
+	while (_numShards < numShards) {
+		_numShards <<= 1;
+	}
+
+	_shards.reset(new Shard[_numShards]);
+
+	for (unsigned int i = 0; i < _numShards; ++i) {
+		Shard& shard = _shards[i];
+		shard.index.assign(MIN_INDEX_SIZE, EMPTY_SLOT);
+		shard.indexBits = 6;
+		shard.hand = 0;
+		shard.maxSize = maxSize / _numShards;
+		shard.hits = 0;
+		shard.misses = 0;
+	}
+}
+
+ShardedAssetCache::~ShardedAssetCache()
+{
+}
+
+IAsset::ptr ShardedAssetCache::fetch(const UUID& key)
+{
+	size_t hash = key.hash();
+	Shard& shard = this->shardFor(hash);
+
+	std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+	unsigned int pos = shard.index[findSlot(shard, key, hash)];
+	if (pos == EMPTY_SLOT) {
+		shard.misses.fetch_add(1, std::memory_order_relaxed);
+		return IAsset::ptr();
+	}
+
+	shard.hits.fetch_add(1, std::memory_order_relaxed);
+
+	Entry& entry = shard.entries[pos];
+
+	//only write when the bit changes so hot entries don't bounce their cache line
+	//between readers
+	if (! entry.referenced.load(std::memory_order_relaxed)) {
+		entry.referenced.store(true, std::memory_order_relaxed);
+	}
+
+	return entry.asset;
+}
+
+void ShardedAssetCache::insert(const UUID& key, const IAsset::ptr& asset)
+{
+	size_t hash = key.hash();
+	Shard& shard = this->shardFor(hash);
+
+	std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+	size_t slot = findSlot(shard, key, hash);
+	if (shard.index[slot] != EMPTY_SLOT) {
+		Entry& entry = shard.entries[shard.index[slot]];
+		shard.calculator.on_remove(entry.asset);
+		entry.asset = asset;
+		entry.referenced.store(true, std::memory_order_relaxed);
+		shard.calculator.on_add(asset);
+
+	} else {
+		if ((shard.entries.size() + 1) * 2 > shard.index.size()) {
+			growIndex(shard);
+			slot = findSlot(shard, key, hash);
+		}
+
+		shard.entries.emplace_back(key, asset);
+		shard.index[slot] = static_cast<unsigned int>(shard.entries.size() - 1);
+		shard.calculator.on_add(asset);
+	}
+
+	evict(shard);
+}
+
+void ShardedAssetCache::remove(const UUID& key)
+{
+	size_t hash = key.hash();
+	Shard& shard = this->shardFor(hash);
+
+	std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+	unsigned int pos = shard.index[findSlot(shard, key, hash)];
+	if (pos != EMPTY_SLOT) {
+		removeEntry(shard, pos);
+	}
+}
+
+void ShardedAssetCache::clear()
+{
+	for (unsigned int i = 0; i < _numShards; ++i) {
+		Shard& shard = _shards[i];
+		std::unique_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+		shard.entries.clear();
+		std::fill(shard.index.begin(), shard.index.end(), EMPTY_SLOT);
+		shard.hand = 0;
+		shard.calculator.on_clear();
+	}
+}
+
+size_t ShardedAssetCache::size() const
+{
+	size_t total = 0;
+	for (unsigned int i = 0; i < _numShards; ++i) {
+		std::shared_lock<std::shared_timed_mutex> lock(_shards[i].mutex);
+		total += _shards[i].entries.size();
+	}
+
+	return total;
+}
+
+unsigned long long ShardedAssetCache::byteSize() const
+{
+	unsigned long long total = 0;
+	for (unsigned int i = 0; i < _numShards; ++i) {
+		std::shared_lock<std::shared_timed_mutex> lock(_shards[i].mutex);
+		total += _shards[i].calculator.get_size();
+	}
+
+	return total;
+}
+
+unsigned long long ShardedAssetCache::maxSize() const
+{
+	return _maxSize;
+}
+
+unsigned long long ShardedAssetCache::hits() const
+{
+	unsigned long long total = 0;
+	for (unsigned int i = 0; i < _numShards; ++i) {
+		total += _shards[i].hits.load(std::memory_order_relaxed);
+	}
+
+	return total;
+}
+
+unsigned long long ShardedAssetCache::misses() const
+{
+	unsigned long long total = 0;
+	for (unsigned int i = 0; i < _numShards; ++i) {
+		total += _shards[i].misses.load(std::memory_order_relaxed);
+	}
+
+	return total;
+}
+
+const char* ShardedAssetCache::policyName() const
+{
+	return "clock";
+}
+
+std::vector<IAsset::ptr> ShardedAssetCache::hottest(size_t maxAssets) const
+{
+	std::vector<std::vector<IAsset::ptr> > referenced(_numShards);
+	std::vector<std::vector<IAsset::ptr> > unreferenced(_numShards);
+
+	for (unsigned int i = 0; i < _numShards; ++i) {
+		const Shard& shard = _shards[i];
+		std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+
+		for (auto entry = shard.entries.rbegin(); entry != shard.entries.rend(); ++entry) {
+			std::vector<IAsset::ptr>& list =
+				entry->referenced.load(std::memory_order_relaxed) ? referenced[i] : unreferenced[i];
+
+			if (list.size() < maxAssets) {
+				list.push_back(entry->asset);
+			}
+		}
+	}
+
+	std::vector<IAsset::ptr> assets(interleave(referenced, maxAssets));
+	if (assets.size() < maxAssets) {
+		std::vector<IAsset::ptr> rest(interleave(unreferenced, maxAssets - assets.size()));
+		assets.insert(assets.end(), rest.begin(), rest.end());
+	}
+
+	return assets;
+}
+
+ShardedAssetCache::Shard& ShardedAssetCache::shardFor(size_t hash)
+{
+	//the low bits pick the HTTP shard that owns an asset, so use others here
+	return _shards[(hash >> 8) & (_numShards - 1)];
+}
+
+size_t ShardedAssetCache::slotFor(const Shard& shard, size_t hash)
+{
+	//fibonacci hashing takes the slot from the high bits of the product, which
+	//depend on every bit of the hash
+	return static_cast<size_t>((static_cast<unsigned long long>(hash) * 0x9E3779B97F4A7C15ULL) >> (64 - shard.indexBits));
+}
+
+size_t ShardedAssetCache::findSlot(const Shard& shard, const UUID& key, size_t hash)
+{
+	size_t mask = shard.index.size() - 1;
+	size_t slot = slotFor(shard, hash);
+
+	for (;;) {
+		unsigned int pos = shard.index[slot];
+		if (pos == EMPTY_SLOT || shard.entries[pos].key == key) {
+			return slot;
+		}
+
+		slot = (slot + 1) & mask;
+	}
+}
+
+void ShardedAssetCache::growIndex(Shard& shard)
+{
+	shard.indexBits++;
+	shard.index.assign(size_t(1) << shard.indexBits, EMPTY_SLOT);
+
+	size_t mask = shard.index.size() - 1;
+	for (size_t i = 0; i < shard.entries.size(); ++i) {
+		size_t slot = slotFor(shard, shard.entries[i].key.hash());
+		while (shard.index[slot] != EMPTY_SLOT) {
+			slot = (slot + 1) & mask;
+		}
+
+		shard.index[slot] = static_cast<unsigned int>(i);
+	}
+}
+
+void ShardedAssetCache::removeEntry(Shard& shard, size_t entryPos)
+{
+	size_t mask = shard.index.size() - 1;
+	size_t hole = findSlot(shard, shard.entries[entryPos].key, shard.entries[entryPos].key.hash());
+
+	//shift back the entries after the hole that would no longer be found past it
+	size_t next = hole;
+	for (;;) {
+		next = (next + 1) & mask;
+		if (shard.index[next] == EMPTY_SLOT) {
+			break;
+		}
+
+		size_t home = slotFor(shard, shard.entries[shard.index[next]].key.hash());
+		bool homeBetween = hole <= next ? (hole < home && home <= next) : (hole < home || home <= next);
+		if (! homeBetween) {
+			shard.index[hole] = shard.index[next];
+			hole = next;
+		}
+	}
+	shard.index[hole] = EMPTY_SLOT;
+
+	shard.calculator.on_remove(shard.entries[entryPos].asset);
+
+	//fill the gap with the last entry so the entries stay packed for the clock
+	size_t last = shard.entries.size() - 1;
+	if (entryPos != last) {
+		const UUID& movedKey = shard.entries[last].key;
+		shard.index[findSlot(shard, movedKey, movedKey.hash())] = static_cast<unsigned int>(entryPos);
+		shard.entries[entryPos] = std::move(shard.entries[last]);
+	}
+	shard.entries.pop_back();
+}
+
+void ShardedAssetCache::evict(Shard& shard)
+{
+	while (shard.calculator.get_size() > shard.maxSize && ! shard.entries.empty()) {
+		if (shard.hand >= shard.entries.size()) {
+			shard.hand = 0;
+		}
+
+		Entry& entry = shard.entries[shard.hand];
+		if (entry.referenced.load(std::memory_order_relaxed)) {
+			entry.referenced.store(false, std::memory_order_relaxed);
+			++shard.hand;
+		} else {
+			//the last entry moves into this position, so the hand stays put
+			removeEntry(shard, shard.hand);
+		}
+	}
+}
+
+}
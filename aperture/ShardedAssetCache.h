@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#include "AssetSizeCalculator.h"
+#include "IAssetCache.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Asset cache that can be hit from many threads at once. Assets are spread over
+ * independently locked shards by id, each shard finds its entries through an
+ * open addressing index and approximates LRU with the CLOCK algorithm: a hit only
+ * sets the entry's reference bit under a shared lock, the exclusive lock is only
+ * taken to insert and evict. Sizes are accounted with AssetSizeCalculator
+ */
+class ShardedAssetCache : public IAssetCache
+{
+public:
+	typedef boost::shared_ptr<ShardedAssetCache> ptr;
+
+private:
+	static const unsigned int EMPTY_SLOT = 0xFFFFFFFF;
+	static const unsigned int MIN_INDEX_SIZE = 64;
+
+	struct Entry
+	{
+		UUID key;
+		IAsset::ptr asset;
+		std::atomic<bool> referenced;
+
+		Entry(const UUID& key, const IAsset::ptr& asset);
+		Entry(Entry&& other) noexcept;
+		Entry& operator=(Entry&& other) noexcept;
+	};
+
+	struct Shard
+	{
+		mutable std::shared_timed_mutex mutex;
+
+		/// Entries in no particular order, the clock hand sweeps over them
+		std::vector<Entry> entries;
+
+		/// Linear probing table of positions in entries
+		std::vector<unsigned int> index;
+		unsigned int indexBits;
+
+		size_t hand;
+		unsigned long long maxSize;
+		AssetSizeCalculator calculator;
+
+		std::atomic<unsigned long long> hits;
+		std::atomic<unsigned long long> misses;
+	};
+
+	std::unique_ptr<Shard[]> _shards;
+	unsigned int _numShards;
+	unsigned long long _maxSize;
+
+public:
+	/**
+	 * Creates a cache holding at most maxSize bytes as counted by AssetSizeCalculator.
+	 * The budget is split evenly between the shards, numShards is rounded up to a
+	 * power of two
+	 */
+	ShardedAssetCache(unsigned long long maxSize, unsigned int numShards);
+	virtual ~ShardedAssetCache();
+
+	virtual IAsset::ptr fetch(const UUID& key);
+	virtual void insert(const UUID& key, const IAsset::ptr& asset);
+	virtual void remove(const UUID& key);
+	virtual void clear();
+	virtual size_t size() const;
+	virtual unsigned long long byteSize() const;
+	virtual unsigned long long maxSize() const;
+	virtual unsigned long long hits() const;
+	virtual unsigned long long misses() const;
+	virtual const char* policyName() const;
+
+	/**
+	 * CLOCK keeps no order, so referenced assets come first and the rest follow,
+	 * the most recently inserted first in both groups
+	 */
+	virtual std::vector<IAsset::ptr> hottest(size_t maxAssets) const;
+
+	unsigned int numShards() const { return _numShards; }
+
+private:
+	Shard& shardFor(size_t hash);
+
+	/// Returns the index slot holding key, or the empty slot where it would go
+	static size_t findSlot(const Shard& shard, const UUID& key, size_t hash);
+
+	static size_t slotFor(const Shard& shard, size_t hash);
+
+	static void growIndex(Shard& shard);
+
+	/// Removes the entry at the given position in entries. Caller holds the lock
+	static void removeEntry(Shard& shard, size_t entryPos);
+
+	/// Sweeps the clock hand until the shard is within budget. Caller holds the lock
+	static void evict(Shard& shard);
+};
+
+}
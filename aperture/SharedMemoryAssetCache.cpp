@@ -0,0 +1,646 @@
+#include "stdafx.h"
+#include "SharedMemoryAssetCache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <new>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/weak_ptr.hpp>
+
+#include "AppLog.h"
+
+namespace aperture {
+
+const unsigned int SharedMemoryAssetCache::PAGE_SIZE;
+const unsigned int SharedMemoryAssetCache::MIN_SLOT_SIZE;
+const unsigned int SharedMemoryAssetCache::NUM_CLASSES;
+const unsigned int SharedMemoryAssetCache::PROBE_LENGTH;
+const unsigned int SharedMemoryAssetCache::MAX_SWEEP;
+
+namespace {
+	const unsigned int REGION_MAGIC = 0x4D485341; //"ASHM"
+	const unsigned int REGION_VERSION = 1;
+
+	const unsigned int NO_PAGE = 0xFFFFFFFF;
+	const unsigned int NO_CLASS = 0xFFFFFFFF;
+
+	/// Slots of the smallest class in a page, slot ids count in these
+	const unsigned int SLOTS_PER_PAGE = SharedMemoryAssetCache::PAGE_SIZE / SharedMemoryAssetCache::MIN_SLOT_SIZE;
+
+	/// How long to wait for another process to lay out a new region
+	const unsigned int ATTACH_TIMEOUT_MS = 5000;
+
+	static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+		"the shared memory cache needs lock free atomics to work across processes");
+
+	/// An asset copied out of the region
+	class SharedMemoryAsset : public IAsset
+	{
+	public:
+		SharedMemoryAsset(const UUID& uuid, aperture::byte type, const char* data, size_t size)
+			: _uuid(uuid), _type(type), _data(data, data + size)
+		{
+		}
+
+		virtual UUID getUUID() const { return _uuid; }
+		virtual size_t getBinaryDataSize() const { return _data.size(); }
+		virtual aperture::byte getType() const { return _type; }
+		virtual boost::asio::const_buffer getAssetData() const
+		{
+			return boost::asio::const_buffer(_data.empty() ? 0 : &_data[0], _data.size());
+		}
+
+	private:
+		UUID _uuid;
+		aperture::byte _type;
+		std::vector<char> _data;
+	};
+
+	unsigned int tag_of(unsigned long long hash)
+	{
+		//never 0 so an empty bucket can't match
+		return static_cast<unsigned int>(hash >> 32) | 1;
+	}
+}
+
+/// Starts every slot, followed by the asset data
+struct SharedMemoryAssetCache::SlotHeader
+{
+	/// Odd while the slot is written, 0 if it was never used
+	std::atomic<unsigned int> sequence;
+	std::atomic<unsigned int> referenced;
+
+	unsigned char key[UUID::BYTE_LEN];
+	unsigned int size;
+	unsigned char type;
+	unsigned char live;
+	unsigned char reserved[2];
+};
+
+struct SharedMemoryAssetCache::RegionHeader
+{
+	struct SizeClass
+	{
+		/// Slots handed out for the first time, past the end of the pages once full
+		std::atomic<unsigned long long> issued;
+
+		/// The CLOCK hand over the slots of the class
+		std::atomic<unsigned long long> hand;
+
+		/// Set once the class wanted another page and there was none
+		std::atomic<unsigned int> full;
+	};
+
+	std::atomic<unsigned int> magic;
+	unsigned int version;
+	unsigned long long regionSize;
+	unsigned int numPages;
+	unsigned int numBuckets;
+
+	std::atomic<unsigned int> nextFreePage;
+	std::atomic<unsigned long long> entries;
+
+	SizeClass classes[NUM_CLASSES];
+};
+
+SharedMemoryAssetCache::SharedMemoryAssetCache(const std::string& name)
+	: _name(name), _region(0), _regionSize(0), _header(0), _pageClasses(0), _classPages(0),
+	_buckets(0), _pages(0), _hits(0), _misses(0)
+{
+}
+
+SharedMemoryAssetCache::ptr SharedMemoryAssetCache::open(const std::string& name, unsigned long long maxSize)
+{
+	static boost::mutex openMutex;
+	static std::map<std::string, boost::weak_ptr<SharedMemoryAssetCache> > openCaches;
+
+	boost::mutex::scoped_lock lock(openMutex);
+
+	ptr cache = openCaches[name].lock();
+	if (! cache) {
+		cache.reset(new SharedMemoryAssetCache(name));
+		if (! cache->attach(maxSize)) {
+			return ptr();
+		}
+
+		openCaches[name] = cache;
+	}
+
+	return cache;
+}
+
+unsigned int SharedMemoryAssetCache::classFor(size_t bytes)
+{
+	unsigned int sizeClass = 0;
+	while (sizeClass < NUM_CLASSES && slotSize(sizeClass) < bytes) {
+		++sizeClass;
+	}
+
+	return sizeClass;
+}
+
+size_t SharedMemoryAssetCache::slotSize(unsigned int sizeClass)
+{
+	return static_cast<size_t>(MIN_SLOT_SIZE) << sizeClass;
+}
+
+SharedMemoryAssetCache::SlotHeader* SharedMemoryAssetCache::slotAt(unsigned int page, unsigned int index) const
+{
+	unsigned int sizeClass = _pageClasses[page].load(std::memory_order_acquire);
+	return reinterpret_cast<SlotHeader*>(_pages + static_cast<size_t>(page) * PAGE_SIZE + index * slotSize(sizeClass));
+}
+
+SharedMemoryAssetCache::SlotHeader* SharedMemoryAssetCache::slotById(unsigned int slotId) const
+{
+	unsigned int page = slotId / SLOTS_PER_PAGE;
+	unsigned int index = slotId % SLOTS_PER_PAGE;
+
+	if (page >= _header->numPages) return 0;
+
+	unsigned int sizeClass = _pageClasses[page].load(std::memory_order_acquire);
+	if (sizeClass == NO_CLASS || index >= PAGE_SIZE / slotSize(sizeClass)) return 0;
+
+	return this->slotAt(page, index);
+}
+
+IAsset::ptr SharedMemoryAssetCache::readSlot(const SlotHeader* slot, unsigned int sizeClass, const UUID* key)
+{
+	unsigned int sequence = slot->sequence.load(std::memory_order_acquire);
+	if (sequence == 0 || (sequence & 1) != 0) {
+		return IAsset::ptr();
+	}
+
+	if (! slot->live || (key && std::memcmp(slot->key, key->data(), UUID::BYTE_LEN) != 0)
+		|| slot->size > slotSize(sizeClass) - sizeof(SlotHeader)) {
+		return IAsset::ptr();
+	}
+
+	IAsset::ptr asset(boost::make_shared<SharedMemoryAsset>(UUID(slot->key), slot->type,
+		reinterpret_cast<const char*>(slot + 1), slot->size));
+
+	//the slot may have been taken over while it was copied
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot->sequence.load(std::memory_order_relaxed) != sequence) {
+		return IAsset::ptr();
+	}
+
+	return asset;
+}
+
+bool SharedMemoryAssetCache::isCurrent(unsigned long long bucket) const
+{
+	const SlotHeader* slot = this->slotById(static_cast<unsigned int>(bucket) - 1);
+
+	return slot && slot->live && tag_of(UUID(slot->key).hash()) == static_cast<unsigned int>(bucket >> 32);
+}
+
+SharedMemoryAssetCache::SlotHeader* SharedMemoryAssetCache::find(const UUID& key, unsigned long long hash,
+	unsigned int& sizeClass) const
+{
+	unsigned int tag = tag_of(hash);
+	unsigned int mask = _header->numBuckets - 1;
+
+	for (unsigned int i = 0; i < PROBE_LENGTH; ++i) {
+		unsigned long long bucket = _buckets[(hash + i) & mask].load(std::memory_order_acquire);
+		if (bucket == 0) break;
+
+		if (static_cast<unsigned int>(bucket >> 32) != tag) continue;
+
+		unsigned int slotId = static_cast<unsigned int>(bucket) - 1;
+		SlotHeader* slot = this->slotById(slotId);
+		if (slot && slot->live && std::memcmp(slot->key, key.data(), UUID::BYTE_LEN) == 0) {
+			sizeClass = _pageClasses[slotId / SLOTS_PER_PAGE].load(std::memory_order_acquire);
+			return slot;
+		}
+	}
+
+	return 0;
+}
+
+IAsset::ptr SharedMemoryAssetCache::fetch(const UUID& key)
+{
+	unsigned int sizeClass;
+	SlotHeader* slot = this->find(key, key.hash(), sizeClass);
+
+	IAsset::ptr asset;
+	if (slot) {
+		asset = readSlot(slot, sizeClass, &key);
+	}
+
+	if (asset) {
+		if (! slot->referenced.load(std::memory_order_relaxed)) {
+			slot->referenced.store(1, std::memory_order_relaxed);
+		}
+
+		_hits.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		_misses.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	return asset;
+}
+
+SharedMemoryAssetCache::SlotHeader* SharedMemoryAssetCache::claimSlot(unsigned int sizeClass,
+	unsigned int& slotId, unsigned int& sequence)
+{
+	RegionHeader::SizeClass& state = _header->classes[sizeClass];
+	unsigned int numPages = _header->numPages;
+	unsigned int perPage = static_cast<unsigned int>(PAGE_SIZE / slotSize(sizeClass));
+	std::atomic<unsigned int>* pages = _classPages + static_cast<size_t>(sizeClass) * numPages;
+
+	//slots never used come first, the class takes a new page when it runs out
+	if (! state.full.load(std::memory_order_relaxed)) {
+		unsigned long long issued = state.issued.fetch_add(1);
+		unsigned long long position = issued / perPage;
+		unsigned int index = static_cast<unsigned int>(issued % perPage);
+
+		if (position < numPages) {
+			if (index == 0) {
+				unsigned int page = _header->nextFreePage.fetch_add(1);
+				if (page < numPages) {
+					_pageClasses[page].store(sizeClass, std::memory_order_release);
+					pages[position].store(page, std::memory_order_release);
+				} else {
+					state.full.store(1);
+				}
+			}
+
+			//another process may still be taking the page
+			unsigned int page;
+			while ((page = pages[position].load(std::memory_order_acquire)) == NO_PAGE
+				&& ! state.full.load(std::memory_order_relaxed)) {
+				boost::this_thread::yield();
+			}
+
+			if (page != NO_PAGE) {
+				SlotHeader* slot = this->slotAt(page, index);
+				unsigned int unused = 0;
+				if (slot->sequence.compare_exchange_strong(unused, 1)) {
+					slotId = page * SLOTS_PER_PAGE + index;
+					sequence = 0;
+					return slot;
+				}
+			}
+		} else {
+			state.full.store(1);
+		}
+	}
+
+	unsigned long long used = std::min<unsigned long long>(state.issued.load(), static_cast<unsigned long long>(numPages) * perPage);
+	if (used == 0) return 0;
+
+	for (unsigned int i = 0; i < MAX_SWEEP; ++i) {
+		unsigned long long position = state.hand.fetch_add(1, std::memory_order_relaxed) % used;
+
+		unsigned int page = pages[position / perPage].load(std::memory_order_acquire);
+		if (page == NO_PAGE) continue;
+
+		unsigned int index = static_cast<unsigned int>(position % perPage);
+		SlotHeader* slot = this->slotAt(page, index);
+
+		unsigned int current = slot->sequence.load(std::memory_order_acquire);
+		if ((current & 1) != 0) continue;
+
+		if (slot->referenced.load(std::memory_order_relaxed)) {
+			slot->referenced.store(0, std::memory_order_relaxed);
+			continue;
+		}
+
+		if (slot->sequence.compare_exchange_strong(current, current + 1)) {
+			slotId = page * SLOTS_PER_PAGE + index;
+			sequence = current;
+			return slot;
+		}
+	}
+
+	return 0;
+}
+
+void SharedMemoryAssetCache::index(const UUID& key, unsigned long long hash, unsigned int slotId)
+{
+	unsigned int tag = tag_of(hash);
+	unsigned long long entry = (static_cast<unsigned long long>(tag) << 32) | (slotId + 1);
+	unsigned int mask = _header->numBuckets - 1;
+
+	for (unsigned int i = 0; i < PROBE_LENGTH; ++i) {
+		std::atomic<unsigned long long>& bucket = _buckets[(hash + i) & mask];
+		unsigned long long current = bucket.load(std::memory_order_acquire);
+
+		if (current == 0 || ! this->isCurrent(current)) {
+			if (bucket.compare_exchange_strong(current, entry)) return;
+		}
+	}
+
+	//every bucket points to a live asset, the first one loses its index entry
+	_buckets[hash & mask].store(entry, std::memory_order_release);
+}
+
+void SharedMemoryAssetCache::insert(const UUID& key, const IAsset::ptr& asset)
+{
+	boost::asio::const_buffer data;
+	try {
+		data = asset->getAssetData();
+	} catch (const std::exception&) {
+		return;
+	}
+
+	size_t size = boost::asio::buffer_size(data);
+	unsigned int sizeClass = classFor(sizeof(SlotHeader) + size);
+	if (sizeClass >= NUM_CLASSES) {
+		return;
+	}
+
+	//assets never change, another process may have cached it already
+	unsigned long long hash = key.hash();
+	unsigned int foundClass;
+	if (this->find(key, hash, foundClass)) {
+		return;
+	}
+
+	unsigned int slotId, sequence;
+	SlotHeader* slot = this->claimSlot(sizeClass, slotId, sequence);
+	if (! slot) {
+		return;
+	}
+
+	std::atomic_thread_fence(std::memory_order_release);
+
+	if (slot->live) {
+		_header->entries.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	std::memcpy(slot->key, key.data(), UUID::BYTE_LEN);
+	slot->size = static_cast<unsigned int>(size);
+	slot->type = asset->getType();
+	slot->live = 1;
+	std::memcpy(reinterpret_cast<char*>(slot + 1), boost::asio::buffer_cast<const char*>(data), size);
+
+	slot->referenced.store(1, std::memory_order_relaxed);
+	slot->sequence.store(sequence + 2, std::memory_order_release);
+
+	_header->entries.fetch_add(1, std::memory_order_relaxed);
+
+	this->index(key, hash, slotId);
+}
+
+void SharedMemoryAssetCache::remove(const UUID& key)
+{
+	unsigned int sizeClass;
+	SlotHeader* slot = this->find(key, key.hash(), sizeClass);
+	if (! slot) {
+		return;
+	}
+
+	unsigned int current = slot->sequence.load(std::memory_order_acquire);
+	if ((current & 1) == 0 && slot->sequence.compare_exchange_strong(current, current + 1)) {
+		if (slot->live && std::memcmp(slot->key, key.data(), UUID::BYTE_LEN) == 0) {
+			slot->live = 0;
+			_header->entries.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		slot->sequence.store(current + 2, std::memory_order_release);
+	}
+}
+
+void SharedMemoryAssetCache::clear()
+{
+	for (unsigned int page = 0; page < _header->numPages; ++page) {
+		unsigned int sizeClass = _pageClasses[page].load(std::memory_order_acquire);
+		if (sizeClass == NO_CLASS) continue;
+
+		for (unsigned int index = 0; index < PAGE_SIZE / slotSize(sizeClass); ++index) {
+			SlotHeader* slot = this->slotAt(page, index);
+
+			unsigned int current = slot->sequence.load(std::memory_order_acquire);
+			if (current != 0 && (current & 1) == 0 && slot->sequence.compare_exchange_strong(current, current + 1)) {
+				if (slot->live) {
+					slot->live = 0;
+					_header->entries.fetch_sub(1, std::memory_order_relaxed);
+				}
+
+				slot->sequence.store(current + 2, std::memory_order_release);
+			}
+		}
+	}
+}
+
+size_t SharedMemoryAssetCache::size() const
+{
+	return static_cast<size_t>(_header->entries.load(std::memory_order_relaxed));
+}
+
+unsigned long long SharedMemoryAssetCache::byteSize() const
+{
+	unsigned long long pagesUsed = std::min(_header->nextFreePage.load(std::memory_order_relaxed), _header->numPages);
+	return pagesUsed * PAGE_SIZE;
+}
+
+unsigned long long SharedMemoryAssetCache::maxSize() const
+{
+	return static_cast<unsigned long long>(_header->numPages) * PAGE_SIZE;
+}
+
+unsigned long long SharedMemoryAssetCache::hits() const
+{
+	return _hits.load(std::memory_order_relaxed);
+}
+
+unsigned long long SharedMemoryAssetCache::misses() const
+{
+	return _misses.load(std::memory_order_relaxed);
+}
+
+const char* SharedMemoryAssetCache::policyName() const
+{
+	return "shared";
+}
+
+std::vector<IAsset::ptr> SharedMemoryAssetCache::hottest(size_t maxAssets) const
+{
+	std::vector<IAsset::ptr> referenced;
+	std::vector<IAsset::ptr> unreferenced;
+
+	for (unsigned int page = 0; page < _header->numPages && referenced.size() < maxAssets; ++page) {
+		unsigned int sizeClass = _pageClasses[page].load(std::memory_order_acquire);
+		if (sizeClass == NO_CLASS) continue;
+
+		for (unsigned int index = 0; index < PAGE_SIZE / slotSize(sizeClass); ++index) {
+			const SlotHeader* slot = this->slotAt(page, index);
+			bool hot = slot->referenced.load(std::memory_order_relaxed) != 0;
+
+			std::vector<IAsset::ptr>& list = hot ? referenced : unreferenced;
+			if (list.size() >= maxAssets) continue;
+
+			IAsset::ptr asset = readSlot(slot, sizeClass, 0);
+			if (asset) list.push_back(asset);
+		}
+	}
+
+	for (size_t i = 0; i < unreferenced.size() && referenced.size() < maxAssets; ++i) {
+		referenced.push_back(unreferenced[i]);
+	}
+
+	return referenced;
+}
+
+#ifndef _WIN32
+
+SharedMemoryAssetCache::~SharedMemoryAssetCache()
+{
+	if (_region) {
+		::munmap(_region, _regionSize);
+	}
+}
+
+bool SharedMemoryAssetCache::attach(unsigned long long maxSize)
+{
+	unsigned int numPages = static_cast<unsigned int>(std::max(1ULL, maxSize / PAGE_SIZE));
+
+	unsigned int numBuckets = 1024;
+	while (numBuckets < static_cast<unsigned long long>(numPages) * SLOTS_PER_PAGE / 2) {
+		numBuckets <<= 1;
+	}
+
+	//header, page classes, class pages and buckets, then the page aligned pages
+	size_t tablesSize = sizeof(RegionHeader)
+		+ numPages * sizeof(std::atomic<unsigned int>)
+		+ static_cast<size_t>(NUM_CLASSES) * numPages * sizeof(std::atomic<unsigned int>)
+		+ numBuckets * sizeof(std::atomic<unsigned long long>);
+	size_t pagesOffset = (tablesSize + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+	size_t regionSize = pagesOffset + static_cast<size_t>(numPages) * PAGE_SIZE;
+
+	bool created = true;
+	int fd = ::shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		created = false;
+		fd = ::shm_open(_name.c_str(), O_RDWR, 0600);
+	}
+
+	if (fd < 0) {
+		AppLog::instance().out()
+			<< "[CACHE] Unable to open shared memory " << _name << ": " << std::strerror(errno)
+			<< std::endl;
+		return false;
+	}
+
+	if (created) {
+		if (::ftruncate(fd, static_cast<off_t>(regionSize)) != 0) {
+			AppLog::instance().out()
+				<< "[CACHE] Unable to size shared memory " << _name << ": " << std::strerror(errno)
+				<< std::endl;
+			::close(fd);
+			::shm_unlink(_name.c_str());
+			return false;
+		}
+	} else {
+		//the region keeps the size it was created with
+		struct stat st;
+		unsigned int waited = 0;
+		while (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(RegionHeader) && waited < ATTACH_TIMEOUT_MS) {
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+			waited += 10;
+		}
+
+		regionSize = static_cast<size_t>(st.st_size);
+	}
+
+	void* region = ::mmap(0, regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (region == MAP_FAILED) {
+		AppLog::instance().out()
+			<< "[CACHE] Unable to map shared memory " << _name << ": " << std::strerror(errno)
+			<< std::endl;
+		return false;
+	}
+
+	_region = region;
+	_regionSize = regionSize;
+	_header = static_cast<RegionHeader*>(region);
+
+	if (created) {
+		new (_header) RegionHeader();
+		_header->version = REGION_VERSION;
+		_header->regionSize = regionSize;
+		_header->numPages = numPages;
+		_header->numBuckets = numBuckets;
+	} else {
+		unsigned int waited = 0;
+		while (_header->magic.load(std::memory_order_acquire) != REGION_MAGIC && waited < ATTACH_TIMEOUT_MS) {
+			boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+			waited += 10;
+		}
+
+		if (_header->magic.load(std::memory_order_acquire) != REGION_MAGIC || _header->version != REGION_VERSION
+			|| _header->regionSize != regionSize) {
+			AppLog::instance().out()
+				<< "[CACHE] Shared memory " << _name << " is not an asset cache of this version, remove it to start over"
+				<< std::endl;
+			return false;
+		}
+
+		numPages = _header->numPages;
+		numBuckets = _header->numBuckets;
+		pagesOffset = static_cast<size_t>(regionSize - static_cast<unsigned long long>(numPages) * PAGE_SIZE);
+	}
+
+	char* tables = static_cast<char*>(region) + sizeof(RegionHeader);
+	_pageClasses = reinterpret_cast<std::atomic<unsigned int>*>(tables);
+	_classPages = _pageClasses + numPages;
+	_buckets = reinterpret_cast<std::atomic<unsigned long long>*>(_classPages + static_cast<size_t>(NUM_CLASSES) * numPages);
+	_pages = static_cast<char*>(region) + pagesOffset;
+
+	if (created) {
+		for (unsigned int i = 0; i < numPages; ++i) {
+			new (&_pageClasses[i]) std::atomic<unsigned int>(NO_CLASS);
+		}
+
+		for (size_t i = 0; i < static_cast<size_t>(NUM_CLASSES) * numPages; ++i) {
+			new (&_classPages[i]) std::atomic<unsigned int>(NO_PAGE);
+		}
+
+		for (unsigned int i = 0; i < numBuckets; ++i) {
+			new (&_buckets[i]) std::atomic<unsigned long long>(0);
+		}
+
+		_header->magic.store(REGION_MAGIC, std::memory_order_release);
+
+		AppLog::instance().out()
+			<< "[CACHE] Created shared memory " << _name << " of " << regionSize / 1024 / 1024 << " MB"
+			<< std::endl;
+	} else {
+		AppLog::instance().out()
+			<< "[CACHE] Attached to shared memory " << _name << " holding " << _header->entries.load() << " assets"
+			<< std::endl;
+	}
+
+	return true;
+}
+
+#else
+
+SharedMemoryAssetCache::~SharedMemoryAssetCache()
+{
+}
+
+bool SharedMemoryAssetCache::attach(unsigned long long maxSize)
+{
+	AppLog::instance().out() << "[CACHE] The shared memory cache is not supported on this platform" << std::endl;
+	return false;
+}
+
+#endif
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+
+#include "IAssetCache.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Asset cache in a named shared memory region, so every aperture process on a
+ * host shares the same assets. The region is created by the first process with
+ * room for the configured number of bytes and kept by the others as it is.
+ *
+ * The memory is cut into pages that are handed to size classes on first use,
+ * each class splits its pages into equal slots and reuses them with the CLOCK
+ * algorithm once it has no more pages. A slot is guarded by a sequence number
+ * that is odd while it is written, readers copy the asset out and retry nothing:
+ * a slot that changed while it was read counts as a miss. The index is a lock free
+ * open addressing table of hints to slots, the slot itself says which asset it
+ * holds, so an index entry left behind by an eviction is simply overwritten later.
+ *
+ * Pages never move between size classes. A process dying while it writes a slot
+ * loses that slot until the region is removed. Only supported on POSIX systems
+ */
+class SharedMemoryAssetCache : public IAssetCache
+{
+public:
+	typedef boost::shared_ptr<SharedMemoryAssetCache> ptr;
+
+	static const unsigned int PAGE_SIZE = 4 * 1024 * 1024;
+	static const unsigned int MIN_SLOT_SIZE = 4096;
+
+	/// Slot sizes are powers of two from MIN_SLOT_SIZE to PAGE_SIZE
+	static const unsigned int NUM_CLASSES = 11;
+
+	/// Number of index buckets an asset may be in
+	static const unsigned int PROBE_LENGTH = 8;
+
+	/// Slots looked at by one insert before it gives up
+	static const unsigned int MAX_SWEEP = 1024;
+
+private:
+	struct SlotHeader;
+	struct RegionHeader;
+
+	std::string _name;
+	void* _region;
+	size_t _regionSize;
+
+	RegionHeader* _header;
+
+	/// The size class of every page
+	std::atomic<unsigned int>* _pageClasses;
+
+	/// The pages of every size class in the order they were taken
+	std::atomic<unsigned int>* _classPages;
+
+	std::atomic<unsigned long long>* _buckets;
+	char* _pages;
+
+	std::atomic<unsigned long long> _hits;
+	std::atomic<unsigned long long> _misses;
+
+	explicit SharedMemoryAssetCache(const std::string& name);
+
+public:
+	/**
+	 * Returns the cache in the named region, creating the region with room for
+	 * maxSize bytes if it doesn't exist yet. All callers in a process get the
+	 * same cache. Returns an empty pointer if the region can't be used
+	 */
+	static ptr open(const std::string& name, unsigned long long maxSize);
+
+	virtual ~SharedMemoryAssetCache();
+
+	virtual IAsset::ptr fetch(const UUID& key);
+	virtual void insert(const UUID& key, const IAsset::ptr& asset);
+	virtual void remove(const UUID& key);
+	virtual void clear();
+	virtual size_t size() const;
+	virtual unsigned long long byteSize() const;
+	virtual unsigned long long maxSize() const;
+	virtual unsigned long long hits() const;
+	virtual unsigned long long misses() const;
+	virtual const char* policyName() const;
+
+	/**
+	 * Copies the assets out of the region, referenced ones first
+	 */
+	virtual std::vector<IAsset::ptr> hottest(size_t maxAssets) const;
+
+private:
+	/// Maps the region, creating and laying it out if it doesn't exist
+	bool attach(unsigned long long maxSize);
+
+	/// Returns the smallest size class holding the given number of bytes
+	static unsigned int classFor(size_t bytes);
+
+	static size_t slotSize(unsigned int sizeClass);
+
+	SlotHeader* slotAt(unsigned int page, unsigned int index) const;
+
+	/// Returns the slot with the given id, 0 if its page isn't in use
+	SlotHeader* slotById(unsigned int slotId) const;
+
+	/// Copies the asset out of a slot if it holds one, and the given key if
+	/// key isn't null
+	static IAsset::ptr readSlot(const SlotHeader* slot, unsigned int sizeClass, const UUID* key);
+
+	/// Returns the slot holding key and sets its size class, or 0
+	SlotHeader* find(const UUID& key, unsigned long long hash, unsigned int& sizeClass) const;
+
+	/// Takes a slot of the given size class for writing, evicting what is in it.
+	/// Returns the slot with its sequence number made odd, or 0 if none is free
+	SlotHeader* claimSlot(unsigned int sizeClass, unsigned int& slotId, unsigned int& sequence);
+
+	/// Points the index at a slot that now holds key
+	void index(const UUID& key, unsigned long long hash, unsigned int slotId);
+
+	/// Whether an index bucket points to a slot that still holds an asset with its tag
+	bool isCurrent(unsigned long long bucket) const;
+};
+
+}
@@ -0,0 +1,233 @@
+#include "stdafx.h"
+#include "StratusAssetDecoder.h"
+
+#include <climits>
+
+namespace aperture {
+namespace cloudfiles {
+
+namespace {
+
+enum WireType
+{
+	WIRE_VARINT = 0,
+	WIRE_FIXED64 = 1,
+	WIRE_LENGTH_DELIMITED = 2,
+	WIRE_START_GROUP = 3,
+	WIRE_END_GROUP = 4,
+	WIRE_FIXED32 = 5
+};
+
+/// The StratusAsset fields we look at
+const unsigned int FIELD_ID = 1;
+const unsigned int FIELD_TYPE = 2;
+const unsigned int FIELD_CREATE_TIME = 5;
+const unsigned int FIELD_DATA = 8;
+
+/// The deepest protobuf nests messages and groups before failing the parse
+const int MAX_DEPTH = 100;
+
+/**
+ * Reads wire format values off a range of bytes with the same limits
+ * libprotobuf applies
+ */
+class WireReader
+{
+private:
+	const aperture::byte* _pos;
+	const aperture::byte* _end;
+
+	/// Reads a varint of at most maxBytes bytes, bits beyond 64 are dropped
+	bool readVarint(unsigned long long& value, int maxBytes)
+	{
+		value = 0;
+		for (int i = 0; i < maxBytes && _pos != _end; ++i) {
+			aperture::byte b = *_pos++;
+			if (i < 10) value |= (unsigned long long)(b & 0x7f) << (7 * i);
+			if (b < 0x80) return true;
+		}
+
+		return false;
+	}
+
+public:
+	WireReader(const aperture::byte* begin, const aperture::byte* end)
+		: _pos(begin), _end(end)
+	{
+	}
+
+	const aperture::byte* position() const
+	{
+		return _pos;
+	}
+
+	bool atEnd() const
+	{
+		return _pos == _end;
+	}
+
+	bool readVarint(unsigned long long& value)
+	{
+		return this->readVarint(value, 10);
+	}
+
+	/// Tags are at most 5 bytes, with a field number other than 0
+	bool readTag(unsigned int& tag)
+	{
+		unsigned long long value;
+		if (! this->readVarint(value, 5)) return false;
+
+		tag = (unsigned int)value;
+		return (tag >> 3) != 0;
+	}
+
+	/// Lengths are at most 5 bytes and a little under 2GB, and have to fit what is left
+	bool readLength(size_t& length)
+	{
+		const aperture::byte* start = _pos;
+
+		unsigned long long value;
+		if (! this->readVarint(value, 5)) return false;
+		if (_pos - start == 5 && start[4] >= 8) return false;
+		if (value >= (unsigned long long)(INT_MAX - 16)) return false;
+		if (value > (unsigned long long)(_end - _pos)) return false;
+
+		length = (size_t)value;
+		return true;
+	}
+
+	bool skip(size_t count)
+	{
+		if (count > (size_t)(_end - _pos)) return false;
+
+		_pos += count;
+		return true;
+	}
+};
+
+bool skipField(WireReader& reader, unsigned int tag, int depth);
+
+/// Checks that a message we don't keep anything from is well formed
+bool skipMessage(WireReader& reader, int depth)
+{
+	if (depth > MAX_DEPTH) return false;
+
+	while (! reader.atEnd()) {
+		unsigned int tag;
+		if (! reader.readTag(tag)) return false;
+		if ((tag & 7) == WIRE_END_GROUP) return false;
+		if (! skipField(reader, tag, depth)) return false;
+	}
+
+	return true;
+}
+
+bool skipField(WireReader& reader, unsigned int tag, int depth)
+{
+	unsigned long long value;
+	size_t length;
+
+	switch (tag & 7) {
+	case WIRE_VARINT:
+		return reader.readVarint(value);
+
+	case WIRE_FIXED64:
+		return reader.skip(8);
+
+	case WIRE_LENGTH_DELIMITED:
+		return reader.readLength(length) && reader.skip(length);
+
+	case WIRE_START_GROUP:
+		if (depth + 1 > MAX_DEPTH) return false;
+
+		for (;;) {
+			unsigned int inner;
+			if (! reader.readTag(inner)) return false;
+
+			if ((inner & 7) == WIRE_END_GROUP) {
+				return (inner >> 3) == (tag >> 3);
+			}
+
+			if (! skipField(reader, inner, depth + 1)) return false;
+		}
+
+	case WIRE_FIXED32:
+		return reader.skip(4);
+
+	default:
+		return false;
+	}
+}
+
+}
+
+StratusAssetDecoder::StratusAssetDecoder()
+	: _type(0), _dataOffset(0), _dataSize(0)
+{
+}
+
+bool StratusAssetDecoder::decode(const aperture::byte* data, size_t size)
+{
+	_type = 0;
+	_dataOffset = 0;
+	_dataSize = 0;
+
+	WireReader reader(data, data + size);
+
+	while (! reader.atEnd()) {
+		unsigned int tag;
+		if (! reader.readTag(tag)) return false;
+
+		unsigned int field = tag >> 3;
+		unsigned int wireType = tag & 7;
+
+		if (wireType == WIRE_END_GROUP) return false;
+
+		if (field == FIELD_TYPE && wireType == WIRE_VARINT) {
+			unsigned long long value;
+			if (! reader.readVarint(value)) return false;
+
+			//int32 keeps the low bits of whatever was encoded
+			_type = (int)(unsigned int)value;
+
+		} else if (field == FIELD_DATA && wireType == WIRE_LENGTH_DELIMITED) {
+			size_t length;
+			if (! reader.readLength(length)) return false;
+
+			_dataOffset = reader.position() - data;
+			_dataSize = length;
+			reader.skip(length);
+
+		} else if ((field == FIELD_ID || field == FIELD_CREATE_TIME) && wireType == WIRE_LENGTH_DELIMITED) {
+			//the embedded bcl message has to parse too
+			size_t length;
+			if (! reader.readLength(length)) return false;
+
+			WireReader embedded(reader.position(), reader.position() + length);
+			if (! skipMessage(embedded, 1)) return false;
+			reader.skip(length);
+
+		} else if (! skipField(reader, tag, 0)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int StratusAssetDecoder::getType() const
+{
+	return _type;
+}
+
+size_t StratusAssetDecoder::getDataOffset() const
+{
+	return _dataOffset;
+}
+
+size_t StratusAssetDecoder::getDataSize() const
+{
+	return _dataSize;
+}
+
+}}
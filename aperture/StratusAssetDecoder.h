@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+
+#include <boost/shared_ptr.hpp>
+
+#include "byte.h"
+
+namespace aperture {
+namespace cloudfiles {
+
+/**
+ * Reads a serialized StratusAsset (see StratusAsset.proto) straight from the
+ * buffer it was received into. Only the type and the location of the asset
+ * data are kept; the other fields are skipped, though they are still checked
+ * to be well formed, so a message is accepted exactly when protobuf would
+ * parse it
+ */
+class StratusAssetDecoder
+{
+private:
+	int _type;
+	size_t _dataOffset;
+	size_t _dataSize;
+
+public:
+	StratusAssetDecoder();
+
+	/**
+	 * Decodes the message held in the given bytes. Returns false if they are
+	 * not a well formed StratusAsset
+	 */
+	bool decode(const aperture::byte* data, size_t size);
+
+	/**
+	 * Returns the asset type, 0 if the message has none
+	 */
+	int getType() const;
+
+	/**
+	 * Returns where the asset data starts in the decoded bytes
+	 */
+	size_t getDataOffset() const;
+
+	/**
+	 * Returns the size of the asset data, 0 if the message has none
+	 */
+	size_t getDataSize() const;
+};
+
+}}
@@ -0,0 +1,116 @@
+#include "stdafx.h"
+#include "StreamRegistry.h"
+
+#include <algorithm>
+
+namespace aperture {
+
+StreamRegistry& StreamRegistry::instance()
+{
+	static StreamRegistry registry;
+	return registry;
+}
+
+StreamRegistry::StreamRegistry()
+	: _nextWatchId(1), _streamsStarted(0), _streamsFailed(0), _repliesStreamed(0)
+{
+}
+
+StreamingAsset::ptr StreamRegistry::find(const UUID& uuid)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	StreamMap::iterator i = _streams.find(uuid);
+	if (i == _streams.end()) {
+		return StreamingAsset::ptr();
+	}
+
+	_repliesStreamed.fetch_add(1, std::memory_order_relaxed);
+	return i->second;
+}
+
+unsigned long long StreamRegistry::watch(const UUID& uuid, WatchCallback callBack)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	Watcher watcher;
+	watcher.id = _nextWatchId++;
+	watcher.callBack = callBack;
+
+	_watchers[uuid].push_back(watcher);
+
+	return watcher.id;
+}
+
+bool StreamRegistry::unwatch(const UUID& uuid, unsigned long long watchId)
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	WatcherMap::iterator i = _watchers.find(uuid);
+	if (i == _watchers.end()) {
+		return false;
+	}
+
+	std::vector<Watcher>& watchers = i->second;
+	std::vector<Watcher>::iterator watcher = std::find_if(watchers.begin(), watchers.end(),
+		[watchId](const Watcher& w) { return w.id == watchId; });
+
+	if (watcher == watchers.end()) {
+		return false;
+	}
+
+	watchers.erase(watcher);
+	if (watchers.empty()) {
+		_watchers.erase(i);
+	}
+
+	return true;
+}
+
+void StreamRegistry::publish(StreamingAsset::ptr stream)
+{
+	std::vector<Watcher> watchers;
+
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+
+		_streams[stream->getUUID()] = stream;
+
+		WatcherMap::iterator i = _watchers.find(stream->getUUID());
+		if (i != _watchers.end()) {
+			watchers.swap(i->second);
+			_watchers.erase(i);
+		}
+	}
+
+	_streamsStarted.fetch_add(1, std::memory_order_relaxed);
+	_repliesStreamed.fetch_add(watchers.size(), std::memory_order_relaxed);
+
+	for (const Watcher& watcher : watchers) {
+		watcher.callBack(stream);
+	}
+}
+
+void StreamRegistry::retire(StreamingAsset::ptr stream)
+{
+	if (stream->hasFailed()) {
+		_streamsFailed.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	boost::mutex::scoped_lock lock(_mutex);
+
+	//another connection may have started a stream of the same asset meanwhile
+	StreamMap::iterator i = _streams.find(stream->getUUID());
+	if (i != _streams.end() && i->second == stream) {
+		_streams.erase(i);
+	}
+}
+
+void StreamRegistry::writeStats(std::ostream& out) const
+{
+	out << "streams_started=" << _streamsStarted.load(std::memory_order_relaxed) << "\n"
+		<< "streams_failed=" << _streamsFailed.load(std::memory_order_relaxed) << "\n"
+		<< "streamed_replies=" << _repliesStreamed.load(std::memory_order_relaxed) << "\n";
+}
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "StreamingAsset.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * The assets being streamed in from the backends, and the requests waiting
+ * for them. A request that missed the caches watches for its asset here
+ * while its fetch is under way: when a backend starts receiving the asset,
+ * every watcher is handed the stream and can start its reply with the first
+ * bytes instead of the whole asset. A request arriving while the asset is
+ * still coming in finds the stream and joins it. Safe to use from any thread
+ */
+class StreamRegistry
+{
+public:
+	typedef boost::function<void (StreamingAsset::ptr)> WatchCallback;
+
+private:
+	struct Watcher
+	{
+		unsigned long long id;
+		WatchCallback callBack;
+	};
+
+	typedef std::unordered_map<UUID, std::vector<Watcher> > WatcherMap;
+	WatcherMap _watchers;
+
+	typedef std::unordered_map<UUID, StreamingAsset::ptr> StreamMap;
+	StreamMap _streams;
+
+	boost::mutex _mutex;
+
+	unsigned long long _nextWatchId;
+
+	std::atomic<unsigned long long> _streamsStarted;
+	std::atomic<unsigned long long> _streamsFailed;
+	std::atomic<unsigned long long> _repliesStreamed;
+
+	StreamRegistry();
+
+public:
+	/**
+	 * Returns the singleton instance
+	 */
+	static StreamRegistry& instance();
+
+	/**
+	 * Returns the stream of the given asset if it is being received now
+	 */
+	StreamingAsset::ptr find(const UUID& uuid);
+
+	/**
+	 * Calls back with the stream of the given asset once one starts. The
+	 * callback is run from the backend's thread. Returns the id to unwatch with
+	 */
+	unsigned long long watch(const UUID& uuid, WatchCallback callBack);
+
+	/**
+	 * Stops watching. Returns false if the watcher was already handed a stream,
+	 * the callback then has run or is about to
+	 */
+	bool unwatch(const UUID& uuid, unsigned long long watchId);
+
+	/**
+	 * Makes a stream that has just started known, and hands it to everyone
+	 * watching for its asset
+	 */
+	void publish(StreamingAsset::ptr stream);
+
+	/**
+	 * Forgets a stream that has completed or failed
+	 */
+	void retire(StreamingAsset::ptr stream);
+
+	/**
+	 * Writes the number of streams started and failed, and of requests answered
+	 * from a stream
+	 */
+	void writeStats(std::ostream& out) const;
+};
+
+}
@@ -0,0 +1,103 @@
+#include "stdafx.h"
+#include "StreamingAsset.h"
+
+#include <algorithm>
+
+namespace aperture {
+
+StreamingAsset::StreamingAsset(const UUID& uuid, byte type, boost::shared_ptr<byte> data, size_t size)
+	: _uuid(uuid), _type(type), _data(data), _size(size), _available(0), _failed(false)
+{
+}
+
+StreamingAsset::~StreamingAsset()
+{
+}
+
+UUID StreamingAsset::getUUID() const
+{
+	return _uuid;
+}
+
+size_t StreamingAsset::getBinaryDataSize() const
+{
+	return _size;
+}
+
+byte StreamingAsset::getType() const
+{
+	return _type;
+}
+
+boost::asio::const_buffer StreamingAsset::getAssetData() const
+{
+	return boost::asio::const_buffer(_data.get(), _size);
+}
+
+size_t StreamingAsset::available() const
+{
+	return _available.load(std::memory_order_acquire);
+}
+
+bool StreamingAsset::isComplete() const
+{
+	return this->available() == _size;
+}
+
+bool StreamingAsset::hasFailed() const
+{
+	return _failed.load(std::memory_order_acquire);
+}
+
+void StreamingAsset::notify(size_t wanted, boost::function<void()> callBack)
+{
+	wanted = std::min(wanted, _size);
+
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+
+		//checked under the lock so an advance can't slip in between
+		if (this->available() < wanted && ! this->hasFailed()) {
+			_waiters.push_back(std::make_pair(wanted, callBack));
+			return;
+		}
+	}
+
+	callBack();
+}
+
+void StreamingAsset::advance(size_t available)
+{
+	_available.store(std::min(available, _size), std::memory_order_release);
+	this->wakeWaiters();
+}
+
+void StreamingAsset::fail()
+{
+	_failed.store(true, std::memory_order_release);
+	this->wakeWaiters();
+}
+
+void StreamingAsset::wakeWaiters()
+{
+	WaiterList ready;
+
+	{
+		boost::mutex::scoped_lock lock(_mutex);
+
+		size_t available = this->available();
+		bool failed = this->hasFailed();
+
+		WaiterList::iterator waiting = std::partition(_waiters.begin(), _waiters.end(),
+			[available, failed](const WaiterList::value_type& waiter) { return waiter.first > available && ! failed; });
+
+		ready.assign(waiting, _waiters.end());
+		_waiters.erase(waiting, _waiters.end());
+	}
+
+	for (const WaiterList::value_type& waiter : ready) {
+		waiter.second();
+	}
+}
+
+}
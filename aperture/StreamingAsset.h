@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "byte.h"
+#include "IAsset.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * An asset still being received from a backend. The size and type are known
+ * from the packet header and the data fills the block front to back, so
+ * replies can send what has arrived before the rest is in. The producer
+ * advances it from its own thread, readers are called back as more data
+ * arrives. Safe to use from any thread
+ */
+class StreamingAsset : public IAsset
+{
+public:
+	typedef boost::shared_ptr<StreamingAsset> ptr;
+
+private:
+	UUID _uuid;
+	byte _type;
+
+	boost::shared_ptr<byte> _data;
+	size_t _size;
+
+	std::atomic<size_t> _available;
+	std::atomic<bool> _failed;
+
+	/// Callbacks and the amount of data each one waits for
+	typedef std::vector<std::pair<size_t, boost::function<void()> > > WaiterList;
+	WaiterList _waiters;
+	boost::mutex _mutex;
+
+	/// Runs the waiters satisfied by the data available now
+	void wakeWaiters();
+
+public:
+	/**
+	 * Constructs a stream of size bytes received into data, with none of them
+	 * available yet
+	 */
+	StreamingAsset(const UUID& uuid, byte type, boost::shared_ptr<byte> data, size_t size);
+	virtual ~StreamingAsset();
+
+	UUID getUUID() const override;
+
+	/**
+	 * Returns the size the asset will have once complete
+	 */
+	size_t getBinaryDataSize() const override;
+
+	byte getType() const override;
+
+	/**
+	 * Returns a view of the whole block, of which only the first available()
+	 * bytes may be read
+	 */
+	boost::asio::const_buffer getAssetData() const override;
+
+	/**
+	 * Returns how many bytes from the start of the data have arrived
+	 */
+	size_t available() const;
+
+	/**
+	 * Returns whether all the data has arrived
+	 */
+	bool isComplete() const;
+
+	/**
+	 * Returns whether the transfer broke off, no more data will arrive
+	 */
+	bool hasFailed() const;
+
+	/**
+	 * Calls back once at least wanted bytes are available, or the stream has
+	 * failed. The callback is run right away if that is already the case, and
+	 * otherwise from the producer's thread, so callers wrap it in their strand
+	 */
+	void notify(size_t wanted, boost::function<void()> callBack);
+
+	/**
+	 * Marks the first available bytes as received. Called by the producer only
+	 */
+	void advance(size_t available);
+
+	/**
+	 * Marks the transfer as broken off. Called by the producer only
+	 */
+	void fail();
+};
+
+}
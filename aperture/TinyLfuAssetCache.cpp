@@ -0,0 +1,298 @@
+#include "stdafx.h"
+#include "TinyLfuAssetCache.h"
+
+#include <algorithm>
+
+namespace aperture {
+
+const unsigned int TinyLfuAssetCache::WINDOW_PERCENT;
+const unsigned int TinyLfuAssetCache::PROTECTED_PERCENT;
+const unsigned int TinyLfuAssetCache::ESTIMATED_ASSET_SIZE;
+
+TinyLfuAssetCache::Shard::Shard(unsigned long long maxSize)
+	: sketch(static_cast<size_t>(std::max(1ULL, maxSize / ESTIMATED_ASSET_SIZE))),
+	maxWindowSize(maxSize * WINDOW_PERCENT / 100),
+	maxMainSize(maxSize - maxWindowSize),
+	maxProtectedSize(maxMainSize * PROTECTED_PERCENT / 100),
+	hits(0), misses(0)
+{
+}
+
+TinyLfuAssetCache::TinyLfuAssetCache(unsigned long long maxSize, unsigned int numShards)
+	: _maxSize(maxSize)
+{
+	unsigned int shardCount = 1;
+	while (shardCount < numShards) {
+		shardCount <<= 1;
+	}
+
+	for (unsigned int i = 0; i < shardCount; ++i) {
+		_shards.emplace_back(new Shard(maxSize / shardCount));
+	}
+}
+
+TinyLfuAssetCache::~TinyLfuAssetCache()
+{
+}
+
+IAsset::ptr TinyLfuAssetCache::fetch(const UUID& key)
+{
+	Shard& shard = this->shardFor(key);
+	boost::mutex::scoped_lock lock(shard.mutex);
+
+	//misses count too, an asset has to be popular before it is admitted
+	shard.sketch.increment(key);
+
+	auto found = shard.index.find(key);
+	if (found == shard.index.end()) {
+		shard.misses.fetch_add(1, std::memory_order_relaxed);
+		return IAsset::ptr();
+	}
+
+	shard.hits.fetch_add(1, std::memory_order_relaxed);
+
+	EntryList::iterator entry = found->second;
+	switch (entry->region) {
+	case WINDOW:
+		shard.windowEntries.splice(shard.windowEntries.begin(), shard.windowEntries, entry);
+		break;
+
+	case PROBATION:
+		moveTo(shard, entry, PROTECTED);
+		demoteProtected(shard);
+		break;
+
+	case PROTECTED:
+		shard.protectedEntries.splice(shard.protectedEntries.begin(), shard.protectedEntries, entry);
+		break;
+	}
+
+	return entry->asset;
+}
+
+void TinyLfuAssetCache::insert(const UUID& key, const IAsset::ptr& asset)
+{
+	Shard& shard = this->shardFor(key);
+	boost::mutex::scoped_lock lock(shard.mutex);
+
+	auto found = shard.index.find(key);
+	if (found != shard.index.end()) {
+		EntryList::iterator entry = found->second;
+		AssetSizeCalculator& regionSize = sizeOf(shard, entry->region);
+
+		regionSize.on_remove(entry->asset);
+		entry->asset = asset;
+		regionSize.on_add(asset);
+
+		if (entry->region == WINDOW) {
+			evictWindow(shard);
+		} else {
+			demoteProtected(shard);
+			evictMain(shard, shard.probationEntries.end(), false);
+		}
+
+		return;
+	}
+
+	Entry newEntry = { key, asset, WINDOW };
+	shard.windowEntries.push_front(newEntry);
+	shard.windowSize.on_add(asset);
+	shard.index[key] = shard.windowEntries.begin();
+
+	evictWindow(shard);
+}
+
+void TinyLfuAssetCache::remove(const UUID& key)
+{
+	Shard& shard = this->shardFor(key);
+	boost::mutex::scoped_lock lock(shard.mutex);
+
+	auto found = shard.index.find(key);
+	if (found != shard.index.end()) {
+		erase(shard, found->second);
+	}
+}
+
+void TinyLfuAssetCache::clear()
+{
+	for (auto& shard : _shards) {
+		boost::mutex::scoped_lock lock(shard->mutex);
+
+		shard->windowEntries.clear();
+		shard->probationEntries.clear();
+		shard->protectedEntries.clear();
+		shard->index.clear();
+		shard->windowSize.on_clear();
+		shard->probationSize.on_clear();
+		shard->protectedSize.on_clear();
+	}
+}
+
+size_t TinyLfuAssetCache::size() const
+{
+	size_t total = 0;
+	for (auto& shard : _shards) {
+		boost::mutex::scoped_lock lock(shard->mutex);
+		total += shard->index.size();
+	}
+
+	return total;
+}
+
+unsigned long long TinyLfuAssetCache::byteSize() const
+{
+	unsigned long long total = 0;
+	for (auto& shard : _shards) {
+		boost::mutex::scoped_lock lock(shard->mutex);
+		total += shard->windowSize.get_size() + shard->probationSize.get_size() + shard->protectedSize.get_size();
+	}
+
+	return total;
+}
+
+unsigned long long TinyLfuAssetCache::maxSize() const
+{
+	return _maxSize;
+}
+
+unsigned long long TinyLfuAssetCache::hits() const
+{
+	unsigned long long total = 0;
+	for (auto& shard : _shards) {
+		total += shard->hits.load(std::memory_order_relaxed);
+	}
+
+	return total;
+}
+
+unsigned long long TinyLfuAssetCache::misses() const
+{
+	unsigned long long total = 0;
+	for (auto& shard : _shards) {
+		total += shard->misses.load(std::memory_order_relaxed);
+	}
+
+	return total;
+}
+
+const char* TinyLfuAssetCache::policyName() const
+{
+	return "tinylfu";
+}
+
+std::vector<IAsset::ptr> TinyLfuAssetCache::hottest(size_t maxAssets) const
+{
+	std::vector<std::vector<IAsset::ptr> > lists(_shards.size());
+
+	for (size_t i = 0; i < _shards.size(); ++i) {
+		Shard& shard = *_shards[i];
+		boost::mutex::scoped_lock lock(shard.mutex);
+
+		for (const EntryList* list : { &shard.protectedEntries, &shard.windowEntries, &shard.probationEntries }) {
+			for (auto entry = list->begin(); entry != list->end() && lists[i].size() < maxAssets; ++entry) {
+				lists[i].push_back(entry->asset);
+			}
+		}
+	}
+
+	return interleave(lists, maxAssets);
+}
+
+TinyLfuAssetCache::Shard& TinyLfuAssetCache::shardFor(const UUID& key) const
+{
+	//the low bits pick the HTTP shard that owns an asset, so use others here
+	return *_shards[(key.hash() >> 8) & (_shards.size() - 1)];
+}
+
+TinyLfuAssetCache::EntryList& TinyLfuAssetCache::listOf(Shard& shard, Region region)
+{
+	switch (region) {
+	case WINDOW:
+		return shard.windowEntries;
+	case PROBATION:
+		return shard.probationEntries;
+	default:
+		return shard.protectedEntries;
+	}
+}
+
+AssetSizeCalculator& TinyLfuAssetCache::sizeOf(Shard& shard, Region region)
+{
+	switch (region) {
+	case WINDOW:
+		return shard.windowSize;
+	case PROBATION:
+		return shard.probationSize;
+	default:
+		return shard.protectedSize;
+	}
+}
+
+void TinyLfuAssetCache::moveTo(Shard& shard, EntryList::iterator entry, Region region)
+{
+	sizeOf(shard, entry->region).on_remove(entry->asset);
+	sizeOf(shard, region).on_add(entry->asset);
+
+	EntryList& to = listOf(shard, region);
+	to.splice(to.begin(), listOf(shard, entry->region), entry);
+	entry->region = region;
+}
+
+void TinyLfuAssetCache::erase(Shard& shard, EntryList::iterator entry)
+{
+	sizeOf(shard, entry->region).on_remove(entry->asset);
+	shard.index.erase(entry->key);
+	listOf(shard, entry->region).erase(entry);
+}
+
+void TinyLfuAssetCache::demoteProtected(Shard& shard)
+{
+	while (shard.protectedSize.get_size() > shard.maxProtectedSize && ! shard.protectedEntries.empty()) {
+		moveTo(shard, std::prev(shard.protectedEntries.end()), PROBATION);
+	}
+}
+
+void TinyLfuAssetCache::evictWindow(Shard& shard)
+{
+	while (shard.windowSize.get_size() > shard.maxWindowSize && ! shard.windowEntries.empty()) {
+		EntryList::iterator candidate = std::prev(shard.windowEntries.end());
+		moveTo(shard, candidate, PROBATION);
+		evictMain(shard, candidate, true);
+	}
+}
+
+void TinyLfuAssetCache::evictMain(Shard& shard, EntryList::iterator candidate, bool hasCandidate)
+{
+	while (shard.probationSize.get_size() + shard.protectedSize.get_size() > shard.maxMainSize) {
+		//the candidate sits at the front of probation, so the back of probation is
+		//only the candidate when it is alone there
+		EntryList::iterator victim;
+		bool victimIsCandidate = false;
+
+		if (shard.probationEntries.size() > (hasCandidate ? 1u : 0u)) {
+			victim = std::prev(shard.probationEntries.end());
+		} else if (! shard.protectedEntries.empty()) {
+			victim = std::prev(shard.protectedEntries.end());
+		} else if (hasCandidate) {
+			victim = candidate;
+			victimIsCandidate = true;
+		} else {
+			break;
+		}
+
+		if (hasCandidate && ! victimIsCandidate &&
+			shard.sketch.estimate(candidate->key) <= shard.sketch.estimate(victim->key)) {
+			//the candidate isn't more popular than what it would replace
+			victim = candidate;
+			victimIsCandidate = true;
+		}
+
+		erase(shard, victim);
+
+		if (victimIsCandidate) {
+			hasCandidate = false;
+		}
+	}
+}
+
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include <boost/thread/mutex.hpp>
+
+#include "AssetSizeCalculator.h"
+#include "FrequencySketch.h"
+#include "IAssetCache.h"
+#include "UUID.h"
+
+namespace aperture {
+
+/**
+ * Asset cache using the W-TinyLFU policy. New assets enter a small LRU window.
+ * Assets leaving the window are only admitted to the main segmented LRU if they
+ * were requested more often than the asset they would evict, as estimated by a
+ * decaying FrequencySketch of all requests. A burst of one-off assets only churns
+ * the window and leaves the popular ones alone.
+ *
+ * Like ShardedAssetCache the assets are spread over independently locked shards,
+ * but a hit reorders the lists and so takes its shard's lock exclusively
+ */
+class TinyLfuAssetCache : public IAssetCache
+{
+public:
+	typedef boost::shared_ptr<TinyLfuAssetCache> ptr;
+
+	/// Percentage of a shard's bytes given to the window
+	static const unsigned int WINDOW_PERCENT = 1;
+
+	/// Percentage of the main segment's bytes given to the protected part
+	static const unsigned int PROTECTED_PERCENT = 80;
+
+	/// Asset size used to guess how many ids the sketch has to track
+	static const unsigned int ESTIMATED_ASSET_SIZE = 16384;
+
+private:
+	enum Region
+	{
+		WINDOW,
+		PROBATION,
+		PROTECTED
+	};
+
+	struct Entry
+	{
+		UUID key;
+		IAsset::ptr asset;
+		Region region;
+	};
+
+	typedef std::list<Entry> EntryList;
+
+	struct Shard
+	{
+		Shard(unsigned long long maxSize);
+
+		boost::mutex mutex;
+
+		/// Most recently used first
+		EntryList windowEntries;
+		EntryList probationEntries;
+		EntryList protectedEntries;
+
+		std::unordered_map<UUID, EntryList::iterator> index;
+
+		FrequencySketch sketch;
+
+		AssetSizeCalculator windowSize;
+		AssetSizeCalculator probationSize;
+		AssetSizeCalculator protectedSize;
+
+		unsigned long long maxWindowSize;
+		unsigned long long maxMainSize;
+		unsigned long long maxProtectedSize;
+
+		std::atomic<unsigned long long> hits;
+		std::atomic<unsigned long long> misses;
+	};
+
+	std::vector<std::unique_ptr<Shard> > _shards;
+	unsigned long long _maxSize;
+
+public:
+	/**
+	 * Creates a cache holding at most maxSize bytes as counted by AssetSizeCalculator.
+	 * The budget is split evenly between the shards, numShards is rounded up to a
+	 * power of two
+	 */
+	TinyLfuAssetCache(unsigned long long maxSize, unsigned int numShards);
+	virtual ~TinyLfuAssetCache();
+
+	virtual IAsset::ptr fetch(const UUID& key);
+	virtual void insert(const UUID& key, const IAsset::ptr& asset);
+	virtual void remove(const UUID& key);
+	virtual void clear();
+	virtual size_t size() const;
+	virtual unsigned long long byteSize() const;
+	virtual unsigned long long maxSize() const;
+	virtual unsigned long long hits() const;
+	virtual unsigned long long misses() const;
+	virtual const char* policyName() const;
+
+	/**
+	 * Protected assets come first, then the window and then probation, each
+	 * most recently used first
+	 */
+	virtual std::vector<IAsset::ptr> hottest(size_t maxAssets) const;
+
+private:
+	Shard& shardFor(const UUID& key) const;
+
+	static EntryList& listOf(Shard& shard, Region region);
+	static AssetSizeCalculator& sizeOf(Shard& shard, Region region);
+
+	/// Moves an entry to the front of another region's list
+	static void moveTo(Shard& shard, EntryList::iterator entry, Region region);
+
+	static void erase(Shard& shard, EntryList::iterator entry);
+
+	/// Moves protected entries over budget back to probation
+	static void demoteProtected(Shard& shard);
+
+	/// Moves entries out of the window over budget and decides whether the main
+	/// segment keeps them
+	static void evictWindow(Shard& shard);
+
+	/// Evicts from the main segment until it is within budget. The candidate
+	/// fresh from the window competes with each victim and loses ties
+	static void evictMain(Shard& shard, EntryList::iterator candidate, bool hasCandidate);
+};
+
+}
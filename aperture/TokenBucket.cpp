@@ -22,7 +22,9 @@ TokenBucket::~TokenBucket()
 
 bool TokenBucket::removeTokens(size_t amount)
 {
-	this->drip();
+	boost::mutex::scoped_lock lock(_mutex);
+
+	this->dripUnlocked();
 
 	if (_tokens >= amount) {
 		_tokens -= amount;
@@ -33,6 +35,13 @@ bool TokenBucket::removeTokens(size_t amount)
 }
 
 bool TokenBucket::drip()
+{
+	boost::mutex::scoped_lock lock(_mutex);
+
+	return this->dripUnlocked();
+}
+
+bool TokenBucket::dripUnlocked()
 {
 	int_least64_t deltaTime = bc::duration_cast<bc::milliseconds>(bc::steady_clock::now() - _lastDrip).count();
 	if (deltaTime <= 0)
@@ -1,9 +1,11 @@
 #pragma once
 
 #include <boost/chrono/system_clocks.hpp>
+#include <boost/thread/mutex.hpp>
 
 /**
- * Token bucket to rate limit outbound transfers 
+ * Token bucket to rate limit outbound transfers. A bucket is shared by every
+ * connection on the same cap, so it is safe to use from multiple threads
  */
 class TokenBucket
 {
@@ -36,6 +38,9 @@ public:
 	size_t getMaxBurst() const;
 
 private:
+	bool dripUnlocked();
+
+	boost::mutex _mutex;
 	size_t _maxBurst;
 	size_t _tokens;
 	boost::chrono::steady_clock::time_point _lastDrip;
@@ -0,0 +1,182 @@
+#include "stdafx.h"
+#include "UUID.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AP_UUID_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace aperture {
+
+namespace {
+	const char HEX_DIGITS[] = "0123456789abcdef";
+
+	/// Returns the value of a lowercase hex digit, or -1
+	inline int hex_value(char c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		return -1;
+	}
+
+	/// Decodes 32 hex characters into 16 bytes. Returns false on anything that
+	/// isn't a lowercase hex digit
+	bool decode_hex(const char* hex, unsigned char* out)
+	{
+#ifdef AP_UUID_SSE2
+		const __m128i zeroMinus = _mm_set1_epi8('0' - 1);
+		const __m128i ninePlus = _mm_set1_epi8('9' + 1);
+		const __m128i aMinus = _mm_set1_epi8('a' - 1);
+		const __m128i fPlus = _mm_set1_epi8('f' + 1);
+		const __m128i lowByte = _mm_set1_epi16(0x00FF);
+
+		__m128i halves[2];
+
+		for (int i = 0; i < 2; ++i)
+		{
+			__m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + i * 16));
+
+			//bytes over 0x7F compare as negative and fail both ranges
+			__m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(chars, zeroMinus), _mm_cmplt_epi8(chars, ninePlus));
+			__m128i isLetter = _mm_and_si128(_mm_cmpgt_epi8(chars, aMinus), _mm_cmplt_epi8(chars, fPlus));
+
+			if (_mm_movemask_epi8(_mm_or_si128(isDigit, isLetter)) != 0xFFFF)
+			{
+				return false;
+			}
+
+			__m128i nibbles = _mm_or_si128(
+				_mm_and_si128(isDigit, _mm_sub_epi8(chars, _mm_set1_epi8('0'))),
+				_mm_and_si128(isLetter, _mm_sub_epi8(chars, _mm_set1_epi8('a' - 10))));
+
+			//each 16 bit lane holds the high nibble in its low byte and the low
+			//nibble in its high byte
+			__m128i high = _mm_slli_epi16(_mm_and_si128(nibbles, lowByte), 4);
+			__m128i low = _mm_srli_epi16(nibbles, 8);
+
+			halves[i] = _mm_or_si128(high, low);
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(halves[0], halves[1]));
+		return true;
+#else
+		for (int i = 0; i < UUID::BYTE_LEN; ++i)
+		{
+			int high = hex_value(hex[i * 2]);
+			int low = hex_value(hex[i * 2 + 1]);
+
+			if (high < 0 || low < 0)
+			{
+				return false;
+			}
+
+			out[i] = static_cast<unsigned char>((high << 4) | low);
+		}
+
+		return true;
+#endif
+	}
+}
+
+UUID::UUID()
+{
+	std::memset(_bytes, 0, BYTE_LEN);
+}
+
+UUID::UUID(const unsigned char* bytes)
+{
+	std::memcpy(_bytes, bytes, BYTE_LEN);
+}
+
+bool UUID::parse(boost::string_view str, UUID& uuid)
+{
+	char compact[HEX_LEN];
+	const char* hex;
+
+	if (str.size() == HEX_LEN)
+	{
+		hex = str.data();
+	}
+	else if (str.size() == HEX_LEN + 4 && str[8] == '-' && str[13] == '-' && str[18] == '-' && str[23] == '-')
+	{
+		//the usual 8-4-4-4-12 form
+		std::memcpy(compact, str.data(), 8);
+		std::memcpy(compact + 8, str.data() + 9, 4);
+		std::memcpy(compact + 12, str.data() + 14, 4);
+		std::memcpy(compact + 16, str.data() + 19, 4);
+		std::memcpy(compact + 20, str.data() + 24, 12);
+		hex = compact;
+	}
+	else
+	{
+		//dashes anywhere else
+		size_t len = 0;
+		for (char c : str)
+		{
+			if (c == '-') continue;
+			if (len == HEX_LEN) return false;
+
+			compact[len++] = c;
+		}
+
+		if (len != HEX_LEN) return false;
+		hex = compact;
+	}
+
+	unsigned char bytes[BYTE_LEN];
+	if (! decode_hex(hex, bytes))
+	{
+		return false;
+	}
+
+	std::memcpy(uuid._bytes, bytes, BYTE_LEN);
+	return true;
+}
+
+void UUID::toHex(char* out) const
+{
+	for (int i = 0; i < BYTE_LEN; ++i)
+	{
+		out[i * 2] = HEX_DIGITS[_bytes[i] >> 4];
+		out[i * 2 + 1] = HEX_DIGITS[_bytes[i] & 0x0F];
+	}
+}
+
+std::string UUID::toString() const
+{
+	std::string str(HEX_LEN, '0');
+	this->toHex(&str[0]);
+
+	return str;
+}
+
+bool UUID::isNil() const
+{
+	return *this == UUID();
+}
+
+size_t UUID::hash() const
+{
+	unsigned long long high, low;
+	std::memcpy(&high, _bytes, sizeof(high));
+	std::memcpy(&low, _bytes + sizeof(high), sizeof(low));
+
+	//ids are mostly random already, but ones made up by hand aren't. mix all
+	//the bits in so the low bits of the hash can be used as a table index
+	unsigned long long h = high ^ (low * 0x9E3779B97F4A7C15ULL);
+	h ^= h >> 32;
+	h *= 0xD6E8FEB86659FD93ULL;
+	h ^= h >> 32;
+
+	return static_cast<size_t>(h);
+}
+
+std::ostream& operator<<(std::ostream& os, const UUID& uuid)
+{
+	char hex[UUID::HEX_LEN];
+	uuid.toHex(hex);
+
+	return os.write(hex, UUID::HEX_LEN);
+}
+
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <string>
+
+#include <boost/utility/string_view.hpp>
+
+namespace aperture {
+
+/**
+ * A 128 bit asset or cap id. Ids arrive and are sent on as 32 lowercase hex
+ * characters, internally they are 16 bytes that compare and hash without
+ * touching the heap
+ */
+class UUID
+{
+public:
+	static const short HEX_LEN = 32;
+	static const short BYTE_LEN = 16;
+
+private:
+	unsigned char _bytes[BYTE_LEN];
+
+public:
+	/**
+	 * Constructs the nil UUID
+	 */
+	UUID();
+
+	/**
+	 * Constructs from the 16 raw bytes of an id
+	 */
+	explicit UUID(const unsigned char* bytes);
+
+	/**
+	 * Parses the 32 lowercase hex character form. Dashes anywhere in the string
+	 * are skipped, so the dashed 36 character form parses as well. Returns false
+	 * and leaves uuid untouched if the string isn't a valid id
+	 */
+	static bool parse(boost::string_view str, UUID& uuid);
+
+	/**
+	 * Writes the 32 lowercase hex characters of this id to out
+	 */
+	void toHex(char* out) const;
+
+	/**
+	 * Returns the 32 lowercase hex character form of this id
+	 */
+	std::string toString() const;
+
+	/**
+	 * Returns true if this is the nil (all zero) id
+	 */
+	bool isNil() const;
+
+	/**
+	 * Returns a well mixed hash of the id, suitable for open addressing tables
+	 */
+	size_t hash() const;
+
+	const unsigned char* data() const { return _bytes; }
+
+	bool operator==(const UUID& other) const
+	{
+		return std::memcmp(_bytes, other._bytes, BYTE_LEN) == 0;
+	}
+
+	bool operator!=(const UUID& other) const
+	{
+		return !(*this == other);
+	}
+
+	bool operator<(const UUID& other) const
+	{
+		return std::memcmp(_bytes, other._bytes, BYTE_LEN) < 0;
+	}
+};
+
+inline size_t hash_value(const UUID& uuid)
+{
+	return uuid.hash();
+}
+
+std::ostream& operator<<(std::ostream& os, const UUID& uuid);
+
+}
+
+namespace std {
+	template <>
+	struct hash<aperture::UUID>
+	{
+		size_t operator()(const aperture::UUID& uuid) const
+		{
+			return uuid.hash();
+		}
+	};
+}
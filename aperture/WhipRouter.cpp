@@ -0,0 +1,168 @@
+#include "stdafx.h"
+
+#include "WhipRouter.h"
+#include "AppLog.h"
+#include "BufferPool.h"
+
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <limits>
+
+using namespace aperture;
+
+namespace whip
+{
+	const unsigned int WhipRouter::SLOW_NODE_FACTOR;
+	const unsigned int WhipRouter::SLOW_NODE_MIN_US;
+
+	WhipRouter::WhipRouter(const std::vector<WhipURI>& serverURIs, boost::asio::io_service& ioService,
+		unsigned int connectionsPerServer)
+	:	_ioService(ioService),
+		_ring(nodeNames(serverURIs))
+	{
+		std::vector<std::string> names = nodeNames(serverURIs);
+
+		for (size_t i = 0; i < serverURIs.size(); ++i) {
+			boost::shared_ptr<Node> node(new Node());
+			node->name = names[i];
+			node->pool.reset(new AssetServerPool(serverURIs[i], ioService, connectionsPerServer));
+			node->requests = 0;
+			node->failovers = 0;
+
+			_nodes.push_back(node);
+		}
+	}
+
+	WhipRouter::~WhipRouter()
+	{
+	}
+
+	std::vector<std::string> WhipRouter::nodeNames(const std::vector<WhipURI>& serverURIs)
+	{
+		std::vector<std::string> names;
+		for (const WhipURI& uri : serverURIs) {
+			names.push_back(uri.getHostName() + ":" + boost::lexical_cast<std::string>(uri.getPort()));
+		}
+
+		return names;
+	}
+
+	void WhipRouter::connect()
+	{
+		for (boost::shared_ptr<Node> node : _nodes) {
+			node->pool->connect();
+		}
+	}
+
+	bool WhipRouter::isConnected() const
+	{
+		for (const boost::shared_ptr<Node>& node : _nodes) {
+			if (node->pool->isConnected()) return true;
+		}
+
+		return false;
+	}
+
+	void WhipRouter::getAsset(const UUID& uuid, boost::function<void (IAsset::ptr)> callBack)
+	{
+		std::vector<unsigned int> replicas;
+		if (_nodes.size() == 1) {
+			replicas.push_back(0);
+		} else {
+			replicas = _ring.owners(uuid, _nodes.size());
+		}
+
+		if (! this->forward(uuid, replicas, 0, callBack)) {
+			_ioService.post(boost::bind(callBack, IAsset::ptr()));
+		}
+	}
+
+	bool WhipRouter::forward(const UUID& uuid, const std::vector<unsigned int>& replicas, size_t position,
+		boost::function<void (IAsset::ptr)> callBack)
+	{
+		//the fastest probes among the candidates, to pass over a backed up owner
+		unsigned long long fastest = std::numeric_limits<unsigned long long>::max();
+		for (size_t i = position; i < replicas.size(); ++i) {
+			const AssetServerPool& pool = *_nodes[replicas[i]]->pool;
+			unsigned long long latency = pool.probeLatencyUs();
+			if (pool.isConnected() && latency != 0) {
+				fastest = std::min(fastest, latency);
+			}
+		}
+
+		size_t fallback = replicas.size();
+		for (; position < replicas.size(); ++position) {
+			Node& node = *_nodes[replicas[position]];
+			if (! node.pool->isConnected()) continue;
+
+			if (fallback == replicas.size()) fallback = position;
+
+			unsigned long long latency = node.pool->probeLatencyUs();
+			if (latency > SLOW_NODE_MIN_US && latency / SLOW_NODE_FACTOR > fastest) continue;
+
+			break;
+		}
+
+		if (position == replicas.size()) {
+			//nothing fast enough, take the first one up anyway
+			position = fallback;
+		}
+
+		if (position == replicas.size()) {
+			return false;
+		}
+
+		Node& node = *_nodes[replicas[position]];
+		++node.requests;
+		node.pool->getAsset(uuid, boost::bind(&WhipRouter::onAssetReceived, shared_from_this(),
+			uuid, replicas, position, callBack, _1));
+		return true;
+	}
+
+	void WhipRouter::onAssetReceived(const UUID& uuid, const std::vector<unsigned int>& replicas, size_t position,
+		boost::function<void (IAsset::ptr)> callBack, IAsset::ptr asset)
+	{
+		//an empty answer from a server that went away says nothing about the asset
+		if (! asset && ! _nodes[replicas[position]]->pool->isConnected()) {
+			if (this->forward(uuid, replicas, position + 1, callBack)) {
+				++_nodes[replicas[position]]->failovers;
+				return;
+			}
+		}
+
+		callBack(asset);
+	}
+
+	void WhipRouter::shutdown()
+	{
+		for (boost::shared_ptr<Node> node : _nodes) {
+			node->pool->shutdown();
+		}
+	}
+
+	void WhipRouter::writeStats(std::ostream& out) const
+	{
+		for (const boost::shared_ptr<Node>& node : _nodes) {
+			unsigned int connected = 0, breakersOpen = 0;
+			unsigned long long outstanding = 0;
+			for (const AssetServer::ptr& member : node->pool->getMembers()) {
+				if (member->isConnected()) ++connected;
+				if (member->isBreakerOpen()) ++breakersOpen;
+				outstanding += member->outstandingBytes();
+			}
+
+			out << "whip_" << node->name << "_connections=" << connected << "\n"
+				<< "whip_" << node->name << "_outstanding_bytes=" << outstanding << "\n"
+				<< "whip_" << node->name << "_requests=" << node->requests << "\n"
+				<< "whip_" << node->name << "_failovers=" << node->failovers << "\n"
+				<< "whip_" << node->name << "_probe_latency_us=" << node->pool->probeLatencyUs() << "\n"
+				<< "whip_" << node->name << "_breakers_open=" << breakersOpen << "\n";
+		}
+
+		BufferPool& buffers = BufferPool::instance();
+		out << "whip_buffers_reused=" << buffers.reused() << "\n"
+			<< "whip_buffers_allocated=" << buffers.allocated() << "\n"
+			<< "whip_buffers_idle_bytes=" << buffers.idleBytes() << "\n";
+	}
+}
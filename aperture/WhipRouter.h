@@ -0,0 +1,93 @@
+#pragma once
+
+#include "AssetServerPool.h"
+#include "HashRing.h"
+#include "IAsset.h"
+#include "IAssetServer.h"
+#include "UUID.h"
+#include "WhipURI.h"
+
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace whip
+{
+	/**
+	 * Spreads asset requests over several WHIP servers. Each asset id is owned
+	 * by one server picked by consistent hashing, and the servers following it
+	 * on the ring act as its replicas: a request goes to the first of them that
+	 * is connected and answering its probes in reasonable time, and is sent on
+	 * to the next one if its server disconnects before answering
+	 */
+	class WhipRouter : public boost::enable_shared_from_this<WhipRouter>, public aperture::IAssetServer
+	{
+	public:
+		typedef boost::shared_ptr<WhipRouter> ptr;
+
+	private:
+		struct Node
+		{
+			std::string name;
+			AssetServerPool::ptr pool;
+
+			std::atomic<unsigned long long> requests;
+			std::atomic<unsigned long long> failovers;
+		};
+
+		boost::asio::io_service& _ioService;
+
+		std::vector<boost::shared_ptr<Node> > _nodes;
+		aperture::HashRing _ring;
+
+		/// A node answering probes this many times slower than another replica
+		/// is passed over, unless it still answers within SLOW_NODE_MIN_US
+		static const unsigned int SLOW_NODE_FACTOR = 4;
+		static const unsigned int SLOW_NODE_MIN_US = 20000;
+
+		/**
+		 * Sends the request to the first connected node in replicas from position
+		 * on that is not much slower than the rest. Returns false if there is none
+		 */
+		bool forward(const aperture::UUID& uuid, const std::vector<unsigned int>& replicas, size_t position,
+			boost::function<void (aperture::IAsset::ptr)> callBack);
+
+		void onAssetReceived(const aperture::UUID& uuid, const std::vector<unsigned int>& replicas, size_t position,
+			boost::function<void (aperture::IAsset::ptr)> callBack, aperture::IAsset::ptr asset);
+
+		static std::vector<std::string> nodeNames(const std::vector<WhipURI>& serverURIs);
+
+	public:
+		/**
+		 * Creates a pool of connectionsPerServer connections to each of the servers
+		 */
+		WhipRouter(const std::vector<WhipURI>& serverURIs, boost::asio::io_service& ioService,
+			unsigned int connectionsPerServer);
+		virtual ~WhipRouter();
+
+		/**
+		 * Connects to every server
+		 */
+		void connect();
+
+		/**
+		 * Returns whether any server is ready for requests
+		 */
+		virtual bool isConnected() const;
+
+		virtual void getAsset(const aperture::UUID& uuid, boost::function<void (aperture::IAsset::ptr)> callBack);
+
+		virtual void shutdown();
+
+		/**
+		 * Writes the connections, outstanding bytes, requests, failovers, probe
+		 * latency and open breakers of every server, and how well the receive
+		 * blocks are being recycled
+		 */
+		virtual void writeStats(std::ostream& out) const;
+	};
+}
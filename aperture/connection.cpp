@@ -12,9 +12,14 @@
 
 #include "connection.hpp"
 
+#include <cerrno>
 #include <vector>
 #include <boost/bind.hpp>
 
+#ifdef AP_HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 #include "connection_manager.hpp"
 #include "request_handler.hpp"
 #include "AppLog.h"
@@ -28,15 +33,24 @@ namespace http {
 
 		connection::connection(boost::asio::io_service& io_service,
 			connection_manager& manager, request_handler& handler)
-			: socket_(io_service),
+			: strand_(io_service),
+			socket_(io_service),
 			connection_manager_(manager),
 			request_handler_(handler),
 			_closeAfterResponseWritten(false),
 			_connKillTimer(io_service),
-			_requestInProgress(false),
+			_inFlight(0),
+			_writeCount(0),
+			_writeInProgress(false),
+			_readInProgress(false),
+			_badRequestReceived(false),
+			_peerClosed(false),
+			_draining(false),
+			_replied(false),
 			_tokenBucketTimer(io_service)
 		{
 			_debug = (aperture::Settings::instance().config())["debug"].as<bool>();
+			_pipelineDepth = std::max(1u, (aperture::Settings::instance().config())["http_pipeline_depth"].as<unsigned int>());
 
 			if (_debug)
 			{
@@ -53,11 +67,12 @@ namespace http {
 
 		void connection::init_new_request()
 		{
-			request::ptr newRequest(new request);
-			newRequest->is_bad = false;
-			newRequest->is_ready = false;
+			pipelined_request::ptr slot(new pipelined_request);
+			slot->req.reset(new request);
+			slot->req->is_bad = false;
+			slot->req->is_ready = false;
 
-			requests_.push(newRequest);
+			requests_.push_back(slot);
 		}
 
 		void connection::start()
@@ -66,13 +81,43 @@ namespace http {
 			this->reset_timeout_timer();			
 			
 			this->init_new_request();
+			this->start_read();
+		}
+
+		void connection::start_read()
+		{
+			_readInProgress = true;
+
 			socket_.async_read_some(boost::asio::buffer(buffer_),
-				boost::bind(&connection::handle_read, shared_from_this(),
+				strand_.wrap(boost::bind(&connection::handle_read, shared_from_this(),
 				boost::asio::placeholders::error,
-				boost::asio::placeholders::bytes_transferred));
+				boost::asio::placeholders::bytes_transferred)));
 		}
 
 		void connection::stop()
+		{
+			strand_.dispatch(boost::bind(&connection::handle_stop, shared_from_this()));
+		}
+
+		void connection::drain()
+		{
+			strand_.dispatch(boost::bind(&connection::handle_drain, shared_from_this()));
+		}
+
+		void connection::handle_drain()
+		{
+			_draining = true;
+
+			//a new connection was opened to send a request, which may not have
+			//arrived yet. Others are only closed when idle between requests
+			boost::system::error_code ec;
+			if (_inFlight == 0 && _replied && socket_.available(ec) == 0)
+			{
+				connection_manager_.stop(shared_from_this());
+			}
+		}
+
+		void connection::handle_stop()
 		{
 			if (_debug)
 			{
@@ -89,65 +134,73 @@ namespace http {
 			_connKillTimer.expires_from_now(seconds(MAXIMUM_LIVE_TIME));
 			
 			_connKillTimer.async_wait(
-				boost::bind(&connection::on_timeout, shared_from_this(), 
-				boost::asio::placeholders::error));
+				strand_.wrap(boost::bind(&connection::on_timeout, shared_from_this(), 
+				boost::asio::placeholders::error)));
 		}
 
-		void connection::process_next_request()
+		void connection::process_requests()
 		{
 			_lastActiveTime = second_clock::local_time();
 
-			if (requests_.front()->is_bad)
+			bool allDispatched = true;
+
+			for (const pipelined_request::ptr& slot : requests_)
 			{
-				_requestInProgress = true;
+				if (slot->dispatched) continue;
 
-				reply_ = reply::stock_reply(reply::bad_request);
-				header connClose;
-				connClose.name = "Connection";
-				connClose.value = "close";
+				if (! slot->req->is_ready && ! slot->req->is_bad)
+				{
+					//still being parsed
+					break;
+				}
 
-				reply_.headers.push_back(connClose);
+				if (_inFlight >= _pipelineDepth)
+				{
+					allDispatched = false;
+					break;
+				}
 
-				_closeAfterResponseWritten = true;
+				slot->dispatched = true;
+				++_inFlight;
 
-				boost::asio::async_write(socket_, reply_.to_buffers(),
-					boost::bind(&connection::handle_write, shared_from_this(),
-					boost::asio::placeholders::error));
-			}
-			else if (requests_.front()->is_ready)
-			{
-				_requestInProgress = true;
+				if (slot->req->is_bad)
+				{
+					//nothing after a bad request is answered
+					slot->rep = reply::stock_reply(reply::bad_request);
+					slot->complete = true;
+					break;
+				}
 
-				reply_.reset();
-				request_handler_.handle_request(*requests_.front(), reply_, 
-					boost::bind(&connection::reply_ready, this));
+				slot->rep.reset();
+				request_handler_.handle_request(*slot->req, slot->rep, 
+					strand_.wrap(boost::bind(&connection::reply_ready, shared_from_this(), slot)));
 			}
-			else
-			{
-				//nothing is ready, begin a recv
-				_requestInProgress = false;
 
-				socket_.async_read_some(boost::asio::buffer(buffer_),
-				boost::bind(&connection::handle_read, shared_from_this(),
-					boost::asio::placeholders::error,
-					boost::asio::placeholders::bytes_transferred));
+			this->write_completed_replies();
+
+			if (allDispatched && ! _readInProgress && ! _badRequestReceived && ! _peerClosed
+				&& ! _closeAfterResponseWritten && ! _draining)
+			{
+				this->start_read();
 			}
 		}
 
 		void connection::handle_read(const boost::system::error_code& e,
 			std::size_t bytes_transferred)
 		{
+			_readInProgress = false;
+
 			if (!e)
 			{
 				_lastActiveTime = second_clock::local_time();
 
-				boost::array<char, 8192>::iterator bufferPos = buffer_.data();
+				const char* bufferPos = buffer_.data();
 				
 				while (bufferPos != buffer_.data() + bytes_transferred)
 				{
 					boost::tribool result;
 					boost::tie(result, bufferPos) = request_parser_.parse(
-						*requests_.back(), bufferPos, buffer_.data() + bytes_transferred);
+						*requests_.back()->req, bufferPos, buffer_.data() + bytes_transferred);
 
 					if (result)
 					{
@@ -161,29 +214,14 @@ namespace http {
 						//reset the parser
 						request_parser_.reset();
 						//the connection will be terminated once this request is processed
+						_badRequestReceived = true;
 						break;
 					}
-					else
-					{
-						if (! requests_.front()->is_ready)
-						{
-							//continue receiving until we have at least one completed request
-							socket_.async_read_some(boost::asio::buffer(buffer_),
-							boost::bind(&connection::handle_read, shared_from_this(),
-								boost::asio::placeholders::error,
-								boost::asio::placeholders::bytes_transferred));
-
-							break;
-						}
-					}
 				}
 
-				if (requests_.front()->is_ready || requests_.front()->is_bad)
-				{
-					this->process_next_request();
-				}
+				this->process_requests();
 			}
-			else
+			else if (_inFlight == 0)
 			{
 				if (_debug)
 				{
@@ -194,16 +232,30 @@ namespace http {
 
 				connection_manager_.stop(shared_from_this());
 			}
+			else
+			{
+				//let the replies already in flight go out first
+				_peerClosed = true;
+			}
 		}
 
 		void connection::handle_write(const boost::system::error_code& e)
 		{
+			_writeInProgress = false;
+
 			if (!e)
 			{
-				if (_closeAfterResponseWritten)
+				for (size_t i = 0; i < _writeCount; ++i)
+				{
+					requests_.pop_front();
+				}
+
+				_inFlight -= _writeCount;
+				_writeCount = 0;
+				_replied = true;
+
+				if (_closeAfterResponseWritten || ((_peerClosed || _draining) && _inFlight == 0))
 				{
-					requests_.pop();
-					
 					if (_debug)
 					{
 						aperture::AppLog::instance().out() 
@@ -218,10 +270,8 @@ namespace http {
 				}
 				else
 				{
-					requests_.pop();
-
-					//handle next request
-					this->process_next_request();
+					//handle next requests
+					this->process_requests();
 				}
 			}
 			else
@@ -230,35 +280,153 @@ namespace http {
 			}
 		}
 
-		void connection::reply_ready()
+		void connection::reply_ready(pipelined_request::ptr slot)
+		{
+			slot->complete = true;
+
+			this->write_completed_replies();
+		}
+
+		bool connection::finish_reply(pipelined_request& slot)
 		{
-			if (requests_.front()->header_value("Connection") == "close"
+			if (slot.req->is_bad || slot.req->header_value("Connection") == "close"
 				|| _closeAfterResponseWritten)
 			{
 				header connClose;
 				connClose.name = "Connection";
 				connClose.value = "close";
 
-				reply_.headers.push_back(connClose);
+				slot.rep.headers.push_back(connClose);
 
 				_closeAfterResponseWritten = true;
 			}
 
-			boost::shared_ptr<TokenBucket> bucket = request_handler_.getBucket(reply_.token);
+			return _closeAfterResponseWritten;
+		}
 
-			if (bucket)
+		void connection::write_completed_replies()
+		{
+			if (_writeInProgress || _closeAfterResponseWritten)
 			{
-				reply_.token_bucket = bucket;
-				boost::asio::async_write(socket_, reply_.header_buffers(),
-					boost::bind(&connection::handle_tb_header_write, shared_from_this(),
-					boost::asio::placeholders::error));
+				return;
 			}
-			else
+
+			std::vector<boost::asio::const_buffer> buffers;
+			size_t count = 0;
+
+			for (const pipelined_request::ptr& slot : requests_)
+			{
+				if (! slot->complete) break;
+
+				boost::shared_ptr<TokenBucket> bucket = request_handler_.getBucket(slot->rep.token);
+
+				if (bucket)
+				{
+					//throttled replies go out on their own
+					if (count != 0) break;
+
+					if (slot->rep.body_stream && ! slot->rep.body_stream->isComplete())
+					{
+						//throttled replies are sent in chunks from the complete asset
+						if (slot->rep.body_stream->hasFailed())
+						{
+							connection_manager_.stop(shared_from_this());
+						}
+						else
+						{
+							slot->rep.body_stream->notify(slot->rep.body_stream->getBinaryDataSize(),
+								strand_.wrap(boost::bind(&connection::write_completed_replies, shared_from_this())));
+						}
+
+						return;
+					}
+
+					this->finish_reply(*slot);
+
+					if (slot->rep.body_file)
+					{
+						//the cap was limited after the reply was made, send it from memory
+						try
+						{
+							slot->rep.map_file_body();
+						}
+						catch (const std::exception& e)
+						{
+							aperture::AppLog::instance().out()
+								<< "[HTTP] " << e.what() << std::endl;
+
+							connection_manager_.stop(shared_from_this());
+							return;
+						}
+					}
+
+					slot->rep.token_bucket = bucket;
+					_writeInProgress = true;
+					_writeCount = 1;
+
+					boost::asio::async_write(socket_, slot->rep.header_buffers(),
+						strand_.wrap(boost::bind(&connection::handle_tb_header_write, shared_from_this(),
+						boost::asio::placeholders::error)));
+
+					return;
+				}
+
+#ifdef AP_HAVE_SENDFILE
+				if (slot->rep.body_file)
+				{
+					//replies from the disk cache go out on their own too
+					if (count != 0) break;
+
+					this->finish_reply(*slot);
+
+					_writeInProgress = true;
+					_writeCount = 1;
+
+					boost::asio::async_write(socket_, slot->rep.header_buffers(),
+						strand_.wrap(boost::bind(&connection::handle_file_writable, shared_from_this(),
+						boost::asio::placeholders::error)));
+
+					return;
+				}
+#endif
+
+				if (slot->rep.body_stream)
+				{
+					//replies still coming in from a backend go out on their own, as it arrives
+					if (count != 0) break;
+
+					this->finish_reply(*slot);
+
+					_writeInProgress = true;
+					_writeCount = 1;
+
+					boost::asio::async_write(socket_, slot->rep.header_buffers(),
+						strand_.wrap(boost::bind(&connection::handle_stream_header_write, shared_from_this(),
+						boost::asio::placeholders::error)));
+
+					return;
+				}
+
+				bool closing = this->finish_reply(*slot);
+
+				std::vector<boost::asio::const_buffer> replyBuffers = slot->rep.to_buffers();
+				buffers.insert(buffers.end(), replyBuffers.begin(), replyBuffers.end());
+				++count;
+
+				if (closing) break;
+			}
+
+			if (count == 0)
 			{
-				boost::asio::async_write(socket_, reply_.to_buffers(),
-					boost::bind(&connection::handle_write, shared_from_this(),
-					boost::asio::placeholders::error));
+				return;
 			}
+
+			_writeInProgress = true;
+			_writeCount = count;
+
+			boost::asio::async_write(socket_, buffers,
+				strand_.wrap(boost::bind(&connection::handle_write, shared_from_this(),
+				boost::asio::placeholders::error)));
 		}
 
 		void connection::handle_tb_header_write(const boost::system::error_code& e)
@@ -277,7 +445,9 @@ namespace http {
 		{
 			_lastActiveTime = second_clock::local_time();
 
-			if (reply_.bytes_sent == reply_.content.size())
+			reply& rep = requests_.front()->rep;
+
+			if (rep.remaining_bytes() == 0)
 			{
 				//done
 				this->handle_write(boost::system::error_code());
@@ -285,20 +455,20 @@ namespace http {
 			}
 
 			//otherwise, check to see if we have enough tokens to send now
-			size_t transmissionSize = std::min(reply_.remaining_bytes(), (size_t)reply_.token_bucket->getMaxBurst());
-			if (reply_.token_bucket->removeTokens(transmissionSize))
+			size_t transmissionSize = std::min(rep.remaining_bytes(), (size_t)rep.token_bucket->getMaxBurst());
+			if (rep.token_bucket->removeTokens(transmissionSize))
 			{
 				//we have enough tokens, send out a chunk
-				boost::asio::async_write(socket_, reply_.get_next_chunk(transmissionSize),
-						boost::bind(&connection::handle_tb_write, shared_from_this(),
+				boost::asio::async_write(socket_, rep.get_next_chunk(transmissionSize),
+						strand_.wrap(boost::bind(&connection::handle_tb_write, shared_from_this(),
 						boost::asio::placeholders::error,
-						boost::asio::placeholders::bytes_transferred));
+						boost::asio::placeholders::bytes_transferred)));
 			}
 			else
 			{
 				//we do not have enough tokens, schedule a retry
 				_tokenBucketTimer.expires_from_now(std::chrono::milliseconds((int)(TokenBucket::DRIP_PERIOD_PERIOD_MS)));
-				_tokenBucketTimer.async_wait(boost::bind(&connection::on_tb_wait_timeout, this, boost::asio::placeholders::error));
+				_tokenBucketTimer.async_wait(strand_.wrap(boost::bind(&connection::on_tb_wait_timeout, shared_from_this(), boost::asio::placeholders::error)));
 			}
 		}
 
@@ -315,7 +485,7 @@ namespace http {
 		{
 			if (!e)
 			{
-				reply_.bytes_sent += bytes_transferred;
+				requests_.front()->rep.bytes_sent += bytes_transferred;
 				this->try_send_next_chunk();
 			}
 			else
@@ -324,12 +494,131 @@ namespace http {
 			}
 		}
 
+		void connection::handle_file_writable(const boost::system::error_code& e)
+		{
+			boost::system::error_code ec = e;
+
+			if (!ec)
+			{
+				socket_.native_non_blocking(true, ec);
+			}
+
+			if (!ec)
+			{
+				this->send_file_body();
+			}
+			else
+			{
+				this->handle_write(ec);
+			}
+		}
+
+		void connection::send_file_body()
+		{
+#ifdef AP_HAVE_SENDFILE
+			_lastActiveTime = second_clock::local_time();
+
+			reply& rep = requests_.front()->rep;
+
+			while (rep.remaining_bytes() != 0)
+			{
+				off_t offset = static_cast<off_t>(rep.body_file_offset + rep.bytes_sent);
+				ssize_t sent = ::sendfile(socket_.native_handle(), rep.body_file->getFile(),
+					&offset, rep.remaining_bytes());
+
+				if (sent > 0)
+				{
+					rep.bytes_sent += sent;
+				}
+				else if (sent < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				{
+					//the socket buffer is full, continue once it drains
+					socket_.async_write_some(boost::asio::null_buffers(),
+						strand_.wrap(boost::bind(&connection::handle_file_writable, shared_from_this(),
+						boost::asio::placeholders::error)));
+					return;
+				}
+				else
+				{
+					//a short file ends the reply early, the client sees the connection close
+					this->handle_write(sent == 0 ? boost::asio::error::eof
+						: boost::system::error_code(errno, boost::system::system_category()));
+					return;
+				}
+			}
+
+			this->handle_write(boost::system::error_code());
+#endif
+		}
+
+		void connection::handle_stream_header_write(const boost::system::error_code& e)
+		{
+			if (!e)
+			{
+				this->send_stream_body();
+			}
+			else
+			{
+				this->handle_write(e);
+			}
+		}
+
+		void connection::send_stream_body()
+		{
+			_lastActiveTime = second_clock::local_time();
+
+			reply& rep = requests_.front()->rep;
+
+			if (rep.remaining_bytes() == 0)
+			{
+				this->handle_write(boost::system::error_code());
+				return;
+			}
+
+			size_t ready = rep.stream_bytes_ready() - rep.bytes_sent;
+
+			if (ready != 0)
+			{
+				boost::asio::async_write(socket_, rep.get_next_chunk(ready),
+					strand_.wrap(boost::bind(&connection::handle_stream_write, shared_from_this(),
+					boost::asio::placeholders::error,
+					boost::asio::placeholders::bytes_transferred)));
+			}
+			else if (rep.body_stream->hasFailed())
+			{
+				//the backend broke off, the client sees the connection close
+				this->handle_write(boost::asio::error::connection_aborted);
+			}
+			else
+			{
+				rep.wait_for_stream(strand_.wrap(boost::bind(&connection::send_stream_body, shared_from_this())));
+			}
+		}
+
+		void connection::handle_stream_write(const boost::system::error_code& e,
+			size_t bytes_transferred)
+		{
+			if (!e)
+			{
+				requests_.front()->rep.bytes_sent += bytes_transferred;
+				this->send_stream_body();
+			}
+			else
+			{
+				this->handle_write(e);
+			}
+		}
+
 		void connection::on_timeout(const boost::system::error_code& e)
 		{
 			if (e != boost::asio::error::operation_aborted)
 			{
 				if (second_clock::local_time() - _lastActiveTime > seconds(MAXIMUM_LIVE_TIME) &&
-					! _requestInProgress)
+					_inFlight == 0)
 				{
 					if (_debug)
 					{
@@ -13,7 +13,7 @@
 
 #include "stdafx.h"
 
-#include <queue>
+#include <deque>
 
 #include <boost/asio.hpp>
 #include <boost/asio/steady_timer.hpp>
@@ -48,9 +48,14 @@ public:
   /// Start the first asynchronous operation for the connection.
   void start();
 
-  /// Stop all asynchronous operations associated with the connection.
+  /// Stop all asynchronous operations associated with the connection. Safe to
+  /// call from any thread.
   void stop();
 
+  /// Stop reading requests and close the connection once the replies already
+  /// in flight have been written. Safe to call from any thread.
+  void drain();
+
 private:
   /// Maximum time for this connection to stay open for requests in seconds
   static const int MAXIMUM_LIVE_TIME = 30;
@@ -73,11 +78,60 @@ private:
   void handle_tb_write(const boost::system::error_code& e,
 	  size_t bytes_transferred);
 
-  void reply_ready();
+  /// Handle the socket becoming writable for a reply sent from a file, the
+  /// first time once its headers were written.
+  void handle_file_writable(const boost::system::error_code& e);
+
+  /// Sends as much of the front reply's file body as the socket takes and
+  /// waits for it to become writable again until it is all sent.
+  void send_file_body();
+
+  /// Handle completion of the header write of a reply streamed from a backend.
+  void handle_stream_header_write(const boost::system::error_code& e);
+
+  /// Sends what has arrived of the front reply's streamed body and waits for
+  /// more until it is all sent.
+  void send_stream_body();
+
+  /// Handle completion of a write of part of a streamed body.
+  void handle_stream_write(const boost::system::error_code& e,
+      size_t bytes_transferred);
+
+  /// A request received on this connection and the reply being built for it.
+  /// Slots stay at the front of the queue until their reply has been written.
+  struct pipelined_request
+  {
+    typedef boost::shared_ptr<pipelined_request> ptr;
+
+    pipelined_request() : dispatched(false), complete(false) {}
+
+    request::ptr req;
+    reply rep;
+
+    /// Whether the request has been handed to the request handler
+    bool dispatched;
+
+    /// Whether the reply is ready to be written
+    bool complete;
+  };
+
+  void reply_ready(pipelined_request::ptr slot);
 
   void init_new_request();
 
-  void process_next_request();
+  /// Dispatches every parsed request up to the pipeline depth, writes out
+  /// completed replies and reads more when everything parsed is dispatched
+  void process_requests();
+
+  /// Writes the completed replies at the front of the queue in request order,
+  /// coalesced into one write
+  void write_completed_replies();
+
+  /// Adds the Connection: close header when this reply ends the connection.
+  /// Returns true if it does.
+  bool finish_reply(pipelined_request& slot);
+
+  void start_read();
 
   void on_timeout(const boost::system::error_code& e);
 
@@ -85,6 +139,15 @@ private:
 
   void reset_timeout_timer();
 
+  /// Performs the stop on the connection's strand
+  void handle_stop();
+
+  /// Performs the drain on the connection's strand
+  void handle_drain();
+
+  /// Strand that serializes all handlers for this connection
+  boost::asio::io_service::strand strand_;
+
   /// Socket for the connection.
   boost::asio::ip::tcp::socket socket_;
 
@@ -97,15 +160,13 @@ private:
   /// Buffer for incoming data.
   boost::array<char, 8192> buffer_;
 
-  /// A list of waiting requests
-  std::queue<request::ptr> requests_;
+  /// Requests in the order they were received. The last one is still being
+  /// parsed.
+  std::deque<pipelined_request::ptr> requests_;
 
   /// The parser for the incoming request.
   request_parser request_parser_;
 
-  /// The reply to be sent back to the client.
-  reply reply_;
-
   /// Asset server we're working with
   whip::AssetServer::ptr _assetServer;
 
@@ -121,8 +182,32 @@ private:
   /// Closes the connection after MAXIMUM_LIVE_TIME
   boost::asio::deadline_timer _connKillTimer;
 
-  /// Whether or not a request is being processed
-  bool _requestInProgress;
+  /// Maximum number of requests dispatched and not yet written
+  unsigned int _pipelineDepth;
+
+  /// Number of requests dispatched and not yet written
+  unsigned int _inFlight;
+
+  /// Number of replies at the front of the queue in the current write
+  size_t _writeCount;
+
+  /// Whether or not a write is in progress
+  bool _writeInProgress;
+
+  /// Whether or not a read is in progress
+  bool _readInProgress;
+
+  /// Whether the last request parsed was bad. Nothing after it is read.
+  bool _badRequestReceived;
+
+  /// The read side failed, the connection closes once in flight replies are written
+  bool _peerClosed;
+
+  /// The server is handing over to another process, no more requests are read
+  bool _draining;
+
+  /// Whether a reply has been written on this connection
+  bool _replied;
 
   boost::asio::steady_timer _tokenBucketTimer;
 };
@@ -18,21 +18,58 @@ namespace server {
 
 void connection_manager::start(connection_ptr c)
 {
-  connections_.insert(c);
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    connections_.insert(c);
+  }
   c->start();
 }
 
 void connection_manager::stop(connection_ptr c)
 {
-  connections_.erase(c);
+  boost::function<void()> drained;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    connections_.erase(c);
+    if (connections_.empty())
+      drained.swap(drained_);
+  }
   c->stop();
+
+  if (drained)
+    drained();
 }
 
 void connection_manager::stop_all()
 {
-  std::for_each(connections_.begin(), connections_.end(),
+  std::set<connection_ptr> connections;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    connections.swap(connections_);
+    drained_.clear();
+  }
+  std::for_each(connections.begin(), connections.end(),
       boost::bind(&connection::stop, _1));
-  connections_.clear();
+}
+
+void connection_manager::drain_all(boost::function<void()> drained)
+{
+  std::set<connection_ptr> connections;
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    connections = connections_;
+    if (!connections.empty())
+      drained_ = drained;
+  }
+
+  if (connections.empty())
+  {
+    drained();
+    return;
+  }
+
+  std::for_each(connections.begin(), connections.end(),
+      boost::bind(&connection::drain, _1));
 }
 
 } // namespace server
@@ -12,7 +12,9 @@
 #define HTTP_CONNECTION_MANAGER_HPP
 
 #include <set>
+#include <boost/function.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
 #include "connection.hpp"
 
 namespace http {
@@ -33,9 +35,19 @@ public:
   /// Stop all connections.
   void stop_all();
 
+  /// Let all connections finish the replies they are writing and close them.
+  /// The callback is run once the last one has closed.
+  void drain_all(boost::function<void()> drained);
+
 private:
   /// The managed connections.
   std::set<connection_ptr> connections_;
+
+  /// Run when the last connection closes while draining.
+  boost::function<void()> drained_;
+
+  /// Protects connections_ since connections are stopped from many threads.
+  boost::mutex mutex_;
 };
 
 } // namespace server
@@ -7,7 +7,7 @@
 #include "server.hpp"
 #include "AppLog.h"
 #include "Settings.h"
-#include "AssetServer.h"
+#include "WhipRouter.h"
 #include "WhipURI.h"
 #include "CloudFilesConnector.h"
 
@@ -46,12 +46,15 @@ int main(int argc, char* argv[])
 			AppLog::instance().out() << "DEBUGGING ENABLED" << std::endl;
 		}
 
-		// Start connection to whip server
-		whip::AssetServer::ptr assetServer;
+		// Start connection to whip servers
+		whip::WhipRouter::ptr assetServer;
 		if (config["enable_whip"].as<bool>()) {
-			whip::WhipURI uri = Settings::instance().getWhipURL();
-			AppLog::instance().out() << "Starting connection to WHIP server: " << uri.getHostName() << ":" << uri.getPort() << std::endl;
-			assetServer.reset(new whip::AssetServer(uri, ioService));
+			std::vector<whip::WhipURI> uris = Settings::instance().getWhipURLs();
+			for (const whip::WhipURI& uri : uris) {
+				AppLog::instance().out() << "Starting connection to WHIP server: " << uri.getHostName() << ":" << uri.getPort() << std::endl;
+			}
+
+			assetServer.reset(new whip::WhipRouter(uris, ioService, config["whip_connections"].as<unsigned int>()));
 			assetServer->connect();
 		}
 
@@ -115,7 +115,10 @@ const char crlf[] = { '\r', '\n' };
 std::vector<boost::asio::const_buffer> reply::to_buffers()
 {
   std::vector<boost::asio::const_buffer> buffers;
-  buffers.push_back(status_strings::to_buffer(status));
+  if (boost::asio::buffer_size(rendered_headers) != 0)
+    buffers.push_back(rendered_headers);
+  else
+    buffers.push_back(status_strings::to_buffer(status));
   for (std::size_t i = 0; i < headers.size(); ++i)
   {
     header& h = headers[i];
@@ -125,14 +128,20 @@ std::vector<boost::asio::const_buffer> reply::to_buffers()
     buffers.push_back(boost::asio::buffer(misc_strings::crlf));
   }
   buffers.push_back(boost::asio::buffer(misc_strings::crlf));
-  buffers.push_back(boost::asio::buffer(content));
+  if (body_asset)
+    buffers.push_back(body);
+  else
+    buffers.push_back(boost::asio::buffer(content));
   return buffers;
 }
 
 std::vector<boost::asio::const_buffer> reply::header_buffers()
 {
 	std::vector<boost::asio::const_buffer> buffers;
-  buffers.push_back(status_strings::to_buffer(status));
+  if (boost::asio::buffer_size(rendered_headers) != 0)
+    buffers.push_back(rendered_headers);
+  else
+    buffers.push_back(status_strings::to_buffer(status));
   for (std::size_t i = 0; i < headers.size(); ++i)
   {
     header& h = headers[i];
@@ -145,23 +154,112 @@ std::vector<boost::asio::const_buffer> reply::header_buffers()
   return buffers;
 }
 
+std::string reply::render_headers(status_type status, const std::vector<header>& headers)
+{
+  boost::asio::const_buffer statusLine = status_strings::to_buffer(status);
+
+  std::string rendered(boost::asio::buffer_cast<const char*>(statusLine),
+    boost::asio::buffer_size(statusLine));
+  for (const header& h : headers)
+  {
+    rendered.append(h.name);
+    rendered.append(misc_strings::name_value_separator, sizeof(misc_strings::name_value_separator));
+    rendered.append(h.value);
+    rendered.append(misc_strings::crlf, sizeof(misc_strings::crlf));
+  }
+
+  return rendered;
+}
+
 void reply::reset()
 {
 	this->status = ok;
 	this->content.clear();
     this->headers.clear();
+	this->rendered_headers = boost::asio::const_buffer();
 	this->bytes_sent = 0;
 	this->token_bucket = boost::shared_ptr<TokenBucket>();
+	this->body_asset.reset();
+	this->body = boost::asio::const_buffer();
+	this->body_file.reset();
+	this->body_stream.reset();
+}
+
+void reply::set_body(aperture::IAsset::ptr asset, boost::asio::const_buffer data)
+{
+	this->content.clear();
+	this->body_asset = asset;
+	this->body = data;
+	this->body_file.reset();
+	this->body_stream.reset();
+}
+
+void reply::set_stream_body(aperture::StreamingAsset::ptr stream, boost::asio::const_buffer data)
+{
+	this->set_body(stream, data);
+	this->body_stream = stream;
+}
+
+namespace {
+
+/// Where a streamed body starts in its asset
+size_t stream_body_offset(const reply& rep)
+{
+	return boost::asio::buffer_cast<const aperture::byte*>(rep.body)
+		- boost::asio::buffer_cast<const aperture::byte*>(rep.body_stream->getAssetData());
+}
+
+} // namespace
+
+size_t reply::stream_bytes_ready() const
+{
+	size_t offset = stream_body_offset(*this);
+	size_t available = body_stream->available();
+
+	return available <= offset ? 0 : std::min(available - offset, boost::asio::buffer_size(body));
+}
+
+void reply::wait_for_stream(boost::function<void()> callBack)
+{
+	body_stream->notify(stream_body_offset(*this) + bytes_sent + 1, callBack);
+}
+
+void reply::set_file_body(aperture::DiskAsset::ptr asset, unsigned long long offset, size_t size)
+{
+	this->content.clear();
+	this->body_asset = asset;
+	this->body = boost::asio::const_buffer();
+	this->body_stream.reset();
+	this->body_file = asset;
+	this->body_file_offset = offset;
+	this->body_file_size = size;
+}
+
+void reply::map_file_body()
+{
+	aperture::DiskAsset::ptr file = this->body_file;
+	boost::asio::const_buffer data = file->getAssetData();
+
+	this->set_body(file, boost::asio::buffer(data + (body_file_offset - file->getFileOffset()), body_file_size));
+}
+
+size_t reply::content_size() const
+{
+	if (body_file)
+		return body_file_size;
+
+	return body_asset ? boost::asio::buffer_size(body) : content.size();
 }
 
 size_t reply::remaining_bytes() const
 {
-	return content.size() - bytes_sent;
+	return this->content_size() - bytes_sent;
 }
 
-boost::asio::mutable_buffers_1 reply::get_next_chunk(size_t maxSize)
+boost::asio::const_buffers_1 reply::get_next_chunk(size_t maxSize)
 {
-	return boost::asio::buffer(&content[bytes_sent], std::min(maxSize, this->remaining_bytes()));
+	const char* data = body_asset ? boost::asio::buffer_cast<const char*>(body) : content.data();
+	return boost::asio::buffer(data + bytes_sent, std::min(maxSize, this->remaining_bytes()));
 }
 
 namespace stock_replies {
@@ -295,6 +393,7 @@ reply reply::stock_reply(reply::status_type status, const header& addnlHeader)
 {
   reply rep;
   rep.status = status;
+  rep.bytes_sent = 0;
   rep.content = stock_replies::to_string(status);
   rep.headers.resize(addnlHeader.name == "" ? 2 : 3);
   rep.headers[0].name = "Content-Length";
@@ -15,6 +15,9 @@
 #include <vector>
 #include <boost/asio.hpp>
 #include "header.hpp"
+#include "IAsset.h"
+#include "DiskAsset.h"
+#include "StreamingAsset.h"
 
 class TokenBucket;
 
@@ -50,11 +53,37 @@ struct reply
   /// The headers to be included in the reply.
   std::vector<header> headers;
 
+  /// A pre-rendered status line and headers that are sent in place of the status
+  /// line when not empty. The headers vector is still sent after it. The memory
+  /// is owned by body_asset.
+  boost::asio::const_buffer rendered_headers;
+
   /// The content to be sent in the reply.
   std::string content;
 
+  /// The asset the body is sent from instead of content. Holding the reference
+  /// keeps the asset data alive until the write has completed.
+  aperture::IAsset::ptr body_asset;
+
+  /// The part of body_asset's data to send as the body.
+  boost::asio::const_buffer body;
+
+  /// When set the body is sent from this asset's file with sendfile instead
+  /// of from body. The connection writes the headers first and the file after.
+  aperture::DiskAsset::ptr body_file;
+
+  /// Offset of the body in body_file's file.
+  unsigned long long body_file_offset;
+
+  /// Size of the body in body_file's file.
+  size_t body_file_size;
+
+  /// When set body is part of an asset still coming in from a backend. The
+  /// connection sends it as it arrives.
+  aperture::StreamingAsset::ptr body_stream;
+
   /// The caps token this is a reply on
-  std::string token;
+  aperture::UUID token;
 
   /// The number of bytes sent if we're running under a token bucket
   size_t bytes_sent;
@@ -73,12 +102,39 @@ struct reply
   /// Resets this reply for reuse
   void reset();
 
+  /// Renders the status line and headers as they are sent on the wire, without
+  /// the blank line that ends them.
+  static std::string render_headers(status_type status, const std::vector<header>& headers);
+
   /// Get a stock reply.
   static reply stock_reply(status_type status, const header& addnlHeader = header());
 
+  /// Sends the given part of the asset data as the body without copying it.
+  void set_body(aperture::IAsset::ptr asset, boost::asio::const_buffer data);
+
+  /// Sends the given part of a streaming asset's data as the body, as it arrives.
+  void set_stream_body(aperture::StreamingAsset::ptr stream, boost::asio::const_buffer data);
+
+  /// The number of body bytes of a streamed body that have arrived so far.
+  size_t stream_bytes_ready() const;
+
+  /// Calls back once more of a streamed body has arrived than was sent, or
+  /// the stream failed.
+  void wait_for_stream(boost::function<void()> callBack);
+
+  /// Sends size bytes at offset in the asset's file as the body.
+  void set_file_body(aperture::DiskAsset::ptr asset, unsigned long long offset, size_t size);
+
+  /// Turns a file body into one sent from the mapped asset data, for replies
+  /// that have to be sent in chunks.
+  void map_file_body();
+
+  /// The size of the body, whether it comes from content or an asset.
+  size_t content_size() const;
+
   size_t remaining_bytes() const;
 
-  boost::asio::mutable_buffers_1 get_next_chunk(size_t maxSize);
+  boost::asio::const_buffers_1 get_next_chunk(size_t maxSize);
 };
 
 } // namespace server
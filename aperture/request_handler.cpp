@@ -18,15 +18,20 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/functional/hash.hpp>
 #include <limits>
 #include <algorithm>
 
-#include "Validator.h"
 #include "Settings.h"
 #include "AppLog.h"
 #include "header.hpp"
 #include "TokenBucket.h"
 #include "CloudFilesAsset.h"
+#include "RenderedAsset.h"
+#include "ShardedAssetCache.h"
+#include "SharedMemoryAssetCache.h"
+#include "StreamRegistry.h"
+#include "TinyLfuAssetCache.h"
 #include <boost/make_shared.hpp>
 
 using namespace aperture;
@@ -34,121 +39,98 @@ using namespace aperture;
 namespace http {
 	namespace server {
 
-		request_handler::request_handler(aperture::IAssetServer::ptr whipAssetServer,
+		namespace {
+			const aperture::byte AT_TEXTURE = 0;
+			const aperture::byte AT_MESH = 49;
+
+			const char* content_type_for(aperture::byte assetType)
+			{
+				return assetType == AT_TEXTURE ? "image/x-j2c" : "application/vnd.ll.mesh";
+			}
+		}
+
+		request_handler::request_handler(boost::asio::io_service& ioService, aperture::IAssetServer::ptr whipAssetServer,
 			aperture::IAssetServer::ptr cfConnector, const std::string& capsToken)
-			: _whipAssetServer(whipAssetServer), _cfConnector(cfConnector), _capsToken(capsToken), _useCache(false)
+			: _ioService(ioService), _whipAssetServer(whipAssetServer), _cfConnector(cfConnector), _capsToken(capsToken),
+			_useCache(false), _shardIndex(0), _applyingReplica(false)
 		{
 			_debug = (aperture::Settings::instance().config())["debug"].as<bool>();
+			_prerenderResponses = (aperture::Settings::instance().config())["cache_prerender_responses"].as<bool>();
+			_streamFromBackends = (aperture::Settings::instance().config())["whip_stream_min_size"].as<unsigned int>() != 0;
 		}
 
-		QueryString request_handler::decode_query_string(const std::string& url)
+		url_parts::url_parts(boost::string_view uri)
+			: _size(0)
 		{
-			enum DecodeState
+			size_t begin = 0;
+			for (;;)
 			{
-				DS_BEGIN,
-				DS_IN_PARAM_NAME,
-				DS_IN_PARAM_VAL,
-				DS_INVALID
-			};
+				size_t end = uri.find('/', begin);
 
-			QueryString retQuery;
-			DecodeState state = DS_BEGIN;
-			std::string currParamName;
-			std::string currParamVal;
-			for (std::size_t i = 0; i < url.size(); ++i)
-			{
-				if (url[i] == '?')
+				if (_size < MAX_PARTS)
 				{
-					state = DS_IN_PARAM_NAME;
-					continue;
+					_parts[_size] = uri.substr(begin, end == boost::string_view::npos ? end : end - begin);
 				}
 
-				if (url[i] == '&' || url[i] == ';')
-				{
-					if (state == DS_BEGIN || state == DS_IN_PARAM_NAME)
-					{
-						//invalid
-						state = DS_INVALID;
-						break;
-					}
+				++_size;
 
-					//otherwise we should have a completed param
-					std::string name;
-					std::string val;
-
-					if (! url_decode(currParamName, name))
-					{
-						state = DS_INVALID;
-						break;
-					}
+				if (end == boost::string_view::npos) break;
+				begin = end + 1;
+			}
+		}
 
-					if (! url_decode(currParamVal, val))
-					{
-						state = DS_INVALID;
-						break;
-					}
+		bool request_handler::find_query_param(boost::string_view uri, boost::string_view name, boost::string_view& rawValue)
+		{
+			size_t queryStart = uri.find('?');
+			if (queryStart == boost::string_view::npos)
+			{
+				return false;
+			}
 
-					boost::to_lower(name);
-					retQuery[name] = val;
-					currParamName.clear();
-					currParamVal.clear();
+			bool found = false;
+			boost::string_view query = uri.substr(queryStart + 1);
 
-					state = DS_BEGIN;
-					continue;
-				}
+			while (! query.empty())
+			{
+				size_t paramEnd = query.find_first_of("&;");
+				boost::string_view param = query.substr(0, paramEnd);
+				query = paramEnd == boost::string_view::npos ? boost::string_view() : query.substr(paramEnd + 1);
 
-				if (url[i] == '=')
+				//stop at the first malformed parameter, but keep what came before it
+				size_t eq = param.find('=');
+				if (eq == boost::string_view::npos || eq == 0 || param.find('=', eq + 1) != boost::string_view::npos)
 				{
-					if (state == DS_BEGIN || state == DS_IN_PARAM_VAL)
-					{
-						//invalid
-						state = DS_INVALID;
-						break;
-					}
-
-					state = DS_IN_PARAM_VAL;
-					continue;
+					break;
 				}
 
-				if (state == DS_IN_PARAM_NAME)
-				{
-					currParamName += url[i];
-					continue;
-				}
+				boost::string_view paramName = param.substr(0, eq);
+				bool nameMatches;
 
-				if (state == DS_IN_PARAM_VAL)
+				if (paramName.find_first_of("%+") == boost::string_view::npos)
 				{
-					currParamVal += url[i];
-					continue;
+					nameMatches = boost::algorithm::iequals(paramName, name);
 				}
-			}
-
-			if (state == DS_IN_PARAM_VAL)
-			{
-				//one last param
-				std::string name;
-				std::string val;
-
-				if (! url_decode(currParamName, name))
+				else
 				{
-					return retQuery;
+					std::string decodedName;
+					if (! url_decode(paramName, decodedName)) break;
+
+					nameMatches = boost::algorithm::iequals(decodedName, name);
 				}
 
-				if (! url_decode(currParamVal, val))
+				if (nameMatches)
 				{
-					return retQuery;
+					rawValue = param.substr(eq + 1);
+					found = true;
 				}
-
-				boost::to_lower(name);
-				retQuery[name] = val;
 			}
 
-			return retQuery;
+			return found;
 		}
 
 		void request_handler::handle_asset_request(const request& req, reply& rep,
-			boost::function<void()> completionCallback,
-			std::vector<std::string>& urlParts)
+			boost::function<void()>& completionCallback,
+			const url_parts& urlParts)
 		{
 			if (urlParts.size() < 5)
 			{
@@ -161,107 +143,124 @@ namespace http {
 				return;
 			}
 
-			// grab the query string parts
-			QueryString queryString = decode_query_string(req.uri);
+			PackedRequestInfo reqInfo(std::move(completionCallback), &rep, &req);
 
-			bool isTextureRequest = queryString.find("texture_id") != queryString.end();
-			bool isMeshRequest = queryString.find("mesh_id") != queryString.end();
+			// grab the asset id out of the query string
+			boost::string_view assetId;
 
-			if (!(isTextureRequest || isMeshRequest))
+			if (! find_query_param(req.uri, "texture_id", assetId)
+				&& ! find_query_param(req.uri, "mesh_id", assetId))
 			{
 				AppLog::instance().out()
 					<< "[HTTP] Bad request for asset: mesh_id nor texture_id supplied "
 					<< std::endl;
 
 				rep = reply::stock_reply(reply::bad_request);
-				completionCallback();
+				reqInfo.CompletionCallback();
 				return;
 			}
 
-			std::string assetId;
-			if (isTextureRequest) {
-				assetId = queryString["texture_id"];
-
-			} else if (isMeshRequest) {
-				assetId = queryString["mesh_id"];
-
-				/*for (auto header : req.headers)
+			//ids are plain hex, only decode when the client escaped something anyway
+			std::string decodedId;
+			if (assetId.find_first_of("%+") != boost::string_view::npos)
+			{
+				if (url_decode(assetId, decodedId))
 				{
-					AppLog::instance().out()
-						<< "[HTTP] Mesh Header: " << header.name << ": " << header.value
-						<< std::endl;
-				}*/
+					assetId = decodedId;
+				}
+				else
+				{
+					assetId.clear();
+				}
 			}
 
-			boost::replace_all(assetId, "-", "");
-
 			//check texture id
-			if (! Validator::IsValidUUID(assetId))
+			if (! aperture::UUID::parse(assetId, reqInfo.AssetId))
 			{
 				AppLog::instance().out()
 					<< "[HTTP] Bad request for asset, invalid UUID supplied"
 					<< std::endl;
 
 				rep = reply::stock_reply(reply::bad_request);
-				completionCallback();
+				reqInfo.CompletionCallback();
 				return;
 			}
 
-			//Check for a valid token
-			if (_validCapIds.find(urlParts[3]) == _validCapIds.end())
+			aperture::UUID capId;
+			if (! aperture::UUID::parse(urlParts[3], capId))
 			{
 				rep = reply::stock_reply(reply::not_found);
-				completionCallback();
+				reqInfo.CompletionCallback();
 				return;
 			}
 
-			rep.token = urlParts[3];
+			boost::mutex::scoped_lock lock(_capsMutex);
 
-			PackedRequestInfo reqInfo = {
-				assetId,
-				completionCallback,
-				&rep,
-				queryString,
-				req,
-				false,
-				false,
-				false
-			};
+			//Check for a valid token
+			if (_validCapIds.find(capId) == _validCapIds.end())
+			{
+				lock.unlock();
+
+				rep = reply::stock_reply(reply::not_found);
+				reqInfo.CompletionCallback();
+				return;
+			}
+
+			rep.token = capId;
 
 			//are we paused? if so we need to queue these requests
-			if (_queuedRequests.find(urlParts[3]) != _queuedRequests.end())
+			auto queueIter = _queuedRequests.find(capId);
+			if (queueIter != _queuedRequests.end())
 			{
 				const int MAX_QUEUED_REQUESTS = 50;
 
-				std::queue<PackedRequestInfo>& queue = _queuedRequests[urlParts[3]];
-				queue.push(reqInfo);
+				std::queue<PackedRequestInfo>& queue = queueIter->second;
+				queue.push(std::move(reqInfo));
 
 				if (_debug)
 				{
 					AppLog::instance().out()
-						<< "[HTTP] Queueing asset request since cap " << urlParts[3] << " is paused"
+						<< "[HTTP] Queueing asset request since cap " << capId << " is paused"
 						<< std::endl;
 				}
 
 				//if there are too many queued requests, start dumping them
 				if (queue.size() > MAX_QUEUED_REQUESTS)
 				{
-					auto req = queue.front();
+					PackedRequestInfo dropped(std::move(queue.front()));
 					queue.pop();
+					lock.unlock();
 
-					*req.Reply = reply::stock_reply(reply::service_unavailable);
-					req.CompletionCallback();
+					*dropped.Reply = reply::stock_reply(reply::service_unavailable);
+					dropped.CompletionCallback();
 				}
 
 				return;
 			}
 
+			lock.unlock();
+
 			//nope not paused. process request
 			this->processRequest(reqInfo);
 		}
 
 		void request_handler::processRequest(PackedRequestInfo& reqInfo)
 		{
+			//when sharded only the owning shard caches an asset, so hand the lookup over
+			if (_shardPeers.size() > 1) {
+				unsigned int owner = this->ownerShard(reqInfo.AssetId);
+				if (owner != _shardIndex) {
+					reqInfo.ServedFromShard = true;
+
+					PackedRequestInfo::ptr pending = boost::make_shared<PackedRequestInfo>(std::move(reqInfo));
+					if (this->joinStream(pending)) return;
+
+					_shardPeers[owner].io_service->post(boost::bind(&request_handler::fetchOwnedAsset,
+						_shardPeers[owner].handler, pending->AssetId, &_ioService, this->continuation(pending)));
+					return;
+				}
+			}
+
 			//check the cache first.
 			if (_useCache) {
 				aperture::IAsset::ptr asset = _assetCache->fetch(reqInfo.AssetId);
@@ -278,6 +277,44 @@ namespace http {
 				}
 			}
 
+			if (_diskCache) {
+				aperture::IAsset::ptr asset = _diskCache->fetch(reqInfo.AssetId);
+				if (asset) {
+					if (_debug) {
+						AppLog::instance().out()
+							<< "[HTTP] Serving asset " << reqInfo.AssetId << " from disk cache "
+							<< std::endl;
+					}
+
+					reqInfo.ServedFromDisk = true;
+					this->asset_response_callback(reqInfo, asset);
+					return;
+				}
+			}
+
+			this->fetchFromBackends(reqInfo, true);
+		}
+
+		void request_handler::fetchFromBackends(PackedRequestInfo& reqInfo, bool askPeer)
+		{
+			//another node owns the asset, its cache is faster than the backends
+			if (askPeer && _peerCluster) {
+				aperture::IAssetServer::ptr peer = _peerCluster->ownerOf(reqInfo.AssetId);
+				if (peer) {
+					if (_debug) {
+						AppLog::instance().out()
+							<< "[HTTP] Asking peer for asset " << reqInfo.AssetId
+							<< std::endl;
+					}
+
+					reqInfo.ServedFromPeer = true;
+
+					PackedRequestInfo::ptr pending = boost::make_shared<PackedRequestInfo>(std::move(reqInfo));
+					peer->getAsset(pending->AssetId, _ioService.wrap(this->continuation(pending)));
+					return;
+				}
+			}
+
 			if (_whipAssetServer && _whipAssetServer->isConnected())
 			{
 				if (_debug)
@@ -289,8 +326,10 @@ namespace http {
 
 				reqInfo.ServedFromWhip = true;
 
-				_whipAssetServer->getAsset(reqInfo.AssetId,
-					boost::bind(&request_handler::asset_response_callback, this, reqInfo, _1));
+				PackedRequestInfo::ptr pending = boost::make_shared<PackedRequestInfo>(std::move(reqInfo));
+				if (this->joinStream(pending)) return;
+
+				_whipAssetServer->getAsset(pending->AssetId, _ioService.wrap(this->continuation(pending)));
 			}
 			else if (_cfConnector)
 			{
@@ -303,8 +342,10 @@ namespace http {
 
 				reqInfo.ServedFromCF = true;
 
-				_cfConnector->getAsset(reqInfo.AssetId,
-					boost::bind(&request_handler::asset_response_callback, this, reqInfo, _1));
+				PackedRequestInfo::ptr pending = boost::make_shared<PackedRequestInfo>(std::move(reqInfo));
+				if (this->joinStream(pending)) return;
+
+				_cfConnector->getAsset(pending->AssetId, _ioService.wrap(this->continuation(pending)));
 			}
 			else
 			{
@@ -318,8 +359,8 @@ namespace http {
 		}
 
 		void request_handler::handle_add_cap(const request& req, reply& rep,
-			boost::function<void()> completionCallback,
-			std::vector<std::string>& urlParts)
+			boost::function<void()>& completionCallback,
+			const url_parts& urlParts)
 		{
 			if (urlParts.size() < 6)
 			{
@@ -344,6 +385,18 @@ namespace http {
 				return;
 			}
 
+			aperture::UUID capId;
+			if (! aperture::UUID::parse(urlParts[5], capId))
+			{
+				AppLog::instance().out()
+					<< "[HTTP][CAPS] Not adding CAP, invalid cap id " << urlParts[5]
+					<< std::endl;
+
+				rep = reply::stock_reply(reply::bad_request);
+				completionCallback();
+				return;
+			}
+
 			if (_debug)
 			{
 				AppLog::instance().out()
@@ -351,25 +404,37 @@ namespace http {
 					<< std::endl;
 			}
 
-			//the 5th part should be the CAP to add
-			_validCapIds.insert(urlParts[5]);
-
 			//the 6th part should be the bandwidth in bytes/sec to use for the cap
 			//if it is missing there is no limit
+			boost::shared_ptr<TokenBucket> bucket;
 			if (urlParts.size() == 7)
 			{
-				int bandwidth = boost::lexical_cast<int>(urlParts[6]);
+				int bandwidth = boost::lexical_cast<int>(urlParts[6].data(), urlParts[6].size());
+
+				bucket = boost::make_shared<TokenBucket>(bandwidth);
+			}
+
+			{
+				boost::mutex::scoped_lock lock(_capsMutex);
+
+				//the 5th part should be the CAP to add
+				_validCapIds.insert(capId);
 
-				_capsBuckets[urlParts[5]] = boost::make_shared<TokenBucket>(bandwidth);
+				if (bucket)
+				{
+					_capsBuckets[capId] = bucket;
+				}
 			}
 
+			this->replicateCapsRequest(req);
+
 			rep = reply::stock_reply(reply::ok);
 			completionCallback();
 		}
 
 		void request_handler::handle_rem_cap(const request& req, reply& rep,
-			boost::function<void()> completionCallback,
-			std::vector<std::string>& urlParts)
+			boost::function<void()>& completionCallback,
+			const url_parts& urlParts)
 		{
 			if (urlParts.size() < 6)
 			{
@@ -394,6 +459,18 @@ namespace http {
 				return;
 			}
 
+			aperture::UUID capId;
+			if (! aperture::UUID::parse(urlParts[5], capId))
+			{
+				AppLog::instance().out()
+					<< "[HTTP][CAPS] Not removing CAP, invalid cap id " << urlParts[5]
+					<< std::endl;
+
+				rep = reply::stock_reply(reply::bad_request);
+				completionCallback();
+				return;
+			}
+
 			if (_debug)
 			{
 				AppLog::instance().out()
@@ -401,22 +478,28 @@ namespace http {
 					<< std::endl;
 			}
 
-			//the 5th part should be the CAP to remove
-			_validCapIds.erase(urlParts[5]);
+			{
+				boost::mutex::scoped_lock lock(_capsMutex);
+
+				//the 5th part should be the CAP to remove
+				_validCapIds.erase(capId);
 
-			//also remove pending queues
-			_queuedRequests.erase(urlParts[5]);
+				//also remove pending queues
+				_queuedRequests.erase(capId);
 
-			//and token buckets
-			_capsBuckets.erase(urlParts[5]);
+				//and token buckets
+				_capsBuckets.erase(capId);
+			}
+
+			this->replicateCapsRequest(req);
 
 			rep = reply::stock_reply(reply::ok);
 			completionCallback();
 		}
 
 		void request_handler::handle_pause_cap(const request& req, reply& rep,
-			boost::function<void()> completionCallback,
-			std::vector<std::string>& urlParts)
+			boost::function<void()>& completionCallback,
+			const url_parts& urlParts)
 		{
 			if (urlParts.size() < 6)
 			{
@@ -441,6 +524,18 @@ namespace http {
 				return;
 			}
 
+			aperture::UUID capId;
+			if (! aperture::UUID::parse(urlParts[5], capId))
+			{
+				AppLog::instance().out()
+					<< "[HTTP][CAPS] Not pausing CAP, invalid cap id " << urlParts[5]
+					<< std::endl;
+
+				rep = reply::stock_reply(reply::bad_request);
+				completionCallback();
+				return;
+			}
+
 			if (_debug)
 			{
 				AppLog::instance().out()
@@ -448,19 +543,25 @@ namespace http {
 					<< std::endl;
 			}
 
-			//the 5th part should be the CAP to pause
-			if (_queuedRequests.find(urlParts[5]) == _queuedRequests.end())
 			{
-				_queuedRequests[urlParts[5]] = std::queue<PackedRequestInfo>();
+				boost::mutex::scoped_lock lock(_capsMutex);
+
+				//the 5th part should be the CAP to pause
+				if (_queuedRequests.find(capId) == _queuedRequests.end())
+				{
+					_queuedRequests[capId];
+				}
 			}
 
+			this->replicateCapsRequest(req);
+
 			rep = reply::stock_reply(reply::ok);
 			completionCallback();
 		}
 
 		void request_handler::handle_resume_cap(const request& req, reply& rep,
-			boost::function<void()> completionCallback,
-			std::vector<std::string>& urlParts)
+			boost::function<void()>& completionCallback,
+			const url_parts& urlParts)
 		{
 			if (urlParts.size() < 6)
 			{
@@ -485,6 +586,18 @@ namespace http {
 				return;
 			}
 
+			aperture::UUID capId;
+			if (! aperture::UUID::parse(urlParts[5], capId))
+			{
+				AppLog::instance().out()
+					<< "[HTTP][CAPS] Not resuming CAP, invalid cap id " << urlParts[5]
+					<< std::endl;
+
+				rep = reply::stock_reply(reply::bad_request);
+				completionCallback();
+				return;
+			}
+
 			if (_debug)
 			{
 				AppLog::instance().out()
@@ -492,37 +605,45 @@ namespace http {
 					<< std::endl;
 			}
 
-			//the 5th part should be the CAP to resume
-			if (_queuedRequests.find(urlParts[5]) != _queuedRequests.end())
+			//the 5th part should be the CAP to resume. take the queue out from under
+			//the lock so processing the requests doesn't hold up other threads
+			std::queue<PackedRequestInfo> queue;
 			{
-				auto queue = _queuedRequests[urlParts[5]];
+				boost::mutex::scoped_lock lock(_capsMutex);
 
-				//process all queued requests
-				while (queue.size() > 0)
+				auto queueIter = _queuedRequests.find(capId);
+				if (queueIter != _queuedRequests.end())
 				{
-					auto reqInfo = queue.front();
-					queue.pop();
+					queue.swap(queueIter->second);
+					_queuedRequests.erase(queueIter);
+				}
+			}
 
-					if (_debug)
-					{
-						AppLog::instance().out()
-							<< "[HTTP] Dequeueing asset request for " << urlParts[3] << " unpaused"
-							<< std::endl;
-					}
+			//process all queued requests
+			while (queue.size() > 0)
+			{
+				PackedRequestInfo reqInfo(std::move(queue.front()));
+				queue.pop();
 
-					this->processRequest(reqInfo);
+				if (_debug)
+				{
+					AppLog::instance().out()
+						<< "[HTTP] Dequeueing asset request for " << urlParts[3] << " unpaused"
+						<< std::endl;
 				}
 
-				_queuedRequests.erase(urlParts[5]);
+				this->processRequest(reqInfo);
 			}
 
+			this->replicateCapsRequest(req);
+
 			rep = reply::stock_reply(reply::ok);
 			completionCallback();
 		}
 
 		void request_handler::handle_limit_cap(const request& req, reply& rep,
-			boost::function<void()> completionCallback,
-			std::vector<std::string>& urlParts)
+			boost::function<void()>& completionCallback,
+			const url_parts& urlParts)
 		{
 			if (urlParts.size() < 7)
 			{
@@ -547,10 +668,22 @@ namespace http {
 				return;
 			}
 
+			aperture::UUID capId;
+			if (! aperture::UUID::parse(urlParts[5], capId))
+			{
+				AppLog::instance().out()
+					<< "[HTTP][CAPS] Not limiting CAP, invalid cap id " << urlParts[5]
+					<< std::endl;
+
+				rep = reply::stock_reply(reply::bad_request);
+				completionCallback();
+				return;
+			}
+
 			int bwLimit;
 			try
 			{
-				bwLimit = boost::lexical_cast<int>(urlParts[6]);
+				bwLimit = boost::lexical_cast<int>(urlParts[6].data(), urlParts[6].size());
 			}
 			catch (const boost::bad_lexical_cast&)
 			{
@@ -582,8 +715,12 @@ namespace http {
 					<< std::endl;
 			}
 
-			if (_validCapIds.find(urlParts[5]) == _validCapIds.end())
+			boost::mutex::scoped_lock lock(_capsMutex);
+
+			if (_validCapIds.find(capId) == _validCapIds.end())
 			{
+				lock.unlock();
+
 				AppLog::instance().out()
 					<< "[HTTP][CAPS] Not limiting CAP " << urlParts[5] << ". Cap does not exist."
 					<< std::endl;
@@ -593,22 +730,127 @@ namespace http {
 				return;
 			}
 
-			_capsBuckets[urlParts[5]] = boost::make_shared<TokenBucket>(bwLimit);
+			_capsBuckets[capId] = boost::make_shared<TokenBucket>(bwLimit);
+			lock.unlock();
+
+			this->replicateCapsRequest(req);
+
+			rep = reply::stock_reply(reply::ok);
+			completionCallback();
+		}
+
+		void request_handler::handle_stats(const request& req, reply& rep,
+			boost::function<void()>& completionCallback,
+			const url_parts& urlParts)
+		{
+			//the 4th part should be the token and should match our settings
+			if (urlParts[4] != _capsToken)
+			{
+				AppLog::instance().out()
+					<< "[HTTP][CAPS] Not sending stats, caps token doesnt match"
+					<< std::endl;
+
+				rep = reply::stock_reply(reply::bad_request);
+				completionCallback();
+				return;
+			}
+
+			//every shard has its own cache, report them together
+			std::vector<aperture::IAssetCache*> caches;
+			if (_shardPeers.size() > 1) {
+				for (const shard_peer& peer : _shardPeers) {
+					aperture::IAssetCache* cache = peer.handler->_assetCache.get();
+
+					//shards using the shared memory cache share one
+					if (cache && std::find(caches.begin(), caches.end(), cache) == caches.end()) {
+						caches.push_back(cache);
+					}
+				}
+			} else if (_assetCache) {
+				caches.push_back(_assetCache.get());
+			}
+
+			unsigned long long entries = 0, bytes = 0, maxBytes = 0, hits = 0, misses = 0;
+			for (aperture::IAssetCache* cache : caches) {
+				entries += cache->size();
+				bytes += cache->byteSize();
+				maxBytes += cache->maxSize();
+				hits += cache->hits();
+				misses += cache->misses();
+			}
+
+			std::ostringstream stats;
+			stats << "cache_policy=" << (caches.empty() ? "none" : caches.front()->policyName()) << "\n"
+				<< "cache_entries=" << entries << "\n"
+				<< "cache_bytes=" << bytes << "\n"
+				<< "cache_max_bytes=" << maxBytes << "\n"
+				<< "cache_hits=" << hits << "\n"
+				<< "cache_misses=" << misses << "\n"
+				<< "cache_hit_ratio=" << (hits + misses == 0 ? 0.0 : double(hits) / (hits + misses)) << "\n";
+
+			if (_diskCache) {
+				unsigned long long diskHits = _diskCache->hits(), diskMisses = _diskCache->misses();
+
+				stats << "disk_cache_entries=" << _diskCache->size() << "\n"
+					<< "disk_cache_bytes=" << _diskCache->byteSize() << "\n"
+					<< "disk_cache_max_bytes=" << _diskCache->maxSize() << "\n"
+					<< "disk_cache_hits=" << diskHits << "\n"
+					<< "disk_cache_misses=" << diskMisses << "\n"
+					<< "disk_cache_hit_ratio=" << (diskHits + diskMisses == 0 ? 0.0 : double(diskHits) / (diskHits + diskMisses)) << "\n";
+			}
+
+			aperture::StreamRegistry::instance().writeStats(stats);
+
+			if (_whipAssetServer) _whipAssetServer->writeStats(stats);
+			if (_cfConnector) _cfConnector->writeStats(stats);
+
+			if (_peerCluster) {
+				for (aperture::PeerAssetServer::ptr peer : _peerCluster->peers()) {
+					stats << "peer_" << peer->name() << "_connected=" << (peer->isConnected() ? 1 : 0) << "\n"
+						<< "peer_" << peer->name() << "_hits=" << peer->hits() << "\n"
+						<< "peer_" << peer->name() << "_misses=" << peer->misses() << "\n"
+						<< "peer_" << peer->name() << "_failures=" << peer->failures() << "\n";
+				}
+			}
 
 			rep = reply::stock_reply(reply::ok);
+			rep.content = stats.str();
+			rep.headers[0].value = boost::lexical_cast<std::string>(rep.content.size());
+			rep.headers[1].value = "text/plain";
 			completionCallback();
 		}
 
+		namespace {
+			typedef void (request_handler::*caps_handler)(const request&, reply&,
+				boost::function<void()>&, const url_parts&);
+
+			struct caps_route
+			{
+				boost::string_view command;
+				caps_handler handler;
+			};
+
+			/// The management commands, matched against the 4th part of the URI
+			const caps_route CAPS_ROUTES[] = {
+				{ "ADDCAP", &request_handler::handle_add_cap },
+				{ "REMCAP", &request_handler::handle_rem_cap },
+				{ "PAUSE", &request_handler::handle_pause_cap },
+				{ "RESUME", &request_handler::handle_resume_cap },
+				{ "LIMIT", &request_handler::handle_limit_cap },
+				{ "STATS", &request_handler::handle_stats }
+			};
+		}
+
 		void request_handler::handle_request(const request& req, reply& rep,
 			boost::function<void()> completionCallback)
 		{
 			//cut up the request by /
-			std::vector<std::string> reqParts;
-			boost::split(reqParts, req.uri, boost::is_any_of("/"));
+			url_parts reqParts(req.uri);
 
 			//must have at least 5 parts
 			// /CAPS/HTT/ADDCAP/{TOKEN}/{CAP_UUID}
 			// /CAPS/HTT/REMCAP/{TOKEN}/{CAP_UUID}
+			// /CAPS/HTT/STATS/{TOKEN}
 			// /CAPS/HTT/{CAP_UUID}/?texture_id={TEXTUREUUID}
 
 			if (reqParts.size() < 5)
@@ -626,45 +868,31 @@ namespace http {
 			}
 
 			//what type of request is this?
-			if (reqParts[3] == "ADDCAP")
+			for (const caps_route& route : CAPS_ROUTES)
 			{
-				this->handle_add_cap(req, rep, completionCallback, reqParts);
-
-				return;
-			}
-			else
-			if (reqParts[3] == "REMCAP")
-			{
-				this->handle_rem_cap(req, rep, completionCallback, reqParts);
-
-				return;
+				if (reqParts[3] == route.command)
+				{
+					(this->*route.handler)(req, rep, completionCallback, reqParts);
+					return;
+				}
 			}
-			else
-			if (reqParts[3] == "PAUSE")
-			{
-				this->handle_pause_cap(req, rep, completionCallback, reqParts);
 
-				return;
-			}
-			else
-			if (reqParts[3] == "RESUME")
-			{
-				this->handle_resume_cap(req, rep, completionCallback, reqParts);
+			//otherwise we have a texture request
+			this->handle_asset_request(req, rep, completionCallback, reqParts);
+		}
 
-				return;
-			}
-			else
-			if (reqParts[3] == "LIMIT")
+		namespace {
+			/// Returns the value of a hex digit, or -1
+			inline int hex_value(char c)
 			{
-				this->handle_limit_cap(req, rep, completionCallback, reqParts);
-				return;
+				if (c >= '0' && c <= '9') return c - '0';
+				if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+				if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+				return -1;
 			}
-
-			//otherwise we have a texture request
-			this->handle_asset_request(req, rep, completionCallback, reqParts);
 		}
 
-		bool request_handler::url_decode(const std::string& in, std::string& out)
+		bool request_handler::url_decode(boost::string_view in, std::string& out)
 		{
 			out.clear();
 			out.reserve(in.size());
@@ -672,24 +900,20 @@ namespace http {
 			{
 				if (in[i] == '%')
 				{
-					if (i + 3 <= in.size())
+					if (i + 3 > in.size())
 					{
-						int value = 0;
-						std::istringstream is(in.substr(i + 1, 2));
-						if (is >> std::hex >> value)
-						{
-							out += static_cast<char>(value);
-							i += 2;
-						}
-						else
-						{
-							return false;
-						}
+						return false;
 					}
-					else
+
+					int high = hex_value(in[i + 1]);
+					int low = hex_value(in[i + 2]);
+					if (high < 0 || low < 0)
 					{
 						return false;
 					}
+
+					out += static_cast<char>((high << 4) | low);
+					i += 2;
 				}
 				else if (in[i] == '+')
 				{
@@ -703,74 +927,118 @@ namespace http {
 			return true;
 		}
 
-		boost::tuple<unsigned int, unsigned int> request_handler::parse_range(const std::string& rangeStr)
+		boost::tuple<unsigned int, unsigned int> request_handler::parse_range(boost::string_view rangeStr)
 		{
 			//the first part of the string should be bytes=X
 			//we want to verify this then strip it
-			if (rangeStr.substr(0, 6) != "bytes=") {
+			if (! rangeStr.starts_with("bytes=")) {
 				throw std::range_error("Invalid range");
 			}
 
-			std::string specStr(rangeStr.substr(6));
-
-			std::vector<std::string> strs;
-			boost::split(strs, specStr, boost::is_any_of("-"));
-
-/*			if (strs.size() == 1) {
-				//starting range only
-				return boost::make_tuple(boost::lexical_cast<unsigned int>(strs[0]), std::numeric_limits<unsigned int>::max());
-			}*/
+			boost::string_view specStr(rangeStr.substr(6));
 
-			if (strs.size() == 2) {
+			size_t dash = specStr.find('-');
+			if (dash != boost::string_view::npos && specStr.find('-', dash + 1) == boost::string_view::npos) {
 				//could be just and end or is start an end
+				boost::string_view first = specStr.substr(0, dash);
+				boost::string_view last = specStr.substr(dash + 1);
 
-				if (strs[0] == "" && strs[1] != "")
+				if (first.empty() && ! last.empty())
 				{
 					//just the end
-					return boost::make_tuple(0, boost::lexical_cast<unsigned int>(strs[1]));
+					return boost::make_tuple(0, boost::lexical_cast<unsigned int>(last.data(), last.size()));
 				}
-				else if (strs[0] != "" && strs[1] == "")
+				else if (! first.empty() && last.empty())
 				{
 #undef max
 					//specified start to the end
-					return boost::make_tuple(boost::lexical_cast<unsigned int>(strs[0]), std::numeric_limits<unsigned int>::max());
+					return boost::make_tuple(boost::lexical_cast<unsigned int>(first.data(), first.size()),
+											 std::numeric_limits<unsigned int>::max());
 				}
-				else if (strs[0] != "" && strs[1] != "")
+				else if (! first.empty() && ! last.empty())
 				{
 					//start and end
-					return boost::make_tuple(boost::lexical_cast<unsigned int>(strs[0]),
-											 boost::lexical_cast<unsigned int>(strs[1]) );
+					return boost::make_tuple(boost::lexical_cast<unsigned int>(first.data(), first.size()),
+											 boost::lexical_cast<unsigned int>(last.data(), last.size()) );
 				}
 			}
 
-			throw std::range_error("Invalid range spec: " + specStr);
+			throw std::range_error("Invalid range spec: " + specStr.to_string());
 		}
 
-		void request_handler::asset_response_callback(PackedRequestInfo reqInfo, aperture::IAsset::ptr asset)
+		boost::function<void (aperture::IAsset::ptr)> request_handler::continuation(PackedRequestInfo::ptr reqInfo)
 		{
-			const aperture::byte AT_TEXTURE = 0;
-			const aperture::byte AT_MESH = 49;
+			return boost::bind(&request_handler::pending_asset_response, this, reqInfo, _1);
+		}
 
-			if (! asset) {
-				if (reqInfo.ServedFromWhip && _cfConnector) {
-					//try CF before failing out
-					if (_debug) {
-						AppLog::instance().out()
-							<< "[HTTP] Asset not found on WHIP, trying CF "
-							<< reqInfo.AssetId
-							<< std::endl;
+		void request_handler::pending_asset_response(PackedRequestInfo::ptr reqInfo, aperture::IAsset::ptr asset)
+		{
+			this->asset_response_callback(*reqInfo, asset);
+		}
+
+		bool request_handler::joinStream(PackedRequestInfo::ptr reqInfo)
+		{
+			//throttled replies are sent in chunks from the complete asset anyway
+			if (! _streamFromBackends || this->getBucket(reqInfo->Reply->token)) {
+				return false;
+			}
+
+			aperture::StreamRegistry& streams = aperture::StreamRegistry::instance();
+
+			aperture::StreamingAsset::ptr stream = streams.find(reqInfo->AssetId);
+			if (stream) {
+				this->stream_response(reqInfo, stream);
+				return true;
+			}
+
+			reqInfo->StreamWatchId = streams.watch(reqInfo->AssetId,
+				_ioService.wrap(boost::bind(&request_handler::stream_response, this, reqInfo, _1)));
+
+			return false;
+		}
+
+		void request_handler::stream_response(PackedRequestInfo::ptr reqInfo, aperture::StreamingAsset::ptr stream)
+		{
+			if (stream->hasFailed() || (stream->getType() != AT_TEXTURE && stream->getType() != AT_MESH)) {
+				*reqInfo->Reply = reply::stock_reply(reply::not_found);
+				reqInfo->CompletionCallback();
+				return;
+			}
+
+			if (_debug) {
+				AppLog::instance().out()
+					<< "[HTTP] Streaming asset " << reqInfo->AssetId << " while it comes in"
+					<< std::endl;
+			}
+
+			this->replyWithAsset(*reqInfo, stream);
+		}
+
+		void request_handler::asset_response_callback(PackedRequestInfo& reqInfo, aperture::IAsset::ptr asset)
+		{
+			if (reqInfo.StreamWatchId != 0) {
+				if (! aperture::StreamRegistry::instance().unwatch(reqInfo.AssetId, reqInfo.StreamWatchId)) {
+					//the reply is streamed already, the asset is still wanted in the caches
+					if (asset && (asset->getType() == AT_TEXTURE || asset->getType() == AT_MESH)) {
+						this->cacheFetchedAsset(reqInfo, asset);
 					}
 
-					reqInfo.ServedFromWhip = false;
-					reqInfo.ServedFromCF = true;
+					return;
+				}
 
-					_cfConnector->getAsset(reqInfo.AssetId,
-						boost::bind(&request_handler::asset_response_callback, this, reqInfo, _1));
+				reqInfo.StreamWatchId = 0;
+			}
 
+			if (! asset) {
+				if (reqInfo.ServedFromPeer) {
+					//the owner doesn't have it cached either
+					reqInfo.ServedFromPeer = false;
+					this->fetchFromBackends(reqInfo, false);
 					return;
 				}
 
-				//we have exhausted our options
+				//we have exhausted our options, the WHIP server already fell back
+				//to CF itself
 				if (_debug) {
 					AppLog::instance().out()
 						<< "[HTTP] Asset not found: "
@@ -783,6 +1051,12 @@ namespace http {
 				return;
 			}
 
+			if (reqInfo.ServedFromWhip && dynamic_cast<cloudfiles::CloudFilesAsset*>(asset.get())) {
+				//CF answered a WHIP request first
+				reqInfo.ServedFromWhip = false;
+				reqInfo.ServedFromCF = true;
+			}
+
 			if (asset->getType() != AT_TEXTURE && asset->getType() != AT_MESH) {
                 std::string source;
                 int type = 0;
@@ -791,6 +1065,10 @@ namespace http {
                     source = "cache";
                     type = asset->getType();
                 }
+                if (reqInfo.ServedFromDisk) {
+                    source = "disk";
+                    type = asset->getType();
+                }
                 if (reqInfo.ServedFromCF) {
                     source = "CF";
                     type = dynamic_cast<cloudfiles::CloudFilesAsset*>(asset.get())->getFullType();
@@ -799,6 +1077,14 @@ namespace http {
                     source = "WHIP";
                     type = asset->getType();
                 }
+                if (reqInfo.ServedFromShard) {
+                    source = "shard";
+                    type = asset->getType();
+                }
+                if (reqInfo.ServedFromPeer) {
+                    source = "peer";
+                    type = asset->getType();
+                }
 
 				AppLog::instance().out()
 					<< "[HTTP] Not sending non-texture asset "
@@ -814,20 +1100,35 @@ namespace http {
 				return;
 			}
 
-			if (! reqInfo.ServedFromCache && _assetCache) {
-				//we didnt get this object from the cache, so we should add it
-				_assetCache->insert(reqInfo.AssetId, asset);
-			}
+			asset = this->cacheFetchedAsset(reqInfo, asset);
 
-			size_t errorReportingFullSz = asset->getBinaryDataSize();
-			try {
-				if (asset->getType() == AT_TEXTURE) {
-					this->sendResponse(reqInfo, asset, "image/x-j2c");
+			this->replyWithAsset(reqInfo, asset);
+		}
 
-				} else {
-					this->sendResponse(reqInfo, asset, "application/vnd.ll.mesh");
+		aperture::IAsset::ptr request_handler::cacheFetchedAsset(const PackedRequestInfo& reqInfo, aperture::IAsset::ptr asset)
+		{
+			if (! reqInfo.ServedFromCache && ! reqInfo.ServedFromDisk && ! reqInfo.ServedFromShard
+				&& ! reqInfo.ServedFromPeer) {
+				//we didnt get this object from a cache, so we should add it. assets
+				//from a peer stay cached by the node owning them
+				if (_diskCache) {
+					_diskCache->insert(asset);
+				}
 
+				if (_assetCache) {
+					asset = this->prepareForCache(asset);
+					_assetCache->insert(reqInfo.AssetId, asset);
 				}
+			}
+
+			return asset;
+		}
+
+		void request_handler::replyWithAsset(PackedRequestInfo& reqInfo, aperture::IAsset::ptr asset)
+		{
+			size_t errorReportingFullSz = asset->getBinaryDataSize();
+			try {
+				this->sendResponse(reqInfo, asset, content_type_for(asset->getType()));
 
 			} catch (const std::range_error& e) {
 				AppLog::instance().out()
@@ -861,11 +1162,11 @@ namespace http {
 
 		void request_handler::sendResponse(PackedRequestInfo& reqInfo, IAsset::ptr asset, const std::string& contentType)
 		{
-			size_t rngBegin, rngEnd = 0;
+			size_t rngBegin = 0, rngEnd = 0;
 
 			bool hasRangeHeader = false;
 
-			for (const header& mheader : reqInfo.Request.headers)
+			for (const header& mheader : reqInfo.Request->headers)
 			{
 				if (mheader.name == "Range")
 				{
@@ -874,61 +1175,397 @@ namespace http {
 				}
 			}
 
-			size_t fullSz = hasRangeHeader
-			    ? asset->copyAssetData(reqInfo.Reply->content, rngBegin, rngEnd)
-			    : asset->copyAssetData(reqInfo.Reply->content);
+			size_t fullSz = asset->getBinaryDataSize();
 
-			if (rngEnd > (fullSz - 1)) rngEnd = (fullSz - 1);
+			if (hasRangeHeader && fullSz != 0) {
+				IAsset::clampRange(fullSz, rngBegin, rngEnd);
+			} else {
+				rngBegin = 0;
+				rngEnd = fullSz - 1;
+			}
 
-			//all is well..
-			reqInfo.Reply->headers.resize(2);
-			reqInfo.Reply->headers[0].name = "Content-Length";
-			reqInfo.Reply->headers[0].value = boost::lexical_cast<std::string>(reqInfo.Reply->content.size());
-			reqInfo.Reply->headers[1].name = "Content-Type";
-			reqInfo.Reply->headers[1].value = contentType;
+#ifdef AP_HAVE_SENDFILE
+			//assets from the disk cache are sent straight from their file unless
+			//the cap is throttled, which needs the data in memory
+			aperture::DiskAsset::ptr onDisk = boost::dynamic_pointer_cast<aperture::DiskAsset>(asset);
+			if (onDisk && ! this->getBucket(reqInfo.Reply->token)) {
+				reqInfo.Reply->set_file_body(onDisk, onDisk->getFileOffset() + rngBegin, fullSz == 0 ? 0 : (rngEnd - rngBegin) + 1);
+			} else
+#endif
+			{
+				//the reply sends straight from the asset's data and holds on to
+				//the asset until the write is done
+				boost::asio::const_buffer data = asset->getAssetData();
+				boost::asio::const_buffer body = fullSz == 0 ? data : boost::asio::buffer(data + rngBegin, (rngEnd - rngBegin) + 1);
+
+				//an asset still coming in is sent as it arrives
+				aperture::StreamingAsset::ptr stream = boost::dynamic_pointer_cast<aperture::StreamingAsset>(asset);
+				if (stream) {
+					reqInfo.Reply->set_stream_body(stream, body);
+				} else {
+					reqInfo.Reply->set_body(asset, body);
+				}
+			}
 
-			if (hasRangeHeader && fullSz != reqInfo.Reply->content.size()) {
-				reqInfo.Reply->status = reply::partial_content;
-				reqInfo.Reply->headers.resize(3);
-				reqInfo.Reply->headers[2].name = "Content-Range";
-				reqInfo.Reply->headers[2].value
-					=	"bytes " + boost::lexical_cast<std::string>(rngBegin) +
-						"-" +
-						boost::lexical_cast<std::string>(rngEnd) +
-						"/" +
-						boost::lexical_cast<std::string>(fullSz);
+			size_t contentSz = reqInfo.Reply->content_size();
+			bool isPartial = hasRangeHeader && fullSz != contentSz;
+
+			//assets from the cache carry their headers already rendered
+			RenderedAsset::ptr rendered = boost::dynamic_pointer_cast<RenderedAsset>(asset);
+
+			if (! isPartial) {
+				reqInfo.Reply->status = reply::ok;
+
+				if (rendered) {
+					reqInfo.Reply->headers.clear();
+					reqInfo.Reply->rendered_headers = boost::asio::buffer(rendered->getFullResponseHeader());
+
+				} else {
+					reqInfo.Reply->headers.resize(2);
+					reqInfo.Reply->headers[0].name = "Content-Length";
+					reqInfo.Reply->headers[0].value = boost::lexical_cast<std::string>(contentSz);
+					reqInfo.Reply->headers[1].name = "Content-Type";
+					reqInfo.Reply->headers[1].value = contentType;
+				}
 
 				if (_debug) {
 					AppLog::instance().out()
-						<< "[HTTP] Sending range to client "
-						<< reqInfo.Reply->headers[2].value
-						<< " for asset "
+						<< "[HTTP] Sending entire asset to client "
 						<< reqInfo.AssetId
 						<< " " << contentType
 						<< std::endl;
 				}
 
+				return;
+			}
+
+			reqInfo.Reply->status = reply::partial_content;
+
+			if (rendered) {
+				reqInfo.Reply->rendered_headers = boost::asio::buffer(rendered->getPartialResponsePrefix());
+				reqInfo.Reply->headers.resize(2);
 			} else {
-				reqInfo.Reply->status = reply::ok;
+				reqInfo.Reply->headers.resize(3);
+				reqInfo.Reply->headers[2].name = "Content-Type";
+				reqInfo.Reply->headers[2].value = contentType;
+			}
 
-				if (_debug) {
+			reqInfo.Reply->headers[0].name = "Content-Length";
+			reqInfo.Reply->headers[0].value = boost::lexical_cast<std::string>(contentSz);
+			reqInfo.Reply->headers[1].name = "Content-Range";
+			reqInfo.Reply->headers[1].value
+				=	"bytes " + boost::lexical_cast<std::string>(rngBegin) +
+					"-" +
+					boost::lexical_cast<std::string>(rngEnd) +
+					"/" +
+					boost::lexical_cast<std::string>(fullSz);
+
+			if (_debug) {
+				AppLog::instance().out()
+					<< "[HTTP] Sending range to client "
+					<< reqInfo.Reply->headers[1].value
+					<< " for asset "
+					<< reqInfo.AssetId
+					<< " " << contentType
+					<< std::endl;
+			}
+		}
+
+		aperture::IAsset::ptr request_handler::prepareForCache(aperture::IAsset::ptr asset)
+		{
+			if (! _prerenderResponses) return asset;
+
+			size_t fullSz;
+			try {
+				fullSz = boost::asio::buffer_size(asset->getAssetData());
+			} catch (const std::exception&) {
+				//a broken asset fails again when it is sent, don't render anything for it
+				return asset;
+			}
+
+			std::vector<header> headers(2);
+			headers[0].name = "Content-Length";
+			headers[0].value = boost::lexical_cast<std::string>(fullSz);
+			headers[1].name = "Content-Type";
+			headers[1].value = content_type_for(asset->getType());
+
+			std::vector<header> partialHeaders(1, headers[1]);
+
+			return boost::make_shared<RenderedAsset>(asset,
+				reply::render_headers(reply::ok, headers),
+				reply::render_headers(reply::partial_content, partialHeaders));
+		}
+
+		void request_handler::initAssetCache(unsigned long long maxSize, unsigned int numCacheShards)
+		{
+			std::string policy = (aperture::Settings::instance().config())["cache_policy"].as<std::string>();
+
+			if (policy == "shared") {
+				//every shard and every process on the host uses the same region,
+				//sized for the whole cache
+				_assetCache = aperture::SharedMemoryAssetCache::open(
+					(aperture::Settings::instance().config())["cache_shm_name"].as<std::string>(),
+					(aperture::Settings::instance().config())["cache_size"].as<unsigned long long>());
+
+				if (! _assetCache) {
 					AppLog::instance().out()
-						<< "[HTTP] Sending entire asset to client "
-						<< reqInfo.AssetId
-						<< " " << contentType
+						<< "[CACHE] Shared memory cache unavailable, using clock"
 						<< std::endl;
+					_assetCache.reset(new aperture::ShardedAssetCache(maxSize, numCacheShards));
 				}
+			} else if (policy == "tinylfu") {
+				_assetCache.reset(new aperture::TinyLfuAssetCache(maxSize, numCacheShards));
+			} else {
+				if (policy != "clock") {
+					AppLog::instance().out()
+						<< "[CACHE] Unknown cache policy " << policy << ", using clock"
+						<< std::endl;
+				}
+
+				_assetCache.reset(new aperture::ShardedAssetCache(maxSize, numCacheShards));
 			}
+			_useCache = true;
 		}
 
-		void request_handler::initAssetCache(unsigned int maxSize)
+		void request_handler::setDiskCache(aperture::DiskAssetCache::ptr diskCache)
 		{
-			_assetCache.reset(new LRUCache<std::string, aperture::IAsset::ptr, AssetSizeCalculator>(maxSize));
-			_useCache = true;
+			_diskCache = diskCache;
 		}
 
-		boost::shared_ptr<TokenBucket> request_handler::getBucket(const std::string& caps)
+		void request_handler::setPeerCluster(aperture::PeerCluster::ptr peerCluster)
 		{
+			_peerCluster = peerCluster;
+		}
+
+		void request_handler::setShardPeers(unsigned int selfIndex, const std::vector<shard_peer>& peers)
+		{
+			_shardIndex = selfIndex;
+			_shardPeers = peers;
+		}
+
+		unsigned int request_handler::ownerShard(const aperture::UUID& assetId) const
+		{
+			return assetId.hash() % _shardPeers.size();
+		}
+
+		void request_handler::fetchOwnedAsset(const aperture::UUID& assetId, boost::asio::io_service* replyTo,
+			boost::function<void (aperture::IAsset::ptr)> callBack)
+		{
+			if (_useCache) {
+				aperture::IAsset::ptr asset = _assetCache->fetch(assetId);
+				if (asset) {
+					replyTo->post(boost::bind(callBack, asset));
+					return;
+				}
+			}
+
+			if (_diskCache) {
+				aperture::IAsset::ptr asset = _diskCache->fetch(assetId);
+				if (asset) {
+					replyTo->post(boost::bind(callBack, asset));
+					return;
+				}
+			}
+
+			this->fetchOwnedFromBackends(assetId, true, replyTo, callBack);
+		}
+
+		void request_handler::fetchOwnedFromBackends(const aperture::UUID& assetId, bool askPeer,
+			boost::asio::io_service* replyTo, boost::function<void (aperture::IAsset::ptr)> callBack)
+		{
+			if (askPeer && _peerCluster) {
+				aperture::IAssetServer::ptr peer = _peerCluster->ownerOf(assetId);
+				if (peer) {
+					peer->getAsset(assetId,
+						_ioService.wrap(boost::bind(&request_handler::owned_peer_response_callback, this,
+							assetId, replyTo, callBack, _1)));
+					return;
+				}
+			}
+
+			if (_whipAssetServer && _whipAssetServer->isConnected())
+			{
+				_whipAssetServer->getAsset(assetId,
+					_ioService.wrap(boost::bind(&request_handler::owned_asset_response_callback, this,
+						assetId, replyTo, callBack, _1)));
+			}
+			else if (_cfConnector)
+			{
+				_cfConnector->getAsset(assetId,
+					_ioService.wrap(boost::bind(&request_handler::owned_asset_response_callback, this,
+						assetId, replyTo, callBack, _1)));
+			}
+			else
+			{
+				replyTo->post(boost::bind(callBack, aperture::IAsset::ptr()));
+			}
+		}
+
+		void request_handler::owned_peer_response_callback(const aperture::UUID& assetId,
+			boost::asio::io_service* replyTo, boost::function<void (aperture::IAsset::ptr)> callBack,
+			aperture::IAsset::ptr asset)
+		{
+			if (! asset) {
+				this->fetchOwnedFromBackends(assetId, false, replyTo, callBack);
+				return;
+			}
+
+			replyTo->post(boost::bind(callBack, asset));
+		}
+
+		void request_handler::fetchCachedAsset(const aperture::UUID& assetId,
+			boost::function<void (aperture::IAsset::ptr)> callBack)
+		{
+			if (_shardPeers.size() > 1) {
+				const shard_peer& owner = _shardPeers[this->ownerShard(assetId)];
+				owner.io_service->post(boost::bind(&request_handler::lookupCachedAsset, owner.handler, assetId, callBack));
+			} else {
+				this->lookupCachedAsset(assetId, callBack);
+			}
+		}
+
+		void request_handler::lookupCachedAsset(const aperture::UUID& assetId,
+			boost::function<void (aperture::IAsset::ptr)> callBack)
+		{
+			aperture::IAsset::ptr asset;
+			if (_useCache) {
+				asset = _assetCache->fetch(assetId);
+			}
+
+			if (! asset && _diskCache) {
+				asset = _diskCache->fetch(assetId);
+			}
+
+			callBack(asset);
+		}
+
+		void request_handler::owned_asset_response_callback(const aperture::UUID& assetId,
+			boost::asio::io_service* replyTo, boost::function<void (aperture::IAsset::ptr)> callBack,
+			aperture::IAsset::ptr asset)
+		{
+			if (asset && (asset->getType() == AT_TEXTURE || asset->getType() == AT_MESH)) {
+				if (_diskCache) {
+					_diskCache->insert(asset);
+				}
+
+				if (_assetCache) {
+					asset = this->prepareForCache(asset);
+					_assetCache->insert(assetId, asset);
+				}
+			}
+
+			replyTo->post(boost::bind(callBack, asset));
+		}
+
+		std::vector<aperture::IAsset::ptr> request_handler::hottestAssets(size_t maxAssets) const
+		{
+			if (_shardPeers.size() <= 1) {
+				return _assetCache ? _assetCache->hottest(maxAssets) : std::vector<aperture::IAsset::ptr>();
+			}
+
+			std::vector<std::vector<aperture::IAsset::ptr> > lists;
+			std::vector<aperture::IAssetCache*> seen;
+			for (const shard_peer& peer : _shardPeers) {
+				aperture::IAssetCache* cache = peer.handler->_assetCache.get();
+				if (cache && std::find(seen.begin(), seen.end(), cache) == seen.end()) {
+					seen.push_back(cache);
+					lists.push_back(cache->hottest(maxAssets));
+				}
+			}
+
+			return aperture::IAssetCache::interleave(lists, maxAssets);
+		}
+
+		bool request_handler::warmAsset(const aperture::UUID& assetId, boost::function<void()> done)
+		{
+			if (! (_whipAssetServer && _whipAssetServer->isConnected()) && ! _cfConnector) {
+				return false;
+			}
+
+			request_handler* owner = this;
+			boost::asio::io_service* ownerService = &_ioService;
+			if (_shardPeers.size() > 1) {
+				owner = _shardPeers[this->ownerShard(assetId)].handler;
+				ownerService = _shardPeers[this->ownerShard(assetId)].io_service;
+			}
+
+			boost::function<void (aperture::IAsset::ptr)> callBack(boost::bind(done));
+			ownerService->post(boost::bind(&request_handler::fetchOwnedAsset, owner, assetId, ownerService, callBack));
+
+			return true;
+		}
+
+		void request_handler::insertWarmAsset(aperture::IAsset::ptr asset)
+		{
+			request_handler* owner = _shardPeers.size() > 1 ? _shardPeers[this->ownerShard(asset->getUUID())].handler : this;
+
+			if (owner->_assetCache) {
+				owner->_assetCache->insert(asset->getUUID(), owner->prepareForCache(asset));
+			}
+		}
+
+		std::string request_handler::exportCaps()
+		{
+			boost::mutex::scoped_lock lock(_capsMutex);
+
+			std::ostringstream caps;
+			for (const aperture::UUID& capId : _validCapIds) {
+				auto bucket = _capsBuckets.find(capId);
+
+				caps << capId.toString() << " "
+					<< (bucket == _capsBuckets.end() ? 0 : bucket->second->getMaxBurst()) << " "
+					<< (_queuedRequests.find(capId) != _queuedRequests.end() ? 1 : 0) << "\n";
+			}
+
+			return caps.str();
+		}
+
+		void request_handler::importCaps(const std::string& caps)
+		{
+			boost::mutex::scoped_lock lock(_capsMutex);
+
+			std::istringstream lines(caps);
+			std::string capHex;
+			size_t bandwidth;
+			int paused;
+
+			while (lines >> capHex >> bandwidth >> paused) {
+				aperture::UUID capId;
+				if (! aperture::UUID::parse(capHex, capId)) continue;
+
+				_validCapIds.insert(capId);
+				if (bandwidth != 0) _capsBuckets[capId] = boost::make_shared<TokenBucket>(bandwidth);
+				if (paused) _queuedRequests[capId];
+			}
+		}
+
+		void request_handler::replicateCapsRequest(const request& req)
+		{
+			if (_applyingReplica) return;
+
+			for (const shard_peer& peer : _shardPeers)
+			{
+				if (peer.handler != this)
+				{
+					peer.io_service->post(boost::bind(&request_handler::handle_replicated_caps_request,
+						peer.handler, req));
+				}
+			}
+		}
+
+		void request_handler::handle_replicated_caps_request(request req)
+		{
+			reply ignored;
+
+			_applyingReplica = true;
+			this->handle_request(req, ignored, []{});
+			_applyingReplica = false;
+		}
+
+		boost::shared_ptr<TokenBucket> request_handler::getBucket(const aperture::UUID& caps)
+		{
+			boost::mutex::scoped_lock lock(_capsMutex);
+
 			auto iter = _capsBuckets.find(caps);
 			if (iter != _capsBuckets.end())
 			{
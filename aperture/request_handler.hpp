@@ -16,17 +16,22 @@
 #include <boost/function.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/utility/string_view.hpp>
 
-#include <map>
-#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <queue>
 
 
 #include "IAssetServer.h"
-#include "lru_cache.h"
-#include "AssetSizeCalculator.h"
 #include "IAsset.h"
+#include "IAssetCache.h"
+#include "DiskAssetCache.h"
+#include "PeerCluster.h"
+#include "StreamingAsset.h"
+#include "UUID.h"
 #include "request.hpp"
 #include "reply.hpp"
 
@@ -38,18 +43,58 @@ namespace http {
 		struct reply;
 		struct request;
 
-		typedef std::map<std::string, std::string> QueryString;
+		/// The '/' separated parts of a request URI. The parts are views into the
+		/// request's uri and only the first MAX_PARTS are kept
+		class url_parts
+		{
+		public:
+			static const size_t MAX_PARTS = 8;
+
+			explicit url_parts(boost::string_view uri);
+
+			/// The number of parts in the URI, including those that weren't kept
+			size_t size() const { return _size; }
 
+			boost::string_view operator[](size_t i) const { return _parts[i]; }
+
+		private:
+			boost::string_view _parts[MAX_PARTS];
+			size_t _size;
+		};
+
+		/// Everything needed to answer an asset request. Moved from stage to
+		/// stage rather than copied, the request itself is owned by the connection
+		/// until the reply has been written
 		struct PackedRequestInfo
 		{
-			std::string AssetId;
+			typedef boost::shared_ptr<PackedRequestInfo> ptr;
+
+			PackedRequestInfo(boost::function<void()>&& completionCallback, reply* rep, const request* req)
+				: CompletionCallback(std::move(completionCallback)), Reply(rep), Request(req),
+				ServedFromCache(false), ServedFromDisk(false), ServedFromWhip(false), ServedFromCF(false),
+				ServedFromShard(false), ServedFromPeer(false), StreamWatchId(0)
+			{
+			}
+
+			PackedRequestInfo(PackedRequestInfo&&) = default;
+			PackedRequestInfo& operator=(PackedRequestInfo&&) = default;
+
+			PackedRequestInfo(const PackedRequestInfo&) = delete;
+			PackedRequestInfo& operator=(const PackedRequestInfo&) = delete;
+
+			aperture::UUID AssetId;
 			boost::function<void()> CompletionCallback;
 			reply* Reply;
-			std::map<std::string, std::string> QueryString;
-			request Request;
+			const request* Request;
 			bool ServedFromCache;
+			bool ServedFromDisk;
 			bool ServedFromWhip;
 			bool ServedFromCF;
+			bool ServedFromShard;
+			bool ServedFromPeer;
+
+			/// Set while watching for the asset to start streaming in from a backend
+			unsigned long long StreamWatchId;
 		};
 
 		/// The common handler for all incoming requests.
@@ -57,8 +102,16 @@ namespace http {
 			: private boost::noncopyable
 		{
 		public:
+			/// Another shard's handler and the io_service it runs on
+			struct shard_peer
+			{
+				request_handler* handler;
+				boost::asio::io_service* io_service;
+			};
+
 			/// Construct with a directory containing files to be served.
-			explicit request_handler(aperture::IAssetServer::ptr whipAssetServer, aperture::IAssetServer::ptr cfConnector,
+			explicit request_handler(boost::asio::io_service& ioService,
+				aperture::IAssetServer::ptr whipAssetServer, aperture::IAssetServer::ptr cfConnector,
 				const std::string& capsToken);
 
 			/// Handle a request and produce a reply.
@@ -66,40 +119,87 @@ namespace http {
 
 			/// Handle a request for an asset
 			void handle_asset_request(const request& req, reply& rep, 
-				boost::function<void()> completionCallback,
-				std::vector<std::string>& urlParts);
+				boost::function<void()>& completionCallback,
+				const url_parts& urlParts);
 			
 			/// Handle a request for add cap
 			void handle_add_cap(const request& req, reply& rep, 
-				boost::function<void()> completionCallback,
-				std::vector<std::string>& urlParts);
+				boost::function<void()>& completionCallback,
+				const url_parts& urlParts);
 
 			/// Handle a request for rem cap
 			void handle_rem_cap(const request& req, reply& rep, 
-				boost::function<void()> completionCallback,
-				std::vector<std::string>& urlParts);
+				boost::function<void()>& completionCallback,
+				const url_parts& urlParts);
 
 			/// Handle a request for pause cap
 			void handle_pause_cap(const request& req, reply& rep, 
-				boost::function<void()> completionCallback,
-				std::vector<std::string>& urlParts);
+				boost::function<void()>& completionCallback,
+				const url_parts& urlParts);
 
 			/// Handle a request for resume cap
 			void handle_resume_cap(const request& req, reply& rep, 
-				boost::function<void()> completionCallback,
-				std::vector<std::string>& urlParts);
+				boost::function<void()>& completionCallback,
+				const url_parts& urlParts);
 
 			/// Handle a request to limit the outbound bandwidth from a cap
 			void handle_limit_cap(const request& req, reply& rep, 
-				boost::function<void()> completionCallback,
-				std::vector<std::string>& urlParts);
+				boost::function<void()>& completionCallback,
+				const url_parts& urlParts);
+
+			/// Handle a request for the asset cache statistics
+			void handle_stats(const request& req, reply& rep, 
+				boost::function<void()>& completionCallback,
+				const url_parts& urlParts);
+
+			/// Configure and enable the asset cache for requests. The cache is split
+			/// into numCacheShards independently locked parts and uses the eviction
+			/// policy named by the cache_policy setting
+			void initAssetCache(unsigned long long maxSize, unsigned int numCacheShards);
+
+			/// Sets the disk cache below the asset cache. Assets fetched from the
+			/// backends are written to it, and it is checked before the backends
+			void setDiskCache(aperture::DiskAssetCache::ptr diskCache);
+
+			/// Sets the other aperture nodes sharing their caches. Assets another
+			/// node owns are asked from it before going to the backends
+			void setPeerCluster(aperture::PeerCluster::ptr peerCluster);
+
+			/// Looks an asset up in the memory and disk caches of the shard that
+			/// owns it, without going to the backends, for another node. Safe to
+			/// call from any thread, the callback is run on the owning shard
+			void fetchCachedAsset(const aperture::UUID& assetId, boost::function<void (aperture::IAsset::ptr)> callBack);
 
-			/// Configure and enable the asset cache for requests
-			void initAssetCache(unsigned int maxSize);
+			/// Sets the handlers of all shards including this one. Assets are only
+			/// cached by the shard that owns them, other shards hand their lookups over.
+			void setShardPeers(unsigned int selfIndex, const std::vector<shard_peer>& peers);
 
-			boost::shared_ptr<TokenBucket> getBucket(const std::string& caps);
+			boost::shared_ptr<TokenBucket> getBucket(const aperture::UUID& caps);
+
+			/// Returns up to maxAssets assets from the caches of all shards, hottest first
+			std::vector<aperture::IAsset::ptr> hottestAssets(size_t maxAssets) const;
+
+			/// Loads an asset into the cache of the shard that owns it, from the disk
+			/// cache or the backends, and calls done when finished. Returns false
+			/// without doing anything if no backend is available. Safe to call from
+			/// any thread
+			bool warmAsset(const aperture::UUID& assetId, boost::function<void()> done);
+
+			/// Puts an asset into the cache of the shard that owns it. Safe to call
+			/// from any thread
+			void insertWarmAsset(aperture::IAsset::ptr asset);
+
+			/// Returns the caps, their limits and whether they are paused, one per
+			/// line, to pass to importCaps() in another process
+			std::string exportCaps();
+
+			/// Adds caps returned by exportCaps()
+			void importCaps(const std::string& caps);
 
 		private:
+			/// The io_service requests on this handler run on
+			boost::asio::io_service& _ioService;
+
 			/// The asset server to request assets from
 			aperture::IAssetServer::ptr _whipAssetServer;
 
@@ -110,13 +210,16 @@ namespace http {
 			std::string _capsToken;
 
 			/// Holds valid cap UUIDs
-			std::set<std::string> _validCapIds;
+			std::unordered_set<aperture::UUID> _validCapIds;
 
 			/// Holds queued requests and signals that the cap id is paused
-			std::map<std::string, std::queue<PackedRequestInfo> > _queuedRequests;
+			std::unordered_map<aperture::UUID, std::queue<PackedRequestInfo> > _queuedRequests;
 
 			/// Holds token buckets for the given caps
-			std::map<std::string, boost::shared_ptr<TokenBucket> > _capsBuckets; 
+			std::unordered_map<aperture::UUID, boost::shared_ptr<TokenBucket> > _capsBuckets; 
+
+			/// Protects the caps tables above. Requests are handled on many threads
+			boost::mutex _capsMutex;
 
 			/// Debugging?
 			bool _debug;
@@ -124,25 +227,111 @@ namespace http {
 			/// using a cache?
 			bool _useCache;
 
+			/// keep the rendered response headers with each cached asset?
+			bool _prerenderResponses;
+
 			/// the cache
-			boost::shared_ptr<LRUCache<std::string, aperture::IAsset::ptr, AssetSizeCalculator> > _assetCache;
+			aperture::IAssetCache::ptr _assetCache;
+
+			/// the disk cache below it, shared by all shards
+			aperture::DiskAssetCache::ptr _diskCache;
+
+			/// the other nodes sharing their caches, if any
+			aperture::PeerCluster::ptr _peerCluster;
+
+			/// The index of this handler's shard in _shardPeers
+			unsigned int _shardIndex;
+
+			/// The handlers of every shard. Empty unless running sharded
+			std::vector<shard_peer> _shardPeers;
+
+			/// Set while applying a caps change replicated from another shard
+			bool _applyingReplica;
+
+			/// whether large assets are sent on while they come in from WHIP
+			bool _streamFromBackends;
 
 
 			/// Perform URL-decoding on a string. Returns false if the encoding was
 			/// invalid.
-			static bool url_decode(const std::string& in, std::string& out);
+			static bool url_decode(boost::string_view in, std::string& out);
 
-			/// Decodes the query string into parts
-			static QueryString decode_query_string(const std::string& url);
+			/// Finds the still encoded value of a query string parameter. Names are
+			/// matched case insensitively and a later parameter wins over an earlier
+			/// one. Returns false if the parameter is missing
+			static bool find_query_param(boost::string_view uri, boost::string_view name, boost::string_view& rawValue);
 
 			/// Called when we have an asset for the reply
-			void asset_response_callback(PackedRequestInfo reqInfo, aperture::IAsset::ptr asset);
+			void asset_response_callback(PackedRequestInfo& reqInfo, aperture::IAsset::ptr asset);
+
+			/// Returns the callback that continues a request set aside for a backend
+			/// lookup with the backend's answer
+			boost::function<void (aperture::IAsset::ptr)> continuation(PackedRequestInfo::ptr reqInfo);
 
-			boost::tuple<unsigned int, unsigned int> parse_range(const std::string& rangeStr);
+			/// Continues a request that was waiting on a backend
+			void pending_asset_response(PackedRequestInfo::ptr reqInfo, aperture::IAsset::ptr asset);
+
+			boost::tuple<unsigned int, unsigned int> parse_range(boost::string_view rangeStr);
 
 			void sendResponse(PackedRequestInfo& reqInfo, aperture::IAsset::ptr asset, const std::string& contentType);
 
+			/// Builds the reply from the asset, or the error reply for a bad
+			/// range, and completes the request
+			void replyWithAsset(PackedRequestInfo& reqInfo, aperture::IAsset::ptr asset);
+
+			/// Adds an asset fetched for the request to the caches, unless it
+			/// came from one. Returns the asset to send, with its headers rendered
+			/// if the cache keeps them
+			aperture::IAsset::ptr cacheFetchedAsset(const PackedRequestInfo& reqInfo, aperture::IAsset::ptr asset);
+
+			/// Answers a request about to wait on a fetch from the stream of its
+			/// asset if one is coming in, and returns true. Otherwise watches for
+			/// one to start while the fetch is under way and returns false
+			bool joinStream(PackedRequestInfo::ptr reqInfo);
+
+			/// Starts the reply to a request from the stream of its asset
+			void stream_response(PackedRequestInfo::ptr reqInfo, aperture::StreamingAsset::ptr stream);
+
+			/// Wraps an asset about to be cached with its rendered response headers
+			aperture::IAsset::ptr prepareForCache(aperture::IAsset::ptr asset);
+
 			void processRequest(PackedRequestInfo& reqInfo);
+
+			/// Sends a request that missed the local caches to the node owning the
+			/// asset, unless askPeer is false, and then to the backends
+			void fetchFromBackends(PackedRequestInfo& reqInfo, bool askPeer);
+
+			/// Returns the index of the shard that caches the given asset
+			unsigned int ownerShard(const aperture::UUID& assetId) const;
+
+			/// Looks up an asset this shard owns on behalf of another shard. The callback
+			/// is run on the requesting shard
+			void fetchOwnedAsset(const aperture::UUID& assetId, boost::asio::io_service* replyTo,
+				boost::function<void (aperture::IAsset::ptr)> callBack);
+
+			/// Sends a fetchOwnedAsset() miss to the node owning the asset, unless
+			/// askPeer is false, and then to the backends
+			void fetchOwnedFromBackends(const aperture::UUID& assetId, bool askPeer,
+				boost::asio::io_service* replyTo, boost::function<void (aperture::IAsset::ptr)> callBack);
+
+			/// Called when the owning node answers a fetchOwnedAsset() miss
+			void owned_peer_response_callback(const aperture::UUID& assetId,
+				boost::asio::io_service* replyTo, boost::function<void (aperture::IAsset::ptr)> callBack,
+				aperture::IAsset::ptr asset);
+
+			/// Looks up an asset this shard owns in its caches only
+			void lookupCachedAsset(const aperture::UUID& assetId, boost::function<void (aperture::IAsset::ptr)> callBack);
+
+			/// Called when a backend answers a fetchOwnedAsset() miss
+			void owned_asset_response_callback(const aperture::UUID& assetId,
+				boost::asio::io_service* replyTo, boost::function<void (aperture::IAsset::ptr)> callBack,
+				aperture::IAsset::ptr asset);
+
+			/// Sends a successful caps change to all other shards
+			void replicateCapsRequest(const request& req);
+
+			/// Applies a caps change made on another shard
+			void handle_replicated_caps_request(request req);
 		};
 
 	} // namespace server
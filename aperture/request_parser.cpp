@@ -13,318 +13,317 @@
 #include "request_parser.hpp"
 #include "request.hpp"
 
+#include <cctype>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AP_PARSER_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 namespace http {
 	namespace server {
 
+		namespace {
+			/// Headers the server looks at. They are stored under these names
+			/// whatever case the client sent them in.
+			const char* const KNOWN_HEADERS[] = { "Range", "Connection", "If-None-Match" };
+
+			void assign_header_name(std::string& name, const char* begin, const char* end)
+			{
+				size_t len = end - begin;
+
+				for (const char* known : KNOWN_HEADERS)
+				{
+					if (std::strlen(known) != len) continue;
+
+					size_t i = 0;
+					while (i < len && std::tolower((unsigned char)begin[i]) == std::tolower((unsigned char)known[i]))
+					{
+						++i;
+					}
+
+					if (i == len)
+					{
+						name = known;
+						return;
+					}
+				}
+
+				name.assign(begin, end);
+			}
+
+			/// Parses a run of digits, returns the position after them or 0 when
+			/// there are none
+			const char* parse_number(const char* begin, const char* end, int& number)
+			{
+				number = 0;
+
+				const char* pos = begin;
+				while (pos != end && *pos >= '0' && *pos <= '9')
+				{
+					number = number * 10 + (*pos - '0');
+					++pos;
+				}
+
+				return pos == begin ? 0 : pos;
+			}
+		}
+
 		request_parser::request_parser()
-			: state_(method_start)
+			: state_(request_line)
 		{
 		}
 
 		void request_parser::reset()
 		{
-			state_ = method_start;
+			state_ = request_line;
+			pending_.clear();
 		}
 
-		boost::tribool request_parser::consume(request& req, char input)
+		boost::tuple<boost::tribool, const char*> request_parser::parse(request& req,
+			const char* begin, const char* end)
 		{
-			switch (state_)
+			while (begin != end)
 			{
-			case method_start:
-				if (!is_char(input) || is_ctl(input) || is_tspecial(input))
-				{
-					req.is_bad = true;
-					return false;
-				}
-				else
-				{
-					state_ = method;
-					req.method.push_back(input);
-					return boost::indeterminate;
-				}
-			case method:
-				if (input == ' ')
-				{
-					state_ = uri;
-					return boost::indeterminate;
-				}
-				else if (!is_char(input) || is_ctl(input) || is_tspecial(input))
-				{
-					req.is_bad = true;
-					return false;
-				}
-				else
-				{
-					req.method.push_back(input);
-					return boost::indeterminate;
-				}
-			case uri_start:
-				if (is_ctl(input))
-				{
-					req.is_bad = true;
-					return false;
-				}
-				else
-				{
-					state_ = uri;
-					req.uri.push_back(input);
-					return boost::indeterminate;
-				}
-			case uri:
-				if (input == ' ')
-				{
-					state_ = http_version_h;
-					return boost::indeterminate;
-				}
-				else if (is_ctl(input))
-				{
-					req.is_bad = true;
-					return false;
-				}
-				else
-				{
-					req.uri.push_back(input);
-					return boost::indeterminate;
-				}
-			case http_version_h:
-				if (input == 'H')
-				{
-					state_ = http_version_t_1;
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case http_version_t_1:
-				if (input == 'T')
-				{
-					state_ = http_version_t_2;
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case http_version_t_2:
-				if (input == 'T')
-				{
-					state_ = http_version_p;
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case http_version_p:
-				if (input == 'P')
-				{
-					state_ = http_version_slash;
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case http_version_slash:
-				if (input == '/')
-				{
-					req.http_version_major = 0;
-					req.http_version_minor = 0;
-					state_ = http_version_major_start;
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case http_version_major_start:
-				if (is_digit(input))
-				{
-					req.http_version_major = req.http_version_major * 10 + input - '0';
-					state_ = http_version_major;
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case http_version_major:
-				if (input == '.')
-				{
-					state_ = http_version_minor_start;
-					return boost::indeterminate;
-				}
-				else if (is_digit(input))
-				{
-					req.http_version_major = req.http_version_major * 10 + input - '0';
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case http_version_minor_start:
-				if (is_digit(input))
-				{
-					req.http_version_minor = req.http_version_minor * 10 + input - '0';
-					state_ = http_version_minor;
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case http_version_minor:
-				if (input == '\r')
-				{
-					state_ = expecting_newline_1;
-					return boost::indeterminate;
-				}
-				else if (is_digit(input))
-				{
-					req.http_version_minor = req.http_version_minor * 10 + input - '0';
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case expecting_newline_1:
-				if (input == '\n')
-				{
-					state_ = header_line_start;
-					return boost::indeterminate;
-				}
-				else
-				{
-					req.is_bad = true;
-					return false;
-				}
-			case header_line_start:
-				if (input == '\r')
-				{
-					state_ = expecting_newline_3;
-					return boost::indeterminate;
-				}
-				else if (!req.headers.empty() && (input == ' ' || input == '\t'))
-				{
-					state_ = header_lws;
-					return boost::indeterminate;
-				}
-				else if (!is_char(input) || is_ctl(input) || is_tspecial(input))
-				{
-					req.is_bad = true;
-					return false;
+				const char* lineBegin;
+				const char* lineEnd;
+
+				if (! pending_.empty() && pending_.back() == '\r')
+				{
+					//the previous read ended between the CR and LF
+					if (*begin != '\n')
+					{
+						req.is_bad = true;
+						return boost::make_tuple(boost::tribool(false), begin);
+					}
+
+					++begin;
+					lineBegin = pending_.data();
+					lineEnd = pending_.data() + pending_.size() - 1;
 				}
 				else
 				{
-					req.headers.push_back(header());
-					req.headers.back().name.push_back(input);
-					state_ = header_name;
-					return boost::indeterminate;
-				}
-			case header_lws:
-				if (input == '\r')
-				{
-					state_ = expecting_newline_2;
-					return boost::indeterminate;
-				}
-				else if (input == ' ' || input == '\t')
-				{
-					return boost::indeterminate;
+					const char* ctl = find_ctl(begin, end);
+
+					if (ctl == end || (*ctl == '\r' && ctl + 1 == end))
+					{
+						//the line continues in the next read
+						pending_.append(begin, end);
+						if (pending_.size() > MAX_LINE_LENGTH)
+						{
+							req.is_bad = true;
+							return boost::make_tuple(boost::tribool(false), end);
+						}
+
+						boost::tribool result = boost::indeterminate;
+						return boost::make_tuple(result, end);
+					}
+
+					if (*ctl != '\r' || ctl[1] != '\n')
+					{
+						req.is_bad = true;
+						return boost::make_tuple(boost::tribool(false), ctl);
+					}
+
+					if (pending_.empty())
+					{
+						lineBegin = begin;
+						lineEnd = ctl;
+					}
+					else
+					{
+						pending_.append(begin, ctl);
+						lineBegin = pending_.data();
+						lineEnd = pending_.data() + pending_.size();
+					}
+
+					begin = ctl + 2;
 				}
-				else if (is_ctl(input))
+
+				boost::tribool result = consume_line(req, lineBegin, lineEnd);
+				pending_.clear();
+
+				if (!result)
 				{
 					req.is_bad = true;
-					return false;
-				}
-				else
-				{
-					state_ = header_value;
-					req.headers.back().value.push_back(input);
-					return boost::indeterminate;
 				}
-			case header_name:
-				if (input == ':')
+
+				if (result || !result)
 				{
-					state_ = space_before_header_value;
-					return boost::indeterminate;
+					return boost::make_tuple(result, begin);
 				}
-				else if (!is_char(input) || is_ctl(input) || is_tspecial(input))
+			}
+
+			boost::tribool result = boost::indeterminate;
+			return boost::make_tuple(result, begin);
+		}
+
+		boost::tribool request_parser::consume_line(request& req, const char* begin, const char* end)
+		{
+			switch (state_)
+			{
+			case request_line:
+				return consume_request_line(req, begin, end);
+
+			case header_line:
+				return consume_header_line(req, begin, end);
+
+			default:
+				return false;
+			}
+		}
+
+		boost::tribool request_parser::consume_request_line(request& req, const char* begin, const char* end)
+		{
+			//METHOD SP URI SP HTTP/major.minor
+			const char* methodEnd = static_cast<const char*>(std::memchr(begin, ' ', end - begin));
+			if (methodEnd == 0 || methodEnd == begin)
+			{
+				return false;
+			}
+
+			for (const char* pos = begin; pos != methodEnd; ++pos)
+			{
+				if (!is_char(*pos) || is_ctl(*pos) || is_tspecial(*pos))
 				{
-					req.is_bad = true;
 					return false;
 				}
-				else
-				{
-					req.headers.back().name.push_back(input);
-					return boost::indeterminate;
-				}
-			case space_before_header_value:
-				if (input == ' ')
-				{
-					state_ = header_value;
-					return boost::indeterminate;
-				}
-				else
+			}
+
+			const char* uriBegin = methodEnd + 1;
+			const char* uriEnd = static_cast<const char*>(std::memchr(uriBegin, ' ', end - uriBegin));
+			if (uriEnd == 0 || std::memchr(uriBegin, '\t', uriEnd - uriBegin) != 0)
+			{
+				return false;
+			}
+
+			const char* version = uriEnd + 1;
+			if (end - version < 5 || std::memcmp(version, "HTTP/", 5) != 0)
+			{
+				return false;
+			}
+
+			const char* pos = parse_number(version + 5, end, req.http_version_major);
+			if (pos == 0 || pos == end || *pos != '.')
+			{
+				return false;
+			}
+
+			pos = parse_number(pos + 1, end, req.http_version_minor);
+			if (pos != end)
+			{
+				return false;
+			}
+
+			req.method.assign(begin, methodEnd);
+			req.uri.assign(uriBegin, uriEnd);
+
+			state_ = header_line;
+			return boost::indeterminate;
+		}
+
+		boost::tribool request_parser::consume_header_line(request& req, const char* begin, const char* end)
+		{
+			if (begin == end)
+			{
+				req.is_bad = false;
+				req.is_ready = true;
+				return true;
+			}
+
+			if (*begin == ' ' || *begin == '\t')
+			{
+				//continuation of the previous header's value
+				if (req.headers.empty())
 				{
-					req.is_bad = true;
 					return false;
 				}
-			case header_value:
-				if (input == '\r')
+
+				while (begin != end && (*begin == ' ' || *begin == '\t'))
 				{
-					state_ = expecting_newline_2;
-					return boost::indeterminate;
+					++begin;
 				}
-				else if (is_ctl(input))
+
+				if (std::memchr(begin, '\t', end - begin) != 0)
 				{
-					req.is_bad = true;
 					return false;
 				}
-				else
-				{
-					req.headers.back().value.push_back(input);
-					return boost::indeterminate;
-				}
-			case expecting_newline_2:
-				if (input == '\n')
-				{
-					state_ = header_line_start;
-					return boost::indeterminate;
-				}
-				else
+
+				req.headers.back().value.append(begin, end);
+				return boost::indeterminate;
+			}
+
+			//Name: value
+			const char* nameEnd = static_cast<const char*>(std::memchr(begin, ':', end - begin));
+			if (nameEnd == 0 || nameEnd == begin || nameEnd + 1 == end || nameEnd[1] != ' ')
+			{
+				return false;
+			}
+
+			for (const char* pos = begin; pos != nameEnd; ++pos)
+			{
+				if (!is_char(*pos) || is_ctl(*pos) || is_tspecial(*pos))
 				{
-					req.is_bad = true;
 					return false;
 				}
-			case expecting_newline_3:
-				if (input == '\n') 
-				{
-					req.is_bad = false;
-					req.is_ready = true;
-					return true;
-				}
-				else
+			}
+
+			const char* valueBegin = nameEnd + 2;
+			if (std::memchr(valueBegin, '\t', end - valueBegin) != 0)
+			{
+				return false;
+			}
+
+			req.headers.push_back(header());
+			assign_header_name(req.headers.back().name, begin, nameEnd);
+			req.headers.back().value.assign(valueBegin, end);
+
+			return boost::indeterminate;
+		}
+
+		const char* request_parser::find_ctl(const char* begin, const char* end)
+		{
+#ifdef AP_PARSER_SSE2
+			const __m128i ctlBits = _mm_set1_epi8((char)0xE0);
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i tab = _mm_set1_epi8('\t');
+			const __m128i del = _mm_set1_epi8((char)0x7F);
+
+			while (end - begin >= 16)
+			{
+				__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+
+				//0x00-0x1F except tab, and DEL
+				__m128i ctl = _mm_cmpeq_epi8(_mm_and_si128(chunk, ctlBits), zero);
+				ctl = _mm_andnot_si128(_mm_cmpeq_epi8(chunk, tab), ctl);
+				ctl = _mm_or_si128(ctl, _mm_cmpeq_epi8(chunk, del));
+
+				int mask = _mm_movemask_epi8(ctl);
+				if (mask != 0)
 				{
-					req.is_bad = true;
-					return false;
+#ifdef _MSC_VER
+					unsigned long index;
+					_BitScanForward(&index, mask);
+					return begin + index;
+#else
+					return begin + __builtin_ctz(mask);
+#endif
 				}
 
-			default:
-				req.is_bad = true;
-				return false;
+				begin += 16;
 			}
+#endif
+
+			while (begin != end && (*begin == '\t' || !is_ctl(*begin)))
+			{
+				++begin;
+			}
+
+			return begin;
 		}
 
 		bool request_parser::is_char(int c)
@@ -11,6 +11,7 @@
 #ifndef HTTP_REQUEST_PARSER_HPP
 #define HTTP_REQUEST_PARSER_HPP
 
+#include <string>
 #include <boost/logic/tribool.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -19,10 +20,15 @@ namespace server {
 
 struct request;
 
-/// Parser for incoming requests.
+/// Parser for incoming requests. Works a line at a time: the input is scanned
+/// 16 bytes at a time for the end of the line and each field is assigned to the
+/// request in one go. Bytes are only copied aside when a line spans two reads.
 class request_parser
 {
 public:
+  /// Longest request or header line accepted
+  static const size_t MAX_LINE_LENGTH = 65536;
+
   /// Construct ready to parse the request method.
   request_parser();
 
@@ -31,25 +37,23 @@ public:
 
   /// Parse some data. The tribool return value is true when a complete request
   /// has been parsed, false if the data is invalid, indeterminate when more
-  /// data is required. The InputIterator return value indicates how much of the
+  /// data is required. The pointer return value indicates how much of the
   /// input has been consumed.
-  template <typename InputIterator>
-  boost::tuple<boost::tribool, InputIterator> parse(request& req,
-      InputIterator begin, InputIterator end)
-  {
-    while (begin != end)
-    {
-      boost::tribool result = consume(req, *begin++);
-      if (result || !result)
-        return boost::make_tuple(result, begin);
-    }
-    boost::tribool result = boost::indeterminate;
-    return boost::make_tuple(result, begin);
-  }
+  boost::tuple<boost::tribool, const char*> parse(request& req,
+      const char* begin, const char* end);
 
 private:
-  /// Handle the next character of input.
-  boost::tribool consume(request& req, char input);
+  /// Handle a complete line of input, without its CRLF.
+  boost::tribool consume_line(request& req, const char* begin, const char* end);
+
+  /// Handle the request line.
+  boost::tribool consume_request_line(request& req, const char* begin, const char* end);
+
+  /// Handle a header line or the blank line that ends the headers.
+  boost::tribool consume_header_line(request& req, const char* begin, const char* end);
+
+  /// Finds the first control character other than tab, or end.
+  static const char* find_ctl(const char* begin, const char* end);
 
   /// Check if a byte is an HTTP character.
   static bool is_char(int c);
@@ -66,28 +70,12 @@ private:
   /// The current state of the parser.
   enum state
   {
-    method_start,
-    method,
-    uri_start,
-    uri,
-    http_version_h,
-    http_version_t_1,
-    http_version_t_2,
-    http_version_p,
-    http_version_slash,
-    http_version_major_start,
-    http_version_major,
-    http_version_minor_start,
-    http_version_minor,
-    expecting_newline_1,
-    header_line_start,
-    header_lws,
-    header_name,
-    space_before_header_value,
-    header_value,
-    expecting_newline_2,
-    expecting_newline_3
+    request_line,
+    header_line
   } state_;
+
+  /// The start of a line that did not end in the previous read.
+  std::string pending_;
 };
 
 } // namespace server
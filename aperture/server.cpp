@@ -12,7 +12,14 @@
 
 #include "server.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
 #include "AppLog.h"
+#include "HedgedAssetServer.h"
 #include "Settings.h"
 
 using namespace aperture;
@@ -24,45 +31,200 @@ namespace http {
 			aperture::IAssetServer::ptr whipServer, aperture::IAssetServer::ptr cfConnector,
 			const std::string& capsToken)
 		: io_service_(ioService),
-			acceptor_(io_service_),
-			connection_manager_(),
-			new_connection_(new connection(io_service_,
-				connection_manager_, request_handler_)),
-			request_handler_(whipServer, cfConnector, capsToken),
+			draining_shards_(0),
+			drain_timer_(ioService),
 			_whipAssetServer(whipServer),
 			_cfConnector(cfConnector)
 		{
-			unsigned int cacheSize = Settings::instance().config()["cache_size"].as<unsigned int>();
+			// put the deadline and the CF fallback on every WHIP fetch
+			if (whipServer) {
+				whipServer.reset(new HedgedAssetServer(whipServer, cfConnector, ioService,
+					Settings::instance().config()["backend_deadline"].as<unsigned int>(),
+					Settings::instance().config()["backend_hedge_percentile"].as<unsigned int>(),
+					Settings::instance().config()["backend_hedge_min_delay"].as<unsigned int>(),
+					Settings::instance().config()["backend_selector_buckets"].as<unsigned int>()));
+				_whipAssetServer = whipServer;
+			}
+
+			unsigned long long cacheSize = Settings::instance().config()["cache_size"].as<unsigned long long>();
+			unsigned int numShards = Settings::instance().config()["http_shards"].as<unsigned int>();
+			unsigned int cacheShards = std::max(1u, Settings::instance().config()["cache_shards"].as<unsigned int>());
 
 			if (cacheSize != 0) {
-				AppLog::instance().out() << "[CACHE] Setting asset cache to " << cacheSize / 1024 / 1024 << " MB" << std::endl;
-				request_handler_.initAssetCache(cacheSize);
+				AppLog::instance().out() << "[CACHE] Setting asset cache to " << cacheSize / 1024 / 1024 << " MB using the "
+					<< Settings::instance().config()["cache_policy"].as<std::string>() << " policy" << std::endl;
 			} else {
 				AppLog::instance().out() << "[CACHE] Asset cache disabled " << std::endl;
 			}
 
+			// take the listening sockets and the cache over from a running process
+			std::vector<int> listenFds;
+			std::string handoffCachePath, handoffCaps;
+			std::string hotRestartPath = Settings::instance().config()["hot_restart_socket"].as<std::string>();
+
+			if (! hotRestartPath.empty()) {
+				_hotRestart.reset(new HotRestart(io_service_, hotRestartPath));
+				_hotRestart->takeOver(listenFds, handoffCachePath, handoffCaps);
+			}
+
 			AppLog::instance().out() << "Starting HTTP texture service on TCP/" << port << std::endl;
 
-			// Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
-			boost::asio::ip::tcp::endpoint endpoint 
-				= boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port);
+			if (numShards <= 1) {
+				shards_.push_back(boost::make_shared<shard>(port, false, io_service_,
+					whipServer, cfConnector, capsToken, cacheSize, cacheShards,
+					listenFds.empty() ? -1 : listenFds[0]));
 
-			acceptor_.open(endpoint.protocol());
-			acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-			acceptor_.bind(endpoint);
-			acceptor_.listen();
-			acceptor_.async_accept(new_connection_->socket(),
-				boost::bind(&server::handle_accept, this,
-				boost::asio::placeholders::error));
+			} else {
+				// each shard owns an equal slice of the cache, selected by asset id.
+				// a shard runs on a single thread so its slice needs no further split
+				AppLog::instance().out() << "[HTTP] Running " << numShards << " shards" << std::endl;
+
+				std::vector<request_handler::shard_peer> peers;
+				for (unsigned int i = 0; i < numShards; ++i) {
+					boost::shared_ptr<boost::asio::io_service> shardIoService(new boost::asio::io_service(1));
+					shard_io_services_.push_back(shardIoService);
+
+					shard::ptr newShard(boost::make_shared<shard>(port, true, *shardIoService,
+						whipServer, cfConnector, capsToken, cacheSize / numShards, 1,
+						i < listenFds.size() ? listenFds[i] : -1));
+					shards_.push_back(newShard);
+
+					request_handler::shard_peer peer = { &newShard->get_request_handler(), shardIoService.get() };
+					peers.push_back(peer);
+				}
+
+				for (unsigned int i = 0; i < numShards; ++i) {
+					shards_[i]->get_request_handler().setShardPeers(i, peers);
+				}
+
+				// the main io_service only runs the backends now, so it needs to be
+				// kept alive while they are idle
+				work_.reset(new boost::asio::io_service::work(io_service_));
+			}
+
+			// sockets of shards the old process had and this one doesn't
+			for (size_t i = shards_.size(); i < listenFds.size(); ++i) {
+				boost::asio::ip::tcp::acceptor unused(io_service_, boost::asio::ip::tcp::v4(), listenFds[i]);
+			}
+
+			std::string diskCachePath = Settings::instance().config()["disk_cache_path"].as<std::string>();
+			unsigned long long diskCacheSize = Settings::instance().config()["disk_cache_size"].as<unsigned long long>();
+
+			if (! diskCachePath.empty() && diskCacheSize != 0) {
+				AppLog::instance().out() << "[DISKCACHE] Setting disk cache in " << diskCachePath << " to "
+					<< diskCacheSize / 1024 / 1024 << " MB" << std::endl;
+
+				_diskCache.reset(new DiskAssetCache(diskCachePath, diskCacheSize,
+					Settings::instance().config()["disk_cache_segment_size"].as<unsigned long long>()));
+
+				if (_diskCache->open()) {
+					for (shard::ptr s : shards_) {
+						s->get_request_handler().setDiskCache(_diskCache);
+					}
+				} else {
+					_diskCache.reset();
+				}
+			}
+
+			std::vector<std::string> peerNodes = PeerCluster::parseNodes(Settings::instance().config()["peers"].as<std::string>());
+
+			if (peerNodes.size() > 1) {
+				try {
+					_peerCluster.reset(new PeerCluster(io_service_, peerNodes,
+						Settings::instance().config()["peer_self"].as<std::string>(),
+						Settings::instance().config()["peer_timeout"].as<unsigned int>()));
+
+					for (shard::ptr s : shards_) {
+						s->get_request_handler().setPeerCluster(_peerCluster);
+					}
+				} catch (const std::exception& e) {
+					AppLog::instance().out() << "[PEER] Not sharing the cache: " << e.what() << std::endl;
+				}
+			}
+
+			// every shard keeps its own copy of the caps
+			for (shard::ptr s : shards_) {
+				s->get_request_handler().importCaps(handoffCaps);
+			}
+
+			if (! handoffCachePath.empty()) {
+				std::vector<CacheSnapshot::Entry> entries;
+				if (cacheSize != 0 && CacheSnapshot::read(handoffCachePath, entries)) {
+					for (const CacheSnapshot::Entry& entry : entries) {
+						if (entry.asset) shards_.front()->get_request_handler().insertWarmAsset(entry.asset);
+					}
+
+					AppLog::instance().out() << "[HOTRESTART] Took over " << entries.size() << " cached assets" << std::endl;
+				}
+
+				// the mapping keeps the data for as long as the assets are cached
+				std::remove(handoffCachePath.c_str());
+			}
+
+			for (shard::ptr s : shards_) {
+				s->start();
+			}
+
+			if (_peerCluster) {
+				// the first shard's handler reaches the caches of all of them
+				_peerCluster->start(boost::bind(&request_handler::fetchCachedAsset,
+					&shards_.front()->get_request_handler(), _1, _2));
+			}
+
+			std::string snapshotPath = Settings::instance().config()["cache_snapshot_path"].as<std::string>();
+
+			if (! snapshotPath.empty() && cacheSize != 0) {
+				AppLog::instance().out() << "[SNAPSHOT] Keeping a snapshot of the asset cache in " << snapshotPath << std::endl;
+
+				_cacheSnapshot = boost::make_shared<CacheSnapshot>(snapshotPath,
+					Settings::instance().config()["cache_snapshot_max_assets"].as<unsigned int>(),
+					Settings::instance().config()["cache_snapshot_data"].as<bool>(),
+					Settings::instance().config()["cache_snapshot_interval"].as<unsigned int>(),
+					Settings::instance().config()["cache_snapshot_restore_concurrency"].as<unsigned int>());
+
+				// the first shard's handler reaches the caches of all of them
+				request_handler* handler = &shards_.front()->get_request_handler();
+				_cacheSnapshot->start(boost::bind(&request_handler::hottestAssets, handler, _1),
+					boost::bind(&request_handler::warmAsset, handler, _1, _2),
+					boost::bind(&request_handler::insertWarmAsset, handler, _1),
+					handoffCachePath.empty());
+			}
+
+			if (_hotRestart) {
+				_hotRestart->listen(boost::bind(&server::prepare_handoff, this, _1, _2),
+					boost::bind(&server::handle_handed_off, this));
+			}
 		}
 
 		void server::run()
 		{
-			// The io_service::run() call will block until all asynchronous operations
-			// have finished. While the server is running, there is always at least one
-			// asynchronous operation outstanding: the asynchronous accept call waiting
-			// for new incoming connections.
+			unsigned int numThreads = Settings::instance().config()["http_threads"].as<unsigned int>();
+			if (numThreads == 0) numThreads = 1;
+
+			boost::thread_group threads;
+
+			if (shard_io_services_.empty()) {
+				AppLog::instance().out() << "Running HTTP service on " << numThreads << " thread(s)" << std::endl;
+
+				// The io_service::run() call will block until all asynchronous operations
+				// have finished. While the server is running, there is always at least one
+				// asynchronous operation outstanding: the asynchronous accept call waiting
+				// for new incoming connections. The calling thread is part of the pool.
+				for (unsigned int i = 1; i < numThreads; ++i)
+				{
+					threads.create_thread(boost::bind(&boost::asio::io_service::run, &io_service_));
+				}
+
+			} else {
+				// shards are single threaded by design, the calling thread runs the backends
+				for (boost::shared_ptr<boost::asio::io_service> shardIoService : shard_io_services_)
+				{
+					threads.create_thread(boost::bind(&boost::asio::io_service::run, shardIoService.get()));
+				}
+			}
+
 			io_service_.run();
+			threads.join_all();
 		}
 
 		void server::stop()
@@ -72,16 +234,73 @@ namespace http {
 			io_service_.post(boost::bind(&server::handle_stop, this));
 		}
 
-		void server::handle_accept(const boost::system::error_code& e)
+		std::vector<int> server::prepare_handoff(std::string& cachePath, std::string& caps)
+		{
+			// the new process writes the snapshot and the disk cache from now on
+			if (_cacheSnapshot) _cacheSnapshot->stop();
+			if (_diskCache) _diskCache->shutdown();
+
+			// the new process answers the other nodes on the same port
+			if (_peerCluster) _peerCluster->closeListener();
+
+			request_handler& handler = shards_.front()->get_request_handler();
+
+			// a cache in shared memory outlives this process by itself
+			std::vector<aperture::IAsset::ptr> assets;
+			if (Settings::instance().config()["cache_policy"].as<std::string>() != "shared") {
+				assets = handler.hottestAssets(std::numeric_limits<size_t>::max());
+			}
+
+			if (! assets.empty()) {
+				std::string path = Settings::instance().config()["hot_restart_shm_dir"].as<std::string>()
+					+ "/aperture-handoff-" + boost::lexical_cast<std::string>(Settings::instance().config()["http_listen_port"].as<unsigned short>());
+
+				if (CacheSnapshot::write(path, assets, true)) {
+					cachePath = path;
+				}
+			}
+
+			caps = handler.exportCaps();
+
+			std::vector<int> fds;
+			for (shard::ptr s : shards_) {
+				fds.push_back(s->listen_handle());
+			}
+
+			return fds;
+		}
+
+		void server::handle_handed_off()
+		{
+			AppLog::instance().out() << "[HOTRESTART] Handed over, finishing the open connections" << std::endl;
+
+			draining_shards_ = static_cast<unsigned int>(shards_.size());
+			for (shard::ptr s : shards_) {
+				s->drain(io_service_.wrap(boost::bind(&server::handle_shard_drained, this)));
+			}
+
+			unsigned int timeout = Settings::instance().config()["hot_restart_drain_timeout"].as<unsigned int>();
+			drain_timer_.expires_from_now(boost::posix_time::seconds(timeout));
+			drain_timer_.async_wait(boost::bind(&server::handle_drain_timeout, this,
+				boost::asio::placeholders::error));
+		}
+
+		void server::handle_shard_drained()
 		{
-			if (!e)
-			{
-				connection_manager_.start(new_connection_);
-				new_connection_.reset(new connection(io_service_,
-					connection_manager_, request_handler_));
-				acceptor_.async_accept(new_connection_->socket(),
-					boost::bind(&server::handle_accept, this,
-					boost::asio::placeholders::error));
+			if (--draining_shards_ == 0) {
+				AppLog::instance().out() << "[HOTRESTART] All connections finished" << std::endl;
+
+				drain_timer_.cancel();
+				this->handle_stop();
+			}
+		}
+
+		void server::handle_drain_timeout(const boost::system::error_code& e)
+		{
+			if (e != boost::asio::error::operation_aborted) {
+				AppLog::instance().out() << "[HOTRESTART] Closing the connections that are still open" << std::endl;
+
+				this->handle_stop();
 			}
 		}
 
@@ -90,10 +309,19 @@ namespace http {
 			// The server is stopped by cancelling all outstanding asynchronous
 			// operations. Once all operations have finished the io_service::run() call
 			// will exit.
-			acceptor_.close();
-			connection_manager_.stop_all();
+			if (_hotRestart) _hotRestart->close();
+			if (_cacheSnapshot) _cacheSnapshot->shutdown();
+
+			for (shard::ptr s : shards_) {
+				s->stop();
+			}
+
+			if (_peerCluster) _peerCluster->shutdown();
 			if (_whipAssetServer) _whipAssetServer->shutdown();
 			if (_cfConnector) _cfConnector->shutdown();
+			if (_diskCache) _diskCache->shutdown();
+
+			work_.reset();
 		}
 
 	} // namespace server
@@ -13,12 +13,16 @@
 
 #include <boost/asio.hpp>
 #include <string>
+#include <vector>
 #include <boost/noncopyable.hpp>
-#include "connection.hpp"
-#include "connection_manager.hpp"
-#include "request_handler.hpp"
+#include <boost/scoped_ptr.hpp>
+#include "shard.hpp"
 
+#include "CacheSnapshot.h"
+#include "DiskAssetCache.h"
+#include "HotRestart.h"
 #include "IAssetServer.h"
+#include "PeerCluster.h"
 
 namespace http {
 namespace server {
@@ -34,39 +38,66 @@ public:
 		aperture::IAssetServer::ptr whipServer, aperture::IAssetServer::ptr cfConnector, 
 		const std::string& capsToken);
 
-  /// Run the server's io_service loop.
+  /// Run the server's io_service loop on the configured number of threads.
+  /// When sharded, each shard's io_service runs on a thread of its own.
   void run();
 
   /// Stop the server.
   void stop();
 
 private:
-  /// Handle completion of an asynchronous accept operation.
-  void handle_accept(const boost::system::error_code& e);
-
   /// Handle a request to stop the server.
   void handle_stop();
 
+  /// Hand the listening sockets, the cache and the caps to a new process.
+  /// Stops the snapshot and disk cache writers and writes the cache to shared
+  /// memory.
+  std::vector<int> prepare_handoff(std::string& cachePath, std::string& caps);
+
+  /// Stop accepting and stop the server once the open connections are done.
+  void handle_handed_off();
+
+  /// Handle a shard finishing its connections after a handoff.
+  void handle_shard_drained();
+
+  /// Handle connections taking too long to finish after a handoff.
+  void handle_drain_timeout(const boost::system::error_code& e);
+
   /// The io_service used to perform asynchronous operations.
   boost::asio::io_service& io_service_;
 
-  /// Acceptor used to listen for incoming connections.
-  boost::asio::ip::tcp::acceptor acceptor_;
+  /// The io_services owned by each shard when running sharded.
+  std::vector<boost::shared_ptr<boost::asio::io_service> > shard_io_services_;
 
-  /// The connection manager which owns all live connections.
-  connection_manager connection_manager_;
+  /// The listeners. There is exactly one unless http_shards is set.
+  std::vector<shard::ptr> shards_;
 
-  /// The next connection to be accepted.
-  connection_ptr new_connection_;
+  /// Keeps the main io_service running while the shards own the listeners.
+  boost::scoped_ptr<boost::asio::io_service::work> work_;
 
-  /// The handler for all incoming requests.
-  request_handler request_handler_;
+  /// The number of shards still finishing connections after a handoff.
+  unsigned int draining_shards_;
+
+  /// Limits how long connections may take to finish after a handoff.
+  boost::asio::deadline_timer drain_timer_;
 
   /// The whip asset server we talk to
   aperture::IAssetServer::ptr _whipAssetServer;
 
   /// The cf asset connector
   aperture::IAssetServer::ptr _cfConnector;
+
+  /// The disk cache shared by all shards, if enabled
+  aperture::DiskAssetCache::ptr _diskCache;
+
+  /// Saves and restores the hottest cached assets, if enabled
+  aperture::CacheSnapshot::ptr _cacheSnapshot;
+
+  /// The other nodes sharing their caches, if enabled
+  aperture::PeerCluster::ptr _peerCluster;
+
+  /// Hands over to a newer process, if enabled
+  aperture::HotRestart::ptr _hotRestart;
 };
 
 } // namespace server
@@ -0,0 +1,134 @@
+//
+// shard.cpp
+// ~~~~~~~~~
+//
+// Copyright (c) 2003-2008 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#include "stdafx.h"
+
+#include "shard.hpp"
+
+#include "AppLog.h"
+
+using namespace aperture;
+
+namespace http {
+	namespace server {
+
+#ifdef SO_REUSEPORT
+		/// Allows several sockets to bind the same port, the kernel balances accepts between them
+		typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+#endif
+
+		shard::shard(unsigned short port, bool reusePort, boost::asio::io_service& ioService,
+			aperture::IAssetServer::ptr whipServer, aperture::IAssetServer::ptr cfConnector,
+			const std::string& capsToken, unsigned long long cacheSize, unsigned int cacheShards,
+			int listenFd)
+		: io_service_(ioService),
+			strand_(io_service_),
+			acceptor_(io_service_),
+			connection_manager_(),
+			new_connection_(new connection(io_service_,
+				connection_manager_, request_handler_)),
+			request_handler_(io_service_, whipServer, cfConnector, capsToken)
+		{
+			if (cacheSize != 0) {
+				request_handler_.initAssetCache(cacheSize, cacheShards);
+			}
+
+			// Open the acceptor with the option to reuse the address (i.e. SO_REUSEADDR).
+			boost::asio::ip::tcp::endpoint endpoint
+				= boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port);
+
+			if (listenFd != -1) {
+				acceptor_.assign(endpoint.protocol(), listenFd);
+
+				boost::system::error_code ec;
+				boost::asio::ip::tcp::endpoint bound = acceptor_.local_endpoint(ec);
+				if (!ec && bound.port() == port) {
+					return;
+				}
+
+				AppLog::instance().out() << "[HTTP] Not using the socket taken over, it isn't listening on TCP/"
+					<< port << std::endl;
+				acceptor_.close();
+			}
+
+			acceptor_.open(endpoint.protocol());
+			acceptor_.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+			if (reusePort) {
+#ifdef SO_REUSEPORT
+				acceptor_.set_option(reuse_port(true));
+#else
+				throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
+			}
+			acceptor_.bind(endpoint);
+			acceptor_.listen();
+		}
+
+		void shard::start()
+		{
+			acceptor_.async_accept(new_connection_->socket(),
+				strand_.wrap(boost::bind(&shard::handle_accept, this,
+				boost::asio::placeholders::error)));
+		}
+
+		void shard::stop()
+		{
+			io_service_.post(strand_.wrap(boost::bind(&shard::handle_stop, this)));
+		}
+
+		void shard::drain(boost::function<void()> drained)
+		{
+			io_service_.post(strand_.wrap(boost::bind(&shard::handle_drain, this, drained)));
+		}
+
+		int shard::listen_handle()
+		{
+			return static_cast<int>(acceptor_.native_handle());
+		}
+
+		boost::asio::io_service& shard::get_io_service()
+		{
+			return io_service_;
+		}
+
+		request_handler& shard::get_request_handler()
+		{
+			return request_handler_;
+		}
+
+		void shard::handle_accept(const boost::system::error_code& e)
+		{
+			if (!e)
+			{
+				connection_manager_.start(new_connection_);
+				new_connection_.reset(new connection(io_service_,
+					connection_manager_, request_handler_));
+				acceptor_.async_accept(new_connection_->socket(),
+					strand_.wrap(boost::bind(&shard::handle_accept, this,
+					boost::asio::placeholders::error)));
+			}
+		}
+
+		void shard::handle_stop()
+		{
+			acceptor_.close();
+			connection_manager_.stop_all();
+		}
+
+		void shard::handle_drain(boost::function<void()> drained)
+		{
+			// The process taking over holds the listening socket too, closing it
+			// here only stops this process from accepting.
+			acceptor_.close();
+			connection_manager_.drain_all(drained);
+		}
+
+	} // namespace server
+} // namespace http
@@ -0,0 +1,97 @@
+//
+// shard.hpp
+// ~~~~~~~~~
+//
+// Copyright (c) 2003-2008 Christopher M. Kohlhoff (chris at kohlhoff dot com)
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef HTTP_SHARD_HPP
+#define HTTP_SHARD_HPP
+
+#include <boost/asio.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include "connection.hpp"
+#include "connection_manager.hpp"
+#include "request_handler.hpp"
+
+#include "IAssetServer.h"
+
+namespace http {
+namespace server {
+
+/// A single listener on the HTTP port along with the connections it accepted
+/// and the request handler that serves them. When running with multiple shards
+/// each one has its own io_service and SO_REUSEPORT listener and shares nothing
+/// with the others.
+class shard
+  : private boost::noncopyable
+{
+public:
+  typedef boost::shared_ptr<shard> ptr;
+
+  /// Construct the shard to listen on the specified TCP port. The cache is
+  /// only enabled when cacheSize is non zero, and is split into cacheShards
+  /// independently locked parts. A listenFd other than -1 is a listening socket
+  /// taken over from another process, used instead of binding a new one if it
+  /// is on the same port.
+  shard(unsigned short port, bool reusePort, boost::asio::io_service& ioService,
+    aperture::IAssetServer::ptr whipServer, aperture::IAssetServer::ptr cfConnector,
+    const std::string& capsToken, unsigned long long cacheSize, unsigned int cacheShards,
+    int listenFd);
+
+  /// Begin accepting connections.
+  void start();
+
+  /// Stop accepting and close all connections. Safe to call from any thread.
+  void stop();
+
+  /// Stop accepting and close connections once their replies in flight are
+  /// written, then run the callback. Safe to call from any thread.
+  void drain(boost::function<void()> drained);
+
+  /// The listening socket, to hand over to another process.
+  int listen_handle();
+
+  /// The io_service this shard's connections run on.
+  boost::asio::io_service& get_io_service();
+
+  /// The handler for all requests on this shard.
+  request_handler& get_request_handler();
+
+private:
+  /// Handle completion of an asynchronous accept operation.
+  void handle_accept(const boost::system::error_code& e);
+
+  /// Handle a request to stop the shard.
+  void handle_stop();
+
+  /// Handle a request to drain the shard.
+  void handle_drain(boost::function<void()> drained);
+
+  /// The io_service used to perform asynchronous operations.
+  boost::asio::io_service& io_service_;
+
+  /// Strand to serialize accept and stop handlers on the acceptor.
+  boost::asio::io_service::strand strand_;
+
+  /// Acceptor used to listen for incoming connections.
+  boost::asio::ip::tcp::acceptor acceptor_;
+
+  /// The connection manager which owns all live connections.
+  connection_manager connection_manager_;
+
+  /// The next connection to be accepted.
+  connection_ptr new_connection_;
+
+  /// The handler for all incoming requests.
+  request_handler request_handler_;
+};
+
+} // namespace server
+} // namespace http
+
+#endif // HTTP_SHARD_HPP